@@ -275,7 +275,7 @@ bool address_space::map( size_t vaddr, size_t paddr, int flags ) {
     return false;
 }
 
-void address_space::unmap( size_t vaddr ) {
+void address_space::unmap( size_t vaddr, bool release_frame ) {
     if(vaddr > 0xC0000000)
         return;
     vaddr &= 0xFFFFF000;
@@ -303,7 +303,7 @@ void address_space::unmap( size_t vaddr ) {
     
     uint32_t *table = (uint32_t*)pt->map();
     int block_addr = pageframe_get_block_from_addr( table[table_offset] & 0xFFFFF000 );
-    if( block_addr != -1 ) {
+    if( release_frame && (block_addr != -1) ) {
         pageframe_deallocate_specific(block_addr, 0);
     }
     if( table[table_offset] != 0 ) {
@@ -385,7 +385,7 @@ extern "C" {
         if( Function == NULL )
             return AE_BAD_PARAMETER;
         char* n = itoa(n_acpi_threads);
-        process *proc = new process( (size_t)Function, false, 1, concatentate_strings("acpi_process", n), Context, 1 );
+        process *proc = kthread_create( (size_t)Function, 1, concatentate_strings("acpi_process", n), Context, 1 );
         kfree(n);
         if( proc ) {
             spawn_process( proc );
@@ -187,7 +187,6 @@ void lapic_initialize() {
 	io_outb( 0x23, 1 );
 
 	device_manager::device_node* dev = new device_manager::device_node;
-	dev->child_id = device_manager::root.children.count();
 	dev->enabled = true;
 	dev->type = device_manager::dev_type::lapic;
 	char* id_str = itoa( lapic_id, 16 );
@@ -210,7 +209,7 @@ void lapic_initialize() {
 
 	dev->resources.add_end(res);
 
-	device_manager::root.children.add_end( dev );
+	device_manager::add_child( &device_manager::root, dev );
 
 	kprintf("apic: Initialized version %#x LAPIC with ID = %#x and NMI pin %u (%s).\n", lapic_version, lapic_id, nmi_pin, (nmi_polarity == 3) ? "active low" : "active high");
 }
@@ -358,7 +357,6 @@ void io_apic::initialize() {
 	this->update_redir_entries();
 
 	device_manager::device_node* dev = new device_manager::device_node;
-	dev->child_id = device_manager::root.children.count();
 	dev->enabled = true;
 	dev->type = device_manager::dev_type::ioapic;
 	dev->device_data = (void*)this;
@@ -384,7 +382,7 @@ void io_apic::initialize() {
 		dev->resources.add_end(res);
 	}
 
-	device_manager::root.children.add_end( dev );
+	device_manager::add_child( &device_manager::root, dev );
 
 	kprintf("apic: Initialized IOAPIC with ID %#x at p%#x / v%#x and %u interrupts from %u.\n", this->ioapic_id, this->paddr, this->vaddr, this->max_redir_entry+1, this->int_base);
 }
@@ -0,0 +1,186 @@
+// fpu.cpp -- lazy x87 / SSE context switching
+// The FPU state is only saved and restored when a process actually uses it:
+// on every context switch CR0.TS is set (unless the incoming process already owns the FPU),
+// and the first FPU / SSE instruction afterwards raises #NM, which swaps the state in.
+
+#include "includes.h"
+#include "arch/x86/sys.h"
+#include "arch/x86/fpu.h"
+#include "core/scheduler.h"
+
+bool fpu_has_fxsr = false;
+bool fpu_has_sse = false;
+process *fpu_owner = NULL; // process whose state is currently loaded in the FPU (NULL if none)
+
+static unsigned int kernel_fpu_depth = 0;
+static interrupt_status_t kernel_fpu_int_status = false;
+
+// clean state (as left by fninit) that processes start out with.
+static uint8_t fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+static void fpu_save( uint8_t* area ) {
+    if( fpu_has_fxsr ) {
+        asm volatile("fxsave (%0)" : : "r"(area) : "memory");
+    } else {
+        // note that fnsave also reinitializes the FPU.
+        asm volatile("fnsave (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore( uint8_t* area ) {
+    if( fpu_has_fxsr ) {
+        asm volatile("fxrstor (%0)" : : "r"(area) : "memory");
+    } else {
+        asm volatile("frstor (%0)" : : "r"(area) : "memory");
+    }
+}
+
+fpu_context::fpu_context() {
+    this->used = false;
+    this->raw = kmalloc( FPU_STATE_SIZE + FPU_STATE_ALIGN );
+    if( this->raw == NULL ) {
+        panic("fpu: could not allocate FPU state area!\n");
+    }
+    this->state = (uint8_t*)( ((uintptr_t)this->raw + (FPU_STATE_ALIGN-1)) & ~(uintptr_t)(FPU_STATE_ALIGN-1) );
+}
+
+fpu_context::~fpu_context() {
+    if( this->raw != NULL ) {
+        kfree( this->raw );
+    }
+    this->raw = NULL;
+    this->state = NULL;
+}
+
+void fpu_initialize() {
+    unsigned int a,b,c,d;
+    if( __get_cpuid( 1, &a, &b, &c, &d ) ) {
+        fpu_has_fxsr = ( (d & (1<<24)) > 0 );
+        fpu_has_sse  = ( (d & (1<<25)) > 0 );
+        if( (d & 1) == 0 ) {
+            panic("fpu: no x87 FPU present!\n");
+        }
+    }
+
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0) : : "memory");
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= (CR0_MP | CR0_NE);
+    asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+
+    if( fpu_has_fxsr ) {
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4) : : "memory");
+        cr4 |= CR4_OSFXSR;
+        if( fpu_has_sse ) {
+            cr4 |= CR4_OSXMMEXCPT;
+        }
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+
+    asm volatile("fninit" : : : "memory");
+    if( fpu_has_sse ) {
+        uint32_t mxcsr = 0x1F80; // all SIMD exceptions masked
+        asm volatile("ldmxcsr %0" : : "m"(mxcsr) : "memory");
+    }
+    fpu_save( fpu_initial_state );
+
+    // nobody owns the FPU yet; the first user will trap and load a clean state.
+    fpu_owner = NULL;
+    fpu_stts();
+
+    kprintf("fpu: FXSR %s, SSE %s.\n", (fpu_has_fxsr ? "supported" : "not supported"), (fpu_has_sse ? "enabled" : "not supported"));
+}
+
+// Called whenever a new process context is about to be loaded.
+void fpu_switch( process* next ) {
+    if( (kernel_fpu_depth == 0) && (next != NULL) && (next == fpu_owner) ) {
+        fpu_clts();
+    } else {
+        fpu_stts();
+    }
+}
+
+// #NM handler: give the FPU to the current process.
+void fpu_handle_device_not_available() {
+    interrupt_status_t int_stat = disable_interrupts();
+    fpu_clts();
+
+    if( (kernel_fpu_depth > 0) || (fpu_owner == process_current) ) {
+        restore_interrupts(int_stat);
+        return;
+    }
+
+    if( fpu_owner != NULL ) {
+        fpu_save( fpu_owner->fpu.state );
+    }
+
+    if( process_current != NULL ) {
+        if( process_current->fpu.used ) {
+            fpu_restore( process_current->fpu.state );
+        } else {
+            fpu_restore( fpu_initial_state );
+            process_current->fpu.used = true;
+        }
+    } else {
+        // no processes yet (early boot), just hand out a clean state.
+        fpu_restore( fpu_initial_state );
+    }
+    fpu_owner = process_current;
+
+    restore_interrupts(int_stat);
+}
+
+void fpu_fork( process* parent, process* child ) {
+    interrupt_status_t int_stat = disable_interrupts();
+
+    if( (parent == fpu_owner) && (kernel_fpu_depth == 0) ) {
+        fpu_clts();
+        fpu_save( parent->fpu.state );
+        // fnsave clobbers the loaded state, so just make the parent reload it on its next use.
+        fpu_owner = NULL;
+        fpu_stts();
+    }
+
+    child->fpu.used = parent->fpu.used;
+    if( parent->fpu.used ) {
+        memcpy( (void*)child->fpu.state, (void*)parent->fpu.state, FPU_STATE_SIZE );
+    }
+
+    restore_interrupts(int_stat);
+}
+
+void fpu_process_exit( process* proc ) {
+    interrupt_status_t int_stat = disable_interrupts();
+    if( fpu_owner == proc ) {
+        fpu_owner = NULL;
+        fpu_stts();
+    }
+    restore_interrupts(int_stat);
+}
+
+// Kernel SIMD sections.
+// Interrupts stay disabled until the matching kernel_fpu_end(), so keep these short.
+void kernel_fpu_begin() {
+    interrupt_status_t int_stat = disable_interrupts();
+    if( kernel_fpu_depth++ == 0 ) {
+        kernel_fpu_int_status = int_stat;
+        fpu_clts();
+        if( fpu_owner != NULL ) {
+            fpu_save( fpu_owner->fpu.state );
+            fpu_owner = NULL;
+        }
+        fpu_restore( fpu_initial_state );
+    }
+}
+
+void kernel_fpu_end() {
+    if( kernel_fpu_depth == 0 ) {
+        panic("fpu: kernel_fpu_end() without matching kernel_fpu_begin()!\n");
+    }
+    if( --kernel_fpu_depth == 0 ) {
+        // the kernel's state is thrown away; the next user of the FPU reloads its own.
+        fpu_stts();
+        restore_interrupts( kernel_fpu_int_status );
+    }
+}
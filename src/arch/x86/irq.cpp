@@ -12,6 +12,9 @@
 #include "device/vga.h"
 
 vector<irq_handler> irq_handlers[256];
+// Serializes changes to the handler lists. Holding it keeps interrupts off, so do_irq() (which runs
+// with interrupts off, and can't sleep on a lock) never sees a list mid-update.
+spinlock irq_handlers_lock;
 signed int waiting_for = -1;
 bool do_wait = false;
 bool in_irq_context = false;
@@ -143,22 +146,27 @@ void do_irq(size_t irq_num, size_t eip, size_t cs) {
 }
 
 bool irq_add_handler(irq_num_t irq_num, irq_handler addr) {
+    irq_handlers_lock.lock();
     for( unsigned int i=0;i<irq_handlers[irq_num].length();i++ ) {
         if( irq_handlers[irq_num].get(i) == addr ) {
+            irq_handlers_lock.unlock();
             return false;
         }
     }
     irq_handlers[irq_num].add(addr);
+    irq_handlers_lock.unlock();
     irq_set_mask(irq_num, false);
     return true;
 }
 
 bool irq_remove_handler(irq_num_t irq_num, irq_handler addr) {
+    irq_handlers_lock.lock();
     for( unsigned int i=0;i<irq_handlers[irq_num].length();i++ ) {
         if( irq_handlers[irq_num].get(i) == addr ) {
             irq_handlers[irq_num].remove(i);
         }
     }
+    irq_handlers_lock.unlock();
     return true;
 }
 
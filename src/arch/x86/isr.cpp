@@ -1,5 +1,6 @@
 #include "includes.h"
 #include "arch/x86/isr.h"
+#include "arch/x86/fpu.h"
 
 extern void paging_handle_pagefault(char, uint32_t, uint32_t, uint32_t);
 
@@ -59,8 +60,9 @@ void do_isr_invalidop(size_t err, size_t eip, size_t cs) {
     halt_err(err, eip, cs, "Invalid operation error");
 }
     
+// CR0.TS was set on the last context switch; load the current process' FPU state.
 void do_isr_devnotavail(size_t err, size_t eip, size_t cs) {
-    halt_err(err, eip, cs, "No FPU error");
+    fpu_handle_device_not_available();
 }
     
 void do_isr_dfault(size_t err, size_t eip, size_t cs) {
@@ -1,7 +1,5 @@
 .global multitasking_enabled
 .global multitasking_timeslice_tick_count
-.global as_syscall
-.global syscall_num
 
 # generic wrapper stuff
 _isr_call_cpp_func:
@@ -168,15 +166,8 @@ _isr_irq_0:
     jne .__isr_irq_0_no_ctext_switch # do a "normal" irq call if it isn't
     
     pop %eax
-    movl $0, (as_syscall)
-    movl $0, (syscall_num)
-    movl $0, (syscall_arg1)
-    movl $0, (syscall_arg2)
-    movl $0, (syscall_arg3)
-    movl $0, (syscall_arg4)
-    movl $0, (syscall_arg5)
-    jmp __multitasking_kmode_entry # do note that __multitasking_kmode_entry calls the irq handler in our stead.
-    # not falling through -- __multitasking_kmode_entry does the iret itself
+    jmp __multitasking_preempt_entry # do note that __multitasking_preempt_entry calls the irq handler in our stead.
+    # not falling through -- __multitasking_preempt_entry does the iret itself
     
 .__isr_irq_0_no_ctext_switch:
     dec %eax
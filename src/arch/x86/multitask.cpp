@@ -5,125 +5,38 @@
 #include "arch/x86/table.h"
 #include "arch/x86/irq.h"
 #include "arch/x86/pic.h"
+#include "arch/x86/fpu.h"
+#include "arch/x86/sys.h"
 #include "core/scheduler.h"
+#include "core/syscall.h"
+#include "core/rcu.h"
 #include "device/vga.h"
 
-// scratch space, do not use
-uint32_t syscall_arg1 = 0; // ebx
-uint32_t syscall_arg2 = 0; // ecx
-uint32_t syscall_arg3 = 0; // edx
-uint32_t syscall_arg4 = 0; // edi
-uint32_t syscall_arg5 = 0; // esi
-uint32_t syscall_num = 0;
-uint32_t as_syscall = 0;
-// we have to dump registers to this array
-uint8_t reg_dump_area[60];
+// IA32_SYSENTER_ESP points here. __sysenter_entry switches to the real kernel stack (TSS esp0) right away,
+// so this only needs to be big enough for an NMI arriving before that.
+uint8_t sysenter_entry_stack[512] __attribute__((aligned(16)));
+bool sysenter_available = false;
 
 uint32_t multitasking_enabled = 0;
 uint32_t multitasking_timeslice_tick_count = MULTITASKING_RUN_TIMESLICE;
-bool starting_init_process = false;
+
+// kernel_main's stack pointer gets saved here when the init process is started; nothing switches back to it.
+static uint32_t boot_context_esp = 0;
 
 // active_tss->esp0 must be loaded upon scheduling a process to be run.
 
 extern "C" {
     void __usermode_jump(size_t, size_t, size_t, size_t);
-    void do_context_switch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
-    void __process_load_registers();
-    void __save_registers_non_int();
+    void do_syscall_trap( trap_frame* );
+    void do_preempt_trap( trap_frame* );
 }
 
 void cpu_regs::clear() {
-    this->eax = 0;
-    this->ebx = 0;
-    this->ecx = 0;
-    this->edx = 0;
-    this->esi = 0;
-    this->edi = 0;
-    this->eip = 0;
     this->esp = 0;
-    this->ebp = 0;
-    this->cs = 0;
-    this->ds = 0;
-    this->es = 0;
-    this->fs = 0;
-    this->gs = 0;
-    this->ss = 0;
     this->cr3 = 0;
     this->kernel_stack = 0;
 }
 
-/*
-typedef struct cpu_regs {
-    uint32_t eax;     // 0
-    uint32_t ebx;     // 4
-    uint32_t ecx;     // 8
-    uint32_t edx;     // 12
-    uint32_t esi;     // 16
-    uint32_t edi;     // 20
-    uint32_t eip;     // 24
-    uint32_t eflags;  // 28
-    uint32_t esp;     // 32
-    uint32_t ebp;     // 36
-    uint16_t cs;      // 40
-    uint16_t ds;      // 42
-    uint16_t es;      // 44
-    uint16_t fs;      // 46
-    uint16_t gs;      // 48
-    uint16_t ss;      // 50
-    uint32_t cr3;     // 52
-    uint32_t kernel_stack; // 56
-    
-    void clear();
-} cpu_regs;
-*/
-
-void cpu_regs::load_from_active() {
-    uint32_t *ptr32 = (uint32_t*)reg_dump_area;
-    uint16_t *ptr16 = (uint16_t*)reg_dump_area;
-    this->eax = ptr32[0];
-    this->ebx = ptr32[1];
-    this->ecx = ptr32[2];
-    this->edx = ptr32[3];
-    this->esi = ptr32[4];
-    this->edi = ptr32[5];
-    this->eip = ptr32[6];
-    this->eflags = ptr32[7];
-    this->esp = ptr32[8];
-    this->ebp = ptr32[9];
-    this->cr3 = ptr32[13];
-    
-    this->cs = ptr16[20];
-    this->ds = ptr16[21];
-    this->es = ptr16[22];
-    this->fs = ptr16[23];
-    this->gs = ptr16[24];
-    this->ss = ptr16[25];
-}
-
-void cpu_regs::load_to_active() {
-    uint32_t *ptr32 = (uint32_t*)reg_dump_area;
-    uint16_t *ptr16 = (uint16_t*)reg_dump_area;
-    ptr32[0] = this->eax;
-    ptr32[1] = this->ebx;
-    ptr32[2] = this->ecx;
-    ptr32[3] = this->edx;
-    ptr32[4] = this->esi;
-    ptr32[5] = this->edi;
-    ptr32[6] = this->eip;
-    ptr32[7] = this->eflags;
-    ptr32[8] = this->esp;
-    ptr32[9] = this->ebp;
-    ptr32[13] = this->cr3;
-    
-    ptr16[20] = this->cs;
-    ptr16[21] = this->ds;
-    ptr16[22] = this->es;
-    ptr16[23] = this->fs;
-    ptr16[24] = this->gs;
-    ptr16[25] = this->ss;
-}
-
-// a syscall(0) looks exactly like a context switch from the perspective of the switching code.
 uint32_t syscall(uint32_t syscall_n, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
     uint32_t ret_val;
     asm volatile("int $0x5C" : "=a" (ret_val) : "a"(syscall_n), "b"(arg1), "c"(arg2), "d"(arg3), "D"(arg4), "S"(arg5) : "memory");
@@ -132,98 +45,148 @@ uint32_t syscall(uint32_t syscall_n, uint32_t arg1, uint32_t arg2, uint32_t arg3
 
 void process_switch_immediate() {
     //kprintf("switching process from pid %u.\n", process_current->id);
-    syscall(0,0,0,0,0,0);
+    syscall(SYSCALL_YIELD,0,0,0,0,0);
 }
 
 uint32_t do_syscall(uint32_t syscall_n, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
-    if( syscall_n == 1 ) {
-        return do_fork();
+    return syscall_dispatch( syscall_n, arg1, arg2, arg3, arg4, arg5 );
+}
+
+// SYSENTER takes the caller's EBP on faith, and the return address and arguments 2 and 3 come off the stack
+// it points to. It has to be a present, user-accessible mapping in our own address space: otherwise we'd
+// read kernel memory on the process' behalf, or take a page fault in here that can't be recovered from.
+// (Checked through the recursive mapping, so it's a couple of loads per page.)
+static bool sysenter_stack_ok( virt_addr_t user_stack ) {
+    if( user_stack > (PAGING_KERNEL_BASE_ADDR - 12) ) {
+        return false;
     }
-    return ~process_current->user_regs.eax;
+    for( virt_addr_t page = (user_stack & 0xFFFFF000); page < (user_stack + 12); page += 0x1000 ) {
+        uint32_t pde = *((uint32_t*)(0xFFFFF000 + ((page >> 22)*4)));
+        if( (pde & 5) != 5 ) {
+            return false;
+        }
+        uint32_t pte = *((uint32_t*)(0xFFC00000 + ((page >> 12)*4)));
+        if( (pte & 5) != 5 ) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void do_context_switch(uint32_t syscall_n, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
-    //kprintf("Context switch!\n");
-    if( (process_current == NULL) && (!starting_init_process) ) {
-        // presumably, multitasking hasn't been set up yet, so just return
-        return;
+// Called from __sysenter_entry, on the process' kernel stack with interrupts enabled.
+// No register context is saved here, so anything that needs one has to go through int $0x5C instead.
+// A process that comes in with a bad stack is killed, since there's nowhere to return it to.
+uint32_t do_fast_syscall(uint32_t syscall_n, uint32_t arg1, uint32_t arg4, uint32_t arg5, uint32_t* user_stack) {
+    if( !sysenter_stack_ok( (virt_addr_t)user_stack ) ) {
+        kprintf("multitask: process %u made a SYSENTER call with a bad stack (0x%x)\n", process_current->id, (unsigned long long int)(virt_addr_t)user_stack);
+        process_exec_complete( -1 );
     }
-    if(starting_init_process) {
-        //kprintf("We're starting the first process. Skipping state saving.\n");
-        active_tss.esp0 = process_current->regs.kernel_stack;
-        active_tss.load_active();
-        process_current->regs.eflags |= (1<<9);
-        process_current->regs.load_to_active();
-        starting_init_process = false;
-        multitasking_enabled = 1;
-        //kprintf("Now loading process context.\n");
-        return;
+    if( syscall_n >= N_SYSCALLS ) {
+        return SYSCALL_ERR_INVALID;
     }
-    if( syscall_n > 0 ) {
-        process_current->in_syscall = syscall_n;
-        process_current->user_regs.load_from_active();
-        // If we're preempted, then the syscall's context is saved.
-        // We save active_regs in a special slot to ensure that we don't lose it.
-        asm volatile("sti" : : : "memory"); // we can reenable interrupts, since we're not going to the scheduler
-        uint32_t ret = do_syscall( syscall_n, arg1, arg2, arg3, arg4, arg5 );
-        asm volatile("cli" : : : "memory"); // make sure preemption doesn't screw this up
-        process_current->user_regs.eax = ret; // set return value
-        process_current->user_regs.eflags |= (1<<9); // set IF
-        process_current->user_regs.load_to_active(); // load new user registers
-        process_current->in_syscall = 0;
-    } else {
-        // Save registers
-        process_current->regs.load_from_active();
-        // reschedule to run
-        multitasking_timeslice_tick_count = MULTITASKING_RUN_TIMESLICE;
-        if( (process_current != NULL) && ((process_current->state == process_state::runnable) || (process_current->state == process_state::forking)) )
-            process_add_to_runqueue( process_current );
-        
-        if( irq_get_in_service(0) ) { // do IRQ0 code, but only if bit 0 of the collective ISR is set
-            do_irq( 0, process_current->regs.eip, process_current->regs.cs ); // do_irq sends an EOI, so we don't need to do it ourselves.
-            in_irq_context = true;
-        }
-        
-        process_scheduler();
-        
-        if( process_current == NULL ) {
-            panic("multitask: process_current is NULL during context switch!\n");
+    if( syscall_table[syscall_n].flags & SYSCALL_FLAGS_NEEDS_CONTEXT ) {
+        return SYSCALL_ERR_USE_INT;
+    }
+    process_current->in_syscall = syscall_n;
+    uint32_t ret = syscall_dispatch( syscall_n, arg1, user_stack[1], user_stack[2], arg4, arg5 );
+    process_current->in_syscall = 0;
+
+    // __sysenter_entry reads the return address off the stack next, and the call might have unmapped it
+    if( !sysenter_stack_ok( (virt_addr_t)user_stack ) ) {
+        kprintf("multitask: process %u unmapped its stack during a SYSENTER call\n", process_current->id);
+        process_exec_complete( -1 );
+    }
+    return ret;
+}
+
+void sysenter_initialize() {
+    unsigned int a,b,c,d;
+    if( cpu_has_msr() && __get_cpuid( 1, &a, &b, &c, &d ) ) {
+        unsigned int family = (a >> 8) & 0xF;
+        unsigned int model = (a >> 4) & 0xF;
+        unsigned int stepping = a & 0xF;
+        // early Pentium Pros report SEP without actually supporting SYSENTER
+        if( (d & (1<<11)) && !((family == 6) && (model < 3) && (stepping < 3)) ) {
+            // SYSENTER loads CS from this and SS from CS+8; SYSEXIT uses CS+16 / CS+24 (the user segments).
+            write_msr( MSR_IA32_SYSENTER_CS, GDT_KCODE_SEGMENT*0x08 );
+            write_msr( MSR_IA32_SYSENTER_ESP, (uint32_t)&sysenter_entry_stack[sizeof(sysenter_entry_stack)] );
+            write_msr( MSR_IA32_SYSENTER_EIP, (uint32_t)&__sysenter_entry );
+            sysenter_available = true;
         }
-        
-        // load new process context
-        active_tss.esp0 = process_current->regs.kernel_stack;
+    }
+    kprintf("multitask: SYSENTER system calls %s.\n", (sysenter_available ? "enabled" : "not supported"));
+}
+
+static void switch_to( process* prev, process* next ) {
+    if( active_tss.esp0 != next->regs.kernel_stack ) {
+        active_tss.esp0 = next->regs.kernel_stack;
         active_tss.load_active();
-        if( process_current->state == process_state::forking ) { // load from user_regs instead of regs (like a syscall)
-            if( process_current->user_regs.eip < 0x1000 ) {
-                panic("multitask: invalid process EIP!\n");
-            }
-            process_current->state = process_state::runnable;
-            process_current->user_regs.eflags |= (1<<9); 
-            process_current->user_regs.load_to_active();
-        } else {
-            if( process_current->regs.eip < 0x1000 ) {
-                panic("multitask: invalid process EIP!\n");
-            }
-            process_current->regs.eflags |= (1<<9); 
-            process_current->regs.load_to_active();
-        }
-        if( irq_get_in_service(0) ) { // were we in IRQ context?
-            in_irq_context = false; // well, we're not going to be anymore after this
-        }
     }
-    // reset various state on our way out
-    as_syscall = 0;
-    syscall_num = 0;
-    syscall_arg1 = 0;
-    syscall_arg2 = 0;
-    syscall_arg3 = 0;
-    syscall_arg4 = 0;
-    syscall_arg5 = 0;
+    // the FPU state is only swapped in on first use (see fpu.cpp)
+    fpu_switch( next );
+    // RCU grace periods can only end here (or on a timer tick); see rcu.cpp
+    rcu_note_context_switch();
+    // kernel threads all share one page directory, so switching between them leaves CR3 (and the TLB) alone.
+    __switch_to( &prev->regs.esp, next->regs.esp, (prev->regs.cr3 == next->regs.cr3) ? 0 : next->regs.cr3 );
+}
+
+// Put the current process back on the run queue (if it can still run) and switch to whatever the scheduler picks.
+// Returns once the current process gets scheduled again.
+void process_reschedule() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return;
+    }
+    interrupt_status_t int_stat = disable_interrupts();
+    
+    process* prev = process_current;
+    multitasking_timeslice_tick_count = MULTITASKING_RUN_TIMESLICE;
+    if( prev->state == process_state::runnable )
+        process_add_to_runqueue( prev );
+    
+    process_scheduler();
+    
+    if( process_current == NULL ) {
+        panic("multitask: process_current is NULL during context switch!\n");
+    }
+    
+    if( process_current != prev ) {
+        switch_to( prev, process_current );
+    }
+    
+    restore_interrupts( int_stat );
+}
+
+void do_syscall_trap( trap_frame* frame ) {
+    if( process_current == NULL ) {
+        // presumably, multitasking hasn't been set up yet, so just return
+        return;
+    }
+    process* proc = process_current;
+    // system calls can nest (e.g. a blocking lock inside fork()), so keep the outer call's state around
+    trap_frame* old_frame = proc->syscall_frame;
+    uint32_t old_syscall = proc->in_syscall;
+    proc->in_syscall = frame->eax;
+    proc->syscall_frame = frame;
+    
+    asm volatile("sti" : : : "memory"); // we're on our own kernel stack, so we can be preempted from here on
+    uint32_t ret = do_syscall( frame->eax, frame->ebx, frame->ecx, frame->edx, frame->edi, frame->esi );
+    asm volatile("cli" : : : "memory");
+    
+    frame->eax = ret;
+    proc->syscall_frame = old_frame;
+    proc->in_syscall = old_syscall;
+}
+
+void do_preempt_trap( trap_frame* frame ) {
+    do_irq( 0, frame->eip, frame->cs ); // do_irq sends an EOI, so we don't need to do it ourselves.
+    process_reschedule();
 }
 
 void process_exec_complete( uint32_t return_value ) {
-    process_current->state = process_state::dead;
     process_current->return_value = return_value;
+    process_current->state = process_state::dead;
+    mutex_pi_process_exit( process_current ); // (anybody waiting on a mutex we still hold gets it now)
+    process_current->exit_waiters.wake_all();
     while(true) { process_switch_immediate(); }
     panic("Reached end of process execution but still going on!\n");
 }
@@ -233,18 +196,28 @@ void initialize_multitasking(process *init) {
     active_tss.ss0 = GDT_KDATA_SEGMENT*0x08; // kernel-mode SS is always the kernel data segment
     active_tss.load_active();
     
+    // the init process always gets PID 1.
+    pid_table_remove( init );
+    free_pid( init->id );
     init->id = 1;
     init->parent = 0;
+    pid_table_insert( init );
     process_current = init;
 }
 
 void multitasking_start_init() {
     kprintf("Starting process 0.\n");
+    disable_interrupts();
+    
+    multitasking_enabled = 1;
+    multitasking_timeslice_tick_count = MULTITASKING_RUN_TIMESLICE;
+    
+    // the init process' stack starts out with a trap_frame that "returns" to its entry point with interrupts on.
+    kprintf("Switching to process.\n");
     active_tss.esp0 = process_current->regs.kernel_stack;
     active_tss.load_active();
+    fpu_switch( process_current );
+    __switch_to( &boot_context_esp, process_current->regs.esp, process_current->regs.cr3 );
     
-    //process_current->regs.load_to_active();
-    starting_init_process = true;
-    kprintf("Switching to process.\n");
-    process_switch_immediate();
+    panic("multitask: returned to boot context!\n");
 }
@@ -1,253 +1,186 @@
 # multitask_ll.s
 
-.global as_syscall
-.global syscall_num
-.global syscall_arg1
-.global syscall_arg2
-.global syscall_arg3
-.global syscall_arg4
-.global syscall_arg5
-.global reg_dump_area
 .global __syscall_entry
-.global __multitasking_kmode_entry
-.global do_context_switch
+.global __sysenter_entry
+.global __sysenter_bench_entry
+.global __multitasking_preempt_entry
+.global __trap_return
+.global __switch_to
+.global do_syscall_trap
+.global do_preempt_trap
 .global __usermode_jump
 .global __process_execution_complete
 .global process_exec_complete
 
-#typedef struct cpu_regs {
-#    uint32_t eax;     // 0
-#    uint32_t ebx;     // 4
-#    uint32_t ecx;     // 8
-#    uint32_t edx;     // 12
-#    uint32_t esi;     // 16
-#    uint32_t edi;     // 20
-#    uint32_t eip;     // 24
-#    uint32_t eflags;  // 28
-#    uint32_t esp;     // 32
-#    uint32_t ebp;     // 36
-#    uint16_t cs;      // 40
-#    uint16_t ds;      // 42
-#    uint16_t es;      // 44
-#    uint16_t fs;      // 46
-#    uint16_t gs;      // 48
-#    uint16_t ss;      // 50
-#    uint32_t cr3;     // 52
-#    uint32_t kern_esp;// 56
-#} cpu_regs;
+#typedef struct trap_frame {
+#    uint32_t gs, fs, es, ds;                  // 0, 4, 8, 12
+#    uint32_t edi, esi, ebp, esp_ignored;      // 16, 20, 24, 28 (pusha)
+#    uint32_t ebx, edx, ecx, eax;              // 32, 36, 40, 44 (pusha)
+#    uint32_t eip, cs, eflags;                 // 48, 52, 56 (pushed by the CPU)
+#    uint32_t user_esp, user_ss;               // 60, 64 (only from user mode)
+#} trap_frame;
 
-# ... program stack ...
-# Saved EFLAGS
-# Saved CS
-# Saved EIP
+# Interrupt frames stay on the interrupted process' own kernel stack:
+# the kernel process stack, or TSS esp0 if we came from user mode.
+# Context switches happen further down that stack, in __switch_to.
 
 __syscall_entry:
-    movl $1, (as_syscall)
-    mov %eax, (syscall_num)
-    mov %ebx, (syscall_arg1)
-    mov %ecx, (syscall_arg2)
-    mov %edx, (syscall_arg3)
-    mov %edi, (syscall_arg4)
-    mov %esi, (syscall_arg5)
-    # now fall through to below
+    pusha
+    push %ds
+    push %es
+    push %fs
+    push %gs
     
-__multitasking_kmode_entry:
-    # we are working off of esp0 / ss0 in active_tss.
-    # or the process' old stack, but either way we're in a kernel-mode stack
-    mov %eax, (reg_dump_area)
-    mov $reg_dump_area, %eax
-    # save "easy" registers
-    mov %ebx, 4(%eax)
-    mov %ecx, 8(%eax)
-    mov %edx, 12(%eax)
-    mov %esi, 16(%eax)
-    mov %edi, 20(%eax)
-    mov %ebp, 36(%eax)
-    mov %cr3, %ebx
-    mov %ebx, 52(%eax)
-    
-    # save EFLAGS first
-    mov 8(%esp), %ebx
-    mov %ebx, 28(%eax)
-    
-    # make sure we don't get preempted
-    cli
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
     
-    # save data segment registers
-    mov %ds, 42(%eax)
-    mov %es, 44(%eax)
-    mov %fs, 46(%eax)
-    mov %gs, 48(%eax)
+    push %esp # trap_frame*
+    call do_syscall_trap
+    add $4, %esp
+    jmp __trap_return
 
-    # save EIP
-    mov (%esp), %ebx
-    mov %ebx, 24(%eax)
-    
-    # save CS
-    mov 4(%esp), %ebx
-    movw %bx, 40(%eax)
+# jumped to by the IRQ0 handler when the running process' timeslice is up.
+# do_preempt_trap handles IRQ0 itself.
+__multitasking_preempt_entry:
+    pusha
+    push %ds
+    push %es
+    push %fs
+    push %gs
     
-    # save ESP (pre-interrupt)
-    # the method to save ESP / SS depends on what mode we were in pre-interrupt.
-    cmp $0x08, %bx
-    jne .__save_esp_umode
-    
-.__save_esp_kmode:
-    mov %esp, %ebx
-    add $12, %ebx
-    mov %ebx, 32(%eax)
-    mov %ss, 50(%eax)
-    jmp .__save_esp_exit
-.__save_esp_umode:
-    # save SS
-    mov $0, %ebx
-    mov 12(%esp), %bx
-    mov %bx, 50(%eax)
-    
-    # save ESP
-    mov 16(%esp), %ebx
-    mov %ebx, 32(%eax)
-.__save_esp_exit:
     mov $0x10, %ax
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
     mov %ax, %gs
-
-    mov (syscall_num), %eax
-    mov (syscall_arg1), %ebx
-    mov (syscall_arg2), %ecx
-    mov (syscall_arg3), %edx
-    mov (syscall_arg4), %edi
-    mov (syscall_arg5), %esi
     
+    push %esp
+    call do_preempt_trap
+    add $4, %esp
+    
+    # fall through
+    
+# also the first return address of new and forked processes (see process.cpp).
+__trap_return:
+    pop %gs
+    pop %fs
+    pop %es
+    pop %ds
+    popa
+    iret # this will load SS:ESP (if needed), EFLAGS, and CS:EIP for us
+
+# void __switch_to(uint32_t* prev_esp, uint32_t next_esp, uint32_t next_cr3)
+# Saves the callee-saved registers on the outgoing stack and resumes the next process
+# wherever it last called __switch_to. Interrupts must be disabled.
+# next_cr3 is 0 if the address space doesn't change.
+__switch_to:
+    mov 4(%esp), %eax   # prev_esp
+    mov 8(%esp), %edx   # next_esp
+    mov 12(%esp), %ecx  # next_cr3
+    
+    push %ebp
+    push %ebx
     push %esi
     push %edi
-    push %edx
-    push %ecx
-    push %ebx
-    push %eax
+    mov %esp, (%eax)
     
-    call do_context_switch
+    # kernel process stacks all live at the same address in their own address spaces,
+    # so nothing may touch the stack between these two instructions.
+    test %ecx, %ecx
+    jz .__switch_to_same_as
+    mov %ecx, %cr3
+.__switch_to_same_as:
+    mov %edx, %esp
     
-    pop %eax
-    pop %ebx
-    pop %ecx
-    pop %edx
     pop %edi
     pop %esi
-    
-__process_load_registers:
-    mov $reg_dump_area, %eax
-    
-    # load cr3
-    mov 52(%eax), %ebx
-    mov %ebx, %cr3
-    
-    # load EBP
-    mov 36(%eax), %ebp
-    
-    mov $0, %ebx
-    mov 40(%eax), %bx
-    
-    # were we in kernel mode to begin with?
-    cmp $0x08, %bx
-    je .__process_kmode_stack_load
-    
-    # load SS for iret (only when coming from usermode)
-    mov $0, %ebx
-    mov 50(%eax), %bx
-    push %ebx
-    
-    # load ESP for iret (only when coming from usermode)
-    mov 32(%eax), %ebx
-    push %ebx
-    jmp .__process_load_rest
-    
-.__process_kmode_stack_load:
-    # don't need to load SS
-    
-    # load ESP
-    mov 32(%eax), %esp
-    
-    # and fall through
+    pop %ebx
+    pop %ebp
+    ret
 
-.__process_load_rest:
-    # load EFLAGS for iret
-    mov 28(%eax), %ebx
-    push %ebx
+# SYSENTER entry point.
+# SYSENTER loads CS / SS / ESP / EIP from the MSRs and nothing else, so:
+#   EAX = syscall number, EBX / EDI / ESI = arguments 1, 4, 5
+#   EBP = user stack: (%ebp) = return EIP, 4(%ebp) = arg2 (saved ECX), 8(%ebp) = arg3 (saved EDX)
+# The user stack is only read once do_fast_syscall has checked that it's mapped (and still is afterwards).
+# No register context is saved, so this never switches processes; see do_fast_syscall.
+__sysenter_entry:
+    # switch to the process' kernel stack (esp0 in umode_tss).
+    mov %ss:(umode_tss+4), %esp
+    
+    push %ebp
+    push %ds
+    push %es
+    push %fs
+    push %gs
     
-    # load CS for iret
-    mov $0, %ebx
-    mov 40(%eax), %bx
-    push %ebx
-    
-    # load EIP for iret
-    mov 24(%eax), %ebx
-    push %ebx
-    
-    # reload general registers
-    mov 4(%eax), %ebx
-    mov 8(%eax), %ecx
-    mov 12(%eax), %edx
-    mov 16(%eax), %esi
-    mov 20(%eax), %edi
+    push %eax
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    pop %eax
     
-    # load segment registers
-    mov 44(%eax), %es
-    mov 46(%eax), %fs
-    mov 48(%eax), %gs
+    # the user stack has to be below the kernel.
+    cmp $0xBFFFFFF4, %ebp
+    jae .__sysenter_bad_stack
     
-    # load EAX
-    mov (reg_dump_area), %eax
-    mov (reg_dump_area+42), %ds
+    sti
     
-    iret # this will load SS:ESP (if needed), EFLAGS, and CS:EIP for us
+    push %ebp
+    push %esi
+    push %edi
+    push %ebx
+    push %eax
     
-# we can't rely on the iret push order here.
-# however, we can rely on a pushed EIP value at (%esp).
-__save_registers_non_int:
-    mov %eax, (reg_dump_area)
-    mov $reg_dump_area, %eax
-    # save "easy" registers
-    mov %ebx, 4(%eax)
-    mov %ecx, 8(%eax)
-    mov %edx, 12(%eax)
-    mov %esi, 16(%eax)
-    mov %edi, 20(%eax)
-    mov %ebp, 36(%eax)
-    mov %cr3, %ebx
-    mov %ebx, 52(%eax)
+    call do_fast_syscall
     
-    # save EFLAGS first
-    pushf
-    pop %ebx
-    mov %ebx, 28(%eax)
+    add $20, %esp
     
-    # make sure we don't get preempted
     cli
-    
-    # save CS
-    mov %cs, 40(%eax)
-    
-    # save other segment registers
-    mov %ds, 42(%eax)
-    mov %es, 44(%eax)
-    mov %fs, 46(%eax)
-    mov %gs, 48(%eax)
-    mov %ss, 50(%eax)
+    pop %gs
+    pop %fs
+    pop %es
+    pop %ds
+    pop %ebp
+    
+    # SYSEXIT: EIP = EDX, ESP = ECX
+    mov (%ebp), %edx
+    lea 4(%ebp), %ecx
+    sti
+    sysexit
+    
+.__sysenter_bad_stack:
+    sti
+    push $-1
+    call process_exec_complete
+    cli
+    hlt
+
+# SYSENTER target for bench_syscall only, while it has IA32_SYSENTER_EIP pointed here.
+# SYSEXIT can only return to ring 3, so this reloads the data segments like __sysenter_entry does and
+# then jumps straight back: EDX = return EIP, ECX = stack pointer to return with. Interrupts stay off.
+__sysenter_bench_entry:
+    push %ds
+    push %es
+    push %fs
+    push %gs
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    pop %gs
+    pop %fs
+    pop %es
+    pop %ds
+    mov %ecx, %esp
+    jmp *%edx
 
-    # save EIP
-    mov 4(%esp), %ebx
-    mov %ebx, 24(%eax)
-    
-    # save ESP (pre-call)
-    mov %esp, %ebx
-    add $4, %ebx
-    mov %ebx, 32(%eax)
-    
-    ret
-    
 # all we need to do here is keep %eax around for safekeeping
 # and clean up the two arguments we've pushed onto the call stack.
 __process_execution_complete:
@@ -129,6 +129,16 @@ uint32_t paging_get_pte(size_t vaddr) {
 
 
 address_space::address_space() {
+    this->initialize();
+}
+
+address_space::address_space( bool allocate ) {
+    if( allocate ) {
+        this->initialize();
+    }
+}
+
+void address_space::initialize() {
     page_frame *pd_frame = pageframe_allocate(1);
     size_t pd_vaddr = k_vmem_alloc(1);
     
@@ -274,7 +284,7 @@ bool address_space::map( size_t vaddr, size_t paddr, int flags ) {
     return false;
 }
 
-void address_space::unmap( size_t vaddr ) {
+void address_space::unmap( size_t vaddr, bool release_frame ) {
     if(vaddr > 0xC0000000)
         return;
     vaddr &= 0xFFFFF000;
@@ -302,7 +312,7 @@ void address_space::unmap( size_t vaddr ) {
     
     uint32_t *table = (uint32_t*)pt->map();
     int block_addr = pageframe_get_block_from_addr( table[table_offset] & 0xFFFFF000 );
-    if( block_addr != -1 ) {
+    if( release_frame && (block_addr != -1) ) {
         pageframe_deallocate_specific(block_addr, 0);
     }
     if( table[table_offset] != 0 ) {
@@ -460,6 +470,9 @@ void paging_handle_pagefault(char error_code, uint32_t cr2, uint32_t eip, uint32
             }
             paging_set_pte( (size_t)cr2 & 0xFFFFF000, pageframe_get_block_addr(frame_id, 0), 0x100 ); // load vaddr to newly allocated page (w/ GLOBAL and PRESENT flags)
         } else {
+            if( process_current->flags & PROCESS_FLAGS_KTHREAD ) {
+                panic("paging: kernel thread %u (%s) accessed user-space address 0x%x!\n", process_current->id, process_current->name, (unsigned long long int)cr2);
+            }
             // map in process-specific page
             int frame_id = -1; //pageframe_allocate_single(0);
             for(int i=0;i<n_blocks[0];i++) {
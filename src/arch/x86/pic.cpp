@@ -43,7 +43,6 @@ void pic_initialize(char vector_offset_1) {
     asm volatile("sti" : : : "memory");
 
     device_manager::device_node* dev = new device_manager::device_node;
-	dev->child_id = device_manager::root.children.count();
 	dev->enabled = true;
 	dev->type = device_manager::dev_type::ioapic;
 	dev->human_name = const_cast<char*>("8259 PICs");
@@ -73,7 +72,7 @@ void pic_initialize(char vector_offset_1) {
 		dev->resources.add_end(res);
 	}
 
-	device_manager::root.children.add_end( dev );
+	device_manager::add_child( &device_manager::root, dev );
 }
 
 uint16_t pic_get_mask() {
@@ -2,6 +2,8 @@
 #include "arch/x86/irq.h"
 #include "arch/x86/pic.h"
 #include "arch/x86/table.h"
+#include "arch/x86/fpu.h"
+#include "arch/x86/multitask.h"
 #include "boot/multiboot.h"
 #include "core/paging.h"
 #include "device/pit.h"
@@ -32,6 +34,8 @@ void kernel_init(multiboot_info_t* mb_info, unsigned int magic) {
     initialize_vmem_allocator();
     k_heap_init();
     initialize_pageframes(mb_info);
+    fpu_initialize();
+    sysenter_initialize();
     
     // do global constructor setup
     kprintf("Calling global constructors.\n");
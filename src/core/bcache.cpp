@@ -0,0 +1,739 @@
+// bcache.cpp -- block cache
+// Blocks are found through a hash table on (disk, block number) and replaced with the CLOCK algorithm.
+// Writes only dirty the cached block; the flusher thread writes dirty blocks back in batches every
+// BCACHE_FLUSH_INTERVAL ms (or sooner, once too many pile up), and bcache_sync() does it on demand.
+// bcache_lock covers the table and every block's bookkeeping, but never the data or any I/O: a block
+// is marked busy instead, and anybody who needs it waits on bcache_io_waiters until it isn't.
+// Sequential reads are detected per stream (see bcache_stream); blocks ahead of the reader are
+// submitted asynchronously, so the disk keeps working while the reader copies out what it has.
+
+#include "includes.h"
+#include "core/bcache.h"
+#include "core/scheduler.h"
+
+static spinlock bcache_lock;
+static wait_queue bcache_io_waiters;                // woken when a block stops being busy or pinned
+static bcache_block* bcache_buckets[BCACHE_HASH_BUCKETS];
+static bcache_block* bcache_blocks[BCACHE_MAX_BLOCKS];
+static unsigned int bcache_n_blocks = 0;
+static unsigned int bcache_clock_hand = 0;
+static unsigned int bcache_n_dirty = 0;
+
+static uint64_t bcache_hits = 0;
+static uint64_t bcache_misses = 0;
+static uint64_t bcache_evictions = 0;
+static uint64_t bcache_writebacks = 0;
+static uint64_t bcache_ra_blocks = 0;
+static uint64_t bcache_ra_hits = 0;
+static uint64_t bcache_ra_wasted = 0;
+
+static bool bcache_readahead_enabled = true;
+static bcache_stream bcache_streams[BCACHE_RA_STREAMS];
+static uint64_t bcache_stream_clock = 0;
+
+static process* bcache_flusher = NULL;
+static wait_queue bcache_flusher_waiters;
+
+static bcache_block** bcache_bucket( unsigned int disk_no, uint64_t block_no ) {
+    uint32_t h = ((uint32_t)block_no) ^ ((uint32_t)(block_no >> 32)) ^ (disk_no * 0x9E3779B9);
+    h ^= (h >> 16);
+    return &bcache_buckets[ h % BCACHE_HASH_BUCKETS ];
+}
+
+// lock must be held.
+static bcache_block* bcache_lookup( unsigned int disk_no, uint64_t block_no ) {
+    for( bcache_block* b = *bcache_bucket( disk_no, block_no ); b != NULL; b = b->hash_next ) {
+        if( (b->disk_no == disk_no) && (b->block_no == block_no) ) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// lock must be held.
+static void bcache_unhash( bcache_block* b ) {
+    for( bcache_block** cur = bcache_bucket( b->disk_no, b->block_no ); *cur != NULL; cur = &(*cur)->hash_next ) {
+        if( *cur == b ) {
+            *cur = b->hash_next;
+            break;
+        }
+    }
+    b->hash_next = NULL;
+    b->disk_no = 0;
+}
+
+// Read or write one block synchronously. The block has to be busy.
+static bool bcache_block_io( bcache_block* b, bool read ) {
+    transfer_request* req = new transfer_request( b->buf, b->sector_start, b->n_sectors, read );
+    req->disk_no = b->disk_no;
+    io_submit( &req, 1 );
+    req->wait();
+    bool ok = req->status;
+    delete req;
+    return ok;
+}
+
+// A block is going away. If it was read ahead for nothing, that stream is reading ahead too far.
+// lock must be held.
+static void bcache_ra_evicted( bcache_block* b ) {
+    if( b->readahead ) {
+        b->readahead = false;
+        bcache_ra_wasted++;
+        if( (b->stream != NULL) && (b->stream->disk_no == b->disk_no) ) {
+            b->stream->window /= 2;
+        }
+    }
+    b->stream = NULL;
+}
+
+// lock must be held.
+static void bcache_set_dirty( bcache_block* b, bool dirty ) {
+    if( b->dirty != dirty ) {
+        b->dirty = dirty;
+        if( dirty ) {
+            bcache_n_dirty++;
+        } else {
+            bcache_n_dirty--;
+        }
+    }
+}
+
+// Add a new (free) block to the cache, if there's room. lock must be held; it's dropped while allocating.
+static bcache_block* bcache_grow() {
+    bcache_lock.unlock();
+    bcache_block* b = new bcache_block;
+    b->buf = new transfer_buffer( BCACHE_BLOCK_SIZE );
+    bcache_lock.lock();
+    if( bcache_n_blocks < BCACHE_MAX_BLOCKS ) {
+        bcache_blocks[bcache_n_blocks++] = b;
+        return b;
+    }
+    bcache_lock.unlock();
+    delete b->buf;
+    delete b;
+    bcache_lock.lock();
+    return NULL;
+}
+
+// Find a block to (re)use. lock must be held; it's dropped (and NULL returned) if we had to wait,
+// allocate or write something back first, in which case the caller has to look again.
+static bcache_block* bcache_replace() {
+    if( bcache_n_blocks < BCACHE_MAX_BLOCKS ) {
+        bcache_grow(); // (it's free, so the next pass picks it up)
+        return NULL;
+    }
+
+    // two trips around at most: the first one clears every referenced bit it passes
+    for( unsigned int i=0;i<(bcache_n_blocks*2);i++ ) {
+        bcache_block* b = bcache_blocks[bcache_clock_hand];
+        bcache_clock_hand = (bcache_clock_hand + 1) % bcache_n_blocks;
+        if( (b->refs > 0) || b->busy ) {
+            continue;
+        }
+        if( b->disk_no == 0 ) {
+            return b;
+        }
+        if( b->referenced ) {
+            b->referenced = false;
+            continue;
+        }
+        if( b->dirty ) {
+            // it has to go out before it can be reused
+            b->busy = true;
+            bcache_set_dirty( b, false );
+            bcache_lock.unlock();
+            bool ok = bcache_block_io( b, false );
+            bcache_lock.lock();
+            b->busy = false;
+            if( ok ) {
+                bcache_writebacks++;
+            } else {
+                bcache_set_dirty( b, true );
+            }
+            bcache_lock.unlock();
+            bcache_io_waiters.wake_all();
+            bcache_lock.lock();
+            return NULL;
+        }
+        bcache_ra_evicted( b ); // (before unhashing, which forgets the disk)
+        bcache_unhash( b );
+        bcache_evictions++;
+        return b;
+    }
+
+    // everything's in use; wait for somebody to let go
+    bcache_io_waiters.wait( &bcache_lock );
+    bcache_lock.lock();
+    return NULL;
+}
+
+// bcache_replace() for read-ahead, which must never wait: only a free block or a clean, unused one will
+// do, and NULL means there isn't one. lock must be held; it's dropped while the cache grows, so the caller
+// has to check the block it wanted still isn't cached.
+static bcache_block* bcache_replace_nowait() {
+    if( bcache_n_blocks < BCACHE_MAX_BLOCKS ) {
+        bcache_block* b = bcache_grow();
+        if( b != NULL ) {
+            return b;
+        }
+    }
+    for( unsigned int i=0;i<(bcache_n_blocks*2);i++ ) {
+        bcache_block* b = bcache_blocks[bcache_clock_hand];
+        bcache_clock_hand = (bcache_clock_hand + 1) % bcache_n_blocks;
+        if( (b->refs > 0) || b->busy || b->dirty ) {
+            continue;
+        }
+        if( b->disk_no == 0 ) {
+            return b;
+        }
+        if( b->referenced ) {
+            b->referenced = false;
+            continue;
+        }
+        bcache_ra_evicted( b ); // (before unhashing, which forgets the disk)
+        bcache_unhash( b );
+        bcache_evictions++;
+        return b;
+    }
+    return NULL;
+}
+
+// Get block_no of disk_no, pinned. With fill set, it's read in if it isn't cached yet; exclusive
+// also keeps it busy until bcache_put(), for writing to. NULL if the read failed.
+static bcache_block* bcache_get( unsigned int disk_no, uint64_t block_no, uint64_t sector_start, unsigned int n_sectors, bool fill, bool exclusive ) {
+    bcache_lock.lock();
+    bcache_block* b = NULL;
+    while( b == NULL ) {
+        b = bcache_lookup( disk_no, block_no );
+        if( b != NULL ) {
+            b->refs++;
+            b->referenced = true;
+            while( b->busy ) {
+                bcache_io_waiters.wait( &bcache_lock );
+                bcache_lock.lock();
+            }
+            if( b->readahead ) {
+                b->readahead = false;
+                bcache_ra_hits++;
+            }
+            if( b->valid ) {
+                bcache_hits++;
+            } else {
+                bcache_misses++; // (an earlier read failed, or a write that would have filled it is still to come)
+            }
+        } else {
+            b = bcache_replace();
+            if( b == NULL ) {
+                continue;
+            }
+            bcache_misses++;
+            b->disk_no = disk_no;
+            b->block_no = block_no;
+            b->sector_start = sector_start;
+            b->n_sectors = n_sectors;
+            b->valid = false;
+            b->refs = 1;
+            b->referenced = true;
+            b->readahead = false;
+            bcache_block** bucket = bcache_bucket( disk_no, block_no );
+            b->hash_next = *bucket;
+            *bucket = b;
+        }
+    }
+
+    if( b->valid || !fill ) {
+        b->busy = exclusive;
+        bcache_lock.unlock();
+        return b;
+    }
+
+    b->busy = true;
+    bcache_lock.unlock();
+    bool ok = bcache_block_io( b, true );
+    bcache_lock.lock();
+    b->valid = ok;
+    b->busy = (ok && exclusive);
+    if( !ok ) {
+        b->refs--;
+    }
+    bcache_lock.unlock();
+    bcache_io_waiters.wake_all();
+    return (ok ? b : NULL);
+}
+
+// Unpin a block from bcache_get(). written means it was gotten exclusively and has new data in it.
+static void bcache_put( bcache_block* b, bool written ) {
+    bcache_lock.lock();
+    if( written ) {
+        b->valid = true;
+        b->busy = false;
+        bcache_set_dirty( b, true );
+    }
+    b->refs--;
+    bool kick = (bcache_n_dirty > BCACHE_DIRTY_HIGH);
+    bcache_lock.unlock();
+    if( !bcache_io_waiters.empty() ) {
+        bcache_io_waiters.wake_all();
+    }
+    if( kick && !bcache_flusher_waiters.empty() ) {
+        bcache_flusher_waiters.wake_one();
+    }
+}
+
+// Disk / LBA order.
+static bool bcache_block_before( bcache_block* a, bcache_block* b ) {
+    if( a->disk_no != b->disk_no ) {
+        return (a->disk_no < b->disk_no);
+    }
+    return (a->sector_start < b->sector_start);
+}
+
+// Write back one batch of dirty blocks (on disk_no, or on any disk if it's 0), all submitted at once.
+// Runs of adjacent blocks go out as one vectored write, straight from the blocks' own pages (as much
+// as the disk takes in one transfer). Returns how many blocks made it out.
+static unsigned int bcache_flush_batch( unsigned int disk_no ) {
+    bcache_block* batch[BCACHE_FLUSH_BATCH];
+    transfer_request* reqs[BCACHE_FLUSH_BATCH];
+    unsigned int run_end[BCACHE_FLUSH_BATCH]; // reqs[i] writes batch[run_end[i-1]] up to (not including) batch[run_end[i]]
+    unsigned int n = 0;
+
+    bcache_lock.lock();
+    for( unsigned int i=0;(i<bcache_n_blocks) && (n<BCACHE_FLUSH_BATCH);i++ ) {
+        bcache_block* b = bcache_blocks[i];
+        if( b->dirty && !b->busy && ((disk_no == 0) || (b->disk_no == disk_no)) ) {
+            b->busy = true;
+            bcache_set_dirty( b, false );
+            batch[n++] = b;
+        }
+    }
+    bcache_lock.unlock();
+    if( n == 0 ) {
+        return 0;
+    }
+
+    for( unsigned int i=1;i<n;i++ ) {
+        bcache_block* b = batch[i];
+        unsigned int j = i;
+        while( (j > 0) && bcache_block_before( b, batch[j-1] ) ) {
+            batch[j] = batch[j-1];
+            j--;
+        }
+        batch[j] = b;
+    }
+
+    unsigned int n_reqs = 0;
+    for( unsigned int i=0;i<n; ) {
+        io_disk* dev = io_get_disk( batch[i]->disk_no );
+        unsigned int max_sectors = ((dev != NULL) ? dev->get_max_sectors() : 0);
+        size_t n_sectors = batch[i]->n_sectors;
+        unsigned int j = i+1;
+        while( (j < n) && (batch[j]->disk_no == batch[i]->disk_no)
+               && (batch[j]->sector_start == (batch[j-1]->sector_start + batch[j-1]->n_sectors))
+               && ((n_sectors + batch[j]->n_sectors) <= max_sectors) ) {
+            n_sectors += batch[j]->n_sectors;
+            j++;
+        }
+
+        transfer_request* req;
+        if( j == (i+1) ) {
+            req = new transfer_request( batch[i]->buf, batch[i]->sector_start, batch[i]->n_sectors, false );
+        } else {
+            io_sg_list* sg = new io_sg_list( j-i );
+            for( unsigned int k=i;k<j;k++ ) {
+                sg->add_list( &batch[k]->buf->sg, batch[k]->n_sectors * dev->get_sector_size() );
+            }
+            req = new transfer_request( sg, batch[i]->sector_start, n_sectors, false );
+        }
+        req->disk_no = batch[i]->disk_no;
+        reqs[n_reqs] = req;
+        run_end[n_reqs] = j;
+        n_reqs++;
+        i = j;
+    }
+    io_submit( reqs, n_reqs );
+
+    unsigned int written = 0;
+    unsigned int first = 0;
+    for( unsigned int r=0;r<n_reqs;r++ ) {
+        reqs[r]->wait();
+        bool ok = reqs[r]->status;
+        if( reqs[r]->buffer == NULL ) {
+            delete reqs[r]->sg; // (a run's list; single blocks use their buffer's own)
+        }
+        delete reqs[r];
+
+        bcache_lock.lock();
+        for( unsigned int i=first;i<run_end[r];i++ ) {
+            batch[i]->busy = false;
+            if( ok ) {
+                bcache_writebacks++;
+                written++;
+            } else {
+                bcache_set_dirty( batch[i], true );
+            }
+        }
+        bcache_lock.unlock();
+        first = run_end[r];
+    }
+    bcache_io_waiters.wake_all();
+    return written;
+}
+
+static void bcache_flusher_func() {
+    while( true ) {
+        bcache_lock.lock();
+        if( bcache_n_dirty <= BCACHE_DIRTY_HIGH ) {
+            bcache_flusher_waiters.wait_timeout( BCACHE_FLUSH_INTERVAL, &bcache_lock );
+        } else {
+            bcache_lock.unlock();
+        }
+        while( bcache_flush_batch( 0 ) > 0 );
+    }
+}
+
+void bcache_initialize() {
+    bcache_flusher = kthread_create( (size_t)&bcache_flusher_func, 1, "bcache_flusher" );
+    spawn_process( bcache_flusher );
+}
+
+// Sectors per block on dev, or 0 if its sectors are too big to cache.
+static unsigned int bcache_sectors_per_block( io_disk* dev ) {
+    unsigned int sector_size = dev->get_sector_size();
+    if( (sector_size == 0) || (sector_size > BCACHE_BLOCK_SIZE) || ((BCACHE_BLOCK_SIZE % sector_size) != 0) ) {
+        return 0;
+    }
+    return BCACHE_BLOCK_SIZE / sector_size;
+}
+
+// How many sectors block_no covers (the last block on a disk can come up short).
+static unsigned int bcache_block_sectors( io_disk* dev, uint64_t block_no, unsigned int per_block ) {
+    uint64_t total = dev->get_total_size() / dev->get_sector_size();
+    uint64_t first = block_no * per_block;
+    if( (first < total) && ((total - first) < per_block) ) {
+        return (unsigned int)(total - first);
+    }
+    return per_block;
+}
+
+static void bcache_readahead_done( transfer_request* req, void* context ) {
+    bcache_block* b = (bcache_block*)context;
+    bool ok = req->status;
+    delete req;
+
+    bcache_lock.lock();
+    b->valid = ok; // (if it failed, whoever wants it will just read it again)
+    b->busy = false;
+    bcache_lock.unlock();
+    bcache_io_waiters.wake_all();
+}
+
+// Start reading blocks [start, end) on disk_no in the background, skipping any that are already cached.
+// Nothing here waits (the blocks claimed so far are busy until they're submitted, so waiting for a block
+// could mean waiting on ourselves); once there are no blocks to spare, we just read ahead less.
+static void bcache_readahead_issue( unsigned int disk_no, io_disk* dev, unsigned int per_block, bcache_stream* s, uint64_t start, uint64_t end ) {
+    transfer_request* reqs[BCACHE_RA_MAX_WINDOW];
+    unsigned int n = 0;
+
+    bcache_lock.lock();
+    for( uint64_t block_no = start; (block_no < end) && (n < BCACHE_RA_MAX_WINDOW); ) {
+        if( bcache_lookup( disk_no, block_no ) != NULL ) {
+            block_no++;
+            continue;
+        }
+        bcache_block* b = bcache_replace_nowait();
+        if( b == NULL ) {
+            break;
+        }
+        if( bcache_lookup( disk_no, block_no ) != NULL ) {
+            continue; // somebody brought it in while the lock was dropped (b stays free)
+        }
+        b->disk_no = disk_no;
+        b->block_no = block_no;
+        b->sector_start = block_no * per_block;
+        b->n_sectors = bcache_block_sectors( dev, block_no, per_block );
+        b->valid = false;
+        b->busy = true;
+        b->refs = 0;
+        b->referenced = true;
+        b->readahead = true;
+        b->stream = s;
+        bcache_block** bucket = bcache_bucket( disk_no, block_no );
+        b->hash_next = *bucket;
+        *bucket = b;
+        bcache_ra_blocks++;
+
+        reqs[n] = new transfer_request( b->buf, b->sector_start, b->n_sectors, true );
+        reqs[n]->disk_no = disk_no;
+        reqs[n]->callback = &bcache_readahead_done;
+        reqs[n]->context = (void*)b;
+        n++;
+        block_no++;
+    }
+    bcache_lock.unlock();
+
+    if( n > 0 ) {
+        io_submit( reqs, n );
+    }
+}
+
+// Account for a read of blocks [first, last] and read ahead of it if it's part of a sequential stream.
+static void bcache_readahead( unsigned int disk_no, io_disk* dev, unsigned int per_block, uint64_t first, uint64_t last ) {
+    bcache_lock.lock();
+    bcache_stream* s = NULL;
+    bcache_stream* lru = &bcache_streams[0];
+    for( unsigned int i=0;i<BCACHE_RA_STREAMS;i++ ) {
+        bcache_stream* cur = &bcache_streams[i];
+        if( (cur->disk_no == disk_no) && ((first + 1) >= cur->next_block) && (first <= cur->ra_end) ) {
+            s = cur;
+            break;
+        }
+        if( cur->last_used < lru->last_used ) {
+            lru = cur;
+        }
+    }
+
+    if( s == NULL ) {
+        // somebody new (or somebody seeking); don't read ahead until it carries on from here
+        s = lru;
+        s->disk_no = disk_no;
+        s->window = 0;
+        s->ra_end = last + 1;
+    } else if( last < s->next_block ) {
+        // still inside the block we were on last time
+    } else if( (first == s->next_block) || ((first + 1) == s->next_block) ) {
+        s->window = ((s->window == 0) ? BCACHE_RA_MIN_WINDOW : (s->window * 2));
+        if( s->window > BCACHE_RA_MAX_WINDOW ) {
+            s->window = BCACHE_RA_MAX_WINDOW;
+        }
+    } else {
+        s->window /= 2; // skipped ahead into the window
+    }
+    if( last >= s->next_block ) {
+        s->next_block = last + 1;
+    }
+    if( s->ra_end < s->next_block ) {
+        s->ra_end = s->next_block;
+    }
+    s->last_used = ++bcache_stream_clock;
+
+    // top the window up once the reader has used half of it, so reads ahead go out in decent batches
+    uint64_t start = s->ra_end;
+    uint64_t end = s->next_block + s->window;
+    bool issue = (s->window > 0) && ((start - s->next_block) <= (s->window / 2)) && (end > start);
+    if( issue ) {
+        s->ra_end = end;
+    }
+    bcache_lock.unlock();
+
+    if( issue ) {
+        bcache_readahead_issue( disk_no, dev, per_block, s, start, end );
+    }
+}
+
+void bcache_set_readahead( bool enabled ) {
+    bcache_readahead_enabled = enabled;
+}
+
+bool bcache_get_readahead() {
+    return bcache_readahead_enabled;
+}
+
+bool bcache_read( unsigned int disk_no, void* out, uint64_t start_pos, uint64_t len ) {
+    io_disk* dev = io_get_disk( disk_no );
+    if( dev == NULL ) {
+        kprintf("bcache: attempted read from unknown disk %u\n", disk_no);
+        return false;
+    }
+    unsigned int per_block = bcache_sectors_per_block( dev );
+    if( per_block == 0 ) {
+        io_read_disk_uncached( disk_no, out, start_pos, len );
+        return true;
+    }
+    if( bcache_readahead_enabled && (len > 0) ) {
+        bcache_readahead( disk_no, dev, per_block, start_pos / BCACHE_BLOCK_SIZE, (start_pos + len - 1) / BCACHE_BLOCK_SIZE );
+    }
+
+    uint8_t* dst = (uint8_t*)out;
+    while( len > 0 ) {
+        uint64_t block_no = start_pos / BCACHE_BLOCK_SIZE;
+        unsigned int offset = start_pos % BCACHE_BLOCK_SIZE;
+        unsigned int n = BCACHE_BLOCK_SIZE - offset;
+        if( n > len ) {
+            n = len;
+        }
+
+        bcache_block* b = bcache_get( disk_no, block_no, block_no * per_block, bcache_block_sectors( dev, block_no, per_block ), true, false );
+        if( b == NULL ) {
+            kprintf("bcache: read of block %llu on disk %u failed\n", block_no, disk_no);
+            return false;
+        }
+        memcpy( (void*)dst, (void*)(((uint8_t*)b->buf->buffer_virt) + offset), n );
+        bcache_put( b, false );
+
+        dst += n;
+        start_pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool bcache_write( unsigned int disk_no, void* data, uint64_t start_pos, uint64_t len ) {
+    io_disk* dev = io_get_disk( disk_no );
+    if( dev == NULL ) {
+        kprintf("bcache: attempted write to unknown disk %u\n", disk_no);
+        return false;
+    }
+    unsigned int per_block = bcache_sectors_per_block( dev );
+    if( per_block == 0 ) {
+        io_write_disk_uncached( disk_no, data, start_pos, len );
+        return true;
+    }
+
+    uint8_t* src = (uint8_t*)data;
+    while( len > 0 ) {
+        uint64_t block_no = start_pos / BCACHE_BLOCK_SIZE;
+        unsigned int offset = start_pos % BCACHE_BLOCK_SIZE;
+        unsigned int n = BCACHE_BLOCK_SIZE - offset;
+        if( n > len ) {
+            n = len;
+        }
+        unsigned int n_sectors = bcache_block_sectors( dev, block_no, per_block );
+
+        // only blocks we don't overwrite completely have to be read in first
+        bool whole = (offset == 0) && (n >= (n_sectors * dev->get_sector_size()));
+        bcache_block* b = bcache_get( disk_no, block_no, block_no * per_block, n_sectors, !whole, true );
+        if( b == NULL ) {
+            kprintf("bcache: read of block %llu on disk %u (for a write) failed\n", block_no, disk_no);
+            return false;
+        }
+        memcpy( (void*)(((uint8_t*)b->buf->buffer_virt) + offset), (void*)src, n );
+        bcache_put( b, true );
+
+        src += n;
+        start_pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+void bcache_sync( unsigned int disk_no ) {
+    while( bcache_flush_batch( disk_no ) > 0 );
+
+    // anything the flusher (or an eviction) is still writing out
+    bcache_lock.lock();
+    while( true ) {
+        bool waiting = false;
+        for( unsigned int i=0;i<bcache_n_blocks;i++ ) {
+            bcache_block* b = bcache_blocks[i];
+            if( b->busy && (b->disk_no != 0) && ((disk_no == 0) || (b->disk_no == disk_no)) ) {
+                waiting = true;
+                break;
+            }
+        }
+        if( !waiting ) {
+            break;
+        }
+        bcache_io_waiters.wait( &bcache_lock );
+        bcache_lock.lock();
+    }
+    bcache_lock.unlock();
+}
+
+unsigned int bcache_shrink( unsigned int n_blocks ) {
+    unsigned int freed = 0;
+    while( freed < n_blocks ) {
+        bcache_block* victim = NULL;
+        bcache_lock.lock();
+        for( unsigned int i=0;i<bcache_n_blocks;i++ ) {
+            bcache_block* b = bcache_blocks[i];
+            if( (b->refs == 0) && !b->busy && !b->dirty ) {
+                if( b->disk_no != 0 ) {
+                    bcache_ra_evicted( b );
+                    bcache_unhash( b );
+                }
+                bcache_blocks[i] = bcache_blocks[--bcache_n_blocks];
+                if( bcache_clock_hand >= bcache_n_blocks ) {
+                    bcache_clock_hand = 0;
+                }
+                victim = b;
+                break;
+            }
+        }
+        bcache_lock.unlock();
+
+        if( victim == NULL ) {
+            break;
+        }
+        delete victim->buf;
+        delete victim;
+        freed++;
+    }
+    return freed;
+}
+
+void bcache_invalidate( unsigned int disk_no, uint64_t sector_start, uint64_t n_sectors ) {
+    uint64_t sector_end = sector_start + n_sectors;
+    bcache_lock.lock();
+    unsigned int i = 0;
+    while( i < bcache_n_blocks ) {
+        bcache_block* b = bcache_blocks[i];
+        if( (b->disk_no != disk_no) || (b->sector_start >= sector_end) || ((b->sector_start + b->n_sectors) <= sector_start) ) {
+            i++;
+            continue;
+        }
+        if( b->busy || (b->refs > 0) ) {
+            bcache_io_waiters.wait( &bcache_lock );
+            bcache_lock.lock();
+            i = 0; // (the list may have changed while we were asleep)
+            continue;
+        }
+        if( b->dirty ) {
+            b->busy = true;
+            bcache_set_dirty( b, false );
+            bcache_lock.unlock();
+            bool ok = bcache_block_io( b, false );
+            bcache_lock.lock();
+            b->busy = false;
+            if( ok ) {
+                bcache_writebacks++;
+            } else {
+                kprintf("bcache: write-back of block %llu on disk %u failed; dropping it anyway\n", b->block_no, disk_no);
+            }
+            bcache_lock.unlock();
+            bcache_io_waiters.wake_all();
+            bcache_lock.lock();
+            i = 0;
+            continue;
+        }
+        bcache_ra_evicted( b );
+        bcache_unhash( b );
+        b->valid = false;
+        i++;
+    }
+    bcache_lock.unlock();
+}
+
+void bcache_get_stats( bcache_stats* out ) {
+    bcache_lock.lock();
+    out->hits = bcache_hits;
+    out->misses = bcache_misses;
+    out->evictions = bcache_evictions;
+    out->writebacks = bcache_writebacks;
+    out->ra_blocks = bcache_ra_blocks;
+    out->ra_hits = bcache_ra_hits;
+    out->ra_wasted = bcache_ra_wasted;
+    out->n_blocks = bcache_n_blocks;
+    out->n_dirty = bcache_n_dirty;
+    bcache_lock.unlock();
+}
+
+void bcache_print_stats() {
+    bcache_stats st;
+    bcache_get_stats( &st );
+    uint64_t lookups = st.hits + st.misses;
+    kprintf("bcache: %u blocks (%u dirty), %llu hits / %llu misses (%u%% hit ratio), %llu evictions, %llu writebacks\n",
+        st.n_blocks, st.n_dirty, st.hits, st.misses, (unsigned int)((lookups > 0) ? ((st.hits * 100) / lookups) : 0),
+        st.evictions, st.writebacks);
+    kprintf("bcache: read-ahead %s: %llu blocks read ahead, %llu used, %llu evicted unused\n",
+        (bcache_readahead_enabled ? "on" : "off"), st.ra_blocks, st.ra_hits, st.ra_wasted);
+}
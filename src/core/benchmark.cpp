@@ -0,0 +1,455 @@
+// benchmark.cpp -- in-kernel microbenchmarks
+// These are run from the shell ("bench <name>"); timings are in TSC cycles, except for the disk
+// benchmarks, which report throughput against the system timer.
+
+#include "includes.h"
+#include "arch/x86/sys.h"
+#include "arch/x86/multitask.h"
+#include "core/benchmark.h"
+#include "core/syscall.h"
+#include "core/scheduler.h"
+#include "lib/sync.h"
+#include "lib/umutex.h"
+#include "core/message.h"
+#include "core/ipc.h"
+#include "core/vfs.h"
+#include "core/bcache.h"
+#include "device/pit.h"
+
+#define BENCH_SYSCALL_ITERATIONS    100000
+#define BENCH_SWITCH_ITERATIONS     10000
+#define BENCH_CREATE_ITERATIONS     100
+#define BENCH_LOCK_ITERATIONS       100000
+#define BENCH_HANDOFF_ITERATIONS    10000
+#define BENCH_CHANNEL_MESSAGES      20000
+#define BENCH_CHANNEL_MAX_RECEIVERS 16
+#define BENCH_IPC_ITERATIONS        10000
+#define BENCH_READAHEAD_FILE        "/bench64.bin"      // (on the FAT partition, which is mounted as /)
+#define BENCH_READAHEAD_SIZE        (64*1024*1024)
+
+// Null system call round trip.
+// Kernel processes can only make real calls through int $0x5C, since SYSEXIT always returns to ring 3.
+// For SYSENTER, the entry MSR is pointed at a stub that does the same segment setup as __sysenter_entry
+// and jumps back: that plus the dispatch-only figure is the SYSENTER path, less the SYSEXIT.
+static void bench_syscall() {
+    uint64_t start = rdtsc();
+    for(unsigned int i=0;i<BENCH_SYSCALL_ITERATIONS;i++) {
+        syscall( SYSCALL_NULL, 0,0,0,0,0 );
+    }
+    uint64_t int_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for(unsigned int i=0;i<BENCH_SYSCALL_ITERATIONS;i++) {
+        syscall_dispatch( SYSCALL_NULL, 0,0,0,0,0 );
+    }
+    uint64_t dispatch_cycles = rdtsc() - start;
+
+    uint64_t sysenter_cycles = 0;
+    if( sysenter_available ) {
+        // (with interrupts off, nothing else can make a SYSENTER call while it's pointed at the stub)
+        interrupt_status_t int_stat = disable_interrupts();
+        write_msr( MSR_IA32_SYSENTER_EIP, (uint32_t)&__sysenter_bench_entry );
+        start = rdtsc();
+        for(unsigned int i=0;i<BENCH_SYSCALL_ITERATIONS;i++) {
+            asm volatile("mov %%esp, %%ecx\n\t"
+                         "mov $1f, %%edx\n\t"
+                         "sysenter\n\t"
+                         "1:\n\t"
+                         : : : "eax", "ecx", "edx", "memory");
+        }
+        sysenter_cycles = rdtsc() - start;
+        write_msr( MSR_IA32_SYSENTER_EIP, (uint32_t)&__sysenter_entry );
+        restore_interrupts(int_stat);
+    }
+
+    kprintf("bench: syscall: %u iterations\n", BENCH_SYSCALL_ITERATIONS);
+    kprintf("bench: syscall: int $0x5C: %llu cycles/call\n", int_cycles / BENCH_SYSCALL_ITERATIONS);
+    kprintf("bench: syscall: table dispatch only: %llu cycles/call\n", dispatch_cycles / BENCH_SYSCALL_ITERATIONS);
+    if( sysenter_available ) {
+        kprintf("bench: syscall: SYSENTER entry, without SYSEXIT: %llu cycles/call (+ dispatch)\n", sysenter_cycles / BENCH_SYSCALL_ITERATIONS);
+    } else {
+        kprintf("bench: syscall: SYSENTER not supported\n");
+    }
+}
+
+static volatile bool bench_switch_done = false;
+
+static void bench_switch_partner() {
+    while( !bench_switch_done ) {
+        process_switch_immediate();
+    }
+}
+
+// Context switch cost: yield back and forth with a partner process at the same priority.
+// Every iteration is two switches.
+static void bench_switch() {
+    bench_switch_done = false;
+    process* partner = new process( (size_t)&bench_switch_partner, false, process_current->priority, "bench_switch_partner", NULL, 0 );
+    spawn_process( partner );
+    process_switch_immediate(); // let the partner get going
+
+    uint64_t start = rdtsc();
+    for(unsigned int i=0;i<BENCH_SWITCH_ITERATIONS;i++) {
+        process_switch_immediate();
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    bench_switch_done = true;
+    partner->wait();
+    delete partner;
+
+    kprintf("bench: switch: %u iterations\n", BENCH_SWITCH_ITERATIONS);
+    kprintf("bench: switch: %llu cycles/switch\n", cycles / (BENCH_SWITCH_ITERATIONS*2));
+}
+
+static void bench_create_entry() {}
+
+// Thread / process creation: construct and destroy without ever running them.
+static void bench_create() {
+    uint64_t start = rdtsc();
+    for(unsigned int i=0;i<BENCH_CREATE_ITERATIONS;i++) {
+        process* t = kthread_create( (size_t)&bench_create_entry, 0, "bench_kthread" );
+        delete t;
+    }
+    uint64_t kthread_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for(unsigned int i=0;i<BENCH_CREATE_ITERATIONS;i++) {
+        process* p = new process( (size_t)&bench_create_entry, false, 0, "bench_process", NULL, 0 );
+        delete p;
+    }
+    uint64_t process_cycles = rdtsc() - start;
+
+    kprintf("bench: create: %u iterations\n", BENCH_CREATE_ITERATIONS);
+    kprintf("bench: create: kthread: %llu cycles\n", kthread_cycles / BENCH_CREATE_ITERATIONS);
+    kprintf("bench: create: process: %llu cycles\n", process_cycles / BENCH_CREATE_ITERATIONS);
+}
+
+static umutex            bench_handoff_lock;
+static ucondvar          bench_handoff_cond;
+static volatile uint32_t bench_handoff_turn = 0;
+static semaphore         bench_handoff_ping(0, 1);
+static semaphore         bench_handoff_pong(0, 1);
+
+static void bench_futex_partner() {
+    for(unsigned int i=0;i<BENCH_HANDOFF_ITERATIONS;i++) {
+        bench_handoff_lock.lock();
+        while( bench_handoff_turn != 1 ) {
+            bench_handoff_cond.wait( &bench_handoff_lock );
+        }
+        bench_handoff_turn = 0;
+        bench_handoff_cond.broadcast();
+        bench_handoff_lock.unlock();
+    }
+}
+
+static void bench_semaphore_partner() {
+    for(unsigned int i=0;i<BENCH_HANDOFF_ITERATIONS;i++) {
+        bench_handoff_ping.acquire(1);
+        bench_handoff_pong.release(1);
+    }
+}
+
+// umutex (futex) vs. kernel semaphore.
+// Uncontended: a lock / unlock pair. A user process would also pay for a system call on each
+// semaphore operation, which the umutex never makes; the syscall figure is printed for comparison.
+// Handoff: two processes take turns, so every iteration sleeps and wakes on both sides.
+static void bench_futex() {
+    umutex m;
+    uint64_t start = rdtsc();
+    for(unsigned int i=0;i<BENCH_LOCK_ITERATIONS;i++) {
+        m.lock();
+        m.unlock();
+    }
+    uint64_t umutex_cycles = rdtsc() - start;
+
+    semaphore sema(1, 1);
+    start = rdtsc();
+    for(unsigned int i=0;i<BENCH_LOCK_ITERATIONS;i++) {
+        sema.acquire(1);
+        sema.release(1);
+    }
+    uint64_t sema_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for(unsigned int i=0;i<BENCH_LOCK_ITERATIONS;i++) {
+        syscall( SYSCALL_NULL, 0,0,0,0,0 );
+    }
+    uint64_t syscall_cycles = rdtsc() - start;
+
+    bench_handoff_turn = 0;
+    process* partner = new process( (size_t)&bench_futex_partner, false, process_current->priority, "bench_futex_partner", NULL, 0 );
+    spawn_process( partner );
+    start = rdtsc();
+    for(unsigned int i=0;i<BENCH_HANDOFF_ITERATIONS;i++) {
+        bench_handoff_lock.lock();
+        bench_handoff_turn = 1;
+        bench_handoff_cond.broadcast();
+        while( bench_handoff_turn != 0 ) {
+            bench_handoff_cond.wait( &bench_handoff_lock );
+        }
+        bench_handoff_lock.unlock();
+    }
+    uint64_t futex_handoff_cycles = rdtsc() - start;
+    partner->wait();
+    delete partner;
+
+    partner = new process( (size_t)&bench_semaphore_partner, false, process_current->priority, "bench_sema_partner", NULL, 0 );
+    spawn_process( partner );
+    start = rdtsc();
+    for(unsigned int i=0;i<BENCH_HANDOFF_ITERATIONS;i++) {
+        bench_handoff_ping.release(1);
+        bench_handoff_pong.acquire(1);
+    }
+    uint64_t sema_handoff_cycles = rdtsc() - start;
+    partner->wait();
+    delete partner;
+
+    kprintf("bench: futex: %u uncontended iterations, %u handoffs\n", BENCH_LOCK_ITERATIONS, BENCH_HANDOFF_ITERATIONS);
+    kprintf("bench: futex: uncontended umutex: %llu cycles/lock+unlock\n", umutex_cycles / BENCH_LOCK_ITERATIONS);
+    kprintf("bench: futex: uncontended semaphore: %llu cycles/acquire+release (+2 syscalls from user mode, %llu cycles each)\n",
+        sema_cycles / BENCH_LOCK_ITERATIONS, syscall_cycles / BENCH_LOCK_ITERATIONS);
+    kprintf("bench: futex: umutex + ucondvar handoff: %llu cycles/round trip\n", futex_handoff_cycles / BENCH_HANDOFF_ITERATIONS);
+    kprintf("bench: futex: semaphore handoff: %llu cycles/round trip\n", sema_handoff_cycles / BENCH_HANDOFF_ITERATIONS);
+}
+
+static channel_handle    bench_channel_handle = CHANNEL_INVALID_HANDLE;
+static volatile uint32_t bench_channel_ready = 0;
+static volatile uint32_t bench_channel_finished = 0;
+
+static void bench_channel_receiver() {
+    channel_receiver ch = listen_to_channel( bench_channel_handle );
+    __sync_fetch_and_add( &bench_channel_ready, 1 );
+
+    unsigned int received = 0;
+    while( received < BENCH_CHANNEL_MESSAGES ) {
+        ch.wait();
+        while( ch.queue.count() > 0 ) {
+            delete ch.queue.remove(0);
+            received++;
+        }
+    }
+    __sync_fetch_and_add( &bench_channel_finished, 1 );
+}
+
+// Channel broadcast throughput with 1, 4 and 16 receivers (each a process draining its own cursor).
+// The channel uses back-pressure, so the sender can't get more than a ring ahead of the slowest receiver.
+static void bench_channel() {
+    if( bench_channel_handle == CHANNEL_INVALID_HANDLE ) {
+        bench_channel_handle = register_channel( const_cast<char*>("bench_channel"), channel_overflow::block );
+    }
+
+    unsigned int counts[] = { 1, 4, BENCH_CHANNEL_MAX_RECEIVERS };
+    for(unsigned int c=0;c<(sizeof(counts)/sizeof(unsigned int));c++) {
+        unsigned int n = counts[c];
+        process* receivers[BENCH_CHANNEL_MAX_RECEIVERS];
+        bench_channel_ready = 0;
+        bench_channel_finished = 0;
+        for(unsigned int i=0;i<n;i++) {
+            receivers[i] = new process( (size_t)&bench_channel_receiver, false, process_current->priority, "bench_channel_receiver", NULL, 0 );
+            spawn_process( receivers[i] );
+        }
+        while( bench_channel_ready < n ) {
+            process_switch_immediate();
+        }
+
+        unsigned long long int start_ms = get_sys_time_counter();
+        uint64_t start = rdtsc();
+        for(unsigned int i=0;i<BENCH_CHANNEL_MESSAGES;i++) {
+            message m( (void*)i, 0 );
+            send_to_channel( bench_channel_handle, m );
+        }
+        while( bench_channel_finished < n ) {
+            process_switch_immediate();
+        }
+        uint64_t cycles = rdtsc() - start;
+        unsigned long long int elapsed_ms = get_sys_time_counter() - start_ms;
+
+        for(unsigned int i=0;i<n;i++) {
+            receivers[i]->wait();
+            delete receivers[i];
+        }
+
+        uint64_t delivered = (uint64_t)BENCH_CHANNEL_MESSAGES * n;
+        kprintf("bench: channel: %u receivers: %llu cycles/message sent, %llu cycles/message delivered",
+            n, cycles / BENCH_CHANNEL_MESSAGES, cycles / delivered);
+        if( elapsed_ms > 0 ) {
+            kprintf(", %llu messages/sec sent", ((uint64_t)BENCH_CHANNEL_MESSAGES * 1000) / elapsed_ms);
+        }
+        kprintf("\n");
+    }
+}
+
+static ipc_endpoint*     bench_ipc_endpoint = NULL;
+static channel_handle    bench_request_channel = CHANNEL_INVALID_HANDLE;
+static channel_handle    bench_reply_channel = CHANNEL_INVALID_HANDLE;
+static volatile bool     bench_ipc_ready = false;
+
+static void bench_ipc_server() {
+    ipc_msg msg;
+    ipc_msg reply;
+    ipc_caller* caller = ipc_receive( bench_ipc_endpoint, &msg );
+    for(unsigned int i=1;i<BENCH_IPC_ITERATIONS;i++) {
+        reply.tag = msg.tag + 1;
+        caller = ipc_reply_wait( bench_ipc_endpoint, caller, &reply, &msg );
+    }
+    reply.tag = msg.tag + 1;
+    ipc_reply( caller, &reply );
+}
+
+static void bench_channel_server() {
+    channel_receiver requests = listen_to_channel( bench_request_channel );
+    bench_ipc_ready = true;
+    for(unsigned int i=0;i<BENCH_IPC_ITERATIONS;i++) {
+        requests.wait();
+        message* req = requests.queue.remove(0);
+        message m( (void*)((uint32_t)req->data + 1), 0 );
+        delete req;
+        send_to_channel( bench_reply_channel, m );
+    }
+}
+
+// Request / response round trip: ipc_call() to a server blocked in ipc_reply_wait(),
+// vs. a request channel and a reply channel with a server process draining the first into the second.
+static void bench_ipc() {
+    if( bench_ipc_endpoint == NULL ) {
+        bench_ipc_endpoint = ipc_endpoint_create();
+        bench_request_channel = register_channel( const_cast<char*>("bench_request") );
+        bench_reply_channel = register_channel( const_cast<char*>("bench_reply") );
+    }
+
+    process* server = new process( (size_t)&bench_ipc_server, false, process_current->priority, "bench_ipc_server", NULL, 0 );
+    spawn_process( server );
+    process_switch_immediate(); // let the server start waiting
+
+    ipc_msg msg;
+    ipc_msg reply;
+    uint64_t start = rdtsc();
+    for(unsigned int i=0;i<BENCH_IPC_ITERATIONS;i++) {
+        msg.tag = i;
+        ipc_call( bench_ipc_endpoint, &msg, &reply );
+    }
+    uint64_t ipc_cycles = rdtsc() - start;
+    server->wait();
+    delete server;
+
+    bench_ipc_ready = false;
+    channel_receiver replies = listen_to_channel( bench_reply_channel );
+    server = new process( (size_t)&bench_channel_server, false, process_current->priority, "bench_channel_server", NULL, 0 );
+    spawn_process( server );
+    while( !bench_ipc_ready ) {
+        process_switch_immediate();
+    }
+
+    start = rdtsc();
+    for(unsigned int i=0;i<BENCH_IPC_ITERATIONS;i++) {
+        message m( (void*)i, 0 );
+        send_to_channel( bench_request_channel, m );
+        replies.wait();
+        delete replies.queue.remove(0);
+    }
+    uint64_t channel_cycles = rdtsc() - start;
+    server->wait();
+    delete server;
+
+    kprintf("bench: ipc: %u round trips (%llu of %llu calls found the server waiting)\n",
+        BENCH_IPC_ITERATIONS, bench_ipc_endpoint->direct, bench_ipc_endpoint->calls);
+    kprintf("bench: ipc: ipc_call: %llu cycles/round trip\n", ipc_cycles / BENCH_IPC_ITERATIONS);
+    kprintf("bench: ipc: channel request + reply: %llu cycles/round trip\n", channel_cycles / BENCH_IPC_ITERATIONS);
+}
+
+// Sequential read of a 64 MiB file from a cold cache, with and without read-ahead.
+// The file is created (and written out) first if it isn't there yet.
+static void bench_readahead() {
+    unsigned char* path = (unsigned char*)const_cast<char*>(BENCH_READAHEAD_FILE);
+    vfs_node* node = NULL;
+    vfs::vfs_status stat = vfs::get_file_info( path, &node );
+    if( (stat != vfs::vfs_status::ok) || (node == NULL) || (node->type != vfs_node_types::file) ) {
+        kprintf("bench: readahead: creating %s (%u MiB)\n", BENCH_READAHEAD_FILE, BENCH_READAHEAD_SIZE / (1024*1024));
+        uint32_t* data = (uint32_t*)kmalloc( BENCH_READAHEAD_SIZE );
+        if( data == NULL ) {
+            kprintf("bench: readahead: out of memory\n");
+            return;
+        }
+        for(unsigned int i=0;i<(BENCH_READAHEAD_SIZE/4);i++) {
+            data[i] = i;
+        }
+        stat = vfs::write_file( path, (void*)data, BENCH_READAHEAD_SIZE );
+        kfree( (void*)data );
+        if( stat != vfs::vfs_status::ok ) {
+            kprintf("bench: readahead: could not create %s: %s\n", BENCH_READAHEAD_FILE, vfs::status_description(stat));
+            return;
+        }
+        bcache_sync();
+        stat = vfs::get_file_info( path, &node );
+        if( stat != vfs::vfs_status::ok ) {
+            kprintf("bench: readahead: could not find %s: %s\n", BENCH_READAHEAD_FILE, vfs::status_description(stat));
+            return;
+        }
+    }
+
+    uint64_t size = ((vfs_file*)node)->size;
+    void* buf = kmalloc( size );
+    if( buf == NULL ) {
+        kprintf("bench: readahead: out of memory\n");
+        return;
+    }
+
+    bool was_enabled = bcache_get_readahead();
+    for(unsigned int pass=0;pass<2;pass++) {
+        bool enabled = (pass == 1);
+        bcache_sync();
+        bcache_shrink( BCACHE_MAX_BLOCKS ); // (start cold)
+        bcache_set_readahead( enabled );
+
+        bcache_stats before;
+        bcache_get_stats( &before );
+        unsigned long long int start = get_sys_time_counter();
+        stat = vfs::read_file( path, buf );
+        unsigned long long int ms = get_sys_time_counter() - start;
+        bcache_stats after;
+        bcache_get_stats( &after );
+
+        if( stat != vfs::vfs_status::ok ) {
+            kprintf("bench: readahead: read failed: %s\n", vfs::status_description(stat));
+            break;
+        }
+        if( ms == 0 ) {
+            ms = 1;
+        }
+        uint64_t kib_per_s = ((size / 1024) * 1000) / ms;
+        kprintf("bench: readahead: %s: %llu KiB in %llu ms, %llu.%02llu MiB/s (%llu blocks read ahead)\n",
+            (enabled ? "on" : "off"), size / 1024, ms, kib_per_s / 1024, ((kib_per_s % 1024) * 100) / 1024,
+            after.ra_blocks - before.ra_blocks);
+    }
+    bcache_set_readahead( was_enabled );
+    kfree( buf );
+}
+
+static benchmark benchmarks[] = {
+    { "syscall", &bench_syscall, "null system call round trip" },
+    { "switch",  &bench_switch,  "yield ping-pong between two processes" },
+    { "create",  &bench_create,  "kernel thread vs. process creation" },
+    { "futex",   &bench_futex,   "umutex / ucondvar vs. kernel semaphore" },
+    { "channel", &bench_channel, "channel broadcast throughput at 1, 4 and 16 receivers" },
+    { "ipc",     &bench_ipc,     "ipc_call round trip vs. channel request / reply" },
+    { "readahead", &bench_readahead, "64 MiB sequential file read with and without read-ahead" },
+};
+
+#define N_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmark))
+
+void list_benchmarks() {
+    for(unsigned int i=0;i<N_BENCHMARKS;i++) {
+        kprintf("%s - %s\n", benchmarks[i].name, benchmarks[i].description);
+    }
+}
+
+bool run_benchmark( char* name ) {
+    for(unsigned int i=0;i<N_BENCHMARKS;i++) {
+        if( strcmp( name, const_cast<char*>(benchmarks[i].name) ) ) {
+            benchmarks[i].func();
+            return true;
+        }
+    }
+    return false;
+}
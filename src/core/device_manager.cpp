@@ -12,6 +12,7 @@ namespace device_manager {
 
 	uint64_t global_ids = 1;
 	device_node root;
+	rwlock tree_lock;
 
 	device_tree_node::device_tree_node() {
 		this->global_id = global_ids++;
@@ -25,6 +26,13 @@ namespace device_manager {
 		root.type = dev_type::computer;
 	}
 
+	void add_child( device_node* parent, device_node* child ) {
+		tree_lock.write_lock();
+		child->child_id = parent->children.count();
+		parent->children.add_end( child );
+		tree_lock.write_unlock();
+	}
+
 }
 
 
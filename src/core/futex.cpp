@@ -0,0 +1,143 @@
+// futex.cpp -- wait on / wake processes sleeping on a memory word
+// This is the kernel half of user-space locks (see lib/umutex.h): uncontended lock and unlock are
+// just atomic operations on a word in user memory, and only a process that has to wait comes in here.
+// The value check in futex_wait() happens under the bucket lock, so a futex_wake() that follows
+// a change to the word can never slip in between the check and the sleep.
+
+#include "includes.h"
+#include "core/futex.h"
+#include "core/syscall.h"
+#include "core/scheduler.h"
+
+static futex_bucket futex_buckets[FUTEX_HASH_BUCKETS];
+
+// Find the physical address behind addr in the current address space.
+static bool futex_get_key( volatile uint32_t* addr, futex_key* key ) {
+    virt_addr_t vaddr = (virt_addr_t)addr;
+    if( (vaddr & 3) != 0 ) {
+        return false;
+    }
+
+    uint32_t pte;
+    if( vaddr >= PAGING_KERNEL_BASE_ADDR ) {
+        if( process_current->regs.kernel_stack != 0 ) {
+            return false; // user processes only get to wait on their own memory
+        }
+        pte = paging_get_pte( vaddr );
+    } else {
+        if( process_current->address_space.page_directory == NULL ) {
+            return false;
+        }
+        pte = process_current->address_space.get( vaddr );
+    }
+    if( (pte == 0xFFFFFFFF) || ((pte & 1) == 0) ) {
+        return false;
+    }
+
+    *key = (pte & 0xFFFFF000) | (vaddr & 0xFFF);
+    return true;
+}
+
+static futex_bucket* futex_hash( futex_key key ) {
+    // the low two bits are always 0, and waiters on one page mostly differ in the next few
+    uint32_t h = (key >> 2) ^ (key >> 12);
+    h ^= (h >> 16);
+    return &futex_buckets[ h % FUTEX_HASH_BUCKETS ];
+}
+
+static void futex_unqueue( futex_bucket* bucket, futex_waiter* waiter ) {
+    futex_waiter* prev = NULL;
+    for( futex_waiter* cur = bucket->head; cur != NULL; cur = cur->next ) {
+        if( cur == waiter ) {
+            if( prev == NULL ) {
+                bucket->head = cur->next;
+            } else {
+                prev->next = cur->next;
+            }
+            break;
+        }
+        prev = cur;
+    }
+    waiter->next = NULL;
+    waiter->queued = false;
+}
+
+uint32_t futex_wait( volatile uint32_t* addr, uint32_t expected, unsigned int timeout_ms ) {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return SYSCALL_ERR_WOULD_BLOCK;
+    }
+
+    futex_key key;
+    if( !futex_get_key( addr, &key ) ) {
+        return SYSCALL_ERR_FAULT;
+    }
+    futex_bucket* bucket = futex_hash( key );
+
+    bucket->lock.lock();
+    if( *addr != expected ) {
+        bucket->lock.unlock();
+        return SYSCALL_ERR_WOULD_BLOCK;
+    }
+
+    futex_waiter* waiter = &process_current->futex_entry;
+    waiter->key = key;
+    waiter->proc = process_current;
+    waiter->queued = true;
+    waiter->next = NULL;
+    // FIFO, so futex_wake() hands out wakeups in the order processes started waiting
+    futex_waiter** tail = &bucket->head;
+    while( *tail != NULL ) {
+        tail = &(*tail)->next;
+    }
+    *tail = waiter;
+
+    process_current->state = process_state::waiting;
+    if( timeout_ms > 0 ) {
+        process_set_timeout( process_current, get_sys_time_counter() + timeout_ms );
+    }
+    bucket->lock.unlock();
+
+    process_switch_immediate();
+
+    if( timeout_ms > 0 ) {
+        process_clear_timeout( process_current );
+    }
+    process_current->state = process_state::runnable;
+
+    bucket->lock.lock();
+    bool woken = !waiter->queued;
+    if( !woken ) {
+        futex_unqueue( bucket, waiter );
+    }
+    bucket->lock.unlock();
+
+    if( !woken && (timeout_ms > 0) ) {
+        return SYSCALL_ERR_TIMED_OUT;
+    }
+    return 0; // (callers recheck their condition anyways, so anything else counts as a spurious wakeup)
+}
+
+uint32_t futex_wake( volatile uint32_t* addr, uint32_t n ) {
+    futex_key key;
+    if( !futex_get_key( addr, &key ) ) {
+        return SYSCALL_ERR_FAULT;
+    }
+    futex_bucket* bucket = futex_hash( key );
+
+    uint32_t woken = 0;
+    bucket->lock.lock();
+    futex_waiter* cur = bucket->head;
+    while( (cur != NULL) && (woken < n) ) {
+        futex_waiter* next = cur->next;
+        if( cur->key == key ) {
+            process* proc = cur->proc;
+            futex_unqueue( bucket, cur );
+            process_wake( proc );
+            woken++;
+        }
+        cur = next;
+    }
+    bucket->lock.unlock();
+
+    return woken;
+}
@@ -7,63 +7,227 @@
 #include "core/scheduler.h"
 #include "core/message.h"
 #include "lib/refcount.h"
+#include "core/bcache.h"
+#include "core/iosched.h"
+#include "device/pit.h"
 
 vector<io_disk*> io_disks;
 vector<io_partition*> io_partitions;
 static uint64_t __io_current_id = 0;
 
-transfer_request::transfer_request( transfer_buffer& buf, uint64_t secst, size_t nsec, bool rd ) : buffer(buf) {
+// free buffers, by number of pages (index 0 is unused)
+static spinlock io_buffer_pool_lock;
+static transfer_buffer* io_buffer_pool[IO_BUFFER_POOL_MAX_PAGES+1][IO_BUFFER_POOL_DEPTH];
+static unsigned int io_buffer_pool_count[IO_BUFFER_POOL_MAX_PAGES+1];
+
+transfer_request::transfer_request( transfer_buffer *buf, uint64_t secst, size_t nsec, bool rd ) : buffer(buf), sg( (buf != NULL) ? &buf->sg : NULL ) {
 	this->id = __io_current_id++;
 	this->sector_start = secst;
 	this->n_sectors = nsec;
 	this->read = rd;
 	this->requesting_process = process_current;
-	this->ch = new channel_receiver( listen_to_channel("transfer_complete") );
 };
 
-transfer_request::transfer_request( transfer_buffer *buf, uint64_t secst, size_t nsec, bool rd ) : buffer(*buf) {
+transfer_request::transfer_request( io_sg_list *list, uint64_t secst, size_t nsec, bool rd ) : buffer(NULL), sg(list) {
 	this->id = __io_current_id++;
 	this->sector_start = secst;
 	this->n_sectors = nsec;
 	this->read = rd;
 	this->requesting_process = process_current;
-	this->ch = new channel_receiver( listen_to_channel("transfer_complete") );
 };
 
-transfer_request::transfer_request( transfer_request& cpy ) : buffer(cpy.buffer) {
+transfer_request::transfer_request( transfer_request& cpy ) : buffer(cpy.buffer), sg(cpy.sg) {
 	this->id = cpy.id;
 	this->sector_start = cpy.sector_start;
 	this->n_sectors = cpy.n_sectors;
 	this->read = cpy.read;
 	this->requesting_process = cpy.requesting_process;
-	this->ch = cpy.ch;
+	this->disk_no = cpy.disk_no;
+	this->origin = ((cpy.origin != NULL) ? cpy.origin : &cpy);
 };
 
+void transfer_request::complete( bool status ) {
+    transfer_request* req = ((this->origin != NULL) ? this->origin : this);
+    this->status = status;
+    req->status = status;
+    if( req->merged != NULL ) {
+        io_sched_split( req, status ); // (a transfer the scheduler put together; req goes away here)
+        return;
+    }
+    io_sched_completed( req );
+
+    // whoever is waiting on done may free req as soon as it's signalled, so look at these first
+    // (if they're set, the submitter has to leave req alone until it comes back through them)
+    io_callback cb = req->callback;
+    void* context = req->context;
+    io_completion_queue* cq = req->cq;
+    req->done.complete();
+    if( cb != NULL ) {
+        cb( req, context );
+    } else if( cq != NULL ) {
+        cq->push( req );
+    }
+}
+
 void transfer_request::wait() {
-    //kprintf("transfer_request::wait - waiting for message (id=%llu)\n", this->id);
-    while(true) {
-        this->ch->wait();
-        unique_ptr<message> msg = this->ch->queue.remove(0);
-        transfer_request* req = (transfer_request*)msg->data;
-        if(req != NULL) {
-            //kprintf("transfer_request::wait - received valid message (id=%llu)\n", req->id);
-            if(req->id == this->id) {
-                return;
-            } else {
-                //kprintf("transfer_request::wait - ids did not match\n");
-            }
+    transfer_request* req = ((this->origin != NULL) ? this->origin : this);
+    req->done.wait();
+}
+
+bool transfer_request::wait_timeout( unsigned int timeout_ms ) {
+    transfer_request* req = ((this->origin != NULL) ? this->origin : this);
+    return req->done.wait_timeout( timeout_ms );
+}
+
+void io_completion_queue::push( transfer_request* req ) {
+    this->lock.lock();
+    req->next_done = NULL;
+    if( this->tail == NULL ) {
+        this->head = req;
+    } else {
+        this->tail->next_done = req;
+    }
+    this->tail = req;
+    this->count++;
+    this->lock.unlock();
+    this->waiters.wake_one();
+}
+
+// lock must be held.
+static transfer_request* io_cq_pop( io_completion_queue* cq ) {
+    transfer_request* req = cq->head;
+    if( req != NULL ) {
+        cq->head = req->next_done;
+        if( cq->head == NULL ) {
+            cq->tail = NULL;
+        }
+        req->next_done = NULL;
+        cq->count--;
+    }
+    return req;
+}
+
+transfer_request* io_completion_queue::poll() {
+    this->lock.lock();
+    transfer_request* req = io_cq_pop( this );
+    this->lock.unlock();
+    return req;
+}
+
+transfer_request* io_completion_queue::wait( unsigned int timeout_ms ) {
+    unsigned long long int deadline = get_sys_time_counter() + timeout_ms;
+    this->lock.lock();
+    while( this->head == NULL ) {
+        if( timeout_ms == 0 ) {
+            this->waiters.wait( &this->lock );
         } else {
-            //kprintf("transfer_request::wait - received invalid message\n");
+            unsigned long long int now = get_sys_time_counter();
+            if( (now >= deadline) || !this->waiters.wait_timeout( deadline - now, &this->lock ) ) {
+                this->lock.lock();
+                break;
+            }
         }
+        this->lock.lock();
     }
+    transfer_request* req = io_cq_pop( this );
+    this->lock.unlock();
+    return req;
+}
+
+static unsigned int io_buffer_pages( size_t n_bytes ) {
+    unsigned int n = (n_bytes + 0xFFF) / 0x1000;
+    return ((n == 0) ? 1 : n);
+}
+
+transfer_buffer* io_buffer_get( size_t n_bytes ) {
+    unsigned int n_pages = io_buffer_pages( n_bytes );
+    transfer_buffer* buf = NULL;
+    if( n_pages <= IO_BUFFER_POOL_MAX_PAGES ) {
+        io_buffer_pool_lock.lock();
+        if( io_buffer_pool_count[n_pages] > 0 ) {
+            buf = io_buffer_pool[n_pages][--io_buffer_pool_count[n_pages]];
+        }
+        io_buffer_pool_lock.unlock();
+    }
+    if( buf == NULL ) {
+        return new transfer_buffer( n_bytes );
+    }
+    buf->size = n_bytes;
+    return buf;
+}
+
+void io_buffer_put( transfer_buffer* buf ) {
+    if( buf == NULL ) {
+        return;
+    }
+    if( buf->n_frames <= IO_BUFFER_POOL_MAX_PAGES ) {
+        io_buffer_pool_lock.lock();
+        if( io_buffer_pool_count[buf->n_frames] < IO_BUFFER_POOL_DEPTH ) {
+            io_buffer_pool[buf->n_frames][io_buffer_pool_count[buf->n_frames]++] = buf;
+            buf = NULL;
+        }
+        io_buffer_pool_lock.unlock();
+    }
+    if( buf != NULL ) {
+        delete buf;
+    }
+}
+
+transfer_request* io_request_alloc( unsigned int disk_no, uint64_t sector_start, size_t n_sectors, bool read ) {
+    io_disk *device = io_get_disk( disk_no );
+    if( device == NULL ) {
+        return NULL;
+    }
+    transfer_buffer* buf = io_buffer_get( n_sectors * device->get_sector_size() );
+    transfer_request* req = new transfer_request( buf, sector_start, n_sectors, read );
+    req->disk_no = disk_no;
+    return req;
+}
+
+void io_request_free( transfer_request* req ) {
+    io_buffer_put( req->buffer );
+    delete req;
+}
+
+// Everything is handed to the drivers before anybody waits, so a device gets the whole batch
+// to work through back to back.
+unsigned int io_submit( transfer_request** reqs, unsigned int n ) {
+    unsigned int sent = 0;
+    for(unsigned int i=0;i<n;i++) {
+        io_disk *device = io_get_disk( reqs[i]->disk_no );
+        if( device == NULL ) {
+            kprintf("io: attempted transfer with unknown disk %u\n", reqs[i]->disk_no);
+            reqs[i]->complete( false );
+            continue;
+        }
+        device->send_request( reqs[i] );
+        sent++;
+    }
+    return sent;
+}
+
+bool io_wait_all( transfer_request** reqs, unsigned int n ) {
+    bool ok = true;
+    for(unsigned int i=0;i<n;i++) {
+        reqs[i]->wait();
+        ok = ok && reqs[i]->status;
+    }
+    return ok;
 }
 
 void io_initialize() {
-    register_channel( "transfer_complete" );
+    // a few single-sector buffers to start with, so early reads don't have to allocate
+    for(unsigned int i=0;i<IO_BUFFER_POOL_DEPTH;i++) {
+        io_buffer_put( new transfer_buffer( 0x1000 ) );
+    }
+    bcache_initialize();
 }
 
 void io_register_disk( io_disk *dev ) {
     dev->device_id = (io_disks.count()+1);
+    if( dev->scheduler == NULL ) {
+        dev->scheduler = io_sched_create( IOSCHED_DEFAULT );
+    }
     io_disks.add_end( dev );
 }
 
@@ -131,99 +295,230 @@ unsigned int io_part_ids_to_global( unsigned int device, unsigned int id ) {
     return part->global_id;
 }
 
-transfer_buffer::transfer_buffer( unsigned int n_bytes ) {
+io_sg_list::io_sg_list( unsigned int capacity ) {
+    this->capacity = ((capacity == 0) ? 1 : capacity);
+    this->segments = (io_sg_segment*)kmalloc( sizeof(io_sg_segment) * this->capacity );
+}
+
+io_sg_list::~io_sg_list() {
+    kfree( (void*)this->segments );
+}
+
+void io_sg_list::add( phys_addr_t phys, void* virt, size_t len ) {
+    if( len == 0 ) {
+        return;
+    }
+    this->size += len;
+    if( this->n_segments > 0 ) {
+        io_sg_segment* last = &this->segments[this->n_segments-1];
+        if( ((last->phys + last->len) == phys) && ((((uint8_t*)last->virt) + last->len) == (uint8_t*)virt) ) {
+            last->len += len;
+            return;
+        }
+    }
+    if( this->n_segments == this->capacity ) {
+        io_sg_segment* grown = (io_sg_segment*)kmalloc( sizeof(io_sg_segment) * this->capacity * 2 );
+        memcpy( (void*)grown, (void*)this->segments, sizeof(io_sg_segment) * this->n_segments );
+        kfree( (void*)this->segments );
+        this->segments = grown;
+        this->capacity *= 2;
+    }
+    io_sg_segment* seg = &this->segments[this->n_segments++];
+    seg->phys = phys;
+    seg->virt = virt;
+    seg->len = len;
+}
+
+bool io_sg_list::add_virt( void* virt, size_t len ) {
+    size_t addr = (size_t)virt;
+    while( len > 0 ) {
+        size_t n = 0x1000 - (addr & 0xFFF);
+        if( n > len ) {
+            n = len;
+        }
+        uint32_t pte = paging_get_pte( addr );
+        if( (pte & 1) == 0 ) {
+            return false;
+        }
+        this->add( (pte & 0xFFFFF000) | (addr & 0xFFF), (void*)addr, n );
+        addr += n;
+        len -= n;
+    }
+    return true;
+}
+
+void io_sg_list::add_list( io_sg_list* other, size_t len ) {
+    for( unsigned int i=0;(i<other->n_segments) && (len > 0);i++ ) {
+        size_t n = ((other->segments[i].len < len) ? other->segments[i].len : len);
+        this->add( other->segments[i].phys, other->segments[i].virt, n );
+        len -= n;
+    }
+}
+
+size_t io_sg_cursor::next( void** virt, size_t max ) {
+    while( (this->seg < this->sg->n_segments) && (this->offset >= this->sg->segments[this->seg].len) ) {
+        this->seg++;
+        this->offset = 0;
+    }
+    if( this->seg >= this->sg->n_segments ) {
+        return 0;
+    }
+    io_sg_segment* cur = &this->sg->segments[this->seg];
+    size_t n = cur->len - this->offset;
+    if( n > max ) {
+        n = max;
+    }
+    *virt = (void*)(((uint8_t*)cur->virt) + this->offset);
+    this->offset += n;
+    return n;
+}
+
+// The frames are allocated one at a time, so big buffers don't depend on the buddy allocator having a
+// contiguous run free; runs it happens to hand out in order still end up as one segment.
+transfer_buffer::transfer_buffer( unsigned int n_bytes ) : sg( io_buffer_pages( n_bytes ) ) {
     this->size = n_bytes;
-    this->n_frames = ( (this->size-(this->size%0x1000)) / 0x1000 )+1;
+    this->n_frames = io_buffer_pages( n_bytes );
     
-    this->frames = pageframe_allocate( this->n_frames );
+    this->frames = (phys_addr_t*)kmalloc( sizeof(phys_addr_t) * this->n_frames );
     this->buffer_virt = (void*)k_vmem_alloc( this->n_frames );
-    this->buffer_phys = (void*)this->frames[0].address;
+    if( (this->frames == NULL) || (this->buffer_virt == NULL) ) {
+        panic("io: Could not allocate DMA buffer!\n");
+    }
     for(unsigned int i=0;i<this->n_frames;i++) {
-        if( !((i <= 0) || (this->frames[i].address == (this->frames[i-1].address+0x1000))) ) {
-        	kprintf("(i=%u, [i]=%#x, [i-1]=%#x)\n", i, this->frames[i].address, this->frames[i-1].address);
-        	kprintf("allocated-as: (%u, %u)\n", this->frames[i].id_allocated_as, this->frames[i].order_allocated_as);
-            panic("io: Could not allocate contiguous frames for DMA buffer!\n");
+        page_frame* frame = pageframe_allocate(1);
+        if( frame == NULL ) {
+            panic("io: Could not allocate frames for DMA buffer!\n");
         }
-        paging_set_pte( ((size_t)this->buffer_virt)+(i*0x1000), this->frames[i].address,0x11 );
-        //kprintf("transfer_buffer::transfer_buffer: mapping %#x to %#x.\n", ((size_t)this->buffer_virt)+(i*0x1000), this->frames[i].address );
+        this->frames[i] = frame->address;
+        kfree( (char*)frame );
+
+        void* page = (void*)(((size_t)this->buffer_virt)+(i*0x1000));
+        paging_set_pte( (virt_addr_t)page, this->frames[i], 0x11 );
+        this->sg.add( this->frames[i], page, 0x1000 );
     }
 }
 
-void *transfer_buffer::remap() {
-    void *buf = (void*)k_vmem_alloc( this->n_frames );
+transfer_buffer::~transfer_buffer() {
     for(unsigned int i=0;i<this->n_frames;i++) {
-    	if( !((i <= 0) || (this->frames[i].address == (this->frames[i-1].address+0x1000))) ){
-    		kprintf("io: WARNING: IO Transfer Buffer frames not contiguous!\n");
-        	kprintf("io: (i=%u, [i]=%#x, [i-1]=%#x)\n", i, this->frames[i].address, this->frames[i-1].address);
-        	kprintf("io: allocated-as: (%u, %u)\n", this->frames[i].id_allocated_as, this->frames[i].order_allocated_as);
-        }
-        paging_set_pte( ((size_t)buf)+(i*0x1000), this->frames[i].address,0x11 );
-        //kprintf("transfer_buffer::remap: mapping %#x to %#x.\n", ((size_t)buf)+(i*0x1000), this->frames[i].address );
+        paging_unset_pte( ((size_t)this->buffer_virt)+(i*0x1000) );
+        pageframe_deallocate_specific( pageframe_get_block_from_addr( this->frames[i] ), 0 );
     }
-    return buf;
+    k_vmem_free( (virt_addr_t)this->buffer_virt );
+    kfree( (void*)this->frames );
 }
 
 unsigned int io_get_disk_count() { return io_disks.count(); }
 
+// Reads and writes go through the block cache; the _uncached versions are single-request batches
+// straight to the disk. start_pos doesn't have to be sector-aligned.
 void io_read_disk( unsigned int disk_no, void* out_buffer, uint64_t start_pos, uint64_t read_amt ) {
+    bcache_read( disk_no, out_buffer, start_pos, read_amt );
+}
+
+void io_write_disk( unsigned int disk_no, void* out_buffer, uint64_t start_pos, uint64_t write_amt ) {
+    bcache_write( disk_no, out_buffer, start_pos, write_amt );
+}
+
+void io_read_disk_uncached( unsigned int disk_no, void* out_buffer, uint64_t start_pos, uint64_t read_amt ) {
     io_disk *device = io_get_disk( disk_no );
     //kprintf("io: reading disk %u, position %llu -> %llu (%llu bytes)\n", disk_no, start_pos, start_pos+read_amt, read_amt);
     if( device == NULL ) {
         kprintf("io: attempted read to unknown disk %u\n", disk_no);
         return; // error message?
     }
-    bool manual_read_required = ( (read_amt % device->get_sector_size()) != 0 );
-    uint64_t n_sectors = ( read_amt / device->get_sector_size() ) + ( manual_read_required ? 1 : 0 );
-    uint64_t sector_start = ( start_pos / device->get_sector_size() );
+    unsigned int sector_size = device->get_sector_size();
+    uint64_t offset = ( start_pos % sector_size );
+    uint64_t n_sectors = ( (offset + read_amt + sector_size - 1) / sector_size );
+    uint64_t sector_start = ( start_pos / sector_size );
     
-    transfer_buffer  *tmp_buffer = new transfer_buffer( n_sectors * device->get_sector_size() );
-    transfer_request *req = new transfer_request( tmp_buffer, sector_start, n_sectors, true );
-    
-    //kprintf("io: sending request for %u sectors from LBA %u\n", n_sectors, sector_start);
-    
-    device->send_request( req );
+    transfer_request *req = io_request_alloc( disk_no, sector_start, n_sectors, true );
+    io_submit( &req, 1 );
     req->wait();
-    
-    uint8_t *dst_ptr = (uint8_t*)out_buffer;
-    uint8_t *src_ptr = (uint8_t*)(tmp_buffer->buffer_virt);
-    //kprintf("io: src buffer at %#p physical, %#p virtual\n", tmp_buffer->buffer_phys, (void*)src_ptr);
-    //kprintf("io: PTE for source address is %#x\n", paging_get_pte((size_t)src_ptr));
-    for( unsigned int i=0;i<read_amt;i++ ) {
-        dst_ptr[i] = src_ptr[ i ];
+    if( !req->status ) {
+        kprintf("io: read of %llu sectors from LBA %llu on disk %u failed\n", n_sectors, sector_start, disk_no);
     }
     
-    //delete req;
-    //delete tmp_buffer;
+    memcpy( out_buffer, (void*)(((uint8_t*)req->buffer->buffer_virt) + offset), read_amt );
+    io_request_free( req );
 }
 
-void io_write_disk( unsigned int disk_no, void* out_buffer, uint64_t start_pos, uint64_t write_amt ) {
+void io_write_disk_uncached( unsigned int disk_no, void* out_buffer, uint64_t start_pos, uint64_t write_amt ) {
     io_disk *device = io_get_disk( disk_no );
     if( device == NULL ) {
         kprintf("io: attempted write to unknown disk %u\n", disk_no);
         return; // error message?
     }
-    bool manual_read_required = ( (write_amt % device->get_sector_size()) != 0 );
-    uint64_t n_sectors = ( write_amt / device->get_sector_size() ) + ( manual_read_required ? 1 : 0 );
-    uint64_t sector_start = ( start_pos / device->get_sector_size() );
+    unsigned int sector_size = device->get_sector_size();
+    uint64_t offset = ( start_pos % sector_size );
+    uint64_t n_sectors = ( (offset + write_amt + sector_size - 1) / sector_size );
+    uint64_t sector_start = ( start_pos / sector_size );
     
-    transfer_buffer  *tmp_buffer = new transfer_buffer( n_sectors * device->get_sector_size() );
-    transfer_request *req        = new transfer_request( tmp_buffer, sector_start, n_sectors, false );
+    transfer_request *req = io_request_alloc( disk_no, sector_start, n_sectors, false );
+    uint8_t *dst_ptr = (uint8_t*)(req->buffer->buffer_virt);
     
-    uint8_t *src_ptr = (uint8_t*)out_buffer;
-    uint8_t *dst_ptr = (uint8_t*)(tmp_buffer->buffer_virt);
-    for( unsigned int i=0;i<(write_amt % device->get_sector_size());i++ ) {
-        dst_ptr[i] = 0;
+    if( (offset != 0) || (((offset + write_amt) % sector_size) != 0) ) {
+        // partial sectors: fill in what's already on the disk around the new data
+        transfer_request *rd_req = io_request_alloc( disk_no, sector_start, n_sectors, true );
+        io_submit( &rd_req, 1 );
+        rd_req->wait();
+        memcpy( (void*)dst_ptr, rd_req->buffer->buffer_virt, n_sectors * sector_size );
+        io_request_free( rd_req );
     }
+    memcpy( (void*)(dst_ptr + offset), out_buffer, write_amt );
     
-    for( unsigned int i=0;i<write_amt;i++ ) {
-        dst_ptr[ i ] = src_ptr[i];
+    io_submit( &req, 1 );
+    req->wait();
+    if( !req->status ) {
+        kprintf("io: write of %llu sectors to LBA %llu on disk %u failed\n", n_sectors, sector_start, disk_no);
     }
-    
-    device->send_request( req );
-    
+    io_request_free( req );
+}
+
+// Vectored I/O: sg->size bytes (a whole number of sectors) straight between the disk and the list's
+// memory, which doesn't have to be contiguous. The block cache is kept out of the way: what it has of
+// those sectors is written back and dropped first (and, for writes, dropped again afterwards, in case
+// somebody read the old data back in meanwhile).
+// The driver threads walk the list (and the memory it describes) from their own address space, so both
+// have to be in kernel memory -- not on the caller's stack.
+static bool io_vectored( unsigned int disk_no, uint64_t sector_start, io_sg_list* sg, bool read ) {
+    io_disk *device = io_get_disk( disk_no );
+    if( device == NULL ) {
+        kprintf("io: attempted vectored %s on unknown disk %u\n", (read ? "read" : "write"), disk_no);
+        return false;
+    }
+    unsigned int sector_size = device->get_sector_size();
+    if( (sg->size == 0) || ((sg->size % sector_size) != 0) ) {
+        return false;
+    }
+    for( unsigned int i=0;i<sg->n_segments;i++ ) {
+        if( ((sg->segments[i].phys & 1) != 0) || ((sg->segments[i].len & 1) != 0) ) {
+            return false;
+        }
+    }
+    size_t n_sectors = sg->size / sector_size;
+
+    bcache_invalidate( disk_no, sector_start, n_sectors );
+    transfer_request *req = new transfer_request( sg, sector_start, n_sectors, read );
+    req->disk_no = disk_no;
+    io_submit( &req, 1 );
     req->wait();
-    
-    //delete req;
+    bool ok = req->status;
+    delete req;
+    if( !read ) {
+        bcache_invalidate( disk_no, sector_start, n_sectors );
+    }
+    if( !ok ) {
+        kprintf("io: vectored %s of %u sectors at LBA %llu on disk %u failed\n", (read ? "read" : "write"), n_sectors, sector_start, disk_no);
+    }
+    return ok;
+}
+
+bool io_readv( unsigned int disk_no, uint64_t sector_start, io_sg_list* sg ) {
+    return io_vectored( disk_no, sector_start, sg, true );
+}
+
+bool io_writev( unsigned int disk_no, uint64_t sector_start, io_sg_list* sg ) {
+    return io_vectored( disk_no, sector_start, sg, false );
 }
 
 void io_read_partition( unsigned int global_part_id, void *out_buffer, uint64_t start_pos, uint64_t read_amt ) {
@@ -287,5 +582,5 @@ void io_write_partition( unsigned int device, unsigned int part_id, void *out_bu
         return;
     }
     
-    return io_read_partition( part->global_id, out_buffer, start_pos, write_amt );
+    return io_write_partition( part->global_id, out_buffer, start_pos, write_amt );
 }
@@ -0,0 +1,297 @@
+// iosched.cpp -- I/O schedulers
+// Requests wait in their disk's scheduler until the driver asks for the next transfer. Merged requests
+// go out as one transfer whose scatter-gather list strings the members' lists together, so the data
+// goes straight in and out of each member's own memory.
+
+#include "includes.h"
+#include "core/iosched.h"
+#include "device/pit.h"
+
+// ---- noop ----
+
+void io_noop_scheduler::add( transfer_request* req ) {
+    req->sched_next = NULL;
+    if( this->tail == NULL ) {
+        this->head = req;
+    } else {
+        this->tail->sched_next = req;
+    }
+    this->tail = req;
+}
+
+transfer_request* io_noop_scheduler::next( unsigned int max_sectors ) {
+    transfer_request* req = this->head;
+    if( req == NULL ) {
+        return NULL;
+    }
+    this->head = req->sched_next;
+    if( this->head == NULL ) {
+        this->tail = NULL;
+    }
+    req->sched_next = NULL;
+    req->merge_next = NULL;
+    this->stats.dispatched++;
+    return req;
+}
+
+// ---- deadline ----
+
+void io_deadline_scheduler::add( transfer_request* req ) {
+    int dir = (req->read ? 0 : 1);
+
+    transfer_request** cur = &this->sorted[dir];
+    while( (*cur != NULL) && ((*cur)->sector_start <= req->sector_start) ) {
+        cur = &(*cur)->sched_next;
+    }
+    req->sched_next = *cur;
+    *cur = req;
+
+    req->fifo_next = NULL;
+    if( this->fifo_tail[dir] == NULL ) {
+        this->fifo_head[dir] = req;
+    } else {
+        this->fifo_tail[dir]->fifo_next = req;
+    }
+    this->fifo_tail[dir] = req;
+}
+
+void io_deadline_scheduler::unlink( transfer_request* req ) {
+    int dir = (req->read ? 0 : 1);
+
+    for( transfer_request** cur = &this->sorted[dir]; *cur != NULL; cur = &(*cur)->sched_next ) {
+        if( *cur == req ) {
+            *cur = req->sched_next;
+            break;
+        }
+    }
+    req->sched_next = NULL;
+
+    transfer_request* prev = NULL;
+    for( transfer_request* cur = this->fifo_head[dir]; cur != NULL; cur = cur->fifo_next ) {
+        if( cur == req ) {
+            if( prev == NULL ) {
+                this->fifo_head[dir] = cur->fifo_next;
+            } else {
+                prev->fifo_next = cur->fifo_next;
+            }
+            if( this->fifo_tail[dir] == cur ) {
+                this->fifo_tail[dir] = prev;
+            }
+            break;
+        }
+        prev = cur;
+    }
+    req->fifo_next = NULL;
+}
+
+// The first request at or past the head in the given direction, or (going back around) the lowest one.
+transfer_request* io_deadline_scheduler::pick( bool write ) {
+    transfer_request* first = this->sorted[write ? 1 : 0];
+    for( transfer_request* cur = first; cur != NULL; cur = cur->sched_next ) {
+        if( cur->sector_start >= this->head_pos ) {
+            return cur;
+        }
+    }
+    return first;
+}
+
+transfer_request* io_deadline_scheduler::next( unsigned int max_sectors ) {
+    if( this->empty() ) {
+        return NULL;
+    }
+
+    // anything past its deadline goes first (reads before writes)
+    unsigned long long int now = get_sys_time_counter();
+    transfer_request* start = NULL;
+    for( int dir=0;(dir<2) && (start == NULL);dir++ ) {
+        transfer_request* oldest = this->fifo_head[dir];
+        unsigned int deadline = ((dir == 0) ? IOSCHED_READ_DEADLINE : IOSCHED_WRITE_DEADLINE);
+        if( (oldest != NULL) && ((oldest->submit_time + deadline) <= now) ) {
+            start = oldest;
+            this->batch_write = (dir == 1);
+            this->batch_count = 0;
+            this->stats.expired++;
+        }
+    }
+
+    if( start == NULL ) {
+        bool write = this->batch_write;
+        if( (this->batch_count >= IOSCHED_BATCH) || (this->sorted[write ? 1 : 0] == NULL) ) {
+            // start a new batch: reads, unless there aren't any or the writes have waited long enough
+            bool have_reads = (this->sorted[0] != NULL);
+            bool have_writes = (this->sorted[1] != NULL);
+            write = have_writes && (!have_reads || (this->writes_starved >= IOSCHED_WRITES_STARVED));
+            if( write ) {
+                this->writes_starved = 0;
+            } else if( have_writes ) {
+                this->writes_starved++;
+            }
+            this->batch_write = write;
+            this->batch_count = 0;
+        }
+        start = this->pick( write );
+    }
+    this->batch_count++;
+
+    // take along whatever carries straight on from it
+    transfer_request* last = start;
+    transfer_request* cand = start->sched_next;
+    size_t n_sectors = start->n_sectors;
+    this->unlink( start );
+    start->merge_next = NULL;
+    while( (max_sectors > 0) && (cand != NULL) && (cand->sector_start == (last->sector_start + last->n_sectors)) && ((n_sectors + cand->n_sectors) <= max_sectors) ) {
+        transfer_request* following = cand->sched_next;
+        this->unlink( cand );
+        cand->merge_next = NULL;
+        last->merge_next = cand;
+        last = cand;
+        n_sectors += cand->n_sectors;
+        this->stats.merged++;
+        cand = following;
+    }
+
+    this->head_pos = last->sector_start + last->n_sectors;
+    this->stats.dispatched++;
+    return start;
+}
+
+// ---- common ----
+
+io_scheduler* io_sched_create( const char* name ) {
+    if( strcmp( const_cast<char*>(name), const_cast<char*>("noop") ) ) {
+        return new io_noop_scheduler;
+    } else if( strcmp( const_cast<char*>(name), const_cast<char*>("deadline") ) ) {
+        return new io_deadline_scheduler;
+    }
+    return NULL;
+}
+
+bool io_set_scheduler( unsigned int disk_no, const char* name ) {
+    io_disk* disk = io_get_disk( disk_no );
+    if( disk == NULL ) {
+        return false;
+    }
+    io_scheduler* sched = io_sched_create( name );
+    if( sched == NULL ) {
+        return false;
+    }
+
+    disk->sched_lock.lock();
+    io_scheduler* old = disk->scheduler;
+    if( old != NULL ) {
+        // (anything still queued moves over as it is)
+        transfer_request* req;
+        while( (req = old->next( 0 )) != NULL ) {
+            sched->add( req );
+        }
+    }
+    disk->scheduler = sched;
+    disk->sched_lock.unlock();
+
+    if( old != NULL ) {
+        delete old;
+    }
+    return true;
+}
+
+void io_disk::queue( transfer_request* req ) {
+    if( this->scheduler == NULL ) {
+        this->scheduler = io_sched_create( IOSCHED_DEFAULT );
+    }
+    req->submit_time = get_sys_time_counter();
+    if( req->submit_time == 0 ) {
+        req->submit_time = 1; // (0 means it never went through a queue)
+    }
+
+    this->sched_lock.lock();
+    this->scheduler->stats.submitted++;
+    this->scheduler->add( req );
+    this->sched_lock.unlock();
+}
+
+bool io_disk::queue_empty() {
+    this->sched_lock.lock();
+    bool ret = ((this->scheduler == NULL) || this->scheduler->empty());
+    this->sched_lock.unlock();
+    return ret;
+}
+
+transfer_request* io_disk::dequeue() {
+    if( this->scheduler == NULL ) {
+        return NULL;
+    }
+    this->sched_lock.lock();
+    transfer_request* first = this->scheduler->next( this->get_max_sectors() );
+    this->sched_lock.unlock();
+    if( (first == NULL) || (first->merge_next == NULL) ) {
+        return first;
+    }
+
+    // build the transfer that carries them all
+    unsigned int sector_size = this->get_sector_size();
+    size_t n_sectors = 0;
+    unsigned int n_segments = 0;
+    for( transfer_request* m = first; m != NULL; m = m->merge_next ) {
+        n_sectors += m->n_sectors;
+        n_segments += m->sg->n_segments;
+    }
+    io_sg_list* sg = new io_sg_list( n_segments );
+    for( transfer_request* m = first; m != NULL; m = m->merge_next ) {
+        sg->add_list( m->sg, m->n_sectors * sector_size ); // (pooled buffers can be bigger than the request)
+    }
+    transfer_request* carrier = new transfer_request( sg, first->sector_start, n_sectors, first->read );
+    carrier->disk_no = first->disk_no;
+    carrier->merged = first;
+    return carrier;
+}
+
+void io_sched_split( transfer_request* carrier, bool status ) {
+    transfer_request* m = carrier->merged;
+    while( m != NULL ) {
+        transfer_request* following = m->merge_next; // (m can be gone once it's completed)
+        m->merge_next = NULL;
+        m->complete( status );
+        m = following;
+    }
+
+    delete carrier->sg;
+    delete carrier;
+}
+
+void io_sched_completed( transfer_request* req ) {
+    if( req->submit_time == 0 ) {
+        return;
+    }
+    io_disk* disk = io_get_disk( req->disk_no );
+    if( (disk == NULL) || (disk->scheduler == NULL) ) {
+        return;
+    }
+    uint64_t latency = get_sys_time_counter() - req->submit_time;
+
+    disk->sched_lock.lock();
+    io_sched_stats* st = &disk->scheduler->stats;
+    st->completed++;
+    st->total_latency += latency;
+    if( latency > st->max_latency ) {
+        st->max_latency = latency;
+    }
+    disk->sched_lock.unlock();
+}
+
+void io_sched_print_stats() {
+    for( unsigned int i=1;i<=io_get_disk_count();i++ ) {
+        io_disk* disk = io_get_disk( i );
+        if( (disk == NULL) || (disk->scheduler == NULL) ) {
+            continue;
+        }
+        disk->sched_lock.lock();
+        io_sched_stats st = disk->scheduler->stats;
+        const char* name = disk->scheduler->name();
+        disk->sched_lock.unlock();
+
+        kprintf("iosched: disk %u (%s): %llu requests in %llu transfers (%llu merged), %llu past their deadline\n",
+            i, name, st.submitted, st.dispatched, st.merged, st.expired);
+        kprintf("iosched: disk %u: latency %llu ms average, %llu ms worst (%llu completed)\n",
+            i, ((st.completed > 0) ? (st.total_latency / st.completed) : 0), st.max_latency, st.completed);
+    }
+}
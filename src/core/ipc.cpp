@@ -0,0 +1,172 @@
+// ipc.cpp -- synchronous call / reply IPC
+// Callers block until their reply comes back, so all per-call state lives in the caller's process
+// (see ipc.h) and nothing is allocated on the way. When a server is already waiting, a call never goes
+// near the run queues: the caller copies its message registers into the server's slot and hands its
+// timeslice to the server, which does the same in reverse when it replies.
+
+#include "includes.h"
+#include "core/ipc.h"
+#include "core/scheduler.h"
+
+static ipc_endpoint* ipc_endpoints[IPC_MAX_ENDPOINTS];
+static volatile uint32_t ipc_n_endpoints = 0; // ids 1 through ipc_n_endpoints are in use
+
+ipc_endpoint* ipc_endpoint_create() {
+    uint32_t id = __sync_add_and_fetch( &ipc_n_endpoints, 1 );
+    if( id >= IPC_MAX_ENDPOINTS ) {
+        kprintf("ipc: out of endpoints!\n");
+        return NULL;
+    }
+    ipc_endpoint* ep = new ipc_endpoint;
+    ep->id = id;
+    ipc_endpoints[id] = ep;
+    return ep;
+}
+
+ipc_endpoint* ipc_get_endpoint( uint32_t id ) {
+    if( (id == IPC_INVALID_ENDPOINT) || (id >= IPC_MAX_ENDPOINTS) ) {
+        return NULL;
+    }
+    return ipc_endpoints[id];
+}
+
+// Sleep until our reply is in. (Anything else that wakes us up just goes around again.)
+static void ipc_wait_reply( ipc_caller* self ) {
+    while( true ) {
+        interrupt_status_t int_stat = disable_interrupts();
+        if( self->done ) {
+            process_current->state = process_state::runnable;
+            restore_interrupts(int_stat);
+            return;
+        }
+        process_current->state = process_state::waiting;
+        restore_interrupts(int_stat);
+        process_switch_immediate();
+    }
+}
+
+uint32_t ipc_call( ipc_endpoint* ep, ipc_msg* msg, ipc_msg* reply ) {
+    if( ep == NULL ) {
+        return IPC_ERR_NO_ENDPOINT;
+    }
+
+    ipc_caller* self = &process_current->ipc_caller_slot;
+    self->proc = process_current;
+    self->msg = *msg;
+    self->done = false;
+    self->next = NULL;
+
+    ep->lock.lock();
+    ep->calls++;
+    ipc_server* server = ep->server;
+    process* target = NULL;
+    if( server != NULL ) {
+        ep->server = NULL;
+        server->msg = *msg;
+        server->caller = self;
+        target = server->proc;
+        ep->direct++;
+    } else {
+        if( ep->callers_tail == NULL ) {
+            ep->callers_head = self;
+        } else {
+            ep->callers_tail->next = self;
+        }
+        ep->callers_tail = self;
+    }
+    process_current->state = process_state::waiting;
+    ep->lock.unlock();
+
+    if( target != NULL ) {
+        process_handoff( target );
+    } else if( !ep->server_waiters.empty() ) {
+        ep->server_waiters.wake_one();
+    }
+    ipc_wait_reply( self );
+    if( reply != NULL ) {
+        *reply = self->reply;
+    }
+    return 0;
+}
+
+// Wait for a call on ep. If wake isn't NULL, that process is woken up as well -- and if we have
+// to sleep, we switch straight to it.
+static ipc_caller* ipc_wait_call( ipc_endpoint* ep, ipc_msg* msg, process* wake ) {
+    ipc_server* self = &process_current->ipc_server_slot;
+    self->proc = process_current;
+    self->caller = NULL;
+
+    ep->lock.lock();
+    while( self->caller == NULL ) {
+        if( ep->callers_head != NULL ) {
+            ipc_caller* c = ep->callers_head;
+            ep->callers_head = c->next;
+            if( ep->callers_head == NULL ) {
+                ep->callers_tail = NULL;
+            }
+            c->next = NULL;
+            self->msg = c->msg;
+            self->caller = c;
+            break;
+        }
+
+        if( ep->server == NULL ) {
+            ep->server = self;
+        }
+        if( ep->server == self ) {
+            process_current->state = process_state::waiting;
+            ep->lock.unlock();
+            if( wake != NULL ) {
+                process_handoff( wake );
+                wake = NULL;
+            } else {
+                process_switch_immediate();
+            }
+        } else {
+            // somebody else is already serving; wait until they pick up a call
+            ep->server_waiters.wait( &ep->lock );
+        }
+        ep->lock.lock();
+    }
+    if( ep->server == self ) {
+        ep->server = NULL;
+    }
+    process_current->state = process_state::runnable;
+    ep->lock.unlock();
+
+    if( !ep->server_waiters.empty() ) {
+        ep->server_waiters.wake_one(); // (somebody else can start waiting now)
+    }
+    if( wake != NULL ) {
+        process_wake( wake );
+    }
+    *msg = self->msg;
+    return self->caller;
+}
+
+// Hand the reply over; returns the caller, which still has to be woken up.
+static process* ipc_complete( ipc_caller* caller, ipc_msg* reply ) {
+    // the caller can return (and start another call with the same slot) as soon as it sees done, so get proc first
+    interrupt_status_t int_stat = disable_interrupts();
+    process* proc = caller->proc;
+    caller->reply = *reply;
+    caller->done = true;
+    restore_interrupts(int_stat);
+    return proc;
+}
+
+ipc_caller* ipc_receive( ipc_endpoint* ep, ipc_msg* msg ) {
+    return ipc_wait_call( ep, msg, NULL );
+}
+
+void ipc_reply( ipc_caller* caller, ipc_msg* reply ) {
+    process_handoff( ipc_complete( caller, reply ) );
+}
+
+ipc_caller* ipc_reply_wait( ipc_endpoint* ep, ipc_caller* caller, ipc_msg* reply, ipc_msg* msg ) {
+    process* proc = NULL;
+    if( caller != NULL ) {
+        proc = ipc_complete( caller, reply );
+    }
+    return ipc_wait_call( ep, msg, proc );
+}
@@ -10,14 +10,17 @@
 #include "lib/vector.h"
 #include "lib/refcount.h"
 #include "core/message.h"
+#include "core/rcu.h"
 
 uint64_t current_work_id = 0;
 vector<k_work::work*> work_queue;
 vector<k_work::work*> finished_list;
 process *worker_thread;
+static channel_handle worker_ready_channel = CHANNEL_INVALID_HANDLE;
+static channel_handle worker_finished_channel = CHANNEL_INVALID_HANDLE;
 
 void k_worker_thread() {
-	channel_receiver ch = listen_to_channel("k_worker_thread_ready");
+	channel_receiver ch = listen_to_channel(worker_ready_channel);
 	while(true) {
 		while( work_queue.count() > 0 ) {
 			k_work::work *current = work_queue.remove_end();
@@ -30,7 +33,7 @@ void k_worker_thread() {
 			}
 			kprintf("Sending wakeup call.\n");
 			message wakeup_call( (void*)current, 0 );
-			send_to_channel("k_worker_thread_finished", wakeup_call);
+			send_to_channel(worker_finished_channel, wakeup_call);
 		}
 		k_work::reap_orphans();
 
@@ -49,7 +52,7 @@ k_work::work::work( work_func func, void* context_1, unsigned int context_2, boo
 	this->return_code = 0;
 	this->finished = false;
 	this->auto_remove = auto_remove;
-	this->ch = new channel_receiver( listen_to_channel("k_worker_thread_finished") );
+	this->ch = new channel_receiver( listen_to_channel(worker_finished_channel) );
 	this->context_1 = context_1;
 	this->context_2 = context_2;
 }
@@ -109,15 +112,18 @@ k_work::work* k_work::schedule( work_func func, void* context_1, unsigned int co
 	work_queue.add_end(work);
 
 	message wakeup_call;
-	send_to_channel( "k_worker_thread_ready", wakeup_call );
+	send_to_channel( worker_ready_channel, wakeup_call );
 
 	return work;
 }
 
 void k_work::reap_orphans() {
 	for(unsigned int i=0;i<finished_list.count();i++) {
+		rcu_read_lock();
 		process* proc = get_process_by_pid(finished_list[i]->spawning_pid);
-		if( (proc == NULL) || (proc->state == process_state::dead) ) {
+		bool orphaned = (proc == NULL) || (proc->state == process_state::dead);
+		rcu_read_unlock();
+		if( orphaned ) {
 			k_work::work *wk = finished_list.remove(i);
 			delete wk;
 		}
@@ -125,8 +131,8 @@ void k_work::reap_orphans() {
 }
 
 void k_work::start() {
-	worker_thread = new process( (uint32_t)&k_worker_thread, false, 0, "k_worker_thread", NULL, 0 );
-	register_channel( "k_worker_thread_ready" );
-	register_channel( "k_worker_thread_finished" );
+	worker_thread = kthread_create( (uint32_t)&k_worker_thread, 0, "k_worker_thread" );
+	worker_ready_channel = register_channel( "k_worker_thread_ready" );
+	worker_finished_channel = register_channel( "k_worker_thread_finished" );
 	spawn_process(worker_thread);
 }
@@ -13,6 +13,10 @@
 #include "device/vga.h"
 #include "core/vfs.h"
 #include "core/k_worker_thread.h"
+#include "core/benchmark.h"
+#include "core/rcu.h"
+#include "core/bcache.h"
+#include "core/iosched.h"
 #include "fs/fat/fat_fs.h"
 #include "fs/iso9660/iso9660.h"
 #include "fs/dev_fs.h"
@@ -47,6 +51,65 @@ unsigned int k_worker_thread_test(void* c1, unsigned int c2) {
 	return 52;
 }
 
+// Read the first sector of a disk straight from the disk, then again through the block cache, and check
+// that they match. This runs in init, which has its own address space (unlike the driver and cache threads
+// that have to wake it up once each read is done).
+bool disk_read_test( unsigned int disk_no ) {
+	uint8_t* direct = (uint8_t*)kmalloc(512);
+	uint8_t* cached = (uint8_t*)kmalloc(512);
+	memset( (void*)direct, 0, 512 );
+	memset( (void*)cached, 0xFF, 512 );
+
+	io_read_disk_uncached( disk_no, (void*)direct, 0, 512 );
+	bcache_invalidate( disk_no, 0, 1 ); // (io_detect_disk() already pulled it in)
+	io_read_disk( disk_no, (void*)cached, 0, 512 );
+
+	bool ok = true;
+	for( unsigned int i=0;i<512;i++ ) {
+		if( direct[i] != cached[i] ) {
+			ok = false;
+			break;
+		}
+	}
+	kfree( (void*)direct );
+	kfree( (void*)cached );
+	return ok;
+}
+
+static bool disk_vectored_check( uint8_t* expected, uint8_t* first, uint8_t* rest ) {
+	for( unsigned int i=0;i<4096;i++ ) {
+		if( expected[i] != ((i < 1024) ? first[i] : rest[i-1024]) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Read the first 4 KiB of a disk with io_readv() into two separate buffers and check it against a plain read,
+// then write the same data back with io_writev() and read it back again.
+bool disk_vectored_test( unsigned int disk_no ) {
+	uint8_t* expected = (uint8_t*)kmalloc(4096);
+	uint8_t* first = (uint8_t*)kmalloc(1024);
+	uint8_t* rest = (uint8_t*)kmalloc(3072);
+	io_sg_list* sg = new io_sg_list( 2 );
+	bool ok = sg->add_virt( (void*)first, 1024 ) && sg->add_virt( (void*)rest, 3072 );
+
+	io_read_disk_uncached( disk_no, (void*)expected, 0, 4096 );
+	ok = ok && io_readv( disk_no, 0, sg ) && disk_vectored_check( expected, first, rest );
+	ok = ok && io_writev( disk_no, 0, sg );
+	if( ok ) {
+		memset( (void*)first, 0, 1024 );
+		memset( (void*)rest, 0, 3072 );
+		ok = io_readv( disk_no, 0, sg ) && disk_vectored_check( expected, first, rest );
+	}
+
+	delete sg;
+	kfree( (void*)expected );
+	kfree( (void*)first );
+	kfree( (void*)rest );
+	return ok;
+}
+
 void test_process_1() {   
     kprintf("Initializing serial logging.\n");
     initialize_serial();
@@ -81,6 +144,9 @@ void test_process_1() {
 
     kprintf("Starting kernel worker thread.\n");
     k_work::start();
+
+    kprintf("Starting RCU callback thread.\n");
+    rcu_initialize();
     
     kprintf("Initializing PS/2 controller.\n");
     ps2_controller_init();
@@ -103,6 +169,17 @@ void test_process_1() {
     
     io_detect_disk( io_get_disk( 1 ) );
 
+    if( disk_read_test( 1 ) ) {
+        kprintf("Disk read test passed.\n");
+    } else {
+        kprintf("Disk read test FAILED: cached and uncached reads of disk 1 don't match!\n");
+    }
+    if( disk_vectored_test( 1 ) ) {
+        kprintf("Vectored I/O test passed.\n");
+    } else {
+        kprintf("Vectored I/O test FAILED on disk 1!\n");
+    }
+
     kprintf("Scheduling work...\n");
     logger_flush_buffer();
     k_work::work* wk = k_work::schedule( &k_worker_thread_test );
@@ -341,6 +418,32 @@ void test_process_1() {
 						} else {
 							kprintf("FS move succeeded.\n");
 						}
+					} else if( strcmp( cmd, const_cast<char*>("bench") ) ) {
+						if( !run_benchmark( arg1 ) ) {
+							kprintf("Unknown benchmark: %s\n", arg1);
+							list_benchmarks();
+						}
+					} else if( strcmp( cmd, const_cast<char*>("trace") ) ) {
+						if( strcmp( arg1, const_cast<char*>("mutex") ) ) {
+							mutex_pi_trace_dump();
+						} else if( strcmp( arg1, const_cast<char*>("bcache") ) ) {
+							bcache_print_stats();
+						} else if( strcmp( arg1, const_cast<char*>("iosched") ) ) {
+							io_sched_print_stats();
+						} else {
+							kprintf("Unknown trace: %s (try 'mutex', 'bcache' or 'iosched')\n", arg1);
+						}
+					} else if( ( arg2 != NULL ) && strcmp( cmd, const_cast<char*>("iosched") ) ) {
+						// "iosched <disk number> <noop|deadline>"
+						if( io_set_scheduler( atoi( arg1 ), arg2 ) ) {
+							kprintf("Disk %s now uses the %s scheduler.\n", arg1, arg2);
+						} else {
+							kprintf("Unknown disk or scheduler: %s %s\n", arg1, arg2);
+						}
+					} else if( strcmp( cmd, const_cast<char*>("sync") ) ) {
+						// "sync all", or "sync <disk number>"
+						bcache_sync( strcmp( arg1, const_cast<char*>("all") ) ? 0 : atoi( arg1 ) );
+						kprintf("Sync complete.\n");
 					}
 				}
 			}
@@ -8,8 +8,55 @@
 #include "includes.h"
 #include "core/message.h"
 #include "lib/hash_table.h"
+#include "core/pipe.h"
+#include "device/pit.h"
+
+// Channels are never unregistered, so a handle stays valid (and its channel stays around) forever.
+// The handle table is swapped for a bigger copy as it fills up; readers only need rcu_read_lock().
+typedef struct channel_table {
+	rcu_head rcu;
+	uint32_t size;
+	channel* entries[];
+} channel_table;
+
+static hash_table< channel_handle > channel_names(16);
+static channel_table* volatile channels = NULL;
+static uint32_t n_channels = 0;  // handles 1 through n_channels are in use
+static rwlock channels_lock;     // serializes registration (and protects channel_names)
+
+message_payload::message_payload( void* data, size_t size ) {
+	this->data = data;
+	this->size = size;
+	this->n_pages = 0;
+}
 
-hash_table< channel* > channels(0x1000);
+message_payload* message_payload::remap_pages( virt_addr_t pages, unsigned int n_pages, size_t size ) {
+	if( (pages < PAGING_KERNEL_BASE_ADDR) || ((pages & 0xFFF) != 0) || (size > (n_pages * 0x1000)) ) {
+		return NULL;
+	}
+	virt_addr_t mapping = k_vmem_alloc( n_pages );
+	if( mapping == 0 ) {
+		return NULL;
+	}
+	for(unsigned int i=0;i<n_pages;i++) {
+		uint32_t pte = paging_get_pte( pages+(i*0x1000) );
+		paging_set_pte( mapping+(i*0x1000), pte & 0xFFFFF000, 0 );
+		paging_unset_pte( pages+(i*0x1000) ); // (this doesn't free the frame)
+	}
+	k_vmem_free( pages );
+
+	message_payload* ret = new message_payload( (void*)mapping, size );
+	ret->n_pages = n_pages;
+	return ret;
+}
+
+message_payload::~message_payload() {
+	if( this->n_pages > 0 ) {
+		munmap( (virt_addr_t)this->data, this->n_pages );
+	} else if( (this->data != NULL) && (this->size > 0) ) {
+		kfree(this->data);
+	}
+}
 
 message::message() {
 	process_ptr p( process_current );
@@ -27,93 +74,153 @@ message::message( void* data, size_t data_sz ) {
 	this->n_receivers = 0;
 	this->data = data;
 	this->data_size = data_sz;
+	if( (data != NULL) && (data_sz > 0) ) {
+		this->payload = new message_payload( data, data_sz );
+	}
+}
+
+message::message( message_payload* payload ) {
+	process_ptr p( process_current );
+	this->sender = p;
+	this->uid = 0;
+	this->n_receivers = 0;
+	this->payload = payload;
+	this->data = payload->data;
+	this->data_size = payload->size;
 }
 
-message::message( message& rhs ) {
+message::message( message& rhs ) : payload( rhs.payload ) {
 	this->n_receivers = rhs.n_receivers;
 	this->uid = rhs.uid;
 
 	this->sender = rhs.sender;
 
-	if( (rhs.data != NULL) && (rhs.data_size > 0) ) {
-		this->data = kmalloc(rhs.data_size);
-		this->data_size = rhs.data_size;
-		memcpy( this->data, rhs.data, rhs.data_size );
-	} else {
-		this->data = rhs.data;
-		this->data_size = rhs.data_size;
-	}
+	this->data = rhs.data;
+	this->data_size = rhs.data_size;
 }
 
-message::message( message* rhs ) {
+message::message( message* rhs ) : payload( rhs->payload ) {
 	this->n_receivers = rhs->n_receivers;
 	this->uid = rhs->uid;
 
 	this->sender = rhs->sender;
 
-	if( (rhs->data != NULL) && (rhs->data_size > 0) ) {
-		this->data = kmalloc(rhs->data_size);
-		this->data_size = rhs->data_size;
-		memcpy( this->data, rhs->data, rhs->data_size );
-	} else {
-		this->data = rhs->data;
-		this->data_size = rhs->data_size;
-	}
+	this->data = rhs->data;
+	this->data_size = rhs->data_size;
 }
 
-channel_receiver::channel_receiver( channel* remote ) {
-	this->remote_channel = remote;
-	if( remote == NULL )
-		return;
+channel_cursor::channel_cursor( channel* ch ) {
+	this->ch = ch;
+	this->pos = 0;
+	this->owner_pid = ((process_current != NULL) ? process_current->id : 0);
+}
 
-	this->remote_channel->lock.lock();
+channel_cursor::~channel_cursor() {
+	this->ch->remove_cursor( this );
+}
 
-	this->last_seen_uid = remote->current_uid;
+channel::channel( unsigned int ring_size, channel_overflow policy ) {
+	if( (ring_size == 0) || ((ring_size & (ring_size-1)) != 0) ) {
+		panic("messaging: channel ring size must be a power of 2!\n");
+	}
+	this->ring_size = ring_size;
+	this->policy = policy;
+	this->ring = (channel_slot*)kmalloc( sizeof(channel_slot) * ring_size );
+	if( this->ring == NULL ) {
+		panic("messaging: could not allocate channel ring!\n");
+	}
+	for(unsigned int i=0;i<ring_size;i++) {
+		this->ring[i].seq = i - ring_size + 1; // "holds" position i - ring_size
+		this->ring[i].msg = NULL;
+	}
+}
 
-	bool already_there = false;
-	for(unsigned int i=0;i<this->remote_channel->listeners.count();i++) {
-		if( this->remote_channel->listeners[i].raw_ptr() == process_current ) {
-			already_there = true;
+channel::~channel() {
+	for(unsigned int i=0;i<this->ring_size;i++) {
+		if( this->ring[i].msg != NULL ) {
+			delete this->ring[i].msg;
+		}
+	}
+	kfree( (void*)this->ring );
+}
+
+// New cursors start at the current head, so they only see messages sent from now on.
+void channel::add_cursor( channel_cursor* cursor ) {
+	this->cursors_lock.lock();
+	cursor->pos = this->head;
+	cursor->next = this->cursors;
+	this->cursors = cursor;
+	this->n_receivers++;
+	this->cursors_lock.unlock();
+}
+
+void channel::remove_cursor( channel_cursor* cursor ) {
+	this->cursors_lock.lock();
+	channel_cursor* prev = NULL;
+	for( channel_cursor* cur = this->cursors; cur != NULL; cur = cur->next ) {
+		if( cur == cursor ) {
+			if( prev == NULL ) {
+				this->cursors = cur->next;
+			} else {
+				prev->next = cur->next;
+			}
+			this->n_receivers--;
 			break;
 		}
+		prev = cur;
 	}
-	if( !already_there ) {
-		process_ptr p(process_current);
-		this->remote_channel->listeners.add_end( p );
+	this->cursors_lock.unlock();
+	this->space_waiters.wake_all(); // we might have been the one holding them up
+}
+
+// Position of the receiver that's furthest behind (or the head, if there are none).
+uint32_t channel::slowest_cursor() {
+	this->cursors_lock.lock();
+	uint32_t head = this->head;
+	uint32_t ret = head;
+	rcu_read_lock();
+	for( channel_cursor* cur = this->cursors; cur != NULL; cur = cur->next ) {
+		process* owner = get_process_by_pid( cur->owner_pid );
+		if( (owner == NULL) || (owner->state == process_state::dead) ) {
+			continue;
+		}
+		if( (head - cur->pos) > (head - ret) ) {
+			ret = cur->pos;
+		}
 	}
+	rcu_read_unlock();
+	this->tail_hint = ret;
+	this->cursors_lock.unlock();
+	return ret;
+}
+
+channel_receiver::channel_receiver( channel* remote ) {
+	this->remote_channel = remote;
+	if( remote == NULL )
+		return;
 
-	this->remote_channel->lock.unlock();
+	this->cursor = new channel_cursor( remote );
+	remote->add_cursor( this->cursor );
 }
 
-channel_receiver::channel_receiver( const channel_receiver& copy ) {
+channel_receiver::channel_receiver( const channel_receiver& copy ) : cursor( copy.cursor ) {
 	this->remote_channel = copy.remote_channel;
-	this->last_seen_uid = copy.last_seen_uid;
 	this->queue = copy.queue;
 }
 
 channel_receiver& channel_receiver::operator=( channel_receiver& rhs ) {
 	this->remote_channel = rhs.remote_channel;
-	this->last_seen_uid = rhs.last_seen_uid;
+	this->cursor = rhs.cursor;
 	this->queue = rhs.queue;
 
 	return *this;
 }
 
 channel_receiver::~channel_receiver() {
-	this->remote_channel->lock.lock();
-
-	for(unsigned int i=0;i<this->remote_channel->listeners.count();i++) {
-		if( this->remote_channel->listeners[i].raw_ptr() == process_current ) {
-			this->remote_channel->listeners.remove(i);
-			break;
-		}
-	}
-
 	for(unsigned int i=0;i<this->queue.count();i++) {
 		delete this->queue[i];
 	}
-
-	this->remote_channel->lock.unlock();
+	// (the cursor unregisters itself once no copy of us is left)
 }
 
 void channel_receiver::sort_internal( unsigned int lo_index, unsigned int hi_index ) {
@@ -160,52 +267,67 @@ void channel_receiver::sort() {
 	}
 }
 
+// Copy everything published since our last look into queue. This never waits for anything:
+// a slot that's still being written just ends the scan, and is picked up next time.
 bool channel_receiver::update() {
-	this->remote_channel->lock.lock();
-
-	if( this->remote_channel->message_queue.count() > 0 ) {
-		if( this->remote_channel->message_queue[0]->uid >= this->last_seen_uid ) {
-			unsigned int first_new = 0;
-			for(unsigned int i=1;i<this->remote_channel->message_queue.count();i++) {
-				if( this->remote_channel->message_queue[i]->uid <= this->last_seen_uid ) {
-					first_new = i-1;
-					break;
-				}
-			}
-
-			this->last_seen_uid = this->remote_channel->message_queue[0]->uid;
-			vector< unsigned int > to_delete;
-
-			for(unsigned int i=0;i<=first_new;i++) {
-				message *msg = new message( this->remote_channel->message_queue[i] );
-				this->remote_channel->message_queue[i]->n_receivers--;
-				if( this->remote_channel->message_queue[i]->n_receivers == 0 ) {
-					to_delete.add_end(i);
-				}
-				this->queue.add_end(msg);
-			}
-
-			unsigned int offset = 0;
-			for(unsigned int i=0;i<to_delete.count();i++) {
-				message *msg = this->remote_channel->message_queue.remove(to_delete[i-offset]);
-				delete msg;
-				offset++;
+	if( this->cursor.get() == NULL ) {
+		return false;
+	}
+	channel* ch = this->remote_channel;
+	channel_cursor* cur = this->cursor;
+	uint32_t mask = ch->ring_size - 1;
+	bool got = false;
+
+	rcu_read_lock();
+	while( true ) {
+		uint32_t pos = cur->pos;
+		channel_slot* slot = &ch->ring[pos & mask];
+		uint32_t seq = slot->seq;
+		asm volatile("" : : : "memory");
+
+		if( seq == pos+1 ) {
+			message* msg = slot->msg;
+			asm volatile("" : : : "memory");
+			if( slot->seq != seq ) {
+				continue; // overwritten while we were looking
 			}
-
-			this->remote_channel->lock.unlock();
-
-			this->sort();
-
-			return true;
+			this->queue.add_end( new message( msg ) );
+			cur->pos = pos+1;
+			got = true;
+		} else if( (int32_t)(seq - (pos+1)) > 0 ) {
+			// the slot has moved on by at least one lap (drop_oldest): skip to the oldest message that could still be there
+			uint32_t oldest = seq - ch->ring_size;
+			cur->dropped += oldest - pos;
+			cur->pos = oldest;
+		} else {
+			break; // not published yet
 		}
 	}
+	rcu_read_unlock();
 
-	this->remote_channel->lock.unlock();
-	return false;
+	if( got && !ch->space_waiters.empty() ) {
+		ch->space_waiters.wake_all();
+	}
+	return got;
+}
+
+// Whether there's anything left to read, without taking it.
+bool channel_receiver::pending() {
+	if( this->queue.count() > 0 ) {
+		return true;
+	}
+	if( this->cursor.get() == NULL ) {
+		return false;
+	}
+	channel* ch = this->remote_channel;
+	uint32_t pos = this->cursor->pos;
+	uint32_t seq = ch->ring[pos & (ch->ring_size-1)].seq;
+	return ((int32_t)(seq - (pos+1)) >= 0); // published, or lapped (there's still something newer)
 }
 
 void channel_receiver::wait() {
 	while(true) {
+		uint64_t last_sent = this->channel_uid();
 		if( this->update() ) {
 			//kprintf("messaging: update got something\n");
 			break;
@@ -215,34 +337,156 @@ void channel_receiver::wait() {
 			break;
 		}
 		//kprintf("messaging: nothing here, going to sleep now\n");
-		process_sleep();
+		// (if anything got sent after we looked, don't go to sleep)
+		this->remote_channel->waiters.prepare_to_wait();
+		if( this->channel_uid() == last_sent ) {
+			process_switch_immediate();
+		}
+		this->remote_channel->waiters.finish_wait();
 	}
 }
 
+static void free_ring_message( rcu_head* head ) {
+	delete rcu_container( head, message, rcu );
+}
+
 void channel::send( message& msg ) {
-	if( this->listeners.count() == 0 ) {
+	if( this->n_receivers == 0 ) {
 		return;
 	}
 
-	this->lock.lock();
+	channel_overflow policy = this->policy;
+	bool can_sleep = multitasking_enabled && (process_current != NULL) && interrupts_enabled();
+	if( (policy == channel_overflow::block) && !can_sleep ) {
+		policy = channel_overflow::drop_newest;
+	}
 
-	msg.uid = this->current_uid++;
-	msg.n_receivers = this->listeners.count();
+	message *m = new message(msg); // (shares msg's payload)
+
+	// Reserve a position and publish the message with interrupts off, so nobody on this CPU can end up
+	// waiting on a sender that was interrupted halfway through.
+	interrupt_status_t int_stat;
+	uint32_t pos;
+	unsigned long long int deadline = 0;
+	while( true ) {
+		int_stat = disable_interrupts();
+		pos = this->head;
+		if( policy == channel_overflow::drop_oldest ) {
+			pos = __sync_fetch_and_add( &this->head, 1 );
+			break;
+		}
+		if( ((pos - this->tail_hint) < this->ring_size) || ((pos - this->slowest_cursor()) < this->ring_size) ) {
+			if( __sync_bool_compare_and_swap( &this->head, pos, pos+1 ) ) {
+				break;
+			}
+			restore_interrupts(int_stat);
+			continue;
+		}
+		restore_interrupts(int_stat);
 
-	message *m = new message(msg);
+		// the ring is full
+		if( policy == channel_overflow::drop_newest ) {
+			__sync_fetch_and_add( &this->dropped, 1 );
+			delete m;
+			return;
+		}
+		unsigned long long int now = get_sys_time_counter();
+		if( deadline == 0 ) {
+			deadline = now + CHANNEL_BLOCK_TIMEOUT;
+		} else if( now >= deadline ) {
+			policy = channel_overflow::drop_oldest; // somebody has stopped reading; run them over
+			continue;
+		}
+		this->space_waiters.prepare_to_wait();
+		if( (this->head - this->slowest_cursor()) >= this->ring_size ) {
+			process_set_timeout( process_current, deadline );
+			process_switch_immediate();
+			process_clear_timeout( process_current );
+		}
+		this->space_waiters.finish_wait();
+	}
 
-	this->message_queue.add( m );
+	m->uid = pos;
+	m->n_receivers = this->n_receivers;
 
-	for(unsigned int i=0;i<this->listeners.count();i++) {
-		process_wake(this->listeners[i]);
+	channel_slot* slot = &this->ring[pos & (this->ring_size-1)];
+	uint32_t prev_lap = pos - this->ring_size;
+	while( slot->seq != prev_lap+1 ) {
+		asm volatile("pause" : : : "memory"); // another CPU is still publishing the previous lap's message here
 	}
+	slot->seq = prev_lap; // (matches nobody while we swap the message in)
+	asm volatile("" : : : "memory");
+	message* old = slot->msg;
+	slot->msg = m;
+	asm volatile("" : : : "memory");
+	slot->seq = pos+1;
+
+	__sync_fetch_and_add( &this->current_uid, 1 );
+	this->sent++;
+	restore_interrupts(int_stat);
+
+	if( old != NULL ) {
+		call_rcu( &old->rcu, &free_ring_message );
+	}
+	this->waiters.wake_all();
+	this->post_events();
+}
 
-	this->lock.unlock();
+void channel::post_events() {
+	if( this->watches == NULL ) {
+		return;
+	}
+	this->cursors_lock.lock();
+	for( event_watch* w = this->watches; w != NULL; w = w->next_in_source ) {
+		w->set->post( w );
+	}
+	this->cursors_lock.unlock();
 }
 
-channel_receiver listen_to_channel( char* channel_name ) {
-	channel* ch = channels[ channel_name ];
+static void free_channel_table( rcu_head* head ) {
+	kfree( (void*)rcu_container( head, channel_table, rcu ) );
+}
+
+channel* get_channel( channel_handle handle ) {
+	channel* ret = NULL;
+	rcu_read_lock();
+	channel_table* table = channels;
+	if( (table != NULL) && (handle != CHANNEL_INVALID_HANDLE) && (handle < table->size) ) {
+		ret = table->entries[handle];
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+channel_handle get_channel_handle( char* channel_name ) {
+	channels_lock.read_lock();
+	channel_handle ret = channel_names[ channel_name ];
+	channels_lock.read_unlock();
+	return ret;
+}
 
+channel_receiver listen_to_channel( channel_handle handle ) {
+	channel* ch = get_channel( handle );
+	if(ch == NULL) {
+		kprintf("messaging: Process %u attempted to listen to a nonexistent channel (handle %u).\n", process_current->id, handle);
+	}
+
+	channel_receiver recv(ch);
+	return recv;
+}
+
+void send_to_channel( channel_handle handle, message& msg ) {
+	channel* ch = get_channel( handle );
+	if(ch == NULL) {
+		kprintf("messaging: Process %u attempted to send to a nonexistent channel (handle %u).\n", process_current->id, handle);
+		return;
+	}
+
+	ch->send( msg );
+}
+
+channel_receiver listen_to_channel( char* channel_name ) {
+	channel* ch = get_channel( get_channel_handle( channel_name ) );
 	if(ch == NULL) {
 		kprintf("messaging: Process %u attempted to listen to a nonexistent channel %s.\n", process_current->id, channel_name);
 	}
@@ -252,8 +496,7 @@ channel_receiver listen_to_channel( char* channel_name ) {
 }
 
 void send_to_channel( char* channel_name, message& msg ) {
-	channel* ch = channels[ channel_name ];
-
+	channel* ch = get_channel( get_channel_handle( channel_name ) );
 	if(ch == NULL) {
 		kprintf("messaging: Process %u attempted to send to a nonexistent channel %s.\n", process_current->id, channel_name);
 		return;
@@ -262,38 +505,296 @@ void send_to_channel( char* channel_name, message& msg ) {
 	ch->send( msg );
 }
 
-void register_channel( char* channel_name ) {
-	channel *ch = new channel;
-	channels.set(channel_name, ch);
+channel_handle register_channel( char* channel_name, channel_overflow policy, unsigned int ring_size ) {
+	channels_lock.write_lock();
+	channel_handle handle;
+	if( channel_names.lookup( channel_name, &handle ) ) {
+		channels_lock.write_unlock();
+		return handle;
+	}
+
+	handle = ++n_channels;
+	channel_table* table = channels;
+	if( (table == NULL) || (handle >= table->size) ) {
+		uint32_t size = ((table == NULL) ? 16 : (table->size * 2));
+		channel_table* grown = (channel_table*)kmalloc( sizeof(channel_table) + (size * sizeof(channel*)) );
+		if( grown == NULL ) {
+			panic("messaging: could not allocate channel table!\n");
+		}
+		grown->size = size;
+		for(unsigned int i=0;i<size;i++) {
+			grown->entries[i] = (((table != NULL) && (i < table->size)) ? table->entries[i] : NULL);
+		}
+		asm volatile("" : : : "memory");
+		channels = grown;
+		if( table != NULL ) {
+			call_rcu( &table->rcu, &free_channel_table );
+		}
+		table = grown;
+	}
+	table->entries[handle] = new channel( ring_size, policy );
+
+	// the table keeps its own copy of the name
+	char* name = (char*)kmalloc( strlen(channel_name)+1 );
+	strcpy( name, channel_name );
+	channel_names.set( name, handle );
+
+	channels_lock.write_unlock();
+	return handle;
 }
 
 unsigned int wait_multiple( unsigned int n_receivers, channel_receiver* recv_1, ... ) {
 	vector< channel_receiver* > recv_list;
+	event_set* set = new event_set; // (senders post to it, so it can't be on our stack)
 	va_list args;
 	va_start(args, recv_1);
 
 	recv_list.add_end(recv_1);
+	set->add( recv_1, 0 );
 
 	for(unsigned int i=1;i<n_receivers;i++) {
 		channel_receiver* t = va_arg(args, channel_receiver*);
 		recv_list.add_end(t);
+		set->add( t, i );
 	}
+	va_end(args);
 
-	while(true) {
-		for(unsigned int i=0;i<n_receivers;i++) {
-			if( recv_list[i]->update() ) {
-				va_end(args);
-				return i;
-			}
+	uint32_t ret = 0;
+	set->wait( &ret, 1 );
+	delete set;
+	recv_list[ret]->update();
+	return ret;
+}
 
-			if( recv_list[i]->queue.count() > 0 ) {
-				va_end(args);
-				return i;
+// Takes watch off the ready list; the set must be locked.
+static void event_unlink_ready( event_set* set, event_watch* watch ) {
+	event_watch* prev = NULL;
+	for( event_watch* w = set->ready_head; w != NULL; w = w->next_ready ) {
+		if( w == watch ) {
+			if( prev == NULL ) {
+				set->ready_head = w->next_ready;
+			} else {
+				prev->next_ready = w->next_ready;
+			}
+			if( set->ready_tail == w ) {
+				set->ready_tail = prev;
 			}
+			break;
 		}
+		prev = w;
+	}
+	watch->next_ready = NULL;
+	watch->ready = false;
+}
 
-		process_sleep();
+// The set must be locked.
+static void event_push_ready( event_set* set, event_watch* watch ) {
+	watch->ready = true;
+	watch->next_ready = NULL;
+	if( set->ready_tail == NULL ) {
+		set->ready_head = watch;
+	} else {
+		set->ready_tail->next_ready = watch;
+	}
+	set->ready_tail = watch;
+}
+
+event_set::~event_set() {
+	while( this->watches != NULL ) {
+		this->remove_watch( this->watches );
 	}
+}
+
+static event_watch* event_new_watch( event_set* set, uint32_t id, event_trigger trigger ) {
+	event_watch* watch = new event_watch;
+	watch->set = set;
+	watch->id = id;
+	watch->trigger = trigger;
+	return watch;
+}
+
+// Both lists have to be locked (the source's first).
+static void event_link( event_set* set, event_watch** source_list, event_watch* watch ) {
+	watch->next_in_source = *source_list;
+	*source_list = watch;
+	watch->next_in_set = set->watches;
+	set->watches = watch;
+}
+
+static bool event_watch_pending( event_watch* watch ) {
+	if( watch->recv != NULL ) {
+		return watch->recv->pending();
+	}
+	return watch->pipe->poll_readable();
+}
+
+void event_set::add( channel_receiver* recv, uint32_t id, event_trigger trigger ) {
+	channel* ch = recv->remote();
+	if( ch == NULL ) {
+		return;
+	}
+	event_watch* watch = event_new_watch( this, id, trigger );
+	watch->recv = recv;
+
+	ch->cursors_lock.lock();
+	this->lock.lock();
+	event_link( this, &ch->watches, watch );
+	this->lock.unlock();
+	ch->cursors_lock.unlock();
+
+	// anything that came in before we started watching counts as one edge
+	if( event_watch_pending( watch ) ) {
+		this->post( watch );
+	}
+}
+
+void event_set::add( kpipe* pipe, uint32_t id, event_trigger trigger ) {
+	event_watch* watch = event_new_watch( this, id, trigger );
+	watch->pipe = pipe;
+
+	pipe->lock.lock();
+	this->lock.lock();
+	event_link( this, &pipe->watches, watch );
+	this->lock.unlock();
+	pipe->lock.unlock();
 
-	return 0;
+	if( event_watch_pending( watch ) ) {
+		this->post( watch );
+	}
+}
+
+void event_set::remove( channel_receiver* recv ) {
+	for( event_watch* w = this->watches; w != NULL; w = w->next_in_set ) {
+		if( w->recv == recv ) {
+			return this->remove_watch( w );
+		}
+	}
+}
+
+void event_set::remove( kpipe* pipe ) {
+	for( event_watch* w = this->watches; w != NULL; w = w->next_in_set ) {
+		if( w->pipe == pipe ) {
+			return this->remove_watch( w );
+		}
+	}
+}
+
+void event_set::remove_watch( event_watch* watch ) {
+	spinlock* source_lock;
+	event_watch** source_list;
+	if( watch->recv != NULL ) {
+		source_lock = &watch->recv->remote()->cursors_lock;
+		source_list = &watch->recv->remote()->watches;
+	} else {
+		source_lock = &watch->pipe->lock;
+		source_list = &watch->pipe->watches;
+	}
+
+	source_lock->lock();
+	this->lock.lock();
+
+	for( event_watch** cur = &this->watches; *cur != NULL; cur = &(*cur)->next_in_set ) {
+		if( *cur == watch ) {
+			*cur = watch->next_in_set;
+			break;
+		}
+	}
+	for( event_watch** cur = source_list; *cur != NULL; cur = &(*cur)->next_in_source ) {
+		if( *cur == watch ) {
+			*cur = watch->next_in_source;
+			break;
+		}
+	}
+	if( watch->ready ) {
+		event_unlink_ready( this, watch );
+	}
+
+	this->lock.unlock();
+	source_lock->unlock();
+
+	// (posters only reach watches through the source's list, under its lock)
+	delete watch;
+}
+
+// Called by senders (with the channel's cursors_lock, or the pipe's lock, held).
+void event_set::post( event_watch* watch ) {
+	this->lock.lock();
+	if( !watch->ready ) {
+		event_push_ready( this, watch );
+	}
+	this->lock.unlock();
+
+	if( !this->waiters.empty() ) {
+		this->waiters.wake_all();
+	}
+}
+
+unsigned int event_set::wait( uint32_t* ready_ids, unsigned int max, unsigned int timeout_ms ) {
+	unsigned long long int deadline = get_sys_time_counter() + timeout_ms;
+	if( max == 0 ) {
+		return 0;
+	}
+	event_watch** batch = new event_watch*[max];
+
+	while( true ) {
+		this->lock.lock();
+
+		// Take up to max watches off the front of the ready list. Once they're off (and not ready),
+		// a post() during the check below just queues them again, so nothing is missed.
+		unsigned int n_batch = 0;
+		while( (this->ready_head != NULL) && (n_batch < max) ) {
+			event_watch* w = this->ready_head;
+			this->ready_head = w->next_ready;
+			if( this->ready_head == NULL ) {
+				this->ready_tail = NULL;
+			}
+			w->ready = false;
+			w->next_ready = NULL;
+			batch[n_batch++] = w;
+		}
+
+		if( n_batch == 0 ) {
+			// nothing's ready: sleep until a sender posts to us (post() needs our lock, so nothing is missed)
+			if( timeout_ms == EVENT_WAIT_FOREVER ) {
+				this->waiters.wait( &this->lock );
+			} else {
+				unsigned long long int now = get_sys_time_counter();
+				if( (timeout_ms == 0) || (now >= deadline) ) {
+					this->lock.unlock();
+					delete[] batch;
+					return 0;
+				}
+				this->waiters.wait_timeout( (unsigned int)(deadline - now), &this->lock );
+			}
+			continue;
+		}
+		this->lock.unlock();
+
+		// Checking a source can take its lock, which comes before ours (see message.h), so do it unlocked.
+		// Level-triggered watches that have nothing left to read are dropped.
+		unsigned int n = 0;
+		for( unsigned int i=0;i<n_batch;i++ ) {
+			event_watch* w = batch[i];
+			if( (w->trigger == event_trigger::level) && !event_watch_pending( w ) ) {
+				continue;
+			}
+			batch[n] = w;
+			ready_ids[n++] = w->id;
+		}
+
+		// level-triggered watches that still have something to read go back on the end
+		// (so one busy channel doesn't starve the others)
+		this->lock.lock();
+		for( unsigned int i=0;i<n;i++ ) {
+			if( (batch[i]->trigger == event_trigger::level) && !batch[i]->ready ) {
+				event_push_ready( this, batch[i] );
+			}
+		}
+		this->lock.unlock();
+
+		if( n > 0 ) {
+			delete[] batch;
+			return n;
+		}
+	}
 }
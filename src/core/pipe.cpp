@@ -0,0 +1,246 @@
+// pipe.cpp -- kernel pipes
+// head and tail only ever increase (mod 2^32); head - tail is how much is buffered. Only the writer
+// moves head and only the reader moves tail, so the copies themselves happen without the spinlock
+// held -- it only covers the counters, the closed flags and the wait queues.
+
+#include "includes.h"
+#include "core/pipe.h"
+#include "core/paging.h"
+
+kpipe* kpipe::create( unsigned int n_pages ) {
+    if( n_pages == 0 ) {
+        return NULL;
+    }
+    // (a power of 2, so the counters wrapping around at 2^32 don't throw the ring offsets off)
+    while( (n_pages & (n_pages-1)) != 0 ) {
+        n_pages = (n_pages | (n_pages-1)) + 1;
+    }
+    kpipe* p = new kpipe;
+    p->n_pages = n_pages;
+    p->frames = (phys_addr_t*)kmalloc( sizeof(phys_addr_t) * n_pages );
+    p->buf = (uint8_t*)k_vmem_alloc( n_pages * 2 );
+    if( (p->frames == NULL) || (p->buf == NULL) ) {
+        delete p;
+        return NULL;
+    }
+
+    for(unsigned int i=0;i<n_pages;i++) {
+        page_frame* frame = pageframe_allocate(1);
+        if( frame == NULL ) {
+            delete p;
+            return NULL;
+        }
+        p->frames[i] = frame->address;
+        kfree( (char*)frame );
+        p->n_frames++;
+
+        paging_set_pte( (virt_addr_t)p->buf + (i*0x1000), p->frames[i], 0 );
+        paging_set_pte( (virt_addr_t)p->buf + ((n_pages+i)*0x1000), p->frames[i], 0 ); // the mirror
+    }
+    p->capacity = n_pages * 0x1000;
+    return p;
+}
+
+kpipe::~kpipe() {
+    for(unsigned int i=0;i<this->n_frames;i++) {
+        paging_unset_pte( (virt_addr_t)this->buf + (i*0x1000) );
+        paging_unset_pte( (virt_addr_t)this->buf + ((this->n_pages+i)*0x1000) );
+        pageframe_deallocate_specific( pageframe_get_block_from_addr( this->frames[i] ), 0 );
+    }
+    if( this->buf != NULL ) {
+        k_vmem_free( (virt_addr_t)this->buf );
+    }
+    if( this->frames != NULL ) {
+        kfree( (void*)this->frames );
+    }
+}
+
+// lock must be held.
+void kpipe::post_events() {
+    for( event_watch* w = this->watches; w != NULL; w = w->next_in_source ) {
+        w->set->post( w );
+    }
+}
+
+// Wait until want bytes can be read (or the write side is closed); returns how many can be.
+uint32_t kpipe::wait_for_data( uint32_t want, bool block ) {
+    this->lock.lock();
+    while( block && (this->readable() < want) && !this->write_closed ) {
+        this->readers.wait( &this->lock );
+        this->lock.lock();
+    }
+    uint32_t ret = this->readable();
+    this->lock.unlock();
+    return ret;
+}
+
+// Wait until there's room for want bytes; returns how much room there is (0 if the read side is closed).
+uint32_t kpipe::wait_for_room( uint32_t want, bool block ) {
+    this->lock.lock();
+    while( block && ((this->capacity - this->readable()) < want) && !this->read_closed ) {
+        this->writers.wait( &this->lock );
+        this->lock.lock();
+    }
+    uint32_t ret = (this->read_closed ? 0 : (this->capacity - this->readable()));
+    this->lock.unlock();
+    return ret;
+}
+
+void kpipe::produced( uint32_t n ) {
+    asm volatile("" : : : "memory"); // (the data has to be in before the reader can see it)
+    this->lock.lock();
+    this->head += n;
+    this->post_events();
+    this->lock.unlock();
+    this->readers.wake_all();
+}
+
+void kpipe::consumed( uint32_t n ) {
+    this->lock.lock();
+    this->tail += n;
+    this->lock.unlock();
+    this->writers.wake_all();
+}
+
+size_t kpipe::read( void* out, size_t len, bool block ) {
+    this->read_lock.lock();
+    uint32_t n = this->wait_for_data( 1, block );
+    if( n > len ) {
+        n = len;
+    }
+    if( n > 0 ) {
+        memcpy( out, (void*)(this->buf + (this->tail % this->capacity)), n );
+        this->consumed( n );
+    }
+    this->read_lock.unlock();
+    return n;
+}
+
+size_t kpipe::write( void* data, size_t len, bool block ) {
+    this->write_lock.lock();
+    size_t done = 0;
+    while( done < len ) {
+        uint32_t n = this->wait_for_room( 1, block );
+        if( n == 0 ) {
+            break; // nobody's reading anymore (or we'd have to wait)
+        }
+        if( n > (len - done) ) {
+            n = len - done;
+        }
+        memcpy( (void*)(this->buf + (this->head % this->capacity)), (void*)((uint8_t*)data + done), n );
+        this->produced( n );
+        done += n;
+    }
+    this->write_lock.unlock();
+    return done;
+}
+
+void kpipe::close_read() {
+    this->lock.lock();
+    this->read_closed = true;
+    this->lock.unlock();
+    this->writers.wake_all();
+}
+
+void kpipe::close_write() {
+    this->lock.lock();
+    this->write_closed = true;
+    this->post_events(); // (end of file is something to read, too)
+    this->lock.unlock();
+    this->readers.wake_all();
+}
+
+// Files are written as a whole, so this moves at most capacity bytes.
+vfs::vfs_status kpipe::splice_to_file( unsigned char* path, size_t len, size_t* moved ) {
+    if( len > this->capacity ) {
+        len = this->capacity;
+    }
+    this->read_lock.lock();
+    uint32_t n = this->wait_for_data( len, true );
+    if( n > len ) {
+        n = len;
+    }
+    // thanks to the mirror mapping, n bytes from tail are contiguous no matter where tail is
+    vfs::vfs_status stat = vfs::write_file( path, (void*)(this->buf + (this->tail % this->capacity)), n );
+    if( stat == vfs::vfs_status::ok ) {
+        this->consumed( n );
+    } else {
+        n = 0;
+    }
+    this->read_lock.unlock();
+
+    if( moved != NULL ) {
+        *moved = n;
+    }
+    return stat;
+}
+
+// Read path into buf if it's no bigger than max (or just get its size, with buf NULL); *size gets the
+// size either way. tree_lock keeps the file from changing between the check and the read.
+static vfs::vfs_status kpipe_read_file( unsigned char* path, void* buf, size_t max, size_t* size ) {
+    vfs_node* node;
+    vfs::tree_lock.read_lock();
+    rcu_read_lock();
+    vfs::vfs_status stat = vfs::lookup_node( path, &node );
+    if( (stat == vfs::vfs_status::ok) && (node->type != vfs_node_types::file) ) {
+        stat = vfs::vfs_status::incorrect_type;
+    }
+    if( stat == vfs::vfs_status::ok ) {
+        *size = ((vfs_file*)node)->size;
+        if( (buf != NULL) && (*size <= max) ) {
+            node->fs->read_file( (vfs_file*)node, buf );
+        }
+    }
+    rcu_read_unlock();
+    vfs::tree_lock.read_unlock();
+    return stat;
+}
+
+// If the file grows past what was set aside for it between looking at it and reading it, we just go
+// around again with the new size.
+vfs::vfs_status kpipe::splice_from_file( unsigned char* path, size_t* moved ) {
+    size_t size = 0;
+    size_t n = 0;
+    vfs::vfs_status stat = kpipe_read_file( path, NULL, 0, &size );
+
+    this->write_lock.lock();
+    while( stat == vfs::vfs_status::ok ) {
+        if( size <= this->capacity ) {
+            // have the filesystem read straight into the ring
+            uint32_t room = this->wait_for_room( size, true );
+            if( room < size ) {
+                stat = vfs::vfs_status::unknown_error; // the read side is closed
+                break;
+            }
+            stat = kpipe_read_file( path, (void*)(this->buf + (this->head % this->capacity)), room, &size );
+            if( (stat == vfs::vfs_status::ok) && (size <= room) ) {
+                this->produced( size );
+                n = size;
+                break;
+            }
+        } else {
+            // too big to go in all at once: it has to be staged somewhere while the reader catches up
+            size_t max = size;
+            void* tmp = kmalloc( max );
+            if( tmp == NULL ) {
+                stat = vfs::vfs_status::unknown_error;
+                break;
+            }
+            stat = kpipe_read_file( path, tmp, max, &size );
+            bool fit = (size <= max);
+            if( (stat == vfs::vfs_status::ok) && fit ) {
+                n = this->write( tmp, size ); // (write_lock is reentrant)
+            }
+            kfree( tmp );
+            if( fit ) {
+                break;
+            }
+        }
+    }
+    this->write_lock.unlock();
+
+    if( moved != NULL ) {
+        *moved = n;
+    }
+    return stat;
+}
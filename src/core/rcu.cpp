@@ -0,0 +1,170 @@
+// rcu.cpp -- epoch-based deferred reclamation ("RCU-lite")
+// Readers announce themselves by bumping a counter for the current epoch (there are only two, by parity).
+// A grace period starts by flipping the epoch, so new readers count against the other parity, and ends once
+// every reader that started under the old epoch has left -- that's checked on every context switch and timer tick.
+// Callbacks queued through call_rcu() are run by the rcu kernel thread once a grace period has passed.
+
+#include "includes.h"
+#include "core/rcu.h"
+#include "core/scheduler.h"
+#include "lib/sync.h"
+
+static volatile uint32_t rcu_epoch = 0;
+static volatile uint32_t rcu_readers[2] = { 0, 0 };
+
+static bool rcu_gp_active = false;
+static uint32_t rcu_gp_parity = 0;      // parity of the epoch the current grace period is waiting out
+static volatile uint32_t rcu_gp_completed = 0;
+static uint32_t rcu_gp_requested = 0;
+static wait_queue rcu_gp_waiters;
+
+static rcu_head* rcu_cb_head = NULL;
+static rcu_head* rcu_cb_tail = NULL;
+static wait_queue rcu_cb_waiters;
+static process* rcu_thread = NULL;
+
+void rcu_read_lock() {
+    if( process_current == NULL ) {
+        return;
+    }
+    interrupt_status_t int_stat = disable_interrupts();
+    if( process_current->rcu_nesting++ == 0 ) {
+        process_current->rcu_parity = rcu_epoch & 1;
+        rcu_readers[ process_current->rcu_parity ]++;
+    }
+    restore_interrupts(int_stat);
+}
+
+void rcu_read_unlock() {
+    if( process_current == NULL ) {
+        return;
+    }
+    interrupt_status_t int_stat = disable_interrupts();
+    if( process_current->rcu_nesting > 0 ) {
+        if( --process_current->rcu_nesting == 0 ) {
+            rcu_readers[ process_current->rcu_parity ]--;
+        }
+    }
+    restore_interrupts(int_stat);
+}
+
+// Interrupts must be off.
+static void rcu_start_gp() {
+    rcu_gp_parity = rcu_epoch & 1;
+    rcu_epoch = rcu_epoch + 1;
+    rcu_gp_active = true;
+}
+
+// Returns the grace period number the caller has to wait for.
+static uint32_t rcu_request_gp() {
+    interrupt_status_t int_stat = disable_interrupts();
+    uint32_t target;
+    if( rcu_gp_active ) {
+        // readers that started before now may have started under the new epoch, so wait for the next one too
+        target = rcu_gp_completed + 2;
+    } else {
+        target = rcu_gp_completed + 1;
+        rcu_start_gp();
+    }
+    if( (int32_t)(target - rcu_gp_requested) > 0 ) {
+        rcu_gp_requested = target;
+    }
+    restore_interrupts(int_stat);
+    return target;
+}
+
+// Called on every context switch (from switch_to) and timer tick, with interrupts off.
+void rcu_note_context_switch() {
+    if( !rcu_gp_active || (rcu_readers[ rcu_gp_parity ] != 0) ) {
+        return;
+    }
+    rcu_gp_active = false;
+    rcu_gp_completed = rcu_gp_completed + 1;
+    if( (int32_t)(rcu_gp_requested - rcu_gp_completed) > 0 ) {
+        rcu_start_gp();
+    }
+    rcu_gp_waiters.wake_all();
+}
+
+void rcu_process_exit( process* proc ) {
+    interrupt_status_t int_stat = disable_interrupts();
+    if( proc->rcu_nesting > 0 ) {
+        proc->rcu_nesting = 0;
+        rcu_readers[ proc->rcu_parity ]--;
+    }
+    restore_interrupts(int_stat);
+}
+
+void synchronize_rcu() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return; // nobody else can be reading
+    }
+    if( process_current->rcu_nesting > 0 ) {
+        panic("rcu: synchronize_rcu() called from within a read-side section!\n");
+    }
+
+    uint32_t target = rcu_request_gp();
+    while( true ) {
+        rcu_gp_waiters.prepare_to_wait();
+
+        interrupt_status_t int_stat = disable_interrupts();
+        rcu_note_context_switch(); // (we might already be done)
+        restore_interrupts(int_stat);
+
+        if( (int32_t)(rcu_gp_completed - target) >= 0 ) {
+            break;
+        }
+        process_switch_immediate();
+    }
+    rcu_gp_waiters.finish_wait();
+}
+
+void call_rcu( rcu_head* head, void (*func)( rcu_head* ) ) {
+    head->func = func;
+    head->next = NULL;
+
+    interrupt_status_t int_stat = disable_interrupts();
+    if( rcu_cb_tail == NULL ) {
+        rcu_cb_head = head;
+    } else {
+        rcu_cb_tail->next = head;
+    }
+    rcu_cb_tail = head;
+    restore_interrupts(int_stat);
+
+    if( rcu_thread != NULL ) {
+        rcu_cb_waiters.wake_one();
+    }
+}
+
+static void rcu_thread_func() {
+    while( true ) {
+        while( true ) {
+            rcu_cb_waiters.prepare_to_wait();
+            if( rcu_cb_head != NULL )
+                break;
+            process_switch_immediate();
+        }
+        rcu_cb_waiters.finish_wait();
+
+        // take everything queued so far; anything queued after this waits for the next round.
+        interrupt_status_t int_stat = disable_interrupts();
+        rcu_head* list = rcu_cb_head;
+        rcu_cb_head = NULL;
+        rcu_cb_tail = NULL;
+        restore_interrupts(int_stat);
+
+        synchronize_rcu();
+
+        while( list != NULL ) {
+            rcu_head* next = list->next;
+            list->func( list );
+            list = next;
+        }
+    }
+}
+
+void rcu_initialize() {
+    rcu_thread = kthread_create( (size_t)&rcu_thread_func, 1, "rcu" );
+    spawn_process( rcu_thread );
+}
@@ -0,0 +1,71 @@
+/*
+ * kthread.cpp
+ *
+ * Kernel threads: processes that run entirely in kernel space.
+ * They don't get an address space of their own; they all run on the boot page directory (BootPD),
+ * so switching between them doesn't reload CR3, and their stacks come from a small pool in kernel memory.
+ */
+
+#include "includes.h"
+#include "core/scheduler.h"
+#include "core/paging.h"
+#include "core/rcu.h"
+#include "arch/x86/sys.h"
+
+static vector<virt_addr_t> kthread_stack_pool;
+
+virt_addr_t kthread_stack_allocate() {
+    interrupt_status_t int_stat = disable_interrupts();
+    if( kthread_stack_pool.count() > 0 ) {
+        virt_addr_t stack = kthread_stack_pool.remove_end();
+        restore_interrupts(int_stat);
+        return stack;
+    }
+    restore_interrupts(int_stat);
+
+    virt_addr_t stack = mmap( KTHREAD_STACK_SIZE );
+    if( stack == 0 ) {
+        return 0;
+    }
+
+    // Interrupt frames get pushed onto this stack while BootPD is loaded, and a page fault on the stack itself can't be handled.
+    // So make sure BootPD has the page tables for it up front instead of picking them up lazily.
+    // (BootPD is identity-mapped through PDE 0 in every address space.)
+    uint32_t* boot_pd = (uint32_t*)&BootPD;
+    for( unsigned int pde = (stack >> 22); pde <= ((stack + (KTHREAD_STACK_SIZE*0x1000) - 1) >> 22); pde++ ) {
+        boot_pd[pde] = global_kernel_page_directory[pde-768];
+    }
+
+    return stack;
+}
+
+void kthread_stack_free( virt_addr_t stack ) {
+    interrupt_status_t int_stat = disable_interrupts();
+    if( kthread_stack_pool.count() < KTHREAD_STACK_POOL_SIZE ) {
+        kthread_stack_pool.add_end( stack );
+        restore_interrupts(int_stat);
+        return;
+    }
+    restore_interrupts(int_stat);
+    munmap( stack, KTHREAD_STACK_SIZE );
+}
+
+static void kthread_stack_free_rcu( rcu_head* head ) {
+    kthread_stack_free( (virt_addr_t)head );
+}
+
+// For a thread that's going away. It may still be running on the stack (a dead thread can be deleted by the
+// scheduler on its way out), so the stack is only freed once a grace period -- and so a context switch -- has
+// gone by. The rcu_head lives at the bottom of the stack, which the thread won't be using by then.
+void kthread_stack_release( virt_addr_t stack ) {
+    call_rcu( (rcu_head*)stack, &kthread_stack_free_rcu );
+}
+
+// Like new process(...), the returned thread still has to be started with spawn_process().
+process* kthread_create( virt_addr_t entry_point, int priority, const char* name, void* args, int n_args ) {
+    virt_addr_t stack = kthread_stack_allocate();
+    if( stack == 0 ) {
+        return NULL;
+    }
+    return new process( stack, entry_point, priority, name, args, n_args );
+}
@@ -0,0 +1,112 @@
+/*
+ * pid.cpp
+ *
+ * PID allocation and PID -> process lookup.
+ * PIDs come from a bitmap with a next-fit cursor (so recently freed IDs aren't handed out again right away),
+ * and are mapped to processes through a two-level radix table. Lookups don't take any locks:
+ * leaf nodes are never freed once allocated, and slots are updated with single aligned stores.
+ * A process found through get_process_by_pid() stays allocated until the caller's rcu_read_unlock()
+ * (see process::operator delete), though it may already have been destroyed (check its state).
+ */
+
+#include "includes.h"
+#include "core/scheduler.h"
+#include "lib/sync.h"
+
+// 0 is reserved for the kernel (in the "parent" field only) and 1 is used for the initial process.
+static uint32_t pid_bitmap[PID_MAX / 32] = { 3 };
+static uint32_t pid_cursor = 0; // PID to start searching from (just past the last one handed out)
+static spinlock pid_lock("pid");
+
+static process** volatile pid_table[PID_TABLE_ROOT_SIZE];
+
+uint32_t allocate_new_pid() {
+    pid_lock.lock();
+
+    // (the cursor's own word comes up twice: first from the cursor on, and last of all in full)
+    uint32_t n_words = PID_MAX / 32;
+    for( uint32_t i=0;i<=n_words;i++ ) {
+        uint32_t word = ((pid_cursor / 32) + i) % n_words;
+        uint32_t free = ~pid_bitmap[word];
+        if( i == 0 ) {
+            free &= (0xFFFFFFFF << (pid_cursor % 32));
+        }
+        if( free != 0 ) {
+            uint32_t bit = __builtin_ctz( free );
+            pid_bitmap[word] |= (1<<bit);
+            uint32_t pid = (word*32)+bit;
+            pid_cursor = (pid + 1) % PID_MAX;
+            pid_lock.unlock();
+            return pid;
+        }
+    }
+
+    pid_lock.unlock();
+    panic("scheduler: out of process IDs!\n");
+    return 0;
+}
+
+void free_pid( uint32_t pid ) {
+    if( (pid <= 1) || (pid >= PID_MAX) )
+        return;
+    pid_lock.lock();
+    pid_bitmap[pid / 32] &= ~(1<<(pid % 32));
+    pid_lock.unlock();
+}
+
+void pid_table_insert( process* proc ) {
+    if( (proc == NULL) || (proc->id >= PID_MAX) )
+        return;
+    uint32_t root = proc->id >> PID_TABLE_LEAF_BITS;
+    uint32_t leaf = proc->id & (PID_TABLE_LEAF_SIZE-1);
+
+    process** node = pid_table[root];
+    if( node == NULL ) {
+        // allocate outside the lock; if someone beats us to it, just use theirs.
+        process** new_node = (process**)kmalloc( sizeof(process*) * PID_TABLE_LEAF_SIZE );
+        if( new_node == NULL )
+            panic("scheduler: could not allocate PID table node!\n");
+        memset( (void*)new_node, 0, sizeof(process*) * PID_TABLE_LEAF_SIZE );
+
+        pid_lock.lock();
+        if( pid_table[root] == NULL ) {
+            pid_table[root] = new_node;
+            new_node = NULL;
+        }
+        node = pid_table[root];
+        pid_lock.unlock();
+
+        if( new_node != NULL )
+            kfree( (void*)new_node );
+    }
+
+    pid_lock.lock();
+    node[leaf] = proc;
+    pid_lock.unlock();
+}
+
+void pid_table_remove( process* proc ) {
+    if( (proc == NULL) || (proc->id >= PID_MAX) )
+        return;
+    process** node = pid_table[ proc->id >> PID_TABLE_LEAF_BITS ];
+    if( node == NULL )
+        return;
+    pid_lock.lock();
+    if( node[ proc->id & (PID_TABLE_LEAF_SIZE-1) ] == proc ) {
+        node[ proc->id & (PID_TABLE_LEAF_SIZE-1) ] = NULL;
+    }
+    pid_lock.unlock();
+}
+
+process* get_process_by_pid( unsigned int pid ) {
+    if( pid >= PID_MAX )
+        return NULL;
+    process** node = pid_table[ pid >> PID_TABLE_LEAF_BITS ];
+    if( node == NULL )
+        return NULL;
+    return ((process* volatile*)node)[ pid & (PID_TABLE_LEAF_SIZE-1) ];
+}
+
+bool is_valid_process( process* proc ) {
+    return (proc != NULL) && (get_process_by_pid( proc->id ) == proc);
+}
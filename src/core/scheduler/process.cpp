@@ -10,23 +10,92 @@
 #include "arch/x86/sys.h"
 #include "arch/x86/table.h"
 #include "arch/x86/multitask.h"
+#include "core/rcu.h"
+#include "core/shm.h"
 
-extern uint32_t allocate_new_pid();
 extern vector<process*> run_queues[SCHEDULER_PRIORITY_LEVELS];
 
+// Copy data onto a process' kernel stack, which doesn't have to be in the current address space.
+static void process_stack_write( process* proc, uint32_t vaddr, void* data, size_t len ) {
+    if( vaddr >= 0xC0000000 ) { // user-mode processes' kernel stacks are in kernel memory
+        memcpy( (void*)vaddr, data, len );
+        return;
+    }
+    uint8_t* src = (uint8_t*)data;
+    size_t tmp_page = k_vmem_alloc(1);
+    if( tmp_page == 0 )
+        panic("multitasking: failed to allocate temporary mapping for process stack!\n");
+    while( len > 0 ) {
+        uint32_t offset = vaddr & 0xFFF;
+        size_t n = 0x1000 - offset;
+        if( n > len )
+            n = len;
+        uint32_t stack_phys_page = proc->address_space.get( vaddr & 0xFFFFF000 ) & 0xFFFFF000;
+        if( stack_phys_page == 0 )
+            panic("multitasking: process stack page is not mapped!\n");
+        paging_set_pte( tmp_page, stack_phys_page, 0 );
+        memcpy( (void*)(tmp_page+offset), (void*)src, n );
+        paging_unset_pte( tmp_page );
+        vaddr += n;
+        src += n;
+        len -= n;
+    }
+    k_vmem_free( tmp_page );
+}
+
+// Set up a process' kernel stack so that switching to it "returns" through __trap_return into the given trap frame.
+// frame_top is the address just past the end of the trap frame.
+static void process_stack_init( process* proc, uint32_t frame_top, trap_frame* frame ) {
+    size_t frame_size = ( (frame->cs & 3) != 0 ) ? sizeof(trap_frame) : TRAP_FRAME_KERNEL_SIZE;
+    uint8_t stack_data[ sizeof(switch_frame) + sizeof(trap_frame) ];
+    switch_frame* sw = (switch_frame*)stack_data;
+    
+    sw->edi = 0;
+    sw->esi = 0;
+    sw->ebx = 0;
+    sw->ebp = 0;
+    sw->eip = (uint32_t)&__trap_return;
+    memcpy( (void*)(stack_data+sizeof(switch_frame)), (void*)frame, frame_size );
+    
+    proc->regs.esp = frame_top - frame_size - sizeof(switch_frame);
+    process_stack_write( proc, proc->regs.esp, (void*)stack_data, frame_size + sizeof(switch_frame) );
+}
+
 int process::wait() {
     if( this->flags & PROCESS_FLAGS_DELETE_ON_EXIT ) {
         this->flags &= ~(PROCESS_FLAGS_DELETE_ON_EXIT);
     }
     while(true) {
+        this->exit_waiters.prepare_to_wait();
         if( this->state == process_state::dead ) {
-            return this->return_value;
+            break;
         }
         process_switch_immediate();
     }
+    this->exit_waiters.finish_wait();
+    return this->return_value;
+}
+
+static void process_free_rcu( rcu_head* head ) {
+    kfree( (void*)head );
+}
+
+void* process::operator new( size_t size ) {
+    return kmalloc( size );
+}
+
+void process::operator delete( void* ptr ) {
+    if( ptr != NULL ) {
+        call_rcu( (rcu_head*)ptr, &process_free_rcu );
+    }
 }
 
 process::~process() {
+    fpu_process_exit( this );
+    process_clear_timeout( this );
+    mutex_pi_process_exit( this );
+    rcu_process_exit( this );
+    shm_process_exit( this );
     if( this->id != 0 ) {
     	this->process_reference_lock.lock(); // keep people from getting references to us
 
@@ -36,16 +105,15 @@ process::~process() {
     		this->process_reflist[i]->invalidate();
     	}
 
-        for( unsigned int i=0;i<system_processes.count();i++ ) {
-            if( (system_processes[i] != NULL) && (system_processes[i]->id == this->id) ) {
-                system_processes.set( i, NULL );
-                break;
-            }
-        }
-        for( unsigned int i=0;i<this->parent->children.count();i++ ) {
-            if( (this->parent->children[i] != NULL) && (this->parent->children[i]->id == this->id) ) {
-                this->parent->children.set( i, NULL );
-                break;
+        pid_table_remove( this );
+        free_pid( this->id );
+
+        if( this->parent != NULL ) {
+            for( unsigned int i=0;i<this->parent->children.count();i++ ) {
+                if( (this->parent->children[i] != NULL) && (this->parent->children[i]->id == this->id) ) {
+                    this->parent->children.set( i, NULL );
+                    break;
+                }
             }
         }
         for( unsigned int i=0;i<run_queues[this->priority].count();i++ ) {
@@ -54,20 +122,21 @@ process::~process() {
             }
         }
 
-        if( process_current->id == this->id ) {
-            this->user_regs.eip = (uint32_t)&__process_execution_complete;
-            this->regs.eip = (uint32_t)&__process_execution_complete; // just in case we happen to come back
-        }
+    }
+    if( this->kthread_stack != 0 ) {
+        kthread_stack_release( this->kthread_stack );
+        this->kthread_stack = 0;
     }
 }
 
 process::process( process* forked_process ) {
-    this->user_regs = forked_process->user_regs;
     this->regs = forked_process->regs;
-    this->priority = forked_process->priority;
+    this->priority = forked_process->base_priority; // (don't inherit any boost)
+    this->base_priority = forked_process->base_priority;
     this->name = forked_process->name;
     this->id = allocate_new_pid();
     this->parent = forked_process;
+    fpu_fork( forked_process, this );
 
     // traverse the process' page directory, and duplicate frames that aren't in PTs 768 or 0.
     // this, coincidentally, also copies the stack.
@@ -122,8 +191,27 @@ process::process( process* forked_process ) {
     this->address_space.map_pde( 768, (size_t)&PageTable768, 1 );
 
     // need to update cr3 to point to our new PD.
-    this->user_regs.cr3 = this->address_space.page_directory_physical;
     this->regs.cr3 = this->address_space.page_directory_physical;
+
+    // The child starts out by returning from the parent's fork() call with a return value of 0.
+    // Kernel process stacks were copied along with the rest of the address space above;
+    // user-mode processes need a kernel stack of their own.
+    trap_frame* parent_frame = forked_process->syscall_frame;
+    if( parent_frame == NULL )
+        panic("fork: parent process is not in a system call!\n");
+    trap_frame frame = *parent_frame;
+    frame.eax = 0;
+    uint32_t frame_top = (uint32_t)parent_frame + ( ((frame.cs & 3) != 0) ? sizeof(trap_frame) : TRAP_FRAME_KERNEL_SIZE );
+    if( forked_process->regs.kernel_stack != 0 ) {
+        size_t k_stack_start = mmap(4);
+        if( k_stack_start == 0 ) {
+            panic("fork: failed to allocate kernel stack frames for process!\n");
+        }
+        this->regs.kernel_stack = k_stack_start + (PROCESS_STACK_SIZE*0x1000);
+        frame_top = this->regs.kernel_stack - (forked_process->regs.kernel_stack - frame_top);
+    }
+    process_stack_init( this, frame_top, &frame );
+    pid_table_insert( this );
     //this->message_queue = new vector<message*>;
     //kprintf("process::process - exiting!\n");
 }
@@ -138,37 +226,33 @@ process::process( virt_addr_t entry_point, bool is_usermode, int priority, const
         this->parent = process_current;
         this->state = process_state::runnable;
         this->priority = priority;
+        this->base_priority = priority;
         this->name = name;
-        this->regs.eax = 0;
-        this->regs.ebx = 0;
-        this->regs.ecx = 0;
-        this->regs.edx = 0;
-        this->regs.esi = 0;
-        this->regs.edi = 0;
-        this->regs.eip = entry_point;
-        this->regs.eflags = (1<<9) | (1<<21); // Interrupt Flag and Identification Flag
+        trap_frame frame;
+        memset( (void*)&frame, 0, sizeof(trap_frame) );
+        frame.eip = entry_point;
+        frame.eflags = (1<<9) | (1<<21); // Interrupt Flag and Identification Flag
 
         if( is_usermode ){
             size_t k_stack_start = mmap(4);
-            if( k_stack_start == NULL ) {
+            if( k_stack_start == 0 ) {
                 panic("multitasking: failed to allocate kernel stack frames for process!\n");
             }
 
             this->regs.kernel_stack = k_stack_start + (PROCESS_STACK_SIZE*0x1000);
-            this->regs.cs = GDT_UCODE_SEGMENT*0x08;
-            this->regs.ds = GDT_UDATA_SEGMENT*0x08;
-            this->regs.es = GDT_UDATA_SEGMENT*0x08;
-            this->regs.fs = GDT_UDATA_SEGMENT*0x08;
-            this->regs.gs = GDT_UDATA_SEGMENT*0x08;
-            this->regs.ss = GDT_UDATA_SEGMENT*0x08;
+            frame.cs = (GDT_UCODE_SEGMENT*0x08) | 3;
+            frame.ds = (GDT_UDATA_SEGMENT*0x08) | 3;
+            frame.es = (GDT_UDATA_SEGMENT*0x08) | 3;
+            frame.fs = (GDT_UDATA_SEGMENT*0x08) | 3;
+            frame.gs = (GDT_UDATA_SEGMENT*0x08) | 3;
+            frame.user_ss = (GDT_UDATA_SEGMENT*0x08) | 3;
         } else {
             this->regs.kernel_stack = 0; // don't need to worry about TSS' esp0 / ss0 if this is a kmode process
-            this->regs.cs = GDT_KCODE_SEGMENT*0x08;
-            this->regs.ds = GDT_KDATA_SEGMENT*0x08;
-            this->regs.es = GDT_KDATA_SEGMENT*0x08;
-            this->regs.fs = GDT_KDATA_SEGMENT*0x08;
-            this->regs.gs = GDT_KDATA_SEGMENT*0x08;
-            this->regs.ss = GDT_KDATA_SEGMENT*0x08;
+            frame.cs = GDT_KCODE_SEGMENT*0x08;
+            frame.ds = GDT_KDATA_SEGMENT*0x08;
+            frame.es = GDT_KDATA_SEGMENT*0x08;
+            frame.fs = GDT_KDATA_SEGMENT*0x08;
+            frame.gs = GDT_KDATA_SEGMENT*0x08;
         }
 
         // Each process' stack runs from 0xBFFFFFFF to 0xBFFFC000 -- that's 0x3FFF bytes, or 1 byte shy of 16KB.
@@ -182,21 +266,58 @@ process::process( virt_addr_t entry_point, bool is_usermode, int priority, const
             if(!this->address_space.map_new( ((0xC0000000-1)-(i*0x1000))&0xFFFFF000, 1 ))
                 panic("multitasking: failed to initialize stack frames for process!");
         }
-        uint32_t stack_phys_page = this->address_space.get( 0xBFFFF000 ) & 0xFFFFF000;
-        uint32_t* tmp_stack_page = (uint32_t*)k_vmem_alloc(1);
-        if( stack_phys_page == NULL )
-            panic("multitasking: failed to initialize stack frames!");
-        //kprintf("multitasking: process stack starts at paddr 0x%x.\n", (unsigned long long int)stack_phys_page);
-        paging_set_pte( (size_t)tmp_stack_page, stack_phys_page, 0 );
-        tmp_stack_page[1022] = n_args;
-        tmp_stack_page[1021] = (uint32_t)args;
-        tmp_stack_page[1020] = (uint32_t)&__process_execution_complete;
-        paging_unset_pte( (size_t)tmp_stack_page );
-        this->regs.ebp = 0xBFFFFFF0; // 0xC0000000 - 4 - 4 - 4 - 4
-        this->regs.esp = 0xBFFFFFF0; // 0xC0000000 - 4 - 4 - 4 - 4
+        uint32_t stack_args[3];
+        stack_args[0] = (uint32_t)&__process_execution_complete;
+        stack_args[1] = (uint32_t)args;
+        stack_args[2] = n_args;
+        process_stack_write( this, 0xBFFFFFF0, (void*)stack_args, sizeof(stack_args) );
         this->regs.cr3 = this->address_space.page_directory_physical;
+
+        // the process starts out on its first switch_to() by "returning" from an interrupt to its entry point.
+        frame.ebp = 0xBFFFFFF0; // 0xC0000000 - 4 - 4 - 4 - 4
+        if( is_usermode ) {
+            frame.user_esp = 0xBFFFFFF0;
+            process_stack_init( this, this->regs.kernel_stack, &frame );
+        } else {
+            process_stack_init( this, 0xBFFFFFF0, &frame );
+        }
+        pid_table_insert( this );
         //this->message_queue = new vector<message*>;
     } else {
         panic("multitasking: failed to initialize address space for process!\n");
     }
 }
+
+// Kernel thread constructor (see kthread.cpp).
+// The thread runs on the shared boot page directory and a pooled stack in kernel memory.
+process::process( virt_addr_t kthread_stack, virt_addr_t entry_point, int priority, const char* name, void* args, int n_args ) : address_space(false) {
+    this->id = allocate_new_pid();
+    this->parent = process_current;
+    this->state = process_state::runnable;
+    this->priority = priority;
+    this->base_priority = priority;
+    this->name = name;
+    this->flags = PROCESS_FLAGS_KTHREAD;
+    this->kthread_stack = kthread_stack;
+    this->regs.cr3 = (uint32_t)&BootPD;
+    this->regs.kernel_stack = 0;
+
+    // the stack is in kernel memory, so it can be written to directly.
+    uint32_t* stack_top = (uint32_t*)(kthread_stack + (KTHREAD_STACK_SIZE*0x1000));
+    stack_top[-2] = n_args;
+    stack_top[-3] = (uint32_t)args;
+    stack_top[-4] = (uint32_t)&__process_execution_complete;
+
+    trap_frame frame;
+    memset( (void*)&frame, 0, sizeof(trap_frame) );
+    frame.eip = entry_point;
+    frame.eflags = (1<<9) | (1<<21); // Interrupt Flag and Identification Flag
+    frame.cs = GDT_KCODE_SEGMENT*0x08;
+    frame.ds = GDT_KDATA_SEGMENT*0x08;
+    frame.es = GDT_KDATA_SEGMENT*0x08;
+    frame.fs = GDT_KDATA_SEGMENT*0x08;
+    frame.gs = GDT_KDATA_SEGMENT*0x08;
+    frame.ebp = (uint32_t)&stack_top[-4];
+    process_stack_init( this, (uint32_t)&stack_top[-4], &frame );
+    pid_table_insert( this );
+}
@@ -10,47 +10,13 @@
 #include "arch/x86/sys.h"
 
 process *process_current = NULL;
-vector<process*> system_processes;
-
-uint32_t current_pid = 2; // 0 is reserved for the kernel (in the "parent" field only) and 1 is used for the initial process, which has a special startup sequence.
-bool pids_have_overflowed = false;
 
 vector<process*> run_queues[SCHEDULER_PRIORITY_LEVELS];
-vector<process*> sleep_queue;
-
-uint32_t allocate_new_pid() {
-    uint32_t ret = current_pid++;
-    if( current_pid == 0 ) { // overflow
-        current_pid = 777;
-        pids_have_overflowed = true;
-    }
-    if( pids_have_overflowed ) {
-        bool is_okay = false;
-        while( !is_okay ) {
-            is_okay = true;
-            for( unsigned int i=0;i<system_processes.length();i++ ) {
-                if( (system_processes[i]->id) == ret ) {
-                    ret++;
-                    is_okay = false;
-                    break;
-                }
-            }
-        }
-    }
-    return ret;
-}
-
-process* get_process_by_pid( unsigned int pid ) {
-    for( unsigned int i=0;i<system_processes.length();i++ ) {
-        if( (system_processes[i]) && (system_processes[i]->id == pid) ) {
-            return system_processes[i];
-        }
-    }
-    return NULL;
-}
+vector<process*> sleep_queue; // processes with a wakeup deadline, sorted by deadline
+static process* scheduler_handoff = NULL; // run this next instead of going through the run queues (see process_handoff)
 
 void spawn_process( process* to_add, bool sched_immediate ) {
-    system_processes.add( to_add );
+    // (live processes are found through the PID table, which the constructors already put us in)
     if( sched_immediate )
         process_add_to_runqueue( to_add );
     //kprintf("Starting new process with ID: %u (%s).", (unsigned long long int)to_add->id, to_add->name);
@@ -59,16 +25,14 @@ void spawn_process( process* to_add, bool sched_immediate ) {
 // syscall implementation
 semaphore __debug_fork_sema(1,1);
 uint32_t do_fork() {
-    process* child_process = new process( process_current );
+    if( process_current->flags & PROCESS_FLAGS_KTHREAD ) {
+        return -1; // nothing to copy
+    }
+    process* child_process = new process( process_current ); // the child gets a copy of our syscall frame (see process.cpp)
     if( child_process != NULL ) {
         process_current->children.add_end(child_process);
-        process_current->user_regs.eax = child_process->id;        // so we need to move the new regs over
-        spawn_process( child_process, false );
-        process_add_to_runqueue( process_current );                // schedule ourselves to run later
-        process_current->state = process_state::forking;           // tell the scheduler to load from user_regs
-        child_process->state = process_state::runnable;            // let the child run
-        process_current = child_process;
-        return 0;
+        spawn_process( child_process );                    // the child returns from fork() whenever it first gets scheduled
+        return child_process->id;
     }
     return -1;
 }
@@ -97,17 +61,114 @@ void process_wake(process* proc) {
 	process_add_to_runqueue(proc);
 }
 
-bool is_valid_process( process* proc ) {
-	for(unsigned int i=0;i<system_processes.count();i++) {
-		if( system_processes[i] == proc )
-			return true;
-	}
-	return false;
+// Wake next and switch straight to it, whatever else is waiting to run.
+// The current process gives up the rest of its timeslice (and keeps running later if it's still runnable).
+void process_handoff( process* next ) {
+    if( !multitasking_enabled || (process_current == NULL) || (next == process_current) ) {
+        return;
+    }
+    interrupt_status_t int_stat = disable_interrupts();
+    process_wake( next );
+    scheduler_handoff = next;
+    restore_interrupts(int_stat);
+    process_switch_immediate();
+}
+
+// Change proc's current priority, moving it to the right run queue if it's runnable.
+// (This doesn't touch base_priority; see the priority inheritance code in synchronization.cpp.)
+void process_set_priority( process* proc, int priority ) {
+    if( (priority < 0) || (priority >= SCHEDULER_PRIORITY_LEVELS) ) {
+        return;
+    }
+    interrupt_status_t int_stat = disable_interrupts();
+    if( proc->priority != priority ) {
+        bool queued = false;
+        for( unsigned int i=0;i<run_queues[proc->priority].count();i++ ) {
+            if( run_queues[proc->priority][i] == proc ) {
+                run_queues[proc->priority].remove(i);
+                queued = true;
+                break;
+            }
+        }
+        proc->priority = priority;
+        if( queued ) {
+            run_queues[priority].add_end( proc );
+        }
+    }
+    restore_interrupts(int_stat);
+}
+
+// Wake proc up at the given time (in system timer ms), unless process_clear_timeout() gets called first.
+void process_set_timeout( process* proc, unsigned long long int deadline ) {
+    interrupt_status_t int_stat = disable_interrupts();
+    if( proc->wake_deadline != 0 ) {
+        process_clear_timeout( proc );
+    }
+    proc->wake_deadline = deadline;
+    unsigned int i = 0;
+    for( ;i<sleep_queue.count();i++ ) {
+        if( sleep_queue[i]->wake_deadline > deadline ) {
+            break;
+        }
+    }
+    if( i == sleep_queue.count() ) {
+        sleep_queue.add_end( proc );
+    } else {
+        // vector has no insert(), so shift everything after i up by one
+        sleep_queue.add_end( sleep_queue[sleep_queue.count()-1] );
+        for( unsigned int j=sleep_queue.count()-2;j>i;j-- ) {
+            sleep_queue.set( j, sleep_queue[j-1] );
+        }
+        sleep_queue.set( i, proc );
+    }
+    restore_interrupts(int_stat);
+}
+
+void process_clear_timeout( process* proc ) {
+    interrupt_status_t int_stat = disable_interrupts();
+    if( proc->wake_deadline != 0 ) {
+        for( unsigned int i=0;i<sleep_queue.count();i++ ) {
+            if( sleep_queue[i] == proc ) {
+                sleep_queue.remove(i);
+                break;
+            }
+        }
+        proc->wake_deadline = 0;
+    }
+    restore_interrupts(int_stat);
+}
+
+// Called on every timer tick (see pit.cpp).
+void process_check_timeouts() {
+    if( sleep_queue.count() == 0 ) {
+        return;
+    }
+    unsigned long long int now = get_sys_time_counter();
+    while( (sleep_queue.count() > 0) && (sleep_queue[0]->wake_deadline <= now) ) {
+        process* proc = sleep_queue.remove(0);
+        proc->wake_deadline = 0;
+        process_wake( proc );
+    }
 }
 
 void process_scheduler() {
     //asm volatile("cli" : : : "memory");
 	interrupt_status_t int_stat = disable_interrupts();
+
+    process* handoff = scheduler_handoff;
+    scheduler_handoff = NULL;
+    if( (handoff != NULL) && (handoff->state == process_state::runnable) ) {
+        vector<process*>& queue = run_queues[handoff->priority];
+        for( unsigned int i=0;i<queue.count();i++ ) {
+            if( queue[i] == handoff ) {
+                queue.remove(i);
+                process_current = handoff;
+                restore_interrupts(int_stat);
+                return;
+            }
+        }
+    }
+
     int current_priority = -1;
     for( int i=0;i<SCHEDULER_PRIORITY_LEVELS;i++ ) {
         if( run_queues[i].count() > 0 ) {
@@ -0,0 +1,176 @@
+// shm.cpp -- shared memory objects
+// An shm_object owns its page frames outright; mappings only borrow them (each one holding a reference
+// to the object), so tearing down a mapping clears the page table entries without freeing anything,
+// and the frames go back to the allocator when the object itself is deleted.
+
+#include "includes.h"
+#include "core/shm.h"
+#include "core/paging.h"
+#include "core/scheduler.h"
+
+static spinlock shm_lock;                     // protects every process' shm_mappings list (and shm_kernel_mappings)
+static shm_mapping* shm_kernel_mappings = NULL;
+
+intrusive_ptr<shm_object> shm_object::create( size_t size ) {
+    if( size == 0 ) {
+        return NULL;
+    }
+    shm_object* obj = new shm_object;
+    obj->size = size;
+    obj->n_pages = (size + 0xFFF) / 0x1000;
+    obj->frames = (phys_addr_t*)kmalloc( sizeof(phys_addr_t) * obj->n_pages );
+    if( obj->frames == NULL ) {
+        obj->n_pages = 0;
+        delete obj;
+        return NULL;
+    }
+
+    virt_addr_t tmp = k_vmem_alloc(1);
+    for(unsigned int i=0;i<obj->n_pages;i++) {
+        page_frame* frame = pageframe_allocate(1);
+        if( frame == NULL ) {
+            obj->n_pages = i; // (only free what we got)
+            k_vmem_free( tmp );
+            delete obj;
+            return NULL;
+        }
+        obj->frames[i] = frame->address;
+        kfree( (char*)frame );
+
+        paging_set_pte( tmp, obj->frames[i], 0 );
+        memset( (void*)tmp, 0, 0x1000 );
+        paging_unset_pte( tmp );
+    }
+    k_vmem_free( tmp );
+    return obj;
+}
+
+shm_object::~shm_object() {
+    for(unsigned int i=0;i<this->n_pages;i++) {
+        pageframe_deallocate_specific( pageframe_get_block_from_addr( this->frames[i] ), 0 );
+    }
+    if( this->frames != NULL ) {
+        kfree( (void*)this->frames );
+    }
+}
+
+// Kernel threads don't have address spaces of their own, so they get kernel mappings.
+static bool shm_kernel_space( process* proc ) {
+    return ( (proc == NULL) || (proc->flags & PROCESS_FLAGS_KTHREAD) || (proc->address_space.page_directory == NULL) );
+}
+
+// First run of n_pages unmapped pages in the user shm range, or 0.
+static virt_addr_t shm_find_user_range( process* proc, unsigned int n_pages ) {
+    unsigned int run = 0;
+    for( virt_addr_t addr = SHM_USER_BASE; addr < SHM_USER_END; addr += 0x1000 ) {
+        if( (proc->address_space.get( addr ) & 1) != 0 ) {
+            run = 0;
+            continue;
+        }
+        if( ++run == n_pages ) {
+            return addr - ((n_pages-1) * 0x1000);
+        }
+    }
+    return 0;
+}
+
+static void shm_unmap_pages( process* proc, virt_addr_t addr, unsigned int n_pages ) {
+    for(unsigned int i=0;i<n_pages;i++) {
+        virt_addr_t page = addr + (i*0x1000);
+        if( shm_kernel_space( proc ) ) {
+            paging_unset_pte( page ); // (never frees anything for kernel addresses)
+        } else {
+            proc->address_space.unmap( page, false );
+            if( proc == process_current ) {
+                invalidate_tlb( page );
+            }
+        }
+    }
+}
+
+virt_addr_t shm_map( shm_object* obj, process* proc, virt_addr_t addr, uint32_t flags ) {
+    if( obj == NULL ) {
+        return 0;
+    }
+    bool kernel = shm_kernel_space( proc );
+
+    if( kernel ) {
+        addr = k_vmem_alloc( obj->n_pages );
+        if( addr == 0 ) {
+            return 0;
+        }
+        for(unsigned int i=0;i<obj->n_pages;i++) {
+            paging_set_pte( addr+(i*0x1000), obj->frames[i], 0 );
+        }
+    } else {
+        shm_lock.lock();
+        if( addr == 0 ) {
+            addr = shm_find_user_range( proc, obj->n_pages );
+        } else if( ((addr & 0xFFF) != 0) || (addr >= PAGING_KERNEL_BASE_ADDR) || ((PAGING_KERNEL_BASE_ADDR - addr) < (obj->n_pages * 0x1000)) ) {
+            addr = 0;
+        } else {
+            for(unsigned int i=0;i<obj->n_pages;i++) {
+                if( (proc->address_space.get( addr+(i*0x1000) ) & 1) != 0 ) {
+                    addr = 0; // something's already there
+                    break;
+                }
+            }
+        }
+        if( addr == 0 ) {
+            shm_lock.unlock();
+            return 0;
+        }
+
+        int pte_flags = 0x04 | ((flags & SHM_MAP_WRITE) ? 0x02 : 0); // user, and maybe writable
+        for(unsigned int i=0;i<obj->n_pages;i++) {
+            if( !proc->address_space.map( addr+(i*0x1000), obj->frames[i], pte_flags ) ) {
+                shm_unmap_pages( proc, addr, i );
+                shm_lock.unlock();
+                return 0;
+            }
+        }
+        shm_lock.unlock();
+    }
+
+    shm_mapping* mapping = new shm_mapping;
+    mapping->obj = obj;
+    mapping->addr = addr;
+
+    shm_lock.lock();
+    shm_mapping** list = ((proc != NULL) ? &proc->shm_mappings : &shm_kernel_mappings);
+    mapping->next = *list;
+    *list = mapping;
+    shm_lock.unlock();
+    return addr;
+}
+
+bool shm_unmap( process* proc, virt_addr_t addr ) {
+    shm_lock.lock();
+    shm_mapping** list = ((proc != NULL) ? &proc->shm_mappings : &shm_kernel_mappings);
+    shm_mapping* mapping = NULL;
+    for( shm_mapping** cur = list; *cur != NULL; cur = &(*cur)->next ) {
+        if( (*cur)->addr == addr ) {
+            mapping = *cur;
+            *cur = mapping->next;
+            break;
+        }
+    }
+    shm_lock.unlock();
+
+    if( mapping == NULL ) {
+        return false;
+    }
+    shm_unmap_pages( proc, addr, mapping->obj->n_pages );
+    if( shm_kernel_space( proc ) ) {
+        k_vmem_free( addr );
+    }
+    delete mapping; // (drops its reference to the object)
+    return true;
+}
+
+// Called from ~process, before the address space (which would free every frame it maps) goes away.
+void shm_process_exit( process* proc ) {
+    while( proc->shm_mappings != NULL ) {
+        shm_unmap( proc, proc->shm_mappings->addr );
+    }
+}
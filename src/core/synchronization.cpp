@@ -4,36 +4,88 @@
 #include "lib/sync.h"
 #include "arch/x86/multitask.h"
 #include "core/scheduler.h"
+#include "arch/x86/sys.h"
 
 #define cas __sync_bool_compare_and_swap
 
 uint64_t last_mutex_id = 0;
 uint64_t last_semaphore_id = 0;
 
-spinlock::spinlock() {
-    this->lock_value = SPINLOCK_UNLOCKED_VALUE;
+spinlock_stats* spinlock_stats_list = NULL;
+
+spinlock::spinlock() {}
+
+spinlock::spinlock( const char* name ) {
+    this->stats = new spinlock_stats;
+    if( this->stats != NULL ) {
+        this->stats->name = name;
+        interrupt_status_t int_stat = disable_interrupts();
+        this->stats->next = spinlock_stats_list;
+        spinlock_stats_list = this->stats;
+        restore_interrupts(int_stat);
+    }
+}
+
+// Take the lock for the current process. Returns false if it already held it.
+bool spinlock::acquire() {
+    if( this->locker == process_current->id ) {
+        this->depth++;
+        return false;
+    }
+    uint32_t ticket = __sync_fetch_and_add( &this->next_ticket, 1 );
+    if( this->now_serving != ticket ) {
+        uint64_t start = 0;
+        if( this->stats != NULL ) {
+            start = rdtsc();
+        }
+        while( this->now_serving != ticket ) {
+            asm volatile("pause" : : : "memory");
+        }
+        if( this->stats != NULL ) {
+            this->stats->contended++;
+            this->stats->spin_cycles += rdtsc() - start;
+        }
+    }
+    asm volatile("" : : : "memory");
+    this->locker = process_current->id;
+    if( this->stats != NULL ) {
+        this->stats->acquisitions++;
+        this->stats->acquired_at = rdtsc();
+    }
+    return true;
+}
+
+// Returns true if the lock was actually given up (as opposed to just dropping one nested lock()).
+bool spinlock::release() {
+    if( this->locker != process_current->id ) {
+        return false; // not ours
+    }
+    if( this->depth > 0 ) {
+        this->depth--;
+        return false;
+    }
+    if( this->stats != NULL ) {
+        uint64_t held = rdtsc() - this->stats->acquired_at;
+        if( held > this->stats->max_hold_cycles ) {
+            this->stats->max_hold_cycles = held;
+        }
+    }
+    this->locker = 0;
+    asm volatile("" : : : "memory");
+    this->now_serving = this->now_serving + 1; // only the holder ever writes now_serving
+    return true;
 }
 
 // Lock / Unlock, No interrupt disabling
 void spinlock::lock_no_cli() {
-    if(multitasking_enabled) { // No point in locking if we're the only thing running THIS early on
-        if( (process_current != NULL) && (this->locker != process_current->id) ) { // don't lock if we've already locked this lock, but be safe about it
-            while(!cas(&this->lock_value, SPINLOCK_UNLOCKED_VALUE, SPINLOCK_LOCKED_VALUE)) {
-                //process_switch_immediate();
-                asm volatile("pause" : : : "memory");
-            }
-            if( process_current != NULL ) {
-                this->locker = process_current->id;
-            }
-        }
+    if( multitasking_enabled && (process_current != NULL) ) { // No point in locking if we're the only thing running THIS early on
+        this->acquire();
     }
 }
 
 void spinlock::unlock_no_cli() {
-    if(multitasking_enabled) {
-        asm volatile("" : : : "memory");
-        this->lock_value = SPINLOCK_UNLOCKED_VALUE;
-        this->locker = 0;
+    if( multitasking_enabled && (process_current != NULL) ) {
+        this->release();
     }
 }
 
@@ -42,33 +94,26 @@ void spinlock::lock() {
     if( this == NULL ) {
         panic("lock_cli: this==NULL!\n");
     }
-    if (multitasking_enabled && (process_current != NULL) ) {
-        if( this->locker != process_current->id ) {
-            while(!cas(&this->lock_value, SPINLOCK_UNLOCKED_VALUE, SPINLOCK_LOCKED_VALUE)) {
-                //process_switch_immediate();
-                asm volatile("pause" : : : "memory");
-            }
-
-            if( process_current != NULL ) {
-                this->int_status = disable_interrupts();
-                this->locker = process_current->id;
-            }
+    if( multitasking_enabled && (process_current != NULL) ) {
+        interrupt_status_t int_stat = disable_interrupts();
+        if( this->acquire() ) {
+            this->int_status = int_stat;
         }
     }
 }
 
 void spinlock::unlock() {
-    if(multitasking_enabled) {
-        asm volatile("" : : : "memory");
-        this->lock_value = SPINLOCK_UNLOCKED_VALUE;
-        this->locker = 0;
-        restore_interrupts( this->int_status );
+    if( multitasking_enabled && (process_current != NULL) ) {
+        interrupt_status_t int_stat = this->int_status;
+        if( this->release() ) {
+            restore_interrupts( int_stat );
+        }
     }
 }
 
 bool spinlock::get_lock_status() {
     asm volatile("" : : : "memory");
-    return (this->lock_value == SPINLOCK_LOCKED_VALUE);
+    return (this->now_serving != this->next_ticket);
 }
 
 uint32_t spinlock::get_lock_owner() {
@@ -76,6 +121,341 @@ uint32_t spinlock::get_lock_owner() {
     return this->locker;
 }
 
+int spinlock_stats_format( spinlock_stats* stats, char* out, size_t bufsz ) {
+    return ksnprintf( out, bufsz, "acquisitions: %llu\ncontended: %llu\nspin cycles: %llu\nmax hold cycles: %llu\n",
+        stats->acquisitions, stats->contended, stats->spin_cycles, stats->max_hold_cycles );
+}
+
+void wait_queue::remove( wait_queue_entry* ent ) {
+    wait_queue_entry* prev = NULL;
+    for( wait_queue_entry* cur = this->head; cur != NULL; cur = cur->next ) {
+        if( cur == ent ) {
+            if( prev == NULL ) {
+                this->head = cur->next;
+            } else {
+                prev->next = cur->next;
+            }
+            if( this->tail == cur ) {
+                this->tail = prev;
+            }
+            break;
+        }
+        prev = cur;
+    }
+    ent->next = NULL;
+    ent->queue = NULL;
+}
+
+// Queue up the current process and mark it as waiting; it'll go to sleep on its next process_switch_immediate().
+void wait_queue::prepare_to_wait() {
+    wait_queue_entry* ent = &process_current->wait_entry;
+    this->lock.lock();
+    if( ent->queue == NULL ) {
+        ent->proc = process_current;
+        ent->next = NULL;
+        ent->queue = this;
+        if( this->tail == NULL ) {
+            this->head = ent;
+        } else {
+            this->tail->next = ent;
+        }
+        this->tail = ent;
+    } else if( ent->queue != this ) {
+        panic("wait_queue: process %u is already waiting on another queue!\n", process_current->id);
+    }
+    process_current->state = process_state::waiting;
+    this->lock.unlock();
+}
+
+void wait_queue::finish_wait() {
+    wait_queue_entry* ent = &process_current->wait_entry;
+    process_current->state = process_state::runnable;
+    this->lock.lock();
+    if( ent->queue == this ) { // we weren't woken through this queue
+        this->remove( ent );
+    }
+    this->lock.unlock();
+}
+
+// Sleep until woken. If held is given, it's released once we're on the queue (and not reacquired).
+void wait_queue::wait( spinlock* held ) {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        if( held != NULL )
+            held->unlock();
+        return;
+    }
+    this->prepare_to_wait();
+    if( held != NULL )
+        held->unlock();
+    process_switch_immediate();
+    this->finish_wait();
+}
+
+// Returns false if we timed out instead of being woken.
+bool wait_queue::wait_timeout( unsigned int timeout_ms, spinlock* held ) {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        if( held != NULL )
+            held->unlock();
+        return false;
+    }
+    this->prepare_to_wait();
+    process_set_timeout( process_current, get_sys_time_counter() + timeout_ms );
+    if( held != NULL )
+        held->unlock();
+    process_switch_immediate();
+    process_clear_timeout( process_current );
+
+    this->lock.lock();
+    bool woken = (process_current->wait_entry.queue != this);
+    this->lock.unlock();
+
+    this->finish_wait();
+    return woken;
+}
+
+bool wait_queue::wake_one() {
+    return (this->wake_first() != NULL);
+}
+
+process* wait_queue::wake_first() {
+    this->lock.lock();
+    wait_queue_entry* ent = this->head;
+    if( ent == NULL ) {
+        this->lock.unlock();
+        return NULL;
+    }
+    process* proc = ent->proc;
+    this->remove( ent );
+    process_wake( proc );
+    this->lock.unlock();
+    return proc;
+}
+
+unsigned int wait_queue::wake_all() {
+    unsigned int n = 0;
+    this->lock.lock();
+    while( this->head != NULL ) {
+        process* proc = this->head->proc;
+        this->remove( this->head );
+        process_wake( proc );
+        n++;
+    }
+    this->lock.unlock();
+    return n;
+}
+
+bool wait_queue::empty() {
+    asm volatile("" : : : "memory");
+    return (this->head == NULL);
+}
+
+int wait_queue::top_priority() {
+    int prio = -1;
+    this->lock.lock();
+    for( wait_queue_entry* cur = this->head; cur != NULL; cur = cur->next ) {
+        if( (prio == -1) || (cur->proc->priority < prio) ) {
+            prio = cur->proc->priority;
+        }
+    }
+    this->lock.unlock();
+    return prio;
+}
+
+// Priority inheritance bookkeeping.
+// Everything here runs with some mutex's control lock held (so interrupts are off), which
+// keeps the owner / blocked_on chains from changing while we walk them.
+static mutex_pi_event pi_trace[MUTEX_PI_TRACE_SIZE];
+static unsigned int pi_trace_next = 0;
+static unsigned int pi_trace_count = 0;
+
+static void pi_set_priority( process* proc, int priority, uint64_t mutex_id ) {
+    if( proc->priority == priority ) {
+        return;
+    }
+    unsigned long long int now = get_sys_time_counter();
+    mutex_pi_event* ev = &pi_trace[pi_trace_next];
+    ev->time = now;
+    ev->pid = proc->id;
+    ev->mutex_id = mutex_id;
+    ev->old_priority = proc->priority;
+    ev->new_priority = priority;
+    ev->boosted_for = 0;
+
+    if( proc->priority == proc->base_priority ) {
+        proc->boost_start = now; // start of a boosted period
+    } else if( priority == proc->base_priority ) {
+        ev->boosted_for = now - proc->boost_start;
+        proc->boosted_time += ev->boosted_for;
+    }
+    pi_trace_next = (pi_trace_next+1) % MUTEX_PI_TRACE_SIZE;
+    if( pi_trace_count < MUTEX_PI_TRACE_SIZE )
+        pi_trace_count++;
+
+    process_set_priority( proc, priority );
+}
+
+// Set proc's priority to the best of its base priority and the priorities of everyone waiting on a mutex it holds.
+void mutex_pi_recompute( process* proc ) {
+    int prio = proc->base_priority;
+    for( reentrant_mutex* m = proc->held_mutexes; m != NULL; m = m->next_held ) {
+        int top = m->waiters.top_priority();
+        if( (top != -1) && (top < prio) ) {
+            prio = top;
+        }
+    }
+    pi_set_priority( proc, prio, ~0 );
+}
+
+// Release everything a process still holds when it goes away, so waiters don't have to wait for the owner check.
+// Called once a process has exited (and again from ~process); anything it still holds goes to the next waiter.
+void mutex_pi_process_exit( process* proc ) {
+    interrupt_status_t int_stat = disable_interrupts();
+    while( proc->held_mutexes != NULL ) {
+        reentrant_mutex* m = proc->held_mutexes;
+        m->control_lock.lock();
+        m->release_ownership( proc );
+        m->hand_off();
+        m->control_lock.unlock();
+    }
+    restore_interrupts(int_stat);
+}
+
+void mutex_pi_trace_dump() {
+    kprintf("Last %u mutex priority changes:\n", pi_trace_count);
+    unsigned int start = (pi_trace_next + MUTEX_PI_TRACE_SIZE - pi_trace_count) % MUTEX_PI_TRACE_SIZE;
+    for( unsigned int i=0;i<pi_trace_count;i++ ) {
+        mutex_pi_event* ev = &pi_trace[(start+i) % MUTEX_PI_TRACE_SIZE];
+        if( ev->mutex_id == (uint64_t)~0 ) {
+            if( ev->boosted_for > 0 ) {
+                kprintf("[%llu] pid %u: priority %d -> %d (restored after %llu ms boosted)\n", ev->time, ev->pid, ev->old_priority, ev->new_priority, ev->boosted_for);
+            } else {
+                kprintf("[%llu] pid %u: priority %d -> %d (boost reduced)\n", ev->time, ev->pid, ev->old_priority, ev->new_priority);
+            }
+        } else {
+            kprintf("[%llu] pid %u: priority %d -> %d (waiter on mutex %llu)\n", ev->time, ev->pid, ev->old_priority, ev->new_priority, ev->mutex_id);
+        }
+    }
+}
+
+void rwlock::read_lock() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return;
+    }
+    this->control_lock.lock();
+    while( this->writing || (this->writers_waiting > 0) ) {
+        this->read_waiters.wait( &this->control_lock );
+        this->control_lock.lock();
+    }
+    this->readers++;
+    this->control_lock.unlock();
+}
+
+void rwlock::read_unlock() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return;
+    }
+    this->control_lock.lock();
+    if( this->readers > 0 ) {
+        this->readers--;
+        if( (this->readers == 0) && (this->writers_waiting > 0) ) {
+            this->write_waiters.wake_one();
+        }
+    }
+    this->control_lock.unlock();
+}
+
+void rwlock::write_lock() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return;
+    }
+    this->control_lock.lock();
+    this->writers_waiting++;
+    while( this->writing || (this->readers > 0) ) {
+        this->write_waiters.wait( &this->control_lock );
+        this->control_lock.lock();
+    }
+    this->writers_waiting--;
+    this->writing = true;
+    this->control_lock.unlock();
+}
+
+void rwlock::write_unlock() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return;
+    }
+    this->control_lock.lock();
+    if( this->writing ) {
+        this->writing = false;
+        if( this->writers_waiting > 0 ) {
+            this->write_waiters.wake_one();
+        } else {
+            this->read_waiters.wake_all();
+        }
+    }
+    this->control_lock.unlock();
+}
+
+bool rwlock::try_read_lock() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return true;
+    }
+    bool ret = false;
+    this->control_lock.lock();
+    if( !this->writing && (this->writers_waiting == 0) ) {
+        this->readers++;
+        ret = true;
+    }
+    this->control_lock.unlock();
+    return ret;
+}
+
+bool rwlock::try_write_lock() {
+    if( !multitasking_enabled || (process_current == NULL) ) {
+        return true;
+    }
+    bool ret = false;
+    this->control_lock.lock();
+    if( !this->writing && (this->readers == 0) ) {
+        this->writing = true;
+        ret = true;
+    }
+    this->control_lock.unlock();
+    return ret;
+}
+
+uint32_t seqlock::read_begin() {
+    uint32_t seq;
+    while( true ) {
+        seq = this->sequence;
+        asm volatile("" : : : "memory");
+        if( (seq & 1) == 0 ) {
+            return seq;
+        }
+        asm volatile("pause" : : : "memory"); // writer in progress
+    }
+}
+
+bool seqlock::read_retry( uint32_t start ) {
+    asm volatile("" : : : "memory");
+    return (this->sequence != start);
+}
+
+void seqlock::write_begin() {
+    interrupt_status_t int_stat = disable_interrupts();
+    this->write_lock.lock_no_cli();
+    this->int_status = int_stat;
+    this->sequence = this->sequence + 1;
+    asm volatile("" : : : "memory");
+}
+
+void seqlock::write_end() {
+    asm volatile("" : : : "memory");
+    this->sequence = this->sequence + 1;
+    interrupt_status_t int_stat = this->int_status;
+    this->write_lock.unlock_no_cli();
+    restore_interrupts( int_stat );
+}
+
 reentrant_mutex::~reentrant_mutex() {
     //delete this->control_lock;
 }
@@ -92,12 +472,64 @@ reentrant_mutex::reentrant_mutex() {
     this->mutex_id = last_mutex_id++;
 }
 
+// Make the current process the owner. control_lock must be held.
+void reentrant_mutex::take() {
+    if( this->lock_count == 0 ) {
+        this->next_held = process_current->held_mutexes;
+        process_current->held_mutexes = this;
+    }
+    this->uid = process_current->id;
+    this->lock_count++;
+}
+
+// Drop the mutex from owner's held list and mark it unlocked. control_lock must be held.
+void reentrant_mutex::release_ownership( process* owner ) {
+    reentrant_mutex** link = &owner->held_mutexes;
+    while( *link != NULL ) {
+        if( *link == this ) {
+            *link = this->next_held;
+            break;
+        }
+        link = &((*link)->next_held);
+    }
+    this->next_held = NULL;
+    this->uid = -1;
+    this->lock_count = 0;
+}
+
+// Give the (released) mutex to the first waiter, if there is one. It becomes the owner right away, so nobody
+// can take the mutex in between, but it only adds the mutex to its held list once it runs (see take()).
+// control_lock must be held.
+void reentrant_mutex::hand_off() {
+    process* next = this->waiters.wake_first();
+    if( next != NULL ) {
+        this->uid = next->id;
+    }
+}
+
+// Lend our priority to the owner, and on down the chain if the owner is blocked on another mutex.
+void reentrant_mutex::propagate_priority() {
+    process* waiter = process_current;
+    reentrant_mutex* m = this;
+    for( unsigned int depth=0; (m != NULL) && (depth < MUTEX_PI_MAX_CHAIN); depth++ ) {
+        if( m->uid == -1 ) {
+            break;
+        }
+        process* owner = get_process_by_pid( m->uid );
+        if( (owner == NULL) || (owner == waiter) || (owner->priority <= waiter->priority) ) {
+            break; // (lower numbers are higher priorities)
+        }
+        pi_set_priority( owner, waiter->priority, this->mutex_id );
+        waiter = owner;
+        m = owner->blocked_on;
+    }
+}
+
 bool reentrant_mutex::trylock() {
     if( multitasking_enabled ) {
         this->control_lock.lock();
         if( (this->uid == ~0) || (this->uid == process_current->id) ){
-            this->uid = process_current->id;
-            this->lock_count++;
+            this->take();
             this->control_lock.unlock();
             return true;
         }
@@ -121,31 +553,31 @@ void reentrant_mutex::lock() {
             }
             */
             this->control_lock.lock();
-            if( (this->uid == -1) || (this->uid == process_current->id) ){ // okay, it's not taken yet (or we've already taken it), acquire it
-                this->uid = process_current->id;
-            } else {
-                this->control_lock.unlock();
-                while( true ) {
-                    process_switch_immediate(); // go to sleep
-                    this->control_lock.lock(); // okay, checking again
-                    if( (this->uid == -1) || (this->uid == process_current->id) ) { // is it still locked?
-                        this->uid = process_current->id; // okay it is, acquire it
-                        break;
+            while( (this->uid != -1) && (this->uid != process_current->id) ) {
+                process *locker_process = get_process_by_pid( this->uid );
+                if( (locker_process == NULL) || (locker_process->state == process_state::dead) ) {
+                    // the owner exited without unlocking
+                    if( locker_process != NULL ) {
+                        this->release_ownership( locker_process );
                     } else {
-                        process *locker_process = get_process_by_pid( this->uid );
-                        if( locker_process ) {
-                            if( locker_process->state == process_state::dead ) {
-                                this->uid = process_current->id;
-                                break;
-                            }
-                        }
-                        this->control_lock.unlock(); // no, it's not, release and go to sleep again
+                        this->uid = -1;
+                        this->lock_count = 0;
                     }
+                    break;
                 }
-                // control_lock is LOCKED.
+                process_current->blocked_on = this;
+                this->propagate_priority();
+                // sleep until the mutex is handed to us (by unlock(), or when the owner exits)
+                this->waiters.wait( &this->control_lock );
+                this->control_lock.lock();
+                process_current->blocked_on = NULL;
+            }
+            // control_lock is LOCKED.
+            this->take();
+            // anyone still waiting on this mutex now lends us their priority instead
+            if( !this->waiters.empty() ) {
+                mutex_pi_recompute( process_current );
             }
-            // this->uid == uid
-            this->lock_count++;
             this->control_lock.unlock();
         }
     }
@@ -161,7 +593,11 @@ void reentrant_mutex::unlock() {
                 }
                 this->lock_count--;
                 if( this->lock_count == 0 ) {
-                    this->uid = -1;
+                    this->release_ownership( process_current );
+                    this->hand_off();
+                    if( process_current->priority != process_current->base_priority ) {
+                        mutex_pi_recompute( process_current ); // drop whatever boost this mutex gave us
+                    }
                 }
             }
             this->control_lock.unlock();
@@ -224,6 +660,8 @@ bool semaphore::release(uint32_t count) {
     // make sure we don't attempt to increment the count past what it's supposed to be
     if( (this->max_count == 0) || ((this->count + count) <= this->max_count) ) {
         this->count += count;
+        // waiters may want different counts, so let all of them re-check
+        this->waiters.wake_all();
         this->control_lock.unlock();
         return true;
     }
@@ -271,8 +709,7 @@ bool semaphore::acquire(uint32_t count) {
                 this->control_lock.unlock();
                 break;
             }
-            this->control_lock.unlock();
-            process_switch_immediate();
+            this->waiters.wait( &this->control_lock );
         }
     }
     return true;
@@ -285,3 +722,43 @@ uint32_t semaphore::get_count() {
 uint32_t semaphore::get_max_count() {
     return this->max_count;
 }
+
+// Waiters are woken with lock still held: once it's dropped, a waiter can see is_done (or time out)
+// and free whatever the completion is part of.
+void completion::complete() {
+    this->lock.lock();
+    this->is_done = true;
+    this->waiters.wake_all();
+    this->lock.unlock();
+}
+
+void completion::wait() {
+    this->lock.lock();
+    while( !this->is_done ) {
+        this->waiters.wait( &this->lock );
+        this->lock.lock();
+    }
+    this->lock.unlock();
+}
+
+bool completion::wait_timeout( unsigned int timeout_ms ) {
+    unsigned long long int deadline = get_sys_time_counter() + timeout_ms;
+    this->lock.lock();
+    while( !this->is_done ) {
+        unsigned long long int now = get_sys_time_counter();
+        if( now >= deadline ) {
+            break;
+        }
+        this->waiters.wait_timeout( (unsigned int)(deadline - now), &this->lock );
+        this->lock.lock();
+    }
+    bool ret = this->is_done;
+    this->lock.unlock();
+    return ret;
+}
+
+void completion::reinit() {
+    this->lock.lock();
+    this->is_done = false;
+    this->lock.unlock();
+}
@@ -0,0 +1,72 @@
+// syscall.cpp -- system call table
+
+#include "includes.h"
+#include "core/syscall.h"
+#include "core/scheduler.h"
+#include "core/futex.h"
+#include "core/ipc.h"
+
+static uint32_t sys_yield( uint32_t, uint32_t, uint32_t, uint32_t, uint32_t ) {
+    process_reschedule();
+    return 0;
+}
+
+static uint32_t sys_fork( uint32_t, uint32_t, uint32_t, uint32_t, uint32_t ) {
+    return do_fork();
+}
+
+static uint32_t sys_null( uint32_t, uint32_t, uint32_t, uint32_t, uint32_t ) {
+    return 0;
+}
+
+static uint32_t sys_getpid( uint32_t, uint32_t, uint32_t, uint32_t, uint32_t ) {
+    return process_current->id;
+}
+
+// wait_on_address( addr, expected, timeout_ms )
+static uint32_t sys_wait_on_address( uint32_t addr, uint32_t expected, uint32_t timeout_ms, uint32_t, uint32_t ) {
+    return futex_wait( (volatile uint32_t*)addr, expected, timeout_ms );
+}
+
+// wake( addr, n )
+static uint32_t sys_wake( uint32_t addr, uint32_t n, uint32_t, uint32_t, uint32_t ) {
+    return futex_wake( (volatile uint32_t*)addr, n );
+}
+
+// ipc_call( endpoint, tag, word0, word1, word2 )
+// The reply comes back in registers too: the tag in EAX, the words in EBX / ECX / EDX.
+static uint32_t sys_ipc_call( uint32_t endpoint, uint32_t tag, uint32_t w0, uint32_t w1, uint32_t w2 ) {
+    ipc_msg msg;
+    ipc_msg reply;
+    msg.tag = tag;
+    msg.words[0] = w0;
+    msg.words[1] = w1;
+    msg.words[2] = w2;
+
+    uint32_t err = ipc_call( ipc_get_endpoint( endpoint ), &msg, &reply );
+    if( err != 0 ) {
+        return err;
+    }
+    trap_frame* frame = process_current->syscall_frame;
+    frame->ebx = reply.words[0];
+    frame->ecx = reply.words[1];
+    frame->edx = reply.words[2];
+    return reply.tag;
+}
+
+syscall_entry syscall_table[N_SYSCALLS] = {
+    { &sys_yield,   0,                              "yield"  },
+    { &sys_fork,    SYSCALL_FLAGS_NEEDS_CONTEXT,    "fork"   },
+    { &sys_null,    0,                              "null"   },
+    { &sys_getpid,  0,                              "getpid" },
+    { &sys_wait_on_address, 0,                      "wait_on_address" },
+    { &sys_wake,    0,                              "wake"   },
+    { &sys_ipc_call, SYSCALL_FLAGS_NEEDS_CONTEXT,   "ipc_call" },
+};
+
+uint32_t syscall_dispatch( uint32_t syscall_n, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5 ) {
+    if( (syscall_n >= N_SYSCALLS) || (syscall_table[syscall_n].handler == NULL) ) {
+        return SYSCALL_ERR_INVALID;
+    }
+    return syscall_table[syscall_n].handler( arg1, arg2, arg3, arg4, arg5 );
+}
@@ -19,6 +19,7 @@ uint16_t port1_ident = 0;
 uint16_t port2_ident = 0;
 
 process *irq1_handler_process = NULL;
+channel_handle ps2_data_channel = CHANNEL_INVALID_HANDLE;
 
 // Screw the PS2 controller. Seriously.
 // Why don't you support interrupt-driven sending?!
@@ -87,7 +88,7 @@ unsigned char ps2_receive_byte(bool port2) {
     return (unsigned char)data;
     */
 
-	channel_receiver ch = listen_to_channel("ps2_data");
+	channel_receiver ch = listen_to_channel(ps2_data_channel);
 	while( true ) {
 		ch.wait();
 
@@ -131,7 +132,7 @@ bool ps2_irq_handler( uint8_t irq_num ) {
 	d->port = ( irq_num == 12 );
 
 	message m( (void*)d, sizeof(ps2_data) );
-	send_to_channel("ps2_data", m);
+	send_to_channel(ps2_data_channel, m);
 
 	return ((irq_num == 1) || (irq_num == 12));
 }
@@ -268,7 +269,6 @@ void ps2_controller_init() {
     ps2_send_byte(PS2_CCB_PORT1_INT | PS2_CCB_PORT2_INT | PS2_CCB_SYS_FLAG | PS2_CCB_PORT1_CLK | PS2_CCB_PORT2_CLK, false);
 
     device_manager::device_node* dev = new device_manager::device_node;
-	dev->child_id = device_manager::root.children.count();
 	dev->enabled = true;
 	dev->type = device_manager::dev_type::ps2_controller;
 	dev->human_name = const_cast<char*>("8042 Keyboard Controller");
@@ -289,9 +289,9 @@ void ps2_controller_init() {
 
 	dev->resources.add_end(res);
 
-	device_manager::root.children.add_end( dev );
+	device_manager::add_child( &device_manager::root, dev );
 
-	register_channel("ps2_data");
+	ps2_data_channel = register_channel("ps2_data");
 }
 
 uint16_t ps2_get_ident_bytes(bool port2) {
@@ -5,6 +5,7 @@
 #include "core/paging.h"
 #include "core/scheduler.h"
 #include "core/message.h"
+#include "core/io.h"
 #include "device/ahci.h"
 #include "device/ata.h"
 #include "device/pci.h"
@@ -425,6 +426,31 @@ int ahci_find_command_slot( unsigned int port ) {
 
 // Issue a data command
 unsigned int ahci_issue_data( unsigned int port, uint64_t lba_start, uint16_t sector_count, void* buffer, bool read ) {
+    io_sg_list sg( 1 );
+    sg.add( (phys_addr_t)buffer, NULL, ((size_t)sector_count) << 9 );
+    return ahci_issue_data_sg( port, lba_start, sector_count, &sg, read );
+}
+
+// PRDT entries needed for the first n_bytes of sg (segments bigger than an entry can hold take several).
+static unsigned int ahci_count_prdt_entries( io_sg_list* sg, size_t n_bytes ) {
+    unsigned int n = 0;
+    for( unsigned int i=0;(i<sg->n_segments) && (n_bytes > 0);i++ ) {
+        size_t len = ((sg->segments[i].len < n_bytes) ? sg->segments[i].len : n_bytes);
+        n += (len + AHCI_PRDT_MAX_BYTES - 1) / AHCI_PRDT_MAX_BYTES;
+        n_bytes -= len;
+    }
+    return n;
+}
+
+// One PRDT entry per segment of sg, so the data goes straight to (or from) wherever it lives.
+unsigned int ahci_issue_data_sg( unsigned int port, uint64_t lba_start, uint16_t sector_count, io_sg_list* sg, bool read ) {
+    size_t n_bytes = ((size_t)sector_count) << 9;
+    unsigned int n_entries = ahci_count_prdt_entries( sg, n_bytes );
+    if( (n_entries == 0) || (n_entries > AHCI_MAX_PRDT_ENTRIES) ) {
+        kprintf("ahci: could not complete request: %u segments won't fit in one command.\n", n_entries);
+        return AHCI_ERR_TOO_MANY_SEGMENTS;
+    }
+
     kprintf("ahci: beginning AHCI transaction.\n");
     hba->ports[port].int_status = 0xFFFFFFFF; // clear Interrupt Status
     int cmd_slot = ahci_find_command_slot( port );
@@ -439,35 +465,36 @@ unsigned int ahci_issue_data( unsigned int port, uint64_t lba_start, uint16_t se
     hdr += cmd_slot;
     hdr->lo_params = (sizeof(fis_reg_h2d) / 4) | ( read ? 0 : (1<<6) );
     hdr->hi_params = 0;
-    hdr->prdt_length = ((sector_count-1)>>4)+1;
+    hdr->prdt_length = n_entries;
     kprintf("ahci: prdt length is %u.\n", hdr->prdt_length);
     
-    // okay, maybe find a better / more efficient way to reserve physical memory?
-    unsigned int n_pages = ((sizeof(cmd_table) + ((hdr->prdt_length-1)*sizeof(prdt_entry))) / 0x1000)+1;
-    size_t tbl_vmem = k_vmem_alloc(n_pages);
-    if( hdr->cmdt_addr == NULL ) {
-        page_frame *tbl_frames = pageframe_allocate(n_pages);
-        logger_flush_buffer();
-        hdr->cmdt_addr = tbl_frames->address;
-    }
-    for(int i=0;i<n_pages;i++) {
-        paging_set_pte( tbl_vmem+(i*0x1000), hdr->cmdt_addr+(i*0x1000), 0x81 );
+    // each slot's command table is a single page, big enough for AHCI_MAX_PRDT_ENTRIES
+    size_t tbl_vmem = k_vmem_alloc(1);
+    if( hdr->cmdt_addr == 0 ) {
+        page_frame *tbl_frame = pageframe_allocate(1);
+        hdr->cmdt_addr = tbl_frame->address;
+        kfree( (char*)tbl_frame );
     }
+    paging_set_pte( tbl_vmem, hdr->cmdt_addr, 0x81 );
     cmd_table *tbl = (cmd_table*)(tbl_vmem);
     memclr( (void*)tbl, sizeof(cmd_table) + ((hdr->prdt_length-1)*sizeof(prdt_entry)) );
-    uint32_t buf_tmp = (uint32_t)buffer;
-    uint32_t cnt_tmp = (uint32_t)sector_count;
-    
-    for(unsigned int i=0;i<hdr->prdt_length-1;i++) {
-        tbl->prdt[i].dba   = buf_tmp;
-        tbl->prdt[i].dba_u = 0;
-        tbl->prdt[i].count = 0x2000 | 0x80000000;
-        buf_tmp += 0x2000;
-        cnt_tmp -= 16;
+    
+    unsigned int entry = 0;
+    size_t left = n_bytes;
+    for(unsigned int i=0;(i<sg->n_segments) && (left > 0);i++) {
+        phys_addr_t addr = sg->segments[i].phys;
+        size_t len = ((sg->segments[i].len < left) ? sg->segments[i].len : left);
+        left -= len;
+        while( len > 0 ) {
+            size_t n = ((len < AHCI_PRDT_MAX_BYTES) ? len : AHCI_PRDT_MAX_BYTES);
+            tbl->prdt[entry].dba   = addr;
+            tbl->prdt[entry].dba_u = 0;
+            tbl->prdt[entry].count = (n-1) | 0x80000000; // (the byte count is 0-based)
+            entry++;
+            addr += n;
+            len -= n;
+        }
     }
-    tbl->prdt[ hdr->prdt_length-1 ].dba   = buf_tmp;
-    tbl->prdt[ hdr->prdt_length-1 ].dba_u = 0;
-    tbl->prdt[ hdr->prdt_length-1 ].count = (cnt_tmp<<9) | 0x80000000;
     
     fis_reg_h2d *cmd_fis = (fis_reg_h2d*)(tbl->cmd_fis);
     cmd_fis->fis_type = FIS_TYPE_REG_H2D;
@@ -486,6 +513,8 @@ unsigned int ahci_issue_data( unsigned int port, uint64_t lba_start, uint16_t se
     cmd_fis->count_lo = (uint8_t)(sector_count&0xFF);
     cmd_fis->count_hi = (uint8_t)((sector_count>>8)&0xFF);
     
+    paging_unset_pte( tbl_vmem );
+    k_vmem_free( tbl_vmem );
     flushCache();
     
     uint64_t start_time = get_sys_time_counter();
@@ -9,6 +9,32 @@
 #include "arch/x86/sys.h"
 #include "device/ata.h"
 
+// Move n_bytes through the data port, wherever cur says they go (or come from) next.
+static void ata_pio_sg( uint16_t port, io_sg_cursor* cur, size_t n_bytes, bool read ) {
+	while( n_bytes > 0 ) {
+		void* piece;
+		size_t n = cur->next( &piece, n_bytes );
+		if( n == 0 ) {
+			// (the list is shorter than the transfer: keep the drive happy, but the data goes nowhere)
+			for(size_t j=0;j<n_bytes/2;j++) {
+				if( read )
+					io_inw( port );
+				else
+					io_outw( port, 0 );
+			}
+			return;
+		}
+		uint16_t* current = (uint16_t*)piece;
+		for(size_t j=0;j<n/2;j++) {
+			if( read )
+				*current++ = io_inw( port );
+			else
+				io_outw( port, *current++ );
+		}
+		n_bytes -= n;
+	}
+}
+
 void ata::ata_device::do_pio_sector_transfer( void *buffer, bool write ) {
 	uint16_t* current = (uint16_t*)buffer;
 	while( ((io_inb( this->channel->control ) & 0x80) > 0) || ((io_inb( this->channel->control ) & 0x8) == 0) ); // busy-wait on DRQ
@@ -193,17 +219,10 @@ void ata::ata_device::do_ata_transfer( ata_transfer_request* req ) {
 		}
 	}
 
-	uint16_t* current = (uint16_t*)req->buffer.buffer_virt;
-	//kprintf("ata: buffer at %#p physical, %#p virtual.\n", req->buffer.buffer_phys, (void*)current);
-	//kprintf("ata: PTE for virt address is %#x\n", paging_get_pte((size_t)current));
+	io_sg_cursor cur( req->sg );
 	for( unsigned int i=0;i<req->n_sectors;i++ ) {
 		while( ((io_inb( this->channel->control ) & ATA_SR_BSY) > 0) || ((io_inb( this->channel->control ) & ATA_SR_DRQ) == 0) ) asm volatile("pause");
-		for(unsigned int j=0;j<256;j++) {
-			if( req->read )
-				*current++ = io_inw( this->channel->base );
-			else
-				io_outw( this->channel->base, *current++ );
-		}
+		ata_pio_sg( this->channel->base, &cur, 512, req->read );
 		for(int k=0;k<4;k++) // 400 ns delay
 			io_inb( this->channel->control );
 	}
@@ -223,7 +242,6 @@ void ata::ata_device::do_ata_transfer( ata_transfer_request* req ) {
 	}
 	flushCache(); // flush the (memory) cache cpu-side as well
 	//kprintf("ata: PIO transfer complete.\n");
-	k_vmem_free( (size_t)current );
 }
 
 void ata::ata_device::send_atapi_command(uint8_t *command_bytes) {
@@ -298,23 +316,29 @@ void ata::ata_device::do_atapi_transfer( ata_transfer_request* req ) {
 
 	this->send_atapi_command(cmd);
 
-	uint8_t lba_mid = io_inb( this->channel->base+4 );
-	uint8_t lba_hi = io_inb( this->channel->base+5 );
+	io_sg_cursor cur( req->sg );
+
+	// the data comes in pieces of at most 2048 bytes (the byte count limit send_atapi_command() asks for)
+	size_t remaining = req->n_sectors * 2048;
+	while( remaining > 0 ) {
+		while( (io_inb( this->channel->control ) & ATA_SR_BSY) > 0 ) asm volatile("pause");
+		if( (io_inb( this->channel->base+7 ) & ATA_SR_DRQ) == 0 ) {
+			break; // (nothing more coming)
+		}
 
-	uint16_t packet_sz = (((uint16_t)lba_hi) << 8) | lba_mid;
+		uint8_t lba_mid = io_inb( this->channel->base+4 );
+		uint8_t lba_hi = io_inb( this->channel->base+5 );
 
-	void* data = req->buffer.buffer_virt;
-	uint16_t *current = (uint16_t*)data;
+		uint16_t packet_sz = (((uint16_t)lba_hi) << 8) | lba_mid;
+		if( (packet_sz == 0) || (packet_sz > remaining) ) {
+			packet_sz = remaining;
+		}
 
-	//while( ((io_inb( this->channel->control ) & ATA_SR_BSY) > 0) || ((io_inb( this->channel->control ) & ATA_SR_DRQ) == 0) ) asm volatile("pause");
-	for(unsigned int j=0;j<packet_sz/2;j++) {
-		if( req->read )
-			*current++ = io_inw( this->channel->base );
-		else
-			io_outw( this->channel->base, *current++ );
+		ata_pio_sg( this->channel->base, &cur, packet_sz, req->read );
+		remaining -= packet_sz;
+		for(int k=0;k<4;k++) // 400 ns delay
+			io_inb( this->channel->control );
 	}
-	for(int k=0;k<4;k++) // 400 ns delay
-		io_inb( this->channel->control );
 
 	this->channel->controller->atapi_transfer_lock.unlock();
 }
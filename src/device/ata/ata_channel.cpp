@@ -20,67 +20,51 @@ void ata::ata_channel::select( uint8_t select_val ) {
 	}
 }
 
-void ata::ata_channel::enqueue_request( ata_transfer_request* req ) {
-    if( req->read ) {
-        this->read_queue.add_end( req );
-    } else {
-        this->write_queue.add_end( req );
-    }
-
-    if( this->currently_idle ) {
-        this->current_operation = req->read;
-        this->currently_idle = false;
-        //this->transfer_cycle();
-    }
+// A drive has something queued; make sure the request server is running.
+void ata::ata_channel::kick() {
+    this->currently_idle = false;
     process_wake(this->delayed_starter);
 }
 
+// The drives' I/O schedulers pick (and merge) what goes next; the drives themselves just take turns.
 void ata::ata_channel::transfer_cycle() {
     if( this->controller->ready ) {
-        this->current_operation = !this->current_operation;
-        if( (this->current_operation ? this->write_queue : this->read_queue).count() == 0 ) {
-            this->current_operation = !this->current_operation;
-            if( (this->current_operation ? this->write_queue : this->read_queue).count() == 0 ) {
-                this->current_transfer = NULL;
-                this->currently_idle = true;
-                return;
+        ata_device* dev = NULL;
+        transfer_request* req = NULL;
+        for( int i=0;(i<2) && (req == NULL);i++ ) {
+            this->last_slave = !this->last_slave;
+            dev = (this->last_slave ? this->slave : this->master);
+            if( (dev != NULL) && (dev->disk != NULL) ) {
+                req = dev->disk->dequeue();
             }
         }
-
-        this->current_transfer = (this->current_operation ? this->write_queue : this->read_queue).remove();
-
-        if(this->current_transfer->to_slave) {
-        	if(this->slave != NULL) {
-        		this->slave->do_pio_transfer( this->current_transfer );
-        	}
-        } else {
-        	if(this->master != NULL) {
-				this->master->do_pio_transfer( this->current_transfer );
-			}
+        if( req == NULL ) {
+            this->current_transfer = NULL;
+            this->currently_idle = true;
+            return;
         }
 
-        this->current_transfer->status = true;
+        this->current_transfer = new ata_transfer_request(*req);
+        this->current_transfer->to_slave = dev->is_slave;
+        dev->do_pio_transfer( this->current_transfer );
+
         //kprintf("ata_channel: transfer complete (id=%llu)\n", this->current_transfer->id);
-		message out(this->current_transfer, 0);
-		send_to_channel("transfer_complete", out);
+		this->current_transfer->complete( true ); // (wakes only whoever submitted it)
+		delete this->current_transfer; // (just our copy; the buffer belongs to the submitter)
 		this->current_transfer = NULL;
 
-		//this>delayed_starter->state = process_state::runnable; // indirectly schedule ourselves to run later
-		//process_add_to_runqueue(this->delayed_starter);
-
         this->currently_idle = false;
     }
 }
 
 bool ata::ata_channel::transfer_available() {
-    bool op = this->current_operation;
-    if( (op ? this->write_queue : this->read_queue).count() == 0 ) {
-        op = !op;
-        if( (op ? this->write_queue : this->read_queue).count() == 0 ) {
-            return false;
-        }
+    if( (this->master != NULL) && (this->master->disk != NULL) && !this->master->disk->queue_empty() ) {
+        return true;
     }
-    return true;
+    if( (this->slave != NULL) && (this->slave->disk != NULL) && !this->slave->disk->queue_empty() ) {
+        return true;
+    }
+    return false;
 }
 
 void ata::ata_channel::perform_requests( ata_channel *ch ) {
@@ -123,7 +107,6 @@ ata::ata_channel::ata_channel( ata_controller* controller, unsigned int channel_
 
 		device_manager::device_node* dev = new device_manager::device_node;
 		device_manager::device_node* base = &device_manager::root; //controller->dev_node;
-		dev->child_id = base->children.count();
 		dev->enabled = true;
 		dev->type = device_manager::dev_type::storage_controller;
 		if( !this->master->is_atapi ) {
@@ -133,8 +116,9 @@ ata::ata_channel::ata_channel( ata_controller* controller, unsigned int channel_
 		}
 		dev->device_data = (void*)disk;
 
-		base->children.add_end(dev);
+		device_manager::add_child( base, dev );
 		this->master->dev = dev;
+		this->master->disk = disk;
 
 		io_register_disk( disk );
 	}
@@ -144,7 +128,6 @@ ata::ata_channel::ata_channel( ata_controller* controller, unsigned int channel_
 
 		device_manager::device_node* dev = new device_manager::device_node;
 		device_manager::device_node* base = &device_manager::root; //this->controller->dev_node;
-		dev->child_id = base->children.count();
 		dev->enabled = true;
 		dev->type = device_manager::dev_type::storage_controller;
 		if( !this->slave->is_atapi ) {
@@ -154,14 +137,15 @@ ata::ata_channel::ata_channel( ata_controller* controller, unsigned int channel_
 		}
 		dev->device_data = (void*)disk;
 
-		base->children.add_end(dev);
+		device_manager::add_child( base, dev );
 		this->slave->dev = dev;
+		this->slave->disk = disk;
 
 		io_register_disk( disk );
 	}
 
 	void(*ptr)(ata_channel*) = (void(*)(ata_channel*))&this->perform_requests;
-	this->delayed_starter = new process(reinterpret_cast<uint32_t>(ptr), false, 0, "ata_channel_request_server", this, 1);
+	this->delayed_starter = kthread_create(reinterpret_cast<uint32_t>(ptr), 0, "ata_channel_request_server", this, 1);
 
 	kprintf("    * master: %s\n", this->master->model);
 	kprintf("    * %s, %u sectors addressable\n", ( this->master->lba48 ? "LBA48 supported" : "LBA48 not supported" ), this->master->n_sectors);
@@ -170,11 +154,10 @@ ata::ata_channel::ata_channel( ata_controller* controller, unsigned int channel_
 }
 
 void ata::ata_io_disk::send_request( transfer_request* req ) {
-	ata_transfer_request *ata_req = new ata_transfer_request(*req);
-
-	ata_req->to_slave = this->device->is_slave;
-	this->channel->enqueue_request(ata_req);
+	this->queue( req );
+	this->channel->kick();
 }
 
 unsigned int ata::ata_io_disk::get_sector_size()  { return this->device->sector_size; };
 unsigned int ata::ata_io_disk::get_total_size()  { return this->device->n_sectors * this->device->sector_size; };
+unsigned int ata::ata_io_disk::get_max_sectors() { return (this->device->is_atapi ? ATAPI_MAX_TRANSFER_SECTORS : ATA_MAX_TRANSFER_SECTORS); };
@@ -195,8 +195,7 @@ void ata::initialize() {
 			dev->resources.add_end(res);
 
 			device_manager::device_node* pnt = pci_search_device_tree( current->bus, 0xFF, 0xFF );
-			dev->child_id = pnt->children.count();
-			pnt->children.add_end(dev);
+			device_manager::add_child( pnt, dev );
 
 			controller->dev_node = dev;
 
@@ -114,6 +114,7 @@ void pci_get_int_routing() {
 					uint16_t device = ((addr >> 16) & 0xFFFF);
 
 					if( index != 0 ) {
+						device_manager::tree_lock.read_lock();
 						for(unsigned int i=0;i<bus->children.count();i++) {
 							pci_device* dev_data = (pci_device*)bus->children[i]->device_data;
 							//kprintf("pci: bus0: %u/%u\n", dev_data->device, dev_data->func);
@@ -126,6 +127,7 @@ void pci_get_int_routing() {
 								dev_data->ints[pin] = index;
 							}
 						}
+						device_manager::tree_lock.read_unlock();
 					}
 				} else {
 					kprintf("pci: _PRT package object %u has incorrect number of elements\n", i);
@@ -226,7 +228,6 @@ void pci_register_function(uint8_t bus, uint8_t device, uint8_t func, device_man
         device_manager::device_node* dev = new device_manager::device_node;
         dev->device_data = (void*)new_device;
         dev->enabled = true;
-        dev->child_id = bus_node->children.count();
         dev->type = device_manager::dev_type::pci_device;
 
         char* bus_str = itoa( bus, 16 );
@@ -241,7 +242,7 @@ void pci_register_function(uint8_t bus, uint8_t device, uint8_t func, device_man
 		kfree(tmp_str_1);
 		kfree(tmp_str_2);
 
-        bus_node->children.add_end(dev);
+        device_manager::add_child( bus_node, dev );
 
         char* ven_name = pci_get_ven_name(new_device->vendorID);
         char* dev_type = pci_get_dev_type( new_device->class_code, new_device->subclass_code, new_device->prog_if );
@@ -282,14 +283,18 @@ void pci_check_device( uint8_t bus, uint8_t device, device_manager::device_node*
 }
 
 device_manager::device_node* pci_search_device_tree( uint8_t bus, uint8_t device, uint8_t func ) {
-	for(unsigned int i=0;i<device_manager::root.children.count();i++) {
+	device_manager::device_node* ret = NULL;
+
+	device_manager::tree_lock.read_lock();
+	for(unsigned int i=0;(ret == NULL) && (i<device_manager::root.children.count());i++) {
 		if( device_manager::root.children[i]->type == device_manager::dev_type::pci_bus ) {
 			device_manager::device_node* dev = device_manager::root.children[i];
 			pci_device *dev_data = (pci_device*)dev->device_data;
 
 			if( dev_data->secondary_bus == bus ) {
 				if( device == 0xFF ) {
-					return dev;
+					ret = dev;
+					break;
 				} else {
 					for(unsigned int j=0;j<dev->children.count();j++) {
 						device_manager::device_node* child = dev->children[j];
@@ -297,7 +302,8 @@ device_manager::device_node* pci_search_device_tree( uint8_t bus, uint8_t device
 							pci_device *chld_data = (pci_device*)child->device_data;
 							if( chld_data->device == device ) {
 								if( (func == 0xFF) || (chld_data->func == func) ) {
-									return child;
+									ret = child;
+									break;
 								}
 							}
 						}
@@ -307,7 +313,9 @@ device_manager::device_node* pci_search_device_tree( uint8_t bus, uint8_t device
 		}
 	}
 
-	return NULL;
+	device_manager::tree_lock.read_unlock();
+
+	return ret;
 }
 
 void pci_check_bus( uint8_t bus, uint8_t bus_bloc, uint8_t bus_dloc, uint8_t bus_floc ) {
@@ -329,14 +337,13 @@ void pci_check_bus( uint8_t bus, uint8_t bus_bloc, uint8_t bus_dloc, uint8_t bus
 
 	bus_node->type = device_manager::dev_type::pci_bus;
 	bus_node->device_data = (void*)new_device;
-	bus_node->child_id = device_manager::root.children.count();
 	bus_node->enabled = true;
 
 	char* bus_str = itoa( bus, 16 );
 	bus_node->human_name = concatentate_strings(const_cast<char*>("PCI"), bus_str );
 	kfree(bus_str);
 
-	device_manager::root.children.add_end(bus_node);
+	device_manager::add_child( &device_manager::root, bus_node );
 
     for( uint8_t device=0;device<32;device++ ) {
         pci_check_device( bus, device, bus_node );
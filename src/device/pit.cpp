@@ -9,6 +9,7 @@
 #include "device/vga.h"
 #include "device/pit.h"
 #include "core/device_manager.h"
+#include "core/rcu.h"
 
 unsigned long long int tick_counter = 0;
 
@@ -19,6 +20,9 @@ unsigned long long int sys_timer_ms = 0;
 double sys_timer_ms_fraction = 0;
 double ms_per_tick = 0; // (1/pit_frequency)*1000
 
+// tick_counter and sys_timer_ms are 64-bit, so readers could otherwise see a half-updated value.
+static seqlock sys_timer_lock;
+
 // This is called AFTER context switching, but before new task context is loaded.
 bool irq0_handler( uint8_t irq_num ) {
     /*
@@ -26,12 +30,14 @@ bool irq0_handler( uint8_t irq_num ) {
         kprintf("IRQ0!\nTimeslice counter: 0x%x!\n", (unsigned long long int)multitasking_timeslice_tick_count);
     }
     */
+    sys_timer_lock.write_begin();
     tick_counter++;
     sys_timer_ms_fraction += ms_per_tick;
     int ms_added = floor(sys_timer_ms_fraction);
 
     sys_timer_ms += ms_added;
     sys_timer_ms_fraction = fractional(sys_timer_ms_fraction);
+    sys_timer_lock.write_end();
     
     if( multitasking_enabled && (process_current != NULL) ) {
         if( process_current->in_syscall != 0 )
@@ -39,16 +45,31 @@ bool irq0_handler( uint8_t irq_num ) {
         else
             process_current->times.prog_exec++;
     }
+
+    process_check_timeouts();
+    rcu_note_context_switch();
     
     return true;
 }
 
 unsigned long long int get_sys_elapsed_time() {
-    return tick_counter;
+    unsigned long long int ticks;
+    uint32_t seq;
+    do {
+        seq = sys_timer_lock.read_begin();
+        ticks = tick_counter;
+    } while( sys_timer_lock.read_retry( seq ) );
+    return ticks;
 }
 
 unsigned long long int get_sys_time_counter() {
-    return sys_timer_ms;
+    unsigned long long int ms;
+    uint32_t seq;
+    do {
+        seq = sys_timer_lock.read_begin();
+        ms = sys_timer_ms;
+    } while( sys_timer_lock.read_retry( seq ) );
+    return ms;
 }
 
 void set_pit_reload_val(short reload_val) {
@@ -66,7 +87,6 @@ void pit_initialize(short reload_val) {
     irq_add_handler(0, &irq0_handler);
 
     device_manager::device_node* dev = new device_manager::device_node;
-	dev->child_id = device_manager::root.children.count();
 	dev->enabled = true;
 	dev->type = device_manager::dev_type::timer;
 	dev->human_name = const_cast<char*>("8254 PIT");
@@ -79,5 +99,5 @@ void pit_initialize(short reload_val) {
 
 	dev->resources.add_end(res);
 
-	device_manager::root.children.add_end( dev );
+	device_manager::add_child( &device_manager::root, dev );
 }
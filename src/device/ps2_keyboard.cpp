@@ -21,6 +21,7 @@ ps2_keypress* keystroke_buffer[256];
 int keystroke_buffer_offset = 0;
 
 process *keyboard_input_process;
+static channel_handle keypress_channel = CHANNEL_INVALID_HANDLE;
 
 char shift_char(char in) {
     switch(in) {
@@ -116,13 +117,14 @@ ps2_keypress* convert_scancode(bool f0, bool e0, unsigned char code_end) {
 
 ps2_keypress* ps2_keyboard_get_keystroke() { // blocks for a keystroke
     ps2_keypress* data;
-    channel_receiver ch = listen_to_channel("keypress");
+    channel_receiver ch = listen_to_channel(keypress_channel);
 
     ch.wait();
 
 	unique_ptr<message> msg = ch.queue.remove(0);
-	data = (ps2_keypress*)(msg->data);
-	msg->data = NULL;
+	// (the payload is shared with every other listener, so hand the caller its own copy)
+	data = new ps2_keypress;
+	memcpy( (void*)data, msg->data, sizeof(ps2_keypress) );
 
 	return data;
 }
@@ -131,7 +133,7 @@ void ps2_keyboard_input_process() {
     bool e0 = false;
     bool f0 = false;
 
-    channel_receiver ch = listen_to_channel("ps2_data");
+    channel_receiver ch = listen_to_channel(ps2_data_channel);
     while(true) {
     	unsigned char data;
 
@@ -161,7 +163,7 @@ void ps2_keyboard_input_process() {
         	ps2_keypress* key = convert_scancode(f0, e0, data);
         	//kprintf("ps2kb_in: sending keypress event (release=%s).\n", (key->released ? "true" : "false"));
 			message msg( key, sizeof(ps2_keypress) );
-			send_to_channel( "keypress", msg );
+			send_to_channel( keypress_channel, msg );
             e0 = false;
             f0 = false;
         }
@@ -188,26 +190,27 @@ void ps2_keyboard_initialize() {
         ps2_send_byte(0xF4, false); // 0xF4 - Enable scanning
         ps2_wait_for_input();
     //}
-    keyboard_input_process = new process( (size_t)&ps2_keyboard_input_process, false, 0, "ps2kb_in" ,NULL, 0 );
+    keyboard_input_process = kthread_create( (size_t)&ps2_keyboard_input_process, 0, "ps2kb_in" );
+    keypress_channel = register_channel( "keypress" );
     spawn_process( keyboard_input_process, true );
-    register_channel( "keypress" );
 
     device_manager::device_node* kbc = NULL;
 
+    device_manager::tree_lock.read_lock();
     for(unsigned int i=0;i<device_manager::root.children.count();i++) {
     	if( device_manager::root.children[i]->type == device_manager::dev_type::ps2_controller ) {
     		kbc = device_manager::root.children[i];
     		break;
     	}
     }
+    device_manager::tree_lock.read_unlock();
 
     device_manager::device_node* dev = new device_manager::device_node;
-	dev->child_id = kbc->children.count();
 	dev->enabled = true;
 	dev->type = device_manager::dev_type::human_input;
 	dev->human_name = const_cast<char*>("PS/2 Keyboard");
 
-	kbc->children.add_end(dev);
+	device_manager::add_child( kbc, dev );
 }
 
 char* ps2_keyboard_readline(unsigned int *len) {
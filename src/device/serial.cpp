@@ -9,6 +9,8 @@
 
 static process *uart_writer_process; 
 bool serial_initialized = false;
+channel_handle serial_recv_channel = CHANNEL_INVALID_HANDLE;
+channel_handle serial_xmit_channel = CHANNEL_INVALID_HANDLE;
 
 // set_dlab - set or clear the DLAB bit.
 void set_dlab(short base, bool val) {
@@ -207,7 +209,7 @@ void uart_fifo_reader() {
 */
 
 void uart_writer() {
-	channel_receiver ch = listen_to_channel("serial_xmit");
+	channel_receiver ch = listen_to_channel(serial_xmit_channel);
     while(true) {
     	ch.wait();
 
@@ -255,7 +257,7 @@ bool serial_irq( uint8_t irq_num ) {
 			d->port = port_int;
 
 			message m( (void*)d, sizeof(serial_data) );
-			send_to_channel( "serial_recv", m );
+			send_to_channel( serial_recv_channel, m );
 		}
     }
     
@@ -270,9 +272,9 @@ void initialize_serial(short base, short divisor) {
     io_outb(base+FCR_IIR_OFFSET, FCR_FIFO_ON | FCR_FIFO_CLEAR_RECV | FCR_FIFO_CLEAR_TRANS | FCR_FIFO_INT_TRIG_14x);
     io_outb(base+MCR_OFFSET, MCR_DATA_TERM_READY | MCR_REQUEST_TO_SEND | MCR_AUX_OUT_2);
     
-    uart_writer_process = new process( (size_t)&uart_writer, false, 0, "uart_writer", NULL, 0 );
-    register_channel( "serial_recv" );
-    register_channel( "serial_xmit" );
+    uart_writer_process = kthread_create( (size_t)&uart_writer, 0, "uart_writer" );
+    serial_recv_channel = register_channel( "serial_recv" );
+    serial_xmit_channel = register_channel( "serial_xmit" );
 	spawn_process(uart_writer_process);
     irq_add_handler(4, &serial_irq);
     serial_enable_interrupts();
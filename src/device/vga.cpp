@@ -5,7 +5,7 @@
 #include "device/vga.h"
 #include "core/device_manager.h"
 
-static spinlock __vga_write_lock;
+static spinlock __vga_write_lock("vga");
 
 const size_t VGA_WIDTH = 80;
 const size_t VGA_HEIGHT = 24;
@@ -46,7 +46,6 @@ void terminal_initialize()
 
 void terminal_device_initialize() {
 	device_manager::device_node* dev = new device_manager::device_node;
-	dev->child_id = device_manager::root.children.count();
 	dev->enabled = true;
 	dev->type = device_manager::dev_type::human_output;
 	dev->device_data = NULL;
@@ -60,7 +59,7 @@ void terminal_device_initialize() {
 
 	dev->resources.add_end(res);
 
-	device_manager::root.children.add_end( dev );
+	device_manager::add_child( &device_manager::root, dev );
 }
  
 void terminal_setcolor(char color)
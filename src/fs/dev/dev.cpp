@@ -11,9 +11,16 @@
 using namespace device_manager;
 
 // the fs_info for a vfs_node in the devfs is a pointer to either the resource entry (for files)
-// or the device node (for directories)
+// or the device node (for directories).
+// Files under /dev/locks are the exception: their fs_info is the spinlock_stats for that lock.
 
 void dev_fs::read_file( vfs_file* file, void* buffer ) {
+	if( file->parent == this->locks_dir ) {
+		memset( buffer, 0, SPINLOCK_STATS_TEXT_SIZE );
+		spinlock_stats_format( (spinlock_stats*)file->fs_info, (char*)buffer, SPINLOCK_STATS_TEXT_SIZE );
+		return;
+	}
+
 	device_resource* rsc = (device_resource*)file->fs_info;
 
 	switch(rsc->type) {
@@ -85,8 +92,18 @@ void dev_fs::read_file( vfs_file* file, void* buffer ) {
 }
 
 void dev_fs::read_directory( vfs_directory* parent, vfs_directory *child ) {
+	if( child == this->locks_dir ) {
+		for( spinlock_stats* stats = spinlock_stats_list; stats != NULL; stats = stats->next ) {
+			vfs_file* file = new vfs_file( child, this, (void*)stats, (unsigned char*)const_cast<char*>(stats->name) );
+			file->size = SPINLOCK_STATS_TEXT_SIZE;
+			child->files.add_end(file);
+		}
+		return;
+	}
+
 	device_node* device = (device_node*)child->fs_info;
 
+	tree_lock.read_lock();
 	//vfs_directory *out = new vfs_directory( parent, this, (void*)child->fs_info, child->name );
 	for(unsigned int i=0;i<device->children.count();i++) {
 		unsigned char* new_name = (unsigned char*)kmalloc(strlen(device->children[i]->human_name));
@@ -138,6 +155,7 @@ void dev_fs::read_directory( vfs_directory* parent, vfs_directory *child ) {
 		}
 		child->files.add_end(file);
 	}
+	tree_lock.read_unlock();
 
 	//return out;
 }
@@ -146,6 +164,7 @@ dev_fs::dev_fs() {
 	device_node* device = (device_node*)&root;
 
 	vfs_directory *out = new vfs_directory( NULL, this, (void*)device, NULL );
+	tree_lock.read_lock();
 	for(unsigned int i=0;i<device->children.count();i++) {
 		unsigned char* new_name = (unsigned char*)kmalloc(strlen(device->children[i]->human_name));
 
@@ -188,6 +207,10 @@ dev_fs::dev_fs() {
 			out->files.add_end(file);
 		}
 	}
+	tree_lock.read_unlock();
+
+	this->locks_dir = new vfs_directory( out, this, NULL, (unsigned char*)const_cast<char*>("locks") );
+	out->files.add_end(this->locks_dir);
 
 	this->base = out;
 
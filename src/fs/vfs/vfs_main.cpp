@@ -10,18 +10,83 @@
 
 vector<vfs::mount_point*> vfs::mounted_filesystems;
 vfs_directory* vfs::vfs_root;
+rwlock vfs::tree_lock;
 
 vfs_directory::~vfs_directory() {
 	for(unsigned int i=0;i<this->files.count();i++) {
 		delete this->files[i];
 	}
+	if( this->children != NULL ) {
+		kfree( (void*)this->children );
+	}
 	this->fs->cleanup_node( this );
 }
 
+static void free_child_list( rcu_head* head ) {
+	kfree( (void*)rcu_container( head, vfs_child_list, rcu ) );
+}
+
+// Replace the snapshot of our contents that lock-free readers see with a copy of files.
+// Must be called (with tree_lock held for writing) after every change to files.
+void vfs_directory::publish_children() {
+	unsigned int n = this->files.count();
+	vfs_child_list* list = (vfs_child_list*)kmalloc( sizeof(vfs_child_list) + (n * sizeof(vfs_node*)) );
+	if( list == NULL ) {
+		panic("vfs: could not allocate directory snapshot!\n");
+	}
+	list->count = n;
+	list->nodes = (vfs_node**)(list+1);
+	for(unsigned int i=0;i<n;i++) {
+		list->nodes[i] = this->files[i];
+	}
+
+	vfs_child_list* old = this->children;
+	asm volatile("" : : : "memory"); // the list has to be filled in before anyone can see it
+	this->children = list;
+	if( old != NULL ) {
+		call_rcu( &old->rcu, &free_child_list );
+	}
+}
+
 // NOTE: the VFS subsystem (in src/fs/vfs) maintains node consistency itself!
 // The underlying FS drivers shouldn't modify the node contents themselves when adding or deleting files/directories!
 
-vfs::vfs_status vfs::get_file_info( unsigned char* path, vfs_node** out ) {
+// Make sure a directory's contents have been read in from its filesystem and published for readers.
+// Filesystems build their root directories before they're mounted, so those only need publishing.
+static void expand_directory( vfs_directory* parent, vfs_directory* dir, bool write_locked ) {
+	if( dir->expanded && (dir->children != NULL) ) {
+		return;
+	}
+	if( !write_locked )
+		vfs::tree_lock.write_lock();
+	if( !(dir->expanded) ) {
+		dir->fs->read_directory( parent, dir );
+		dir->expanded = true;
+	}
+	if( dir->children == NULL ) {
+		dir->publish_children();
+	}
+	if( !write_locked )
+		vfs::tree_lock.write_unlock();
+}
+
+static vfs_node* find_child( vfs_directory* dir, unsigned char* name ) {
+	vfs_child_list* list = dir->children;
+	asm volatile("" : : : "memory");
+	if( list == NULL ) {
+		return NULL;
+	}
+	for(unsigned int i=0;i<list->count;i++) {
+		if( strcmp(list->nodes[i]->name, name) ) {
+			return list->nodes[i];
+		}
+	}
+	return NULL;
+}
+
+// Walk the tree down to path, through the directories' published snapshots.
+// Unless the caller holds tree_lock for writing, this must be done within rcu_read_lock().
+vfs::vfs_status vfs::lookup_node( unsigned char* path, vfs_node** out, bool write_locked ) {
 	vector<unsigned char*> path_components = vfs::split_path(path);
 
 	/*
@@ -40,54 +105,44 @@ vfs::vfs_status vfs::get_file_info( unsigned char* path, vfs_node** out ) {
 
 	vfs_directory* last = NULL;
 	vfs_directory* cur = vfs_root;
+	expand_directory( NULL, cur, write_locked );
 	for(unsigned int i=1;i<path_components.count();i++) {
-		bool found = false;
-		for(unsigned int j=0;j<cur->files.count();j++) {
-			//kprintf("vfs_get_file_info: j=%u / %u\n", j, cur->files.count());
-			vfs_node* cur_node = cur->files[j];
-			if( strcmp(cur_node->name, path_components[i-1]) && (cur_node->type == vfs_node_types::directory) ) {
-				last = cur;
-				cur = (vfs_directory*)cur_node;
-
-				if( !(cur->expanded) ) {
-					cur->fs->read_directory( last, cur );
-				}
-				cur->expanded = true;
-
-				found = true;
-				break;
-			}
-		}
-		if(!found) {
+		vfs_node* cur_node = find_child( cur, path_components[i-1] );
+		if( (cur_node == NULL) || (cur_node->type != vfs_node_types::directory) ) {
 			if( out != NULL ) {
 				*out = NULL;
 			}
 			//kprintf("vfs_get_file_info: did not find file %s: could not find directory component\n", path);
 			return vfs_status::not_found;
 		}
-	}
+		last = cur;
+		cur = (vfs_directory*)cur_node;
 
-	for(unsigned int j=0;j<cur->files.count();j++) {
-		vfs_node* cur_node = cur->files[j];
-		if( strcmp(cur_node->name, path_components[path_components.count()-1]) ) {
-			if( out != NULL ) {
-				*out = cur_node;
-			}
-			//kprintf("vfs_get_file_info: found file %s\n", path);
-			return vfs_status::ok;
-		}
+		expand_directory( last, cur, write_locked );
 	}
 
+	vfs_node* cur_node = find_child( cur, path_components[path_components.count()-1] );
 	if( out != NULL ) {
-		*out = NULL;
+		*out = cur_node;
+	}
+	if( cur_node != NULL ) {
+		//kprintf("vfs_get_file_info: found file %s\n", path);
+		return vfs_status::ok;
 	}
 	//kprintf("vfs_get_file_info: did not find file %s: no matching file in stem\n", path);
 	return vfs_status::not_found;
 }
 
-vfs::vfs_status get_path_parent( unsigned char* path, vfs_directory** out ) {
+vfs::vfs_status vfs::get_file_info( unsigned char* path, vfs_node** out ) {
+	rcu_read_lock();
+	vfs_status stat = lookup_node( path, out );
+	rcu_read_unlock();
+	return stat;
+}
+
+vfs::vfs_status get_path_parent( unsigned char* path, vfs_directory** out, bool write_locked=false ) {
 	kprintf("vfs::get_path_parent: pathstem = %s\n", vfs::get_pathstem(path));
-	return vfs::get_file_info( vfs::get_pathstem(path), (vfs_node**)out );
+	return vfs::lookup_node( vfs::get_pathstem(path), (vfs_node**)out, write_locked );
 }
 
 bool vfs::file_exists( unsigned char* path ) {
@@ -101,48 +156,40 @@ bool vfs::file_exists( unsigned char* path ) {
 vfs::vfs_status vfs::list_directory(unsigned char* path, vector<vfs_node*>* out) {
 	vfs_node *node;
 
-	vfs_status stat = vfs::get_file_info(path, &node);
+	rcu_read_lock();
+	vfs_status stat = lookup_node(path, &node);
 	if( stat != vfs_status::ok ) {
+		rcu_read_unlock();
 		return stat;
 	}
 
 	if( node->type != vfs_node_types::directory ) {
+		rcu_read_unlock();
 		return vfs_status::incorrect_type;
 	}
 
 	vfs_directory *dir = (vfs_directory*)node;
-	vfs_directory *parent;
+	expand_directory( (vfs_directory*)dir->parent, dir, false );
 
-	stat = get_path_parent( path, &parent );
-	if( stat != vfs_status::ok ) {
-		return stat;
-	}
-
-	if( !(dir->expanded) ) {
-		dir->fs->read_directory( parent, dir );
-	}
-	dir->expanded = true;
-
-	for(unsigned int i=0;i<dir->files.count();i++) {
-		out->add_end( dir->files[i] );
+	vfs_child_list* list = dir->children;
+	for(unsigned int i=0;i<list->count;i++) {
+		out->add_end( list->nodes[i] );
 	}
+	rcu_read_unlock();
 
 	return vfs_status::ok;
 }
 
-vfs::vfs_status vfs::create_directory( unsigned char* path ) {
+vfs::vfs_status vfs::create_directory_locked( unsigned char* path ) {
 	vfs_directory* parent;
 	vfs_status stat;
 	unsigned char* name = vfs::get_filename(path);
 
-	if( (stat = get_path_parent( path, &parent )) != vfs_status::ok ) {
+	if( (stat = get_path_parent( path, &parent, true )) != vfs_status::ok ) {
 		return stat;
 	}
 
-	if( !(parent->expanded) ) {
-		parent->fs->read_directory( (vfs_directory*)parent->parent, parent );
-	}
-	parent->expanded = true;
+	expand_directory( (vfs_directory*)parent->parent, parent, true );
 
 	for(unsigned int i=0;i<parent->files.count();i++) {
 		if( strcmp( parent->files[i]->name, name ) ) {
@@ -152,15 +199,23 @@ vfs::vfs_status vfs::create_directory( unsigned char* path ) {
 
 	vfs_node* new_node = (vfs_node*)parent->fs->create_directory( name, parent );
 	parent->files.add(new_node);
+	parent->publish_children();
 
 	return vfs_status::ok;
 }
 
-vfs::vfs_status vfs::delete_file( unsigned char* path ) {
+vfs::vfs_status vfs::create_directory( unsigned char* path ) {
+	tree_lock.write_lock();
+	vfs_status stat = create_directory_locked( path );
+	tree_lock.write_unlock();
+	return stat;
+}
+
+vfs::vfs_status vfs::delete_file_locked( unsigned char* path ) {
 	vfs_node* node;
 	vfs_status stat;
 
-	if( (stat = get_file_info( path, &node )) != vfs_status::ok ) {
+	if( (stat = lookup_node( path, &node, true )) != vfs_status::ok ) {
 		return stat;
 	}
 
@@ -180,44 +235,57 @@ vfs::vfs_status vfs::delete_file( unsigned char* path ) {
 			break;
 		}
 	}
+	parent->publish_children();
 
 	return vfs_status::ok;
 }
 
+vfs::vfs_status vfs::delete_file( unsigned char* path ) {
+	tree_lock.write_lock();
+	vfs_status stat = delete_file_locked( path );
+	tree_lock.write_unlock();
+	return stat;
+}
+
 vfs::vfs_status vfs::read_file( unsigned char* path, void* buffer ) {
 	vfs_node* node;
 	vfs_status stat;
 
-	if( (stat = get_file_info( path, &node )) != vfs_status::ok ) {
+	rcu_read_lock();
+	if( (stat = lookup_node( path, &node )) != vfs_status::ok ) {
+		rcu_read_unlock();
 		return stat;
 	}
 
 	if( node->type != vfs_node_types::file ) {
+		rcu_read_unlock();
 		return vfs_status::incorrect_type;
 	}
 
 	node->fs->read_file((vfs_file*)node, buffer);
+	rcu_read_unlock();
 
 	return vfs_status::ok;
 }
 
-vfs::vfs_status vfs::write_file(unsigned char* path, void* buffer, size_t size) {
+vfs::vfs_status vfs::write_file_locked(unsigned char* path, void* buffer, size_t size) {
 	vfs_status stat;
 
 	vfs_node *node;
-	stat = get_file_info( path, &node );
+	stat = lookup_node( path, &node, true );
 
 	if( !((buffer == NULL) || (size == 0)) ) {
 		if( stat == vfs_status::not_found ) {
 			// file does not exist, create it
 			vfs_directory *parent;
 
-			if( (stat = get_path_parent( path, &parent )) != vfs_status::ok ) {
+			if( (stat = get_path_parent( path, &parent, true )) != vfs_status::ok ) {
 				return stat;
 			}
 
 			node = parent->fs->create_file( get_filename(path), parent );
 			parent->files.add_end( node );
+			parent->publish_children();
 
 			stat = vfs_status::ok;
 		}
@@ -239,12 +307,13 @@ vfs::vfs_status vfs::write_file(unsigned char* path, void* buffer, size_t size)
 		if( stat == vfs_status::not_found ) {
 			vfs_directory *parent;
 
-			if( (stat = get_path_parent( path, &parent )) != vfs_status::ok ) {
+			if( (stat = get_path_parent( path, &parent, true )) != vfs_status::ok ) {
 				return stat;
 			}
 
 			node = parent->fs->create_file( get_filename(path), parent );
 			parent->files.add_end( node );
+			parent->publish_children();
 
 			return vfs_status::ok;
 		} else if( stat == vfs_status::ok ) {
@@ -257,23 +326,45 @@ vfs::vfs_status vfs::write_file(unsigned char* path, void* buffer, size_t size)
 	return vfs_status::unknown_error;
 }
 
+vfs::vfs_status vfs::write_file(unsigned char* path, void* buffer, size_t size) {
+	tree_lock.write_lock();
+	vfs_status stat = write_file_locked(path, buffer, size);
+	tree_lock.write_unlock();
+	return stat;
+}
+
+// Read an entire file into a new buffer (used by copy_file and move_file, which then write it back out
+// through the locking write_file()).
+static vfs::vfs_status read_whole_file( unsigned char* path, void** out, size_t* size ) {
+	vfs_node* node;
+	vfs::vfs_status stat;
+
+	rcu_read_lock();
+	if( (stat = vfs::lookup_node( path, &node )) == vfs::vfs_status::ok ) {
+		if( node->type == vfs_node_types::file ) {
+			vfs_file* src = (vfs_file*)node;
+			*size = src->size;
+			*out = kmalloc(src->size);
+			node->fs->read_file(src, *out);
+		} else {
+			stat = vfs::vfs_status::incorrect_type;
+		}
+	}
+	rcu_read_unlock();
+
+	return stat;
+}
+
 vfs::vfs_status vfs::copy_file( unsigned char* to, unsigned char* from ) {
-	vfs_node* from_node;
+	void* tmp;
+	size_t size;
 	vfs_status stat;
 
-	if( (stat = get_file_info( from, &from_node )) != vfs_status::ok ) {
+	if( (stat = read_whole_file( from, &tmp, &size )) != vfs_status::ok ) {
 		return stat;
 	}
 
-	if( from_node->type != vfs_node_types::file ) {
-		return vfs_status::incorrect_type;
-	}
-
-	vfs_file* src = (vfs_file*)from_node;
-	void* tmp = kmalloc(src->size);
-	from_node->fs->read_file(src, tmp);
-
-	return write_file( to, tmp, src->size );
+	return write_file( to, tmp, size );
 
 	/*
 
@@ -306,23 +397,16 @@ vfs::vfs_status vfs::copy_file( unsigned char* to, unsigned char* from ) {
 
 vfs::vfs_status vfs::move_file( unsigned char* to, unsigned char* from ) {
 	//vfs_node* to_node;
-	vfs_node* from_node;
+	void* tmp;
+	size_t size;
 	vfs_status stat;
 
-	if( (stat = get_file_info( from, &from_node )) != vfs_status::ok ) {
+	if( (stat = read_whole_file( from, &tmp, &size )) != vfs_status::ok ) {
 		return stat;
 	}
 
-	if( from_node->type != vfs_node_types::file ) {
-		return vfs_status::incorrect_type;
-	}
-
-	vfs_file* src = (vfs_file*)from_node;
-	void* tmp = kmalloc(src->size);
-	from_node->fs->read_file(src, tmp);
-
 	//vfs_directory *dst = (vfs_directory*)to_node;
-	if( (stat = write_file( to, tmp, src->size )) != vfs_status::ok ) {
+	if( (stat = write_file( to, tmp, size )) != vfs_status::ok ) {
 		return stat;
 	}
 	return delete_file( from );
@@ -372,21 +456,23 @@ vfs::vfs_status vfs::move_file( unsigned char* to, unsigned char* from ) {
 	*/
 }
 
-vfs::vfs_status vfs::mount( vfs_fs* fs, unsigned char* path ) {
-	if( file_exists(path) ) {
+vfs::vfs_status vfs::mount_locked( vfs_fs* fs, unsigned char* path ) {
+	if( lookup_node( path, NULL, true ) == vfs_status::ok ) {
 		return vfs_status::already_exists;
 	}
 
 	vfs_directory* parent;
 	vfs_status stat;
 
-	if( (stat = get_path_parent( path, &parent )) != vfs_status::ok ) {
+	if( (stat = get_path_parent( path, &parent, true )) != vfs_status::ok ) {
 		return stat;
 	}
 
-	parent->files.add_end( (vfs_node*)fs->base );
 	fs->base->name = vfs::get_filename(path);
 	fs->base->parent = (vfs_node*)parent;
+	fs->base->publish_children();
+	parent->files.add_end( (vfs_node*)fs->base );
+	parent->publish_children();
 	vfs::mount_point *mount_entry = new vfs::mount_point;
 	mount_entry->filesystem = fs;
 	mount_entry->path = (unsigned char*)kmalloc(strlen(path)+1);
@@ -401,15 +487,29 @@ vfs::vfs_status vfs::mount( vfs_fs* fs, unsigned char* path ) {
 	return vfs_status::ok;
 }
 
-vfs::vfs_status vfs::unmount( unsigned char* path ) {
-	if( !file_exists(path) ) {
+vfs::vfs_status vfs::mount( vfs_fs* fs, unsigned char* path ) {
+	tree_lock.write_lock();
+	vfs_status stat = mount_locked( fs, path );
+	tree_lock.write_unlock();
+	return stat;
+}
+
+static void free_mount_point( rcu_head* head ) {
+	vfs::mount_point* mount_entry = rcu_container( head, vfs::mount_point, rcu );
+	delete mount_entry->filesystem;
+	delete mount_entry->path;
+	delete mount_entry;
+}
+
+vfs::vfs_status vfs::unmount_locked( unsigned char* path ) {
+	if( lookup_node( path, NULL, true ) != vfs_status::ok ) {
 		return vfs_status::not_found;
 	}
 
 	vfs_directory* parent;
 	vfs_status stat;
 
-	if( (stat = get_path_parent( path, &parent )) != vfs_status::ok ) {
+	if( (stat = get_path_parent( path, &parent, true )) != vfs_status::ok ) {
 		return stat;
 	}
 
@@ -430,10 +530,16 @@ vfs::vfs_status vfs::unmount( unsigned char* path ) {
 			break;
 		}
 	}
+	parent->publish_children();
 
-	delete mount_entry->filesystem;
-	delete mount_entry->path;
-	delete mount_entry;
+	call_rcu( &mount_entry->rcu, free_mount_point );
 
 	return vfs_status::ok;
 }
+
+vfs::vfs_status vfs::unmount( unsigned char* path ) {
+	tree_lock.write_lock();
+	vfs_status stat = unmount_locked( path );
+	tree_lock.write_unlock();
+	return stat;
+}
@@ -0,0 +1,56 @@
+// fpu.h -- x87 / SSE state management
+#pragma once
+#include "includes.h"
+
+// FXSAVE / FXRSTOR operate on a 512-byte, 16-byte aligned area.
+// (FNSAVE only needs 108 bytes, so the same area works for CPUs without FXSR.)
+#define FPU_STATE_SIZE          512
+#define FPU_STATE_ALIGN         16
+
+#define CR0_MP                  (1<<1)
+#define CR0_EM                  (1<<2)
+#define CR0_TS                  (1<<3)
+#define CR0_NE                  (1<<5)
+#define CR4_OSFXSR              (1<<9)
+#define CR4_OSXMMEXCPT          (1<<10)
+
+struct process;
+
+// Per-process saved FPU state.
+// The state is only saved / restored lazily (see fpu_handle_device_not_available),
+// so processes that never touch the FPU never pay for an FXSAVE.
+typedef struct fpu_context {
+    void*    raw;   // kmalloc'd area (kmalloc only guarantees 8-byte alignment)
+    uint8_t* state; // 16-byte aligned save area within raw
+    bool     used;  // false until the process first executes an FPU / SSE instruction
+
+    fpu_context();
+    ~fpu_context();
+} fpu_context;
+
+extern bool fpu_has_fxsr;
+extern bool fpu_has_sse;
+extern struct process* fpu_owner;
+
+extern void fpu_initialize();
+extern void fpu_switch( struct process* next );
+extern void fpu_fork( struct process* parent, struct process* child );
+extern void fpu_process_exit( struct process* proc );
+extern void kernel_fpu_begin();
+extern void kernel_fpu_end();
+
+extern "C" {
+    extern void fpu_handle_device_not_available();
+}
+
+inline void fpu_clts() {
+    asm volatile("clts" : : : "memory");
+}
+
+inline void fpu_stts() {
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0) : : "memory");
+    if( (cr0 & CR0_TS) == 0 ) {
+        asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS) : "memory");
+    }
+}
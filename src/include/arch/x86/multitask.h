@@ -1,45 +1,101 @@
 // multitask.h
 #pragma once
 #include "core/paging.h"
+#include "core/syscall.h"
 
 #define UMODE_STACK_PAGES 2
 #define MULTITASKING_RUN_TIMESLICE      50
 
+#define MSR_IA32_SYSENTER_CS            0x174
+#define MSR_IA32_SYSENTER_ESP           0x175
+#define MSR_IA32_SYSENTER_EIP           0x176
+
+// Saved state of a process that isn't currently running.
+// Everything else lives on the process' own kernel stack: the interrupted context in a trap_frame,
+// and the callee-saved registers of the scheduler call chain in a switch_frame on top of it.
 typedef struct cpu_regs {
-    uint32_t eax;     // 0
-    uint32_t ebx;     // 4
-    uint32_t ecx;     // 8
-    uint32_t edx;     // 12
-    uint32_t esi;     // 16
-    uint32_t edi;     // 20
-    uint32_t eip;     // 24
-    uint32_t eflags;  // 28
-    uint32_t esp;     // 32
-    uint32_t ebp;     // 36
-    uint16_t cs;      // 40
-    uint16_t ds;      // 42
-    uint16_t es;      // 44
-    uint16_t fs;      // 46
-    uint16_t gs;      // 48
-    uint16_t ss;      // 50
-    uint32_t cr3;     // 52
-    uint32_t kernel_stack; // 56
+    uint32_t esp;          // 0: saved kernel ESP, points to a switch_frame
+    uint32_t cr3;          // 4
+    uint32_t kernel_stack; // 8: stack used on entry from user mode (TSS esp0); 0 for kernel processes
     
     void clear();
-    void load_from_active();
-    void load_to_active();
 } cpu_regs;
 
+// Pushed by the int $0x5C and preemption entry stubs (see multitask_ll.s), lowest address first.
+typedef struct trap_frame {
+    uint32_t gs;
+    uint32_t fs;
+    uint32_t es;
+    uint32_t ds;
+    // pusha
+    uint32_t edi;
+    uint32_t esi;
+    uint32_t ebp;
+    uint32_t esp_ignored;
+    uint32_t ebx;
+    uint32_t edx;
+    uint32_t ecx;
+    uint32_t eax;
+    // pushed by the CPU
+    uint32_t eip;
+    uint32_t cs;
+    uint32_t eflags;
+    uint32_t user_esp; // only present when coming from user mode
+    uint32_t user_ss;
+} trap_frame;
+
+// size of a trap_frame for an interrupted kernel-mode context (no user_esp / user_ss)
+#define TRAP_FRAME_KERNEL_SIZE      (sizeof(trap_frame) - 8)
+
+// Pushed by __switch_to.
+typedef struct switch_frame {
+    uint32_t edi;
+    uint32_t esi;
+    uint32_t ebx;
+    uint32_t ebp;
+    uint32_t eip; // return address
+} switch_frame;
+
 extern "C" {
     extern uint32_t multitasking_enabled;
     extern uint32_t multitasking_timeslice_reset_value;
     extern uint32_t multitasking_timeslice_tick_count;
-    extern uint32_t syscall_num;
     extern void __syscall_entry(void);
-    extern void __ctext_switch_entry(void);
+    extern void __sysenter_entry(void);
+    extern void __sysenter_bench_entry(void);
+    extern uint32_t do_fast_syscall(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t*);
+    extern void __switch_to(uint32_t* prev_esp, uint32_t next_esp, uint32_t next_cr3);
+    extern void __trap_return(void);
     extern void process_exec_complete(uint32_t);
     extern void __process_execution_complete(void);
 }
 
+extern bool sysenter_available;
+
 extern void usermode_jump( size_t, size_t );
-uint32_t syscall(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
\ No newline at end of file
+extern void sysenter_initialize();
+extern void process_reschedule();
+uint32_t syscall(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+// SYSENTER system call stub, for user-mode code only (SYSEXIT always returns to ring 3).
+// ECX / EDX are clobbered by SYSEXIT, so they're saved on the user stack along with EBP and the return address;
+// the kernel reads arguments 2 and 3 from there.
+// Calls that need the full register context (see core/syscall.h) return SYSCALL_ERR_USE_INT and are retried through int $0x5C.
+inline uint32_t syscall_fast(uint32_t syscall_n, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
+    uint32_t ret_val;
+    asm volatile("push %%ebp\n\t"
+                 "push %%edx\n\t"
+                 "push %%ecx\n\t"
+                 "push $1f\n\t"
+                 "mov %%esp, %%ebp\n\t"
+                 "sysenter\n\t"
+                 "1:\n\t"
+                 "pop %%ecx\n\t"
+                 "pop %%edx\n\t"
+                 "pop %%ebp\n\t"
+                 : "=a"(ret_val) : "a"(syscall_n), "b"(arg1), "c"(arg2), "d"(arg3), "D"(arg4), "S"(arg5) : "memory");
+    if( ret_val == SYSCALL_ERR_USE_INT ) {
+        return syscall(syscall_n, arg1, arg2, arg3, arg4, arg5);
+    }
+    return ret_val;
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+// bcache.h -- block cache
+#pragma once
+#include "includes.h"
+#include "lib/sync.h"
+#include "core/io.h"
+
+#define BCACHE_BLOCK_SIZE       0x1000                  // bytes per cache block (one page)
+#define BCACHE_HASH_BUCKETS     256
+#define BCACHE_MAX_BLOCKS       1024                    // (4 MiB)
+#define BCACHE_FLUSH_INTERVAL   5000                    // ms between write-back passes
+#define BCACHE_DIRTY_HIGH       (BCACHE_MAX_BLOCKS/4)   // past this many dirty blocks, the flusher starts early
+#define BCACHE_FLUSH_BATCH      32                      // blocks written back per io_submit()
+#define BCACHE_RA_STREAMS       8                       // sequential readers tracked at once
+#define BCACHE_RA_MIN_WINDOW    4                       // blocks read ahead once a stream looks sequential
+#define BCACHE_RA_MAX_WINDOW    64                      // (256 KiB)
+
+// A run of sequential reads on one disk. Reads that carry on where a stream left off double its
+// read-ahead window; jumping around inside the window, or read-ahead blocks being evicted before
+// anyone used them, halve it.
+typedef struct bcache_stream {
+    unsigned int disk_no = 0;       // (0 if the slot is unused)
+    uint64_t     next_block = 0;    // where the next read is expected to start
+    uint64_t     ra_end = 0;        // first block not read ahead yet
+    unsigned int window = 0;        // blocks to stay ahead of the reader by (0 until it looks sequential)
+    uint64_t     last_used = 0;
+} bcache_stream;
+
+// One cached block of a disk. Disk ids start at 1, so disk_no 0 marks a block that isn't caching anything.
+typedef struct bcache_block {
+    unsigned int         disk_no = 0;
+    uint64_t             block_no = 0;
+    uint64_t             sector_start = 0;
+    unsigned int         n_sectors = 0;     // (fewer than a whole block's worth at the end of a disk)
+    transfer_buffer*     buf = NULL;        // the data; I/O goes straight in and out of it
+    unsigned int         refs = 0;          // somebody's copying in or out; can't be evicted
+    bool                 valid = false;     // buf holds what's on the disk (or something newer)
+    bool                 dirty = false;
+    bool                 busy = false;      // I/O in flight, or somebody's writing to buf
+    bool                 referenced = false; // (CLOCK bit)
+    bool                 readahead = false; // read ahead, and nobody's asked for it yet
+    bcache_stream*       stream = NULL;     // (which stream it was read ahead for)
+    struct bcache_block* hash_next = NULL;
+} bcache_block;
+
+typedef struct bcache_stats {
+    uint64_t     hits;
+    uint64_t     misses;
+    uint64_t     evictions;
+    uint64_t     writebacks;
+    uint64_t     ra_blocks;     // blocks read ahead
+    uint64_t     ra_hits;       // ...that were then used
+    uint64_t     ra_wasted;     // ...that were evicted first
+    unsigned int n_blocks;
+    unsigned int n_dirty;
+} bcache_stats;
+
+extern void bcache_initialize();
+
+// Disks whose sectors don't fit in a block go straight to the disk. false if any part failed.
+extern bool bcache_read( unsigned int disk_no, void* out, uint64_t start_pos, uint64_t len );
+extern bool bcache_write( unsigned int disk_no, void* data, uint64_t start_pos, uint64_t len );
+
+// Write back everything dirty on disk_no (0 for every disk), and wait for it to be on the disk.
+extern void bcache_sync( unsigned int disk_no = 0 );
+// Give back up to n_blocks clean, unused blocks' memory; returns how many were freed.
+extern unsigned int bcache_shrink( unsigned int n_blocks );
+// Write back and drop whatever's cached of the given sectors, for I/O that goes around the cache.
+extern void bcache_invalidate( unsigned int disk_no, uint64_t sector_start, uint64_t n_sectors );
+extern void bcache_set_readahead( bool enabled );
+extern bool bcache_get_readahead();
+
+extern void bcache_get_stats( bcache_stats* out );
+extern void bcache_print_stats();
@@ -0,0 +1,14 @@
+// benchmark.h -- in-kernel microbenchmarks
+#pragma once
+#include "includes.h"
+
+typedef void (*benchmark_func)(void);
+
+typedef struct benchmark {
+    const char* name;
+    benchmark_func func;
+    const char* description;
+} benchmark;
+
+extern bool run_benchmark( char* name );
+extern void list_benchmarks();
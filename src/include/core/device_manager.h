@@ -70,5 +70,7 @@ namespace device_manager {
 
 
 	extern device_node root;
+	extern rwlock tree_lock; // protects the children lists of every node in the tree
 	void initialize();
+	void add_child( device_node* parent, device_node* child );
 };
@@ -0,0 +1,33 @@
+// futex.h -- wait on / wake processes sleeping on a memory word
+#pragma once
+#include "includes.h"
+#include "lib/sync.h"
+
+// number of hash buckets waiters are spread over
+#define FUTEX_HASH_BUCKETS          64
+
+struct process;
+
+// Waiters are keyed by the physical address of the word they're waiting on (frame + offset),
+// so processes that map the same page at different addresses still see each other.
+typedef uint32_t futex_key;
+
+// A process sleeping in futex_wait(). Each process has one (process::futex_entry), since futex_wake()
+// unlinks it from the waker's address space, where the sleeper's stack isn't mapped.
+typedef struct futex_waiter {
+    futex_key             key;
+    struct process*       proc;
+    struct futex_waiter*  next;
+    bool                  queued;
+} futex_waiter;
+
+typedef struct futex_bucket {
+    spinlock              lock;
+    futex_waiter*         head = NULL;
+} futex_bucket;
+
+// If *addr still equals expected, sleep until woken by futex_wake() or until timeout_ms passes (0 waits forever).
+// Returns 0 if woken, or one of SYSCALL_ERR_WOULD_BLOCK, SYSCALL_ERR_TIMED_OUT or SYSCALL_ERR_FAULT.
+extern uint32_t futex_wait( volatile uint32_t* addr, uint32_t expected, unsigned int timeout_ms );
+// Wake up to n processes waiting on addr; returns how many were woken, or SYSCALL_ERR_FAULT.
+extern uint32_t futex_wake( volatile uint32_t* addr, uint32_t n );
@@ -6,43 +6,130 @@
 #include "core/scheduler.h"
 #include "core/message.h"
 
+// buffers of up to this many pages are recycled through a pool instead of being freed
+#define IO_BUFFER_POOL_MAX_PAGES    16
+#define IO_BUFFER_POOL_DEPTH        8   // free buffers kept per size
+
+// One physically contiguous piece of a transfer; virt is where the kernel sees it (PIO goes through that).
+typedef struct io_sg_segment {
+    phys_addr_t phys;
+    void*       virt;
+    size_t      len;
+} io_sg_segment;
+
+// Scatter-gather list: the memory a transfer goes in or out of, in order. Drivers walk it -- PIO drivers
+// through an io_sg_cursor, DMA drivers with a descriptor per segment -- so none of it has to be physically
+// contiguous. Segments have to start on an even address and be an even number of bytes long (disks move
+// 16-bit words). The list grows as needed.
+typedef struct io_sg_list {
+    io_sg_segment* segments = NULL;
+    unsigned int   n_segments = 0;
+    unsigned int   capacity = 0;
+    size_t         size = 0;       // bytes, over all segments
+
+    io_sg_list( unsigned int capacity = 4 );
+    io_sg_list( const io_sg_list& ) = delete;
+    ~io_sg_list();
+    void add( phys_addr_t phys, void* virt, size_t len );  // (joined onto the last segment if it carries straight on)
+    bool add_virt( void* virt, size_t len );               // mapped kernel memory; false if some of it isn't mapped
+    void add_list( io_sg_list* other, size_t len );        // (the first len bytes of other)
+} io_sg_list;
+
+// Walks a list front to back, handing out pieces that never cross a segment boundary.
+typedef struct io_sg_cursor {
+    io_sg_list*  sg;
+    unsigned int seg = 0;
+    size_t       offset = 0;   // into segments[seg]
+
+    io_sg_cursor( io_sg_list* sg ) : sg(sg) {};
+    size_t next( void** virt, size_t max );   // up to max bytes at *virt; 0 once the list is used up
+} io_sg_cursor;
+
+// DMA buffer: single frames mapped to look contiguous to the kernel, with an sg list describing them
+// to drivers. Buffers own their frames and mapping, so they can't be copied; requests only point at them.
 typedef struct transfer_buffer {
     void        *buffer_virt;
-    void        *buffer_phys;
-    page_frame  *frames;
+    phys_addr_t *frames;
     unsigned int n_frames;
     size_t       size;
+    io_sg_list   sg;
     
-    transfer_buffer( const transfer_buffer& rhs ) : buffer_virt(rhs.buffer_virt), buffer_phys(rhs.buffer_phys), frames(rhs.frames), n_frames(rhs.n_frames), size(rhs.size) {};
     transfer_buffer( unsigned int );
-    ~transfer_buffer() { pageframe_deallocate( this->frames, this->n_frames ); };
-    void* remap();
+    transfer_buffer( const transfer_buffer& ) = delete;
+    ~transfer_buffer();
 } transfer_buffer;
 
+struct transfer_request;
+struct io_completion_queue;
+class io_scheduler;
+
+// Called (from the driver, so it mustn't sleep) once a request is finished.
+typedef void (*io_callback)( struct transfer_request* req, void* context );
 
+// Drivers usually queue a copy of the request (see ata_transfer_request); copies remember the
+// original, so completing any of them completes the original.
+// A finished request is reported through its callback if it has one, or else pushed onto its
+// completion queue if it has one; either way, done is signalled first, so wait() always works.
 typedef struct transfer_request {
-    uint64_t        id;
-    transfer_buffer buffer;
-    uint64_t        sector_start;
-    size_t          n_sectors;
-    bool            status = false;
-    bool            read;
-    process*        requesting_process;
-    channel_receiver* ch;
+    uint64_t          id;
+    transfer_buffer*  buffer;       // not owned by the request (NULL for vectored requests)
+    io_sg_list*       sg;           // what drivers actually transfer to/from; buffer's list, if there's a buffer
+    unsigned int      disk_no = 0;  // where io_submit() sends it
+    uint64_t          sector_start;
+    size_t            n_sectors;
+    bool              status = false;
+    bool              read;
+    process*          requesting_process;
+    completion        done;
+    transfer_request* origin = NULL; // the request we're a copy of (NULL if we're the original)
+    io_callback       callback = NULL;
+    void*             context = NULL;
+    io_completion_queue* cq = NULL;
+    transfer_request* next_done = NULL; // (link in cq)
+
+    // used by the disk's I/O scheduler (see core/iosched.h):
+    unsigned long long int submit_time = 0; // ms
+    transfer_request* sched_next = NULL;    // (in LBA order)
+    transfer_request* fifo_next = NULL;     // (in submission order)
+    transfer_request* merged = NULL;        // requests this one carries out, linked through merge_next
+    transfer_request* merge_next = NULL;
     
-    transfer_request( transfer_buffer&, uint64_t, size_t, bool );
     transfer_request( transfer_buffer*, uint64_t, size_t, bool );
+    transfer_request( io_sg_list*, uint64_t, size_t, bool );
     transfer_request( transfer_request& );
-    ~transfer_request() { delete this->ch; };
+    void complete( bool status );
     void wait();
+    bool wait_timeout( unsigned int timeout_ms );
 } transfer_request;
 
+// Where finished requests pile up until somebody collects them.
+typedef struct io_completion_queue {
+    spinlock          lock;
+    wait_queue        waiters;
+    transfer_request* head = NULL;
+    transfer_request* tail = NULL;
+    unsigned int      count = 0;
+
+    void push( transfer_request* req );
+    transfer_request* poll();                               // NULL if nothing has finished yet
+    transfer_request* wait( unsigned int timeout_ms = 0 );  // 0 waits forever; NULL if it timed out
+} io_completion_queue;
+
+// Drivers that queue requests hand them to queue() from send_request(), and take the next transfer
+// to start with dequeue() -- the disk's scheduler decides the order, and may merge requests.
 struct io_disk {
     unsigned int device_id;
+    io_scheduler* scheduler = NULL;
+    spinlock      sched_lock;
     
     virtual void send_request( transfer_request* ) =0;
     virtual unsigned int  get_sector_size() =0;
     virtual unsigned int  get_total_size() =0;
+    virtual unsigned int  get_max_sectors() { return 1; }; // largest single transfer (so, how far requests can be merged)
+
+    void queue( transfer_request* req );
+    transfer_request* dequeue(); // NULL if nothing's waiting
+    bool queue_empty();
 };
 
 struct io_partition {
@@ -65,6 +152,21 @@ extern void io_read_partition( unsigned int, unsigned int, void*, uint64_t, uint
 extern void io_write_partition( unsigned int, void*, uint64_t, uint64_t );
 extern void io_write_partition( unsigned int, unsigned int, void*, uint64_t, uint64_t );
 extern unsigned int io_get_disk_count();
+
+// Asynchronous interface: build requests with io_request_alloc() (the buffer comes from the pool),
+// set a callback or completion queue if you want one, submit as many as you like, then collect them.
+// Each request has to be given back with io_request_free() once it's finished.
+extern transfer_buffer* io_buffer_get( size_t n_bytes );
+extern void io_buffer_put( transfer_buffer* buf );
+extern transfer_request* io_request_alloc( unsigned int disk_no, uint64_t sector_start, size_t n_sectors, bool read ); // NULL for unknown disks
+extern void io_request_free( transfer_request* req );
+extern unsigned int io_submit( transfer_request** reqs, unsigned int n ); // returns how many were sent (the rest fail at once)
+extern bool io_wait_all( transfer_request** reqs, unsigned int n );       // true if they all succeeded
+
 extern void io_read_disk(  unsigned int, void*, uint64_t, uint64_t );
 extern void io_write_disk( unsigned int, void*, uint64_t, uint64_t );
+extern void io_read_disk_uncached(  unsigned int, void*, uint64_t, uint64_t );
+extern void io_write_disk_uncached( unsigned int, void*, uint64_t, uint64_t );
+extern bool io_readv(  unsigned int disk_no, uint64_t sector_start, io_sg_list* sg );  // (see io_vectored() in io.cpp)
+extern bool io_writev( unsigned int disk_no, uint64_t sector_start, io_sg_list* sg );
 extern void io_initialize();
@@ -0,0 +1,76 @@
+// iosched.h -- I/O schedulers
+#pragma once
+#include "includes.h"
+#include "core/io.h"
+
+#define IOSCHED_DEFAULT             "deadline"
+#define IOSCHED_READ_DEADLINE       100     // ms a read can wait before it's served out of order
+#define IOSCHED_WRITE_DEADLINE      1000
+#define IOSCHED_BATCH               16      // transfers in one direction before reads and writes are weighed again
+#define IOSCHED_WRITES_STARVED      2       // read batches that can go by while writes wait
+
+typedef struct io_sched_stats {
+    uint64_t submitted;         // requests queued
+    uint64_t dispatched;        // transfers handed to the driver (a merged transfer counts once)
+    uint64_t merged;            // requests that went out as part of somebody else's transfer
+    uint64_t expired;           // transfers started out of order because a deadline passed
+    uint64_t completed;
+    uint64_t total_latency;     // ms from queueing to completion, over every completed request
+    uint64_t max_latency;
+} io_sched_stats;
+
+// Called with the disk's sched_lock held, so they mustn't allocate or sleep.
+// next() takes the next transfer off the queue: a request, followed (through merge_next) by any
+// contiguous requests in the same direction that fit in max_sectors along with it -- io_disk::dequeue()
+// turns those into a single transfer. max_sectors == 0 means "don't merge".
+class io_scheduler {
+public:
+    io_sched_stats stats;
+
+    io_scheduler() { memclr( (void*)&this->stats, sizeof(io_sched_stats) ); };
+    virtual ~io_scheduler() {};
+    virtual const char* name() =0;
+    virtual void add( transfer_request* req ) =0;
+    virtual transfer_request* next( unsigned int max_sectors ) =0;
+    virtual bool empty() =0;
+};
+
+// Plain FIFO, no merging.
+class io_noop_scheduler : public io_scheduler {
+    transfer_request* head = NULL;
+    transfer_request* tail = NULL;
+
+public:
+    const char* name() { return "noop"; };
+    void add( transfer_request* req );
+    transfer_request* next( unsigned int max_sectors );
+    bool empty() { return (this->head == NULL); };
+};
+
+// One-way elevator (C-SCAN) over per-direction LBA-sorted queues, serving batches of reads or writes
+// and merging contiguous requests. Each request also gets a deadline; once the oldest one in either
+// direction is past it, that request is served next, wherever the elevator is.
+class io_deadline_scheduler : public io_scheduler {
+    transfer_request* sorted[2] = { NULL, NULL };   // [0] reads, [1] writes
+    transfer_request* fifo_head[2] = { NULL, NULL };
+    transfer_request* fifo_tail[2] = { NULL, NULL };
+    uint64_t     head_pos = 0;      // sector just past the last transfer
+    bool         batch_write = false;
+    unsigned int batch_count = 0;
+    unsigned int writes_starved = 0;
+
+    void unlink( transfer_request* req );
+    transfer_request* pick( bool write );
+
+public:
+    const char* name() { return "deadline"; };
+    void add( transfer_request* req );
+    transfer_request* next( unsigned int max_sectors );
+    bool empty() { return (this->sorted[0] == NULL) && (this->sorted[1] == NULL); };
+};
+
+extern io_scheduler* io_sched_create( const char* name ); // NULL if there's no such scheduler
+extern bool io_set_scheduler( unsigned int disk_no, const char* name );
+extern void io_sched_split( transfer_request* carrier, bool status );  // complete everything a merged transfer carried
+extern void io_sched_completed( transfer_request* req );               // (for the latency stats)
+extern void io_sched_print_stats();
@@ -0,0 +1,65 @@
+// ipc.h -- synchronous call / reply IPC
+#pragma once
+#include "includes.h"
+#include "lib/sync.h"
+#include "core/syscall.h"
+
+// Message registers: small enough that a whole message fits in the system call registers
+// (see sys_ipc_call), so nothing is ever copied through memory.
+#define IPC_MSG_WORDS               3
+#define IPC_MAX_ENDPOINTS           64
+#define IPC_INVALID_ENDPOINT        0
+
+#define IPC_ERR_NO_ENDPOINT         SYSCALL_ERR_INVALID
+
+struct process;
+
+typedef struct ipc_msg {
+    uint32_t tag;                   // label / opcode, up to the protocol
+    uint32_t words[IPC_MSG_WORDS];
+} ipc_msg;
+
+// A caller blocked in ipc_call(); servers get a pointer to one from ipc_receive() and hand it back to ipc_reply().
+// Each process has one of these and one ipc_server (process::ipc_caller_slot / ipc_server_slot), in kernel memory:
+// the peer reads and writes them from its own address space, where our stack isn't mapped. Messages are copied
+// through the slots, never through pointers to the other side's stack.
+typedef struct ipc_caller {
+    struct process*      proc;
+    ipc_msg              msg;
+    ipc_msg              reply;  // filled in by the server before it sets done
+    volatile bool        done;
+    struct ipc_caller*   next;
+} ipc_caller;
+
+// A server blocked in ipc_receive().
+typedef struct ipc_server {
+    struct process*          proc;
+    ipc_msg                  msg;    // filled in by the caller that picked us
+    ipc_caller* volatile     caller; // set by the caller that picked us
+} ipc_server;
+
+// A call goes straight to a server blocked in ipc_receive(): the message is copied into the server's
+// slot and the caller switches directly to it (process_handoff), skipping the run queues.
+// ipc_reply_wait() does the same in the other direction, so an uncontended round trip is two switches.
+typedef struct ipc_endpoint {
+    uint32_t             id;
+    spinlock             lock;
+    ipc_caller*          callers_head = NULL; // calls no server has picked up yet, FIFO
+    ipc_caller*          callers_tail = NULL;
+    ipc_server*          server = NULL;       // server blocked in receive, if any
+    wait_queue           server_waiters;      // other servers, while one is already blocked in receive
+    uint64_t             calls = 0;
+    uint64_t             direct = 0;          // calls that found a server waiting
+} ipc_endpoint;
+
+extern ipc_endpoint* ipc_endpoint_create();
+extern ipc_endpoint* ipc_get_endpoint( uint32_t id );
+
+// Send msg and block until the server replies; returns 0, or IPC_ERR_NO_ENDPOINT.
+extern uint32_t ipc_call( ipc_endpoint* ep, ipc_msg* msg, ipc_msg* reply );
+// Block until a call arrives; the message is copied into msg.
+extern ipc_caller* ipc_receive( ipc_endpoint* ep, ipc_msg* msg );
+// Reply to a call and switch back to the caller.
+extern void ipc_reply( ipc_caller* caller, ipc_msg* reply );
+// Reply to a call, then wait for the next one (the usual server loop).
+extern ipc_caller* ipc_reply_wait( ipc_endpoint* ep, ipc_caller* caller, ipc_msg* reply, ipc_msg* msg );
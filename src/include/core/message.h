@@ -10,38 +10,122 @@
 #include "core/scheduler.h"
 #include "lib/vector.h"
 #include "lib/sync.h"
+#include "lib/refcount.h"
+#include "core/rcu.h"
 #include <stdarg.h>
 
+// default number of messages a channel holds (must be a power of 2)
+#define CHANNEL_DEFAULT_RING_SIZE       64
+// longest (in ms) a blocking send waits on a full ring before it overwrites the oldest message anyway
+#define CHANNEL_BLOCK_TIMEOUT           1000
+
+// Channels are named, but registering one also hands out an integer handle (see register_channel()).
+// Handles index straight into the channel table, so senders that cache one skip the name lookup entirely.
+typedef uint32_t channel_handle;
+#define CHANNEL_INVALID_HANDLE          0
+
 struct message;
+struct channel;
+
+// The contents of a message. Every receiver's copy of a message shares the same payload, which is
+// freed when the last of them is deleted, so receivers must treat the data as read-only.
+typedef class message_payload : public refcounted {
+public:
+	void*        data;
+	size_t       size;
+	unsigned int n_pages; // nonzero if data is a page mapping we own (see remap_pages())
+
+	// Takes ownership of a kmalloc'd buffer (if size is 0, data is just passed along as a value).
+	message_payload( void* data, size_t size );
+	// Takes over n_pages of mmap()'d memory by moving the pages to a mapping of our own, so a large payload
+	// is never copied and the sender can't modify it after sending. The sender's mapping is gone afterwards.
+	static message_payload* remap_pages( virt_addr_t pages, unsigned int n_pages, size_t size );
+	~message_payload();
+} message_payload;
+
+// What a send does when the slowest receiver is a whole ring behind.
+enum class channel_overflow {
+	block,       // wait for it to catch up (back-pressure), for up to CHANNEL_BLOCK_TIMEOUT ms, then overwrite
+	             // like drop_oldest; senders that can't sleep drop the message instead
+	drop_oldest, // overwrite the oldest message; receivers that fall behind skip ahead and count what they missed
+	             // (the default: one receiver that stops reading can't hold up everybody else)
+	drop_newest, // discard the message being sent
+};
+
+// One slot in a channel's ring.
+// seq is the ring position of the message in msg plus 1; a slot for position p starts out looking like
+// it holds position p - ring_size, and while it's being rewritten seq is p - ring_size (matching nothing).
+typedef struct channel_slot {
+	volatile uint32_t  seq;
+	message* volatile  msg;
+} channel_slot;
+
+// A receiver's read position in a channel. Shared by all copies of a channel_receiver,
+// and unregistered when the last of them goes away.
+typedef class channel_cursor : public refcounted {
+public:
+	struct channel*    ch;
+	volatile uint32_t  pos;          // next ring position to read
+	uint32_t           dropped = 0;  // messages overwritten before we got to them (drop_oldest)
+	uint32_t           owner_pid;    // cursors of exited processes don't hold up senders
+	channel_cursor*    next = NULL;
 
+	channel_cursor( struct channel* ch );
+	~channel_cursor();
+} channel_cursor;
+
+struct event_watch;
+class kpipe;
+
+// Bounded multi-producer broadcast ring: senders reserve a position with an atomic increment (or CAS, when
+// they have to check for room first) and publish the message into its slot; every receiver reads the ring
+// through its own cursor without taking any locks. Overwritten messages are freed after an RCU grace period,
+// since a receiver might still be copying one.
 typedef struct channel {
-	vector< process_ptr > listeners;
-	vector< message* > message_queue;
-	uint64_t current_uid;
-	mutex    lock;
+	channel_slot*      ring;
+	uint32_t           ring_size;
+	channel_overflow   policy;
+	volatile uint32_t  head = 0;        // next position to hand out to a sender
+	volatile uint32_t  current_uid = 0; // bumped after every message is published
+	uint32_t           tail_hint = 0;   // no cursor is behind this (only updated by senders that need room)
+	volatile uint32_t  n_receivers = 0;
+	channel_cursor*    cursors = NULL;
+	spinlock           cursors_lock;    // protects cursors (registration and slowest_cursor())
+	wait_queue         waiters;         // receivers blocked in channel_receiver::wait() / wait_multiple()
+	wait_queue         space_waiters;   // senders blocked on a full ring
+	event_watch*       watches = NULL;  // event sets to post to on every send (protected by cursors_lock)
+	uint64_t           sent = 0;
+	uint64_t           dropped = 0;     // messages discarded by drop_newest (or by senders that couldn't block)
 
-	channel() : current_uid(0) {};
+	channel( unsigned int ring_size = CHANNEL_DEFAULT_RING_SIZE, channel_overflow policy = channel_overflow::drop_oldest );
+	~channel();
 	void send( message& msg );
+	uint32_t slowest_cursor();
+	void add_cursor( channel_cursor* cursor );
+	void remove_cursor( channel_cursor* cursor );
+	void post_events();
 } channel;
 
 typedef struct message {
-	void *data;
-	size_t data_size;
+	rcu_head rcu;     // (messages in a channel ring are freed through call_rcu once overwritten)
+	void *data;       // (payload->data)
+	size_t data_size; // (payload->size)
 	process_ptr sender;
 	uint64_t uid;
 	uint32_t n_receivers;
+	intrusive_ptr<message_payload> payload;
 
-	~message() { if( (this->data != NULL) && (this->data_size > 0) ) { kfree(this->data); } };
-
+	// copies share rhs's payload
 	message( message& rhs );
 	message( message* rhs);
 	message();
-	message(void *data, size_t data_sz );
+	message(void *data, size_t data_sz ); // takes ownership of data, see message_payload
+	message( message_payload* payload );
 } message;
 
 typedef class channel_receiver {
 	channel *remote_channel;
-	uint64_t last_seen_uid;
+	intrusive_ptr<channel_cursor> cursor;
 	void sort_internal( unsigned int lo_index, unsigned int hi_index );
 public:
 	vector< message* > queue;
@@ -50,13 +134,70 @@ public:
 
 	void wait();
 	bool update();
+	uint64_t channel_uid() { asm volatile("" : : : "memory"); return this->remote_channel->current_uid; }; // changes whenever something is sent
+	wait_queue& waiting_on() { return this->remote_channel->waiters; };
+	uint32_t dropped() { return ((this->cursor.get() != NULL) ? this->cursor->dropped : 0); };
+	channel* remote() { return this->remote_channel; };
+	bool pending();
 	void sort();
 	channel_receiver( channel* remote );
 	channel_receiver( const channel_receiver& copy );
 	~channel_receiver();
 } channel_receiver;
 
+// Registering a name that already exists just returns the existing channel's handle.
+channel_handle register_channel( char* channel_name, channel_overflow policy = channel_overflow::drop_oldest, unsigned int ring_size = CHANNEL_DEFAULT_RING_SIZE );
+channel_handle get_channel_handle( char* channel_name ); // CHANNEL_INVALID_HANDLE if there's no such channel
+channel* get_channel( channel_handle handle );
+channel_receiver listen_to_channel( channel_handle handle );
+void send_to_channel( channel_handle handle, message& msg );
+// (these look the name up on every call)
 channel_receiver listen_to_channel( char* channel_name );
 void send_to_channel( char* channel_name, message& msg );
-void register_channel( char* channel_name );
 unsigned int wait_multiple( unsigned int n_receivers, channel_receiver* recv_1, ... );
+
+#define EVENT_WAIT_FOREVER 0xFFFFFFFF
+
+// level: reported by every wait() for as long as the receiver has something to read.
+// edge: reported once per batch of sends, whether or not the earlier messages were read.
+enum class event_trigger { level, edge };
+
+// One receiver (or pipe) registered with one event_set.
+typedef struct event_watch {
+	struct event_set*  set;
+	channel_receiver*  recv = NULL;      // exactly one of recv / pipe is set
+	kpipe*             pipe = NULL;
+	uint32_t           id;               // returned by event_set::wait() when this fires
+	event_trigger      trigger;
+	bool               ready = false;    // on the set's ready list
+	event_watch*       next_in_source = NULL; // (the channel's or pipe's list of watches)
+	event_watch*       next_in_set = NULL;
+	event_watch*       next_ready = NULL;
+} event_watch;
+
+// Waits on any number of channels (and pipes) at once. Receivers are registered once; from then on every
+// send on their channel puts them on the set's ready list, so wait() only looks at the ones that fired
+// instead of polling all of them. Pipes fire whenever data comes in, or the write side is closed.
+// Sources must be removed (or the set destroyed) before they go away. Nothing here reads messages:
+// call update() on the receivers wait() hands back.
+// Lock order: a source's lock (the channel's cursors_lock, or the pipe's lock) before the set's. Senders post
+// with their source locked, so wait() never looks at a source while it holds the set's lock.
+// Sets live on the heap, since senders post to them from their own address space.
+typedef struct event_set {
+	spinlock       lock;
+	wait_queue     waiters;
+	event_watch*   watches = NULL;
+	event_watch*   ready_head = NULL;
+	event_watch*   ready_tail = NULL;
+
+	~event_set();
+	void add( channel_receiver* recv, uint32_t id, event_trigger trigger = event_trigger::level );
+	void add( kpipe* pipe, uint32_t id, event_trigger trigger = event_trigger::level );
+	void remove( channel_receiver* recv );
+	void remove( kpipe* pipe );
+	void remove_watch( event_watch* watch );
+	void post( event_watch* watch );
+	// Fills ready_ids with up to max ids; returns how many, or 0 if the timeout ran out first
+	// (timeout_ms = 0 just polls, EVENT_WAIT_FOREVER never times out).
+	unsigned int wait( uint32_t* ready_ids, unsigned int max, unsigned int timeout_ms = EVENT_WAIT_FOREVER );
+} event_set;
@@ -108,7 +108,7 @@ extern void paging_unset_pte(virt_addr_t);
 extern virt_addr_t paging_map_phys_address( phys_addr_t, int );
 extern void paging_unmap_phys_address( phys_addr_t, int );
 extern virt_addr_t mmap(int);
-extern void munmap(size_t);
+extern void munmap(virt_addr_t, int);
 
 // misc.
 extern void copy_pageframe_range( phys_addr_t, phys_addr_t, int );
@@ -0,0 +1,61 @@
+// pipe.h -- kernel pipes
+#pragma once
+#include "includes.h"
+#include "lib/sync.h"
+#include "lib/refcount.h"
+#include "core/message.h"
+#include "core/vfs.h"
+
+#define PIPE_DEFAULT_PAGES          4
+
+// Byte stream between processes, backed by a fixed set of pages.
+// The pages are mapped twice in a row, so any run of up to capacity bytes starting anywhere in the ring
+// is contiguous in memory: reads and writes are a single copy, and splice can hand the ring memory
+// straight to the filesystem.
+// Reads return whatever is there (blocking only while the pipe is empty); writes block until everything
+// has gone in, or the read side is closed.
+typedef class kpipe : public refcounted {
+    uint8_t*        buf;
+    phys_addr_t*    frames;
+    unsigned int    n_pages;        // in the ring (the mirror starts this many pages into buf)
+    unsigned int    n_frames;       // allocated so far (fewer than n_pages only if create() failed partway)
+    mutex           read_lock;      // one reader and one writer at a time (they copy without holding lock)
+    mutex           write_lock;
+
+    void post_events();
+    uint32_t wait_for_data( uint32_t want, bool block );
+    uint32_t wait_for_room( uint32_t want, bool block );
+    void consumed( uint32_t n );
+    void produced( uint32_t n );
+
+    kpipe() : buf(NULL), frames(NULL), n_pages(0), n_frames(0) {};
+
+public:
+    spinlock        lock;           // protects everything below
+    uint32_t        capacity;
+    uint32_t        head = 0;       // bytes written so far
+    uint32_t        tail = 0;       // bytes read so far
+    bool            read_closed = false;
+    bool            write_closed = false;
+    wait_queue      readers;
+    wait_queue      writers;
+    event_watch*    watches = NULL; // event sets to post to when data comes in (see event_set::add)
+
+    static kpipe* create( unsigned int n_pages = PIPE_DEFAULT_PAGES ); // NULL if we're out of memory
+    ~kpipe();
+
+    uint32_t readable() { return this->head - this->tail; };
+    bool poll_readable() { return (this->readable() > 0) || this->write_closed; }; // (EOF counts)
+
+    // read() returns 0 only at end of file (or if !block and the pipe is empty).
+    size_t read( void* out, size_t len, bool block = true );
+    size_t write( void* data, size_t len, bool block = true );
+    void close_read();
+    void close_write();
+
+    // Write the next len bytes from the pipe out as the contents of a file, straight from the ring.
+    // Waits for len bytes (or end of file, in which case less is written); *moved gets the amount.
+    vfs::vfs_status splice_to_file( unsigned char* path, size_t len, size_t* moved );
+    // Read a whole file into the pipe. Files that fit go straight into the ring.
+    vfs::vfs_status splice_from_file( unsigned char* path, size_t* moved );
+} kpipe;
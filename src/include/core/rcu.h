@@ -0,0 +1,30 @@
+// rcu.h -- epoch-based deferred reclamation
+#pragma once
+#include "includes.h"
+
+struct process;
+
+// Embedded in objects that get freed through call_rcu().
+typedef struct rcu_head {
+    struct rcu_head* next;
+    void (*func)( struct rcu_head* );
+} rcu_head;
+
+// Read-side critical sections. These nest, and the reader may sleep or be preempted inside one
+// (that just holds up the current grace period).
+// Code that runs with interrupts disabled is also implicitly a read-side section, since grace periods
+// only end at a context switch or timer tick.
+extern void rcu_read_lock();
+extern void rcu_read_unlock();
+
+// Call func(head) once every read-side section that might still see the object has ended.
+extern void call_rcu( rcu_head* head, void (*func)( rcu_head* ) );
+// Sleep until every read-side section that was running when this was called has ended.
+extern void synchronize_rcu();
+
+extern void rcu_note_context_switch();
+extern void rcu_process_exit( struct process* proc );
+extern void rcu_initialize();
+
+// Get the enclosing object from an embedded rcu_head.
+#define rcu_container(ptr, type, member) ((type*)( ((uintptr_t)(ptr)) - offsetof(type, member) ))
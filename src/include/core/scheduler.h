@@ -1,14 +1,23 @@
 #pragma once
 #include "includes.h"
 #include "arch/x86/multitask.h"
+#include "arch/x86/fpu.h"
 #include "device/pit.h"
 #include "lib/vector.h"
+#include "core/futex.h"
+#include "core/ipc.h"
 
 #define SCHEDULER_PRIORITY_LEVELS       16
 // stack size in pages
 #define PROCESS_STACK_SIZE              4
 
 #define PROCESS_FLAGS_DELETE_ON_EXIT    (1<<0)
+#define PROCESS_FLAGS_KTHREAD           (1<<1) // kernel thread: no address space of its own, see kthread.cpp
+
+// kernel thread stack size in pages
+#define KTHREAD_STACK_SIZE              4
+// number of freed kernel thread stacks kept around for reuse
+#define KTHREAD_STACK_POOL_SIZE         16
 
 // size in cpu_reg structs
 // total size = PROCESS_REG_STACK_SIZE*sizeof(cpu_reg)
@@ -16,17 +25,23 @@
 
 #define PROCESS_BREAK_START             0x40000000
 
+// PIDs run from 0 to PID_MAX-1 (see pid.cpp)
+#define PID_MAX                         32768
+#define PID_TABLE_LEAF_BITS             8
+#define PID_TABLE_LEAF_SIZE             (1<<PID_TABLE_LEAF_BITS)
+#define PID_TABLE_ROOT_SIZE             (PID_MAX / PID_TABLE_LEAF_SIZE)
+
 extern "C" {
     extern void process_exec_complete(uint32_t);
     extern void __process_execution_complete(void);
 }
 
 struct process_ptr;
+struct shm_mapping;
 
 enum struct process_state {
     runnable,
     waiting,
-    forking,
     dead,
 };
 
@@ -55,9 +70,11 @@ typedef struct address_space { // implementation in arch/paging.cpp
     void map_pde( int, phys_addr_t, int );
     bool map_new( virt_addr_t, int );
     bool map( virt_addr_t, phys_addr_t, int );
-    void unmap( virt_addr_t );
+    void unmap( virt_addr_t, bool release_frame = true ); // (shared pages aren't ours to free)
     uint32_t get( virt_addr_t );
+    void initialize();
     address_space();
+    address_space( bool allocate ); // address_space(false) doesn't set up a page directory (kernel threads)
     ~address_space();
 } process_address_space;
 
@@ -68,24 +85,40 @@ typedef struct process_times {
 
 typedef struct process {
     cpu_regs                       regs;
-    cpu_regs                       user_regs;
     uint32_t                       id;
     process*                       parent;
     const char*                    name;
-    uint32_t                       flags;
-    int                            priority;
+    uint32_t                       flags = 0;
+    int                            priority;             // current (possibly inherited) priority
+    int                            base_priority;        // priority without any boosts from mutex waiters
     process_address_space          address_space;
     process_state                  state;
     uint32_t                       wait_time;
+    unsigned long long int         wake_deadline = 0;    // in system timer ms, 0 if not in the sleep queue
     uint32_t                       return_value;
     //vector< message* >*            message_queue;
     //mutex                          message_queue_lock;
     uint32_t                       in_syscall = 0;
+    trap_frame*                    syscall_frame = NULL; // on our kernel stack, while in_syscall is set
     uint32_t                       break_val = PROCESS_BREAK_START;
     vector< process* >             children;
     process_times                  times;
+    fpu_context                    fpu;
+    virt_addr_t                    kthread_stack = 0; // pooled stack (kernel threads only)
     char*                          message_waiting_on;
+    reentrant_mutex*               blocked_on = NULL;    // mutex we're waiting to lock
+    reentrant_mutex*               held_mutexes = NULL;  // mutexes we own (linked through next_held)
+    unsigned long long int         boost_start = 0;      // when our priority was last raised above base_priority
+    unsigned long long int         boosted_time = 0;     // total ms spent boosted
+    uint32_t                       rcu_nesting = 0;      // depth of rcu_read_lock() calls
+    uint32_t                       rcu_parity = 0;       // epoch parity our outermost rcu_read_lock() counted against
+    shm_mapping*                   shm_mappings = NULL;  // shared memory mapped into our address space (see shm.cpp)
     
+    wait_queue_entry               wait_entry;           // our place on whichever wait_queue we're sleeping on
+    futex_waiter                   futex_entry;          // (see futex_wait())
+    ipc_caller                     ipc_caller_slot;      // (see ipc.h)
+    ipc_server                     ipc_server_slot;
+    wait_queue                     exit_waiters;
     mutex						   process_reference_lock;
     vector< process_ptr* >		   process_reflist;
 
@@ -95,7 +128,13 @@ typedef struct process {
     ~process();
     process( process* );
     process( virt_addr_t entry_point, bool is_usermode, int priority, const char* name, void* args, int n_args );
+    process( virt_addr_t kthread_stack, virt_addr_t entry_point, int priority, const char* name, void* args, int n_args ); // use kthread_create()
     
+    // The memory behind a deleted process is only freed after an RCU grace period,
+    // so get_process_by_pid() callers inside rcu_read_lock() never see it reused.
+    static void* operator new( size_t size );
+    static void operator delete( void* ptr );
+
     void add_reference( process_ptr* );
     void remove_reference( process_ptr* );
 
@@ -126,7 +165,6 @@ public:
 } process_ptr;
 
 extern process *process_current;
-extern vector<process*> system_processes;
 
 // initialization stuff
 extern void initialize_multitasking( process* );
@@ -136,11 +174,24 @@ extern void multitasking_start_init();
 extern void process_scheduler();
 extern void process_add_to_runqueue( process* );
 extern process* get_process_by_pid( unsigned int );
+extern uint32_t allocate_new_pid();
+extern void free_pid( uint32_t pid );
+extern void pid_table_insert( process* proc );
+extern void pid_table_remove( process* proc );
 extern void spawn_process( process* to_add, bool sched_immediate=true );
 extern uint32_t do_fork();
-extern bool is_valid_process();
+extern process* kthread_create( virt_addr_t entry_point, int priority, const char* name, void* args=NULL, int n_args=0 );
+extern virt_addr_t kthread_stack_allocate();
+extern void kthread_stack_free( virt_addr_t stack );
+extern void kthread_stack_release( virt_addr_t stack ); // (for ~process)
+extern bool is_valid_process( process* proc );
 extern void process_sleep();
 extern void process_wake( process* );
+extern void process_handoff( process* next );
+extern void process_set_priority( process* proc, int priority );
+extern void process_set_timeout( process* proc, unsigned long long int deadline );
+extern void process_clear_timeout( process* proc );
+extern void process_check_timeouts();
 extern "C" {
     extern uint32_t fork();
     extern void process_switch_immediate();
@@ -0,0 +1,157 @@
+// shm.h -- shared memory objects
+#pragma once
+#include "includes.h"
+#include "lib/refcount.h"
+#include "lib/sync.h"
+#include "lib/umutex.h"
+
+// kernel-picked addresses for user mappings come from this range (between the heap and the stack)
+#define SHM_USER_BASE           0x80000000
+#define SHM_USER_END            0xB0000000
+
+#define SHM_MAP_WRITE           (1<<0)
+
+struct process;
+
+// A set of page frames any number of processes (and the kernel) can map at once.
+// Every mapping holds a reference, and so does the pointer create() hands back, so the frames are
+// freed once the last mapping is gone and the creator has dropped their pointer too.
+typedef class shm_object : public refcounted {
+public:
+    size_t        size;
+    unsigned int  n_pages;
+    phys_addr_t*  frames;
+
+    static intrusive_ptr<shm_object> create( size_t size ); // zero-filled; NULL if we're out of memory
+    ~shm_object();
+
+private:
+    shm_object() : size(0), n_pages(0), frames(NULL) {};
+} shm_object;
+
+typedef struct shm_mapping {
+    intrusive_ptr<shm_object> obj;
+    virt_addr_t               addr;
+    struct shm_mapping*       next = NULL;
+} shm_mapping;
+
+// Map obj into proc's address space (or kernel space, if proc is NULL).
+// addr is where to put it; 0 lets the kernel pick. Returns the address, or 0.
+extern virt_addr_t shm_map( shm_object* obj, struct process* proc, virt_addr_t addr = 0, uint32_t flags = SHM_MAP_WRITE );
+extern bool shm_unmap( struct process* proc, virt_addr_t addr );
+extern void shm_process_exit( struct process* proc );
+
+// Single-producer / single-consumer byte ring laid out at the start of a shared region, so both ends
+// can use it from their own mapping. Head and tail only ever increase (mod 2^32); a side that has to
+// wait sleeps on the other side's counter with wait_on_address(), and only then does the other side
+// bother making a wake() call.
+typedef struct shm_ring_header {
+    volatile uint32_t head;     // bytes written so far
+    volatile uint32_t tail;     // bytes read so far
+    uint32_t          size;     // of the data area (a power of 2)
+    volatile uint32_t waiters;  // ends currently sleeping in wait_readable() / wait_writable()
+} shm_ring_header;
+
+typedef class shm_ring {
+    shm_ring_header* hdr;
+    uint8_t*         data;
+
+public:
+    // init sets up a fresh ring (only the side that created the region should do this)
+    shm_ring( void* region, size_t region_size, bool init );
+
+    uint32_t readable() { return this->hdr->head - this->hdr->tail; };
+    uint32_t writable() { return this->hdr->size - this->readable(); };
+
+    // These copy as much as fits / is there right now and return how much that was.
+    size_t write( const void* buf, size_t len );
+    size_t read( void* buf, size_t len );
+
+    // Sleep until there's something to read / room to write (timeout_ms = 0 waits forever).
+    bool wait_readable( uint32_t timeout_ms = 0 );
+    bool wait_writable( uint32_t timeout_ms = 0 );
+} shm_ring;
+
+inline shm_ring::shm_ring( void* region, size_t region_size, bool init ) {
+    this->hdr = (shm_ring_header*)region;
+    this->data = ((uint8_t*)region) + sizeof(shm_ring_header);
+    if( init ) {
+        uint32_t size = 1;
+        while( (size*2) <= (region_size - sizeof(shm_ring_header)) ) {
+            size *= 2;
+        }
+        this->hdr->head = 0;
+        this->hdr->tail = 0;
+        this->hdr->size = size;
+        this->hdr->waiters = 0;
+    }
+}
+
+inline size_t shm_ring::write( const void* buf, size_t len ) {
+    uint32_t head = this->hdr->head;
+    uint32_t room = this->hdr->size - (head - this->hdr->tail);
+    if( len > room ) {
+        len = room;
+    }
+    uint32_t mask = this->hdr->size - 1;
+    for( size_t i=0;i<len;i++ ) {
+        this->data[(head+i) & mask] = ((const uint8_t*)buf)[i];
+    }
+    asm volatile("" : : : "memory"); // (the data has to be there before the consumer sees the new head)
+    this->hdr->head = head + len;
+    __sync_synchronize(); // (and the new head has to be visible before we look for sleepers)
+    if( (len > 0) && (this->hdr->waiters > 0) ) {
+        wake( &this->hdr->head, 1 );
+    }
+    return len;
+}
+
+inline size_t shm_ring::read( void* buf, size_t len ) {
+    uint32_t tail = this->hdr->tail;
+    uint32_t avail = this->hdr->head - tail;
+    if( len > avail ) {
+        len = avail;
+    }
+    asm volatile("" : : : "memory");
+    uint32_t mask = this->hdr->size - 1;
+    for( size_t i=0;i<len;i++ ) {
+        ((uint8_t*)buf)[i] = this->data[(tail+i) & mask];
+    }
+    asm volatile("" : : : "memory");
+    this->hdr->tail = tail + len;
+    __sync_synchronize();
+    if( (len > 0) && (this->hdr->waiters > 0) ) {
+        wake( &this->hdr->tail, 1 );
+    }
+    return len;
+}
+
+inline bool shm_ring::wait_readable( uint32_t timeout_ms ) {
+    while( true ) {
+        uint32_t head = this->hdr->head;
+        if( head != this->hdr->tail ) {
+            return true;
+        }
+        __sync_fetch_and_add( &this->hdr->waiters, 1 );
+        uint32_t err = wait_on_address( &this->hdr->head, head, timeout_ms );
+        __sync_fetch_and_sub( &this->hdr->waiters, 1 );
+        if( (err == SYSCALL_ERR_TIMED_OUT) || (err == SYSCALL_ERR_FAULT) ) {
+            return (this->readable() > 0);
+        }
+    }
+}
+
+inline bool shm_ring::wait_writable( uint32_t timeout_ms ) {
+    while( true ) {
+        uint32_t tail = this->hdr->tail;
+        if( (this->hdr->head - tail) < this->hdr->size ) {
+            return true;
+        }
+        __sync_fetch_and_add( &this->hdr->waiters, 1 );
+        uint32_t err = wait_on_address( &this->hdr->tail, tail, timeout_ms );
+        __sync_fetch_and_sub( &this->hdr->waiters, 1 );
+        if( (err == SYSCALL_ERR_TIMED_OUT) || (err == SYSCALL_ERR_FAULT) ) {
+            return (this->writable() > 0);
+        }
+    }
+}
@@ -22,6 +22,9 @@ extern uint64_t ceil(double);
 extern double fractional(double);
 extern int pow(int,int);
 extern bool interrupts_enabled();
+
+// placement new (there's no <new> in here)
+inline void* operator new(size_t, void* place) { return place; }
 extern "C" {
     extern uint64_t __udivmoddi4( uint64_t, uint64_t, uint64_t* );
     extern uint64_t __udivdi3( uint64_t, uint64_t );
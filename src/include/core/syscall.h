@@ -0,0 +1,38 @@
+// syscall.h -- system call numbers and dispatch table
+#pragma once
+#include "includes.h"
+
+// Arguments are passed in registers on both entry paths:
+//  int $0x5C: EAX = number, EBX / ECX / EDX / EDI / ESI = arguments 1-5
+//  SYSENTER:  EAX = number, EBX / EDI / ESI = arguments 1, 4, 5
+//             (ECX / EDX are needed by SYSEXIT; arguments 2 and 3 are read from the user stack, see multitask_ll.s)
+// The return value comes back in EAX.
+#define SYSCALL_YIELD                   0
+#define SYSCALL_FORK                    1
+#define SYSCALL_NULL                    2
+#define SYSCALL_GETPID                  3
+#define SYSCALL_WAIT_ON_ADDRESS         4
+#define SYSCALL_WAKE                    5
+#define SYSCALL_IPC_CALL                6
+#define N_SYSCALLS                      7
+
+// Set for calls that need the caller's trap_frame (fork copies it into the child).
+// These are only available through int $0x5C; the SYSENTER path returns SYSCALL_ERR_USE_INT for them.
+#define SYSCALL_FLAGS_NEEDS_CONTEXT     (1<<0)
+
+#define SYSCALL_ERR_INVALID             0xFFFFFFFF
+#define SYSCALL_ERR_USE_INT             0xFFFFFFFE
+#define SYSCALL_ERR_FAULT               0xFFFFFFFD  // bad address argument
+#define SYSCALL_ERR_WOULD_BLOCK         0xFFFFFFFC  // wait_on_address: the value had already changed
+#define SYSCALL_ERR_TIMED_OUT           0xFFFFFFFB
+
+typedef uint32_t(*syscall_handler)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+typedef struct syscall_entry {
+    syscall_handler handler;
+    uint32_t        flags;
+    const char*     name;
+} syscall_entry;
+
+extern syscall_entry syscall_table[N_SYSCALLS];
+extern uint32_t syscall_dispatch( uint32_t syscall_n, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5 );
@@ -1,6 +1,7 @@
 #pragma once
 #include "includes.h"
 #include "lib/vector.h"
+#include "core/rcu.h"
 
 struct vfs_attributes {
     bool read_only;
@@ -35,10 +36,21 @@ struct vfs_node {
 
 struct vfs_file;
 
+// Immutable snapshot of a directory's contents, for lock-free path walks.
+// It's replaced (and the old one freed after a grace period) whenever the directory changes.
+struct vfs_child_list {
+    rcu_head    rcu;
+    unsigned int count;
+    vfs_node**  nodes;
+};
+
 struct vfs_directory : public vfs_node {
-    vector<vfs_node*> files;
+    vector<vfs_node*> files;               // modified only with vfs::tree_lock held for writing
+    vfs_child_list* volatile children = NULL; // what readers see (under rcu_read_lock())
     bool expanded;
 
+    void publish_children();
+
     vfs_directory( vfs_node* p, vfs_fs *f, void* d, unsigned char* n ) : vfs_node(p, f, d, n) { this->type = vfs_node_types::directory; this->expanded = false; };
 	vfs_directory(vfs_node* cp) : vfs_node( cp->parent, cp->fs, cp->fs_info, cp->name ) { this->type = vfs_node_types::directory; this->expanded = false; };
 	~vfs_directory();
@@ -71,6 +83,7 @@ struct vfs_file : public vfs_node {
 
 namespace vfs {
 	struct mount_point {
+		rcu_head rcu; // unmounted entries are freed once no reader can still be walking them
 		vfs_fs* filesystem;
 		unsigned char* path;
 		vfs_directory* parent;
@@ -102,8 +115,20 @@ namespace vfs {
 
 	bool file_exists( unsigned char* path );
 
+	// Path walks are lock-free; they must be done inside rcu_read_lock() (or with tree_lock held for writing,
+	// in which case write_locked should be true so directory expansion doesn't try to take it again).
+	vfs_status lookup_node( unsigned char* path, vfs_node** out, bool write_locked=false );
+
+	// These don't take tree_lock themselves; the caller must already hold it for writing.
+	vfs_status create_directory_locked( unsigned char* path );
+	vfs_status delete_file_locked( unsigned char* path );
+	vfs_status write_file_locked( unsigned char* path, void* buffer, size_t size );
+	vfs_status mount_locked( vfs_fs* fs, unsigned char* path );
+	vfs_status unmount_locked( unsigned char* path );
+
 	const char* status_description( vfs_status stat );
 
+	extern rwlock tree_lock; // serializes changes to the node tree and mounted_filesystems (readers use RCU)
 	extern vector<mount_point*> mounted_filesystems;
 	extern vfs_directory* vfs_root;
 };
@@ -16,9 +16,16 @@
 #define AHCI_ERR_NO_SLOT 1
 #define AHCI_ERR_TIMEOUT 2
 #define AHCI_ERR_DISK    3
+#define AHCI_ERR_TOO_MANY_SEGMENTS 4
+
+#define AHCI_MAX_PRDT_ENTRIES   248         // (so a command table fits in one page)
+#define AHCI_PRDT_MAX_BYTES     0x400000    // per PRDT entry
+
+struct io_sg_list;
 
 extern void ahci_initialize();
 extern void ahci_stop_port( unsigned int );
 extern void ahci_start_port( unsigned int );
 extern unsigned int ahci_get_type( unsigned int );
-extern unsigned int ahci_issue_data( unsigned int port, uint64_t lba_start, uint16_t sector_count, void* buffer, bool read );
\ No newline at end of file
+extern unsigned int ahci_issue_data( unsigned int port, uint64_t lba_start, uint16_t sector_count, void* buffer, bool read ); // (buffer is physical)
+extern unsigned int ahci_issue_data_sg( unsigned int port, uint64_t lba_start, uint16_t sector_count, io_sg_list* sg, bool read );
\ No newline at end of file
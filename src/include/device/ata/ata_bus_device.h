@@ -10,6 +10,7 @@
 #include "core/device_manager.h"
 
 namespace ata {
+	struct ata_io_disk;
 
 	struct ata_device {
 		bool  present;
@@ -29,7 +30,7 @@ namespace ata {
 		uint32_t sector_size;
 
 		device_manager::device_node* dev;
-		//ata_io_disk *io_disk;
+		ata_io_disk* disk = NULL; // (requests for us are queued here)
 
 		void initialize();
 		void identify();
@@ -9,6 +9,10 @@
 #include "core/io.h"
 #include "core/scheduler.h"
 
+// largest transfers we'll ask for (in sectors); the I/O scheduler merges requests up to this
+#define ATA_MAX_TRANSFER_SECTORS    128
+#define ATAPI_MAX_TRANSFER_SECTORS  16
+
 namespace ata {
 	struct ata_device;
 
@@ -28,9 +32,7 @@ namespace ata {
 		uint8_t               selected_drive = 0;
 		mutex                 lock;
 		ata_transfer_request* current_transfer = NULL;
-		vector<ata_transfer_request*> read_queue;
-		vector<ata_transfer_request*> write_queue;
-		bool                  current_operation = false; // false - read, true - write
+		bool                  last_slave = true; // which drive went last (they take turns)
 
 		process*              delayed_starter;
 		bool 				  waiting_on_atapi_irq = false;
@@ -41,7 +43,7 @@ namespace ata {
 		ata_device* slave;
 
 		void select( uint8_t select_val );
-		void enqueue_request( ata_transfer_request* );
+		void kick();
 		void transfer_cycle();
 		bool transfer_available();
 		static void perform_requests( ata_channel* ch );
@@ -57,6 +59,7 @@ namespace ata {
 		void send_request( transfer_request* );
 		unsigned int  get_sector_size();
 		unsigned int  get_total_size();
+		unsigned int  get_max_sectors();
 
 		ata_io_disk( ata_channel* ch, ata_device *dev ) { this->channel = ch; this->device = dev; };
 	};
@@ -2,6 +2,7 @@
 
 #pragma once
 #include "includes.h"
+#include "core/message.h"
 
 #define PS2_CTRL_DATA_PORT        0x60
 #define PS2_CTRL_CMD_STAT_PORT    0x64
@@ -42,6 +43,8 @@
 #define PS2_RESP_TIMEOUT          5000
 
 
+extern channel_handle ps2_data_channel;
+
 extern void ps2_controller_init();
 extern bool ps2_send_byte(unsigned char, bool);
 extern bool ps2_send_command(unsigned char);
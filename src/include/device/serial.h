@@ -1,5 +1,6 @@
 #pragma once
 #include "includes.h"
+#include "core/message.h"
 
 #define COM1_BASE_PORT 0x03F8
 #define COM2_BASE_PORT 0x02F8
@@ -86,3 +87,5 @@ extern void initialize_serial(short, short);
 extern void initialize_serial();
 
 extern bool serial_initialized;
+extern channel_handle serial_recv_channel;
+extern channel_handle serial_xmit_channel;
@@ -13,6 +13,8 @@
 namespace device_manager {
 
 	class dev_fs : public vfs_fs {
+		vfs_directory* locks_dir; // /dev/locks: spinlock contention statistics
+
 	public:
 		vfs_file* create_file( unsigned char* name, vfs_directory* parent ) { return NULL; };
 		vfs_directory* create_directory( unsigned char* name, vfs_directory* parent ) { return NULL; };
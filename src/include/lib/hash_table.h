@@ -1,116 +1,168 @@
 // hash_table.h
-
+// String-keyed hash table with open addressing (linear probing).
+// The table doubles in size once it gets 3/4 full (counting removed entries, which leave a tombstone behind).
+// Keys aren't copied, so they have to stay around for as long as they're in the table.
+#pragma once
 #include "includes.h"
-// note to self: implement resizing at some point
 
 template<class T>
-struct ht_bucket_entry {
-    const char* key = NULL;
-    T data;
-    ht_bucket_entry* next = NULL;
+struct ht_slot {
+    const char*   key = NULL;   // NULL if the slot has never been used
+    unsigned long hash = 0;
+    bool          removed = false;
+    T             data;
 };
 
 template<class T>
 class hash_table {
-    ht_bucket_entry<T> **internal_array = NULL;
-    int internal_array_size = 0;
-    int n_known_elements = 0;
-    
+    ht_slot<T>   *internal_array = NULL;
+    unsigned int internal_array_size = 0; // always a power of 2
+    unsigned int n_used_slots = 0;        // live entries + tombstones
+    unsigned int n_known_elements = 0;
+
+    int  find( char*, unsigned long );
+    void resize( unsigned int );
+
     public:
     hash_table( int );
     ~hash_table( );
     void set( char*, T );
     void remove( char* );
-    T get( char* );
+    bool lookup( char*, T* );
+    T get( char* );                       // returns T() if key isn't there
     T operator[](char*);
+    unsigned int count() { return this->n_known_elements; };
 };
 
 inline unsigned long sdbm_hash(char* str) {
     unsigned long ret = 0;
-    while( *str++ ) {
-        ret = (*str)+(ret<<6)+(ret<<16) - ret;
+    int c;
+    while( (c = *str++) ) {
+        ret = c+(ret<<6)+(ret<<16) - ret;
     }
     return ret;
 }
 
 template<class T>
 hash_table<T>::hash_table( int array_size ) {
-    this->internal_array = new ht_bucket_entry<T>*[array_size];
-    this->internal_array_size = array_size;
+    unsigned int size = 8;
+    while( size < (unsigned int)array_size ) {
+        size <<= 1;
+    }
+    this->internal_array = new ht_slot<T>[size];
+    this->internal_array_size = size;
 }
 
 template<class T>
 hash_table<T>::~hash_table() {
     if(this->internal_array) {
-        for(int i=0;i<this->internal_array_size;i++) {
-            delete this->internal_array[i];
+        delete[] this->internal_array;
+    }
+}
+
+// Returns the slot holding key, or -1.
+template<class T>
+int hash_table<T>::find( char* key, unsigned long hash ) {
+    unsigned int mask = this->internal_array_size - 1;
+    for( unsigned int i=0, idx=(hash & mask); i<this->internal_array_size; i++, idx=((idx+1) & mask) ) {
+        ht_slot<T>* slot = &this->internal_array[idx];
+        if( slot->key == NULL ) {
+            return -1; // end of the probe sequence
+        }
+        if( !slot->removed && (slot->hash == hash) && strcmp( const_cast<char*>(slot->key), key, 0 ) ) {
+            return idx;
         }
-        delete this->internal_array;
     }
+    return -1;
 }
 
 template<class T>
-void hash_table<T>::set( char* key, T value ) {
-    unsigned long hash = sdbm_hash(key) % this->internal_array_size;
-    ht_bucket_entry<T> *bucket = this->internal_array[hash];
-    if( bucket == NULL ) {
-        bucket = this->internal_array[hash] = new ht_bucket_entry<T>;
-        bucket->key = key;
-        bucket->data = value;
-        n_known_elements++;
-    } else {
-        while( bucket != NULL ) {
-            if( strcmp( const_cast<char*>(bucket->key), key, 0 ) ) {
-                bucket->data = value;
-                break;
-            }
-            if( bucket->next == NULL ) {
-                bucket->next = new ht_bucket_entry<T>;
-                bucket->next->key = key;
-                bucket->next->data = value;
-                n_known_elements++;
-                break;
+void hash_table<T>::resize( unsigned int new_size ) {
+    ht_slot<T>* old = this->internal_array;
+    unsigned int old_size = this->internal_array_size;
+
+    this->internal_array = new ht_slot<T>[new_size];
+    this->internal_array_size = new_size;
+    this->n_used_slots = this->n_known_elements;
+
+    unsigned int mask = new_size - 1;
+    for(unsigned int i=0;i<old_size;i++) {
+        if( (old[i].key != NULL) && !old[i].removed ) {
+            unsigned int idx = old[i].hash & mask;
+            while( this->internal_array[idx].key != NULL ) {
+                idx = (idx+1) & mask;
             }
-            bucket = bucket->next;
+            this->internal_array[idx] = old[i];
         }
     }
+    delete[] old;
 }
 
 template<class T>
-void hash_table<T>::remove( char* key ) {
-    unsigned long hash = sdbm_hash(key) % (this->internal_array_size);
-    ht_bucket_entry<T> *prev = NULL;
-    ht_bucket_entry<T> *bucket = this->internal_array[hash];
-    while( bucket != NULL ) {
-        if( strcmp( const_cast<char*>(bucket->key), const_cast<char*>(key), 0 ) ) {
-            if( prev )
-                prev->next = bucket->next;
-            n_known_elements--;
-            delete bucket;
-            break;
+void hash_table<T>::set( char* key, T value ) {
+    unsigned long hash = sdbm_hash(key);
+    int idx = this->find( key, hash );
+    if( idx >= 0 ) {
+        this->internal_array[idx].data = value;
+        return;
+    }
+
+    if( ((this->n_used_slots+1) * 4) > (this->internal_array_size * 3) ) {
+        // if it's mostly tombstones, rehashing at the same size is enough
+        unsigned int new_size = this->internal_array_size;
+        if( ((this->n_known_elements+1) * 2) > this->internal_array_size ) {
+            new_size <<= 1;
         }
-        prev = bucket;
-        bucket = bucket->next;
+        this->resize( new_size );
+    }
+
+    unsigned int mask = this->internal_array_size - 1;
+    unsigned int i = hash & mask;
+    while( (this->internal_array[i].key != NULL) && !this->internal_array[i].removed ) {
+        i = (i+1) & mask;
+    }
+    if( this->internal_array[i].key == NULL ) {
+        this->n_used_slots++;
+    }
+    this->internal_array[i].key = key;
+    this->internal_array[i].hash = hash;
+    this->internal_array[i].removed = false;
+    this->internal_array[i].data = value;
+    this->n_known_elements++;
+}
+
+template<class T>
+void hash_table<T>::remove( char* key ) {
+    int idx = this->find( key, sdbm_hash(key) );
+    if( idx >= 0 ) {
+        this->internal_array[idx].removed = true;
+        this->internal_array[idx].data = T();
+        this->n_known_elements--;
+    }
+}
+
+template<class T>
+bool hash_table<T>::lookup( char* key, T* out ) {
+    int idx = this->find( key, sdbm_hash(key) );
+    if( idx < 0 ) {
+        return false;
+    }
+    if( out != NULL ) {
+        *out = this->internal_array[idx].data;
     }
+    return true;
 }
 
 template<class T>
 T hash_table<T>::get( char* key ) {
-    unsigned long hash = sdbm_hash(key) % (this->internal_array_size);
-    ht_bucket_entry<T> *bucket = this->internal_array[hash];
-    if( bucket == NULL ) {
-        return NULL;
-    } else {
-        while( bucket != NULL ) {
-            if( strcmp( const_cast<char*>(bucket->key), const_cast<char*>(key), 0 ) )
-                return bucket->data;
-            bucket = bucket->next;
-        }
+    int idx = this->find( key, sdbm_hash(key) );
+    if( idx < 0 ) {
+        return T();
     }
-    return NULL;
+    return this->internal_array[idx].data;
 }
 
 template<class T>
 T hash_table<T>::operator[](char* key) {
     return this->get(key);
-}
\ No newline at end of file
+}
@@ -6,20 +6,42 @@
 template<class T> class shared_ptr;
 template<class T> class weak_ptr;
 template<class T> class unique_ptr;
+template<class T> class intrusive_ptr;
 
-extern vector<bool> shared_ptr_is_alive;
-extern mutex        shared_ptr_list_lock;
+// (we don't have <utility>, so make_shared brings its own forward())
+template<class T> struct refcount_remove_reference      { typedef T type; };
+template<class T> struct refcount_remove_reference<T&>  { typedef T type; };
+template<class T> struct refcount_remove_reference<T&&> { typedef T type; };
 
-extern uint32_t get_next_shared_ptr_id();
+template<class T>
+inline T&& refcount_forward( typename refcount_remove_reference<T>::type& t ) { return static_cast<T&&>(t); }
+
+// Atomic reference count.
+// increment() and decrement() each come down to a single lock xadd; nothing here ever blocks.
+class refcount {
+    volatile uint32_t count;
 
-typedef class refcount {
-    mutex lock;
-    uint64_t count = 0;
-    
     public:
-    void increment();
-    uint64_t decrement();
-} refcount;
+    void     increment() { __sync_fetch_and_add( &this->count, 1 ); };
+    uint32_t decrement() { return __sync_sub_and_fetch( &this->count, 1 ); }; // returns the new count
+    bool     increment_not_zero();                                            // fails once the count has hit 0
+    uint32_t get() { return this->count; };
+
+    refcount() : count(0) {};
+    refcount( uint32_t initial ) : count(initial) {};
+};
+
+inline bool refcount::increment_not_zero() {
+    uint32_t cur = this->count;
+    while( cur != 0 ) {
+        uint32_t seen = __sync_val_compare_and_swap( &this->count, cur, cur+1 );
+        if( seen == cur ) {
+            return true;
+        }
+        cur = seen;
+    }
+    return false;
+}
 
 //
 //
@@ -27,15 +49,133 @@ typedef class refcount {
 //
 //
 
+// Base class for objects that carry their own reference count (see intrusive_ptr).
+// New objects start out with no references; the first intrusive_ptr to one takes the first reference,
+// and the last one to go away deletes it.
+class refcounted {
+    refcount refs;
+
+    public:
+    void     ref_get() { this->refs.increment(); };
+    bool     ref_put() { return (this->refs.decrement() == 0); }; // true if that was the last reference
+    uint32_t ref_count() { return this->refs.get(); };
+
+    refcounted() : refs(0) {};
+    refcounted( const refcounted& ) : refs(0) {};                 // copies get their own count
+    refcounted& operator=( const refcounted& ) { return *this; };
+};
+
+// T must provide ref_get() / ref_put(), usually by deriving from refcounted.
+template<class T>
+class intrusive_ptr {
+    T* object;
+
+    public:
+    intrusive_ptr<T>&     operator=(const intrusive_ptr<T>& rhs) { this->reset( rhs.object ); return *this; };
+    intrusive_ptr<T>&     operator=(intrusive_ptr<T>&&);
+    intrusive_ptr<T>&     operator=(T* obj) { this->reset( obj ); return *this; };
+    T&                    operator*()  const { return *this->object; };
+    T*                    operator->() const { return this->object; };
+                          operator T*() const { return this->object; };
+
+    bool                  operator==(const intrusive_ptr<T>& rhs) const { return (this->object == rhs.object); }
+    bool                  operator!=(const intrusive_ptr<T>& rhs) const { return (this->object != rhs.object); }
+
+    T*                    get() const { return this->object; };
+    void                  reset( T* obj=NULL );
+    T*                    detach() { T* ret = this->object; this->object = NULL; return ret; }; // hands our reference to the caller
+
+    intrusive_ptr() : object(NULL) {};
+    intrusive_ptr(T* obj) : object(obj) { if( obj != NULL ) obj->ref_get(); };
+    intrusive_ptr(const intrusive_ptr<T>& org) : object(org.object) { if( this->object != NULL ) this->object->ref_get(); };
+    intrusive_ptr(intrusive_ptr<T>&& org) : object(org.object) { org.object = NULL; };
+    ~intrusive_ptr() { this->reset(); };
+};
+
+template<class T>
+void intrusive_ptr<T>::reset( T* obj ) {
+    if( obj != NULL ) {
+        obj->ref_get(); // (before dropping ours, in case obj == this->object)
+    }
+    T* old = this->object;
+    this->object = obj;
+    if( (old != NULL) && old->ref_put() ) {
+        delete old;
+    }
+}
+
+template<class T>
+intrusive_ptr<T>& intrusive_ptr<T>::operator=(intrusive_ptr<T>&& rhs) {
+    if( &rhs != this ) {
+        this->reset();
+        this->object = rhs.object;
+        rhs.object = NULL;
+    }
+    return *this;
+}
+
+//
+//
+//
+//
+//
+
+// Control block shared by all shared_ptrs / weak_ptrs to one object.
+// strong counts shared_ptrs; weak counts weak_ptrs, plus one held collectively by the shared_ptrs
+// (so the block outlives the object for as long as any weak_ptr can still look at it).
+struct shared_ctrl {
+    refcount strong;
+    refcount weak;
+    void (*destroy_object)( shared_ctrl* );
+    void (*free_block)( shared_ctrl* );
+
+    shared_ctrl() : strong(1), weak(1) {};
+};
+
+extern void shared_ctrl_put_strong( shared_ctrl* ctrl );
+extern void shared_ctrl_put_weak( shared_ctrl* ctrl );
+
+// control block for an object that was allocated separately (shared_ptr<T>(new T))
+template<class T>
+struct shared_ctrl_separate : public shared_ctrl {
+    T* object;
+
+    static void destroy( shared_ctrl* ctrl ) { delete ((shared_ctrl_separate<T>*)ctrl)->object; };
+    static void free( shared_ctrl* ctrl ) { delete (shared_ctrl_separate<T>*)ctrl; };
+
+    shared_ctrl_separate( T* obj ) : object(obj) {
+        this->destroy_object = &destroy;
+        this->free_block = &free;
+    };
+};
+
+// control block with the object stored right behind it (make_shared)
+template<class T>
+struct shared_ctrl_inplace : public shared_ctrl {
+    uint8_t storage[sizeof(T)] __attribute__((aligned(__alignof__(T))));
+
+    T* object() { return (T*)this->storage; };
+    static void destroy( shared_ctrl* ctrl ) { ((shared_ctrl_inplace<T>*)ctrl)->object()->~T(); };
+    static void free( shared_ctrl* ctrl ) { kfree( (void*)ctrl ); };
+
+    shared_ctrl_inplace() {
+        this->destroy_object = &destroy;
+        this->free_block = &free;
+    };
+};
+
 template<class T>
 class shared_ptr {
     T* object;
-    refcount* rc; // if (this->rc != NULL) then (this->object != NULL)
-    uint32_t  rc_id;
-    
+    shared_ctrl* ctrl; // if (this->ctrl != NULL) then (this->object != NULL)
+
+    template<class U> friend class weak_ptr;
+    template<class U, class... Args> friend shared_ptr<U> make_shared( Args&&... args );
+
     public:
-    const weak_ptr<T>&    operator=(const weak_ptr<T>&);
+    const shared_ptr<T>&  operator=(const weak_ptr<T>&);
     const shared_ptr<T>&  operator=(const shared_ptr<T>&);
+    shared_ptr<T>&        operator=(shared_ptr<T>&&);
     shared_ptr<T>&        operator=(const T*);
     T&                    operator*()  { return *this->object; };
     T*                    operator->() { return this->object; };
@@ -47,45 +187,43 @@ class shared_ptr {
     bool                  operator!=(const shared_ptr<T>& rhs) { return (this->object != rhs.object); }
     
     T*                    get() { return this->object; };
+    uint32_t              use_count() { return ((this->ctrl != NULL) ? this->ctrl->strong.get() : 0); };
     void                  invalidate();
     
-    shared_ptr() : object(NULL), rc(NULL), rc_id(0) {};
+    shared_ptr() : object(NULL), ctrl(NULL) {};
     shared_ptr(T*);
-    shared_ptr(weak_ptr<T>&);
-    shared_ptr(shared_ptr<T>&);
+    shared_ptr(const weak_ptr<T>&);
+    shared_ptr(const shared_ptr<T>&);
+    shared_ptr(shared_ptr<T>&&);
     ~shared_ptr();
 };
 
 template<class T>
-shared_ptr<T>::shared_ptr(weak_ptr<T>& org) {
-    if( !org.expired() ) {
-        if( org.rc != NULL ) {
-            this->rc = org.rc;
-            this->rc->increment();
-            this->rc_id = org.rc_id;
-        }
+shared_ptr<T>::shared_ptr(const weak_ptr<T>& org) : object(NULL), ctrl(NULL) {
+    if( (org.ctrl != NULL) && org.ctrl->strong.increment_not_zero() ) {
+        this->ctrl = org.ctrl;
         this->object = org.object;
-    } else {
-        this->object = NULL;
     }
 }
 
 template<class T>
-shared_ptr<T>::shared_ptr(shared_ptr<T>& org) {
-    if( org.rc != NULL ) {
-        this->rc = org.rc;
-        this->rc->increment();
-        this->rc_id = org.rc_id;
+shared_ptr<T>::shared_ptr(const shared_ptr<T>& org) : object(org.object), ctrl(org.ctrl) {
+    if( this->ctrl != NULL ) {
+        this->ctrl->strong.increment();
     }
-    this->object = org.object;
 }
 
 template<class T>
-shared_ptr<T>::shared_ptr(T* obj) {
-    this->rc = new refcount;
-    this->rc->increment();
-    this->rc_id = get_next_shared_ptr_id();
-    this->object = obj;
+shared_ptr<T>::shared_ptr(shared_ptr<T>&& org) : object(org.object), ctrl(org.ctrl) {
+    org.object = NULL;
+    org.ctrl = NULL;
+}
+
+template<class T>
+shared_ptr<T>::shared_ptr(T* obj) : object(obj), ctrl(NULL) {
+    if( obj != NULL ) {
+        this->ctrl = new shared_ctrl_separate<T>( obj );
+    }
 }
 
 template<class T>
@@ -95,58 +233,75 @@ shared_ptr<T>::~shared_ptr() {
 
 template<class T>
 void shared_ptr<T>::invalidate() {
-    if( this->rc != NULL ) {
-        if( this->rc->decrement() == 0 ) {
-            shared_ptr_is_alive.set( this->rc_id, false );
-            delete this->object;
-            delete this->rc;
-        }
-    }
+    shared_ctrl* old = this->ctrl;
     this->object = NULL;
-    this->rc     = NULL;
-    this->rc_id  = 0;
+    this->ctrl   = NULL;
+    if( old != NULL ) {
+        shared_ctrl_put_strong( old );
+    }
 }
 
 template<class T>
-const weak_ptr<T>& shared_ptr<T>::operator=(const weak_ptr<T>& org) {
+const shared_ptr<T>& shared_ptr<T>::operator=(const weak_ptr<T>& org) {
     this->invalidate();
-    if( !org.expired() ) {
-        if( org.rc != NULL ) {
-            this->rc = org.rc;
-            this->object = org.object;
-            this->rc->increment();
-            this->rc_id = org.rc_id;
-        }
+    if( (org.ctrl != NULL) && org.ctrl->strong.increment_not_zero() ) {
+        this->ctrl = org.ctrl;
+        this->object = org.object;
     }
-    return org;
+    return *this;
 }
 
 template<class T>
 const shared_ptr<T>& shared_ptr<T>::operator=(const shared_ptr<T>& org) {
     if( &org != this ) {
-        this->invalidate();
-        if( org.rc != NULL ) {
-            this->rc = org.rc;
-            this->object = org.object;
-            this->rc->increment();
-            this->rc_id = org.rc_id;
+        if( org.ctrl != NULL ) {
+            org.ctrl->strong.increment();
         }
+        this->invalidate();
+        this->ctrl = org.ctrl;
+        this->object = org.object;
+    }
+    return *this;
+}
+
+template<class T>
+shared_ptr<T>& shared_ptr<T>::operator=(shared_ptr<T>&& org) {
+    if( &org != this ) {
+        this->invalidate();
+        this->ctrl = org.ctrl;
+        this->object = org.object;
+        org.ctrl = NULL;
+        org.object = NULL;
     }
-    return const_cast<shared_ptr<T>&>(org);
+    return *this;
 }
 
 template<class T>
 shared_ptr<T>& shared_ptr<T>::operator=(const T* obj) {
     this->invalidate();
     if( obj != NULL ) {
-        this->rc = new refcount;
-        this->rc->increment();
-        this->rc_id = get_next_shared_ptr_id();
+        this->ctrl = new shared_ctrl_separate<T>( const_cast<T*>(obj) );
     }
     this->object = const_cast<T*>(obj);
     return *this;
 }
 
+// Allocate the object and its control block together, in one kmalloc.
+template<class T, class... Args>
+shared_ptr<T> make_shared( Args&&... args ) {
+    void* block = kmalloc( sizeof(shared_ctrl_inplace<T>) );
+    if( block == NULL ) {
+        return shared_ptr<T>();
+    }
+    shared_ctrl_inplace<T>* ctrl = new(block) shared_ctrl_inplace<T>;
+    new((void*)ctrl->storage) T( refcount_forward<Args>(args)... );
+
+    shared_ptr<T> ret;
+    ret.ctrl = ctrl;
+    ret.object = ctrl->object();
+    return ret;
+}
+
 //
 //
 //
@@ -156,12 +311,15 @@ shared_ptr<T>& shared_ptr<T>::operator=(const T* obj) {
 template<class T>
 class weak_ptr {
     T* object;
-    refcount* rc; // if (this->rc != NULL) then (this->object != NULL)
-    uint32_t  rc_id;
-    
+    shared_ctrl* ctrl; // if (this->ctrl != NULL) then (this->object != NULL)
+
+    template<class U> friend class shared_ptr;
+
+    void                  assign( T* obj, shared_ctrl* c );
+
     public:
-    const shared_ptr<T>   operator=(const shared_ptr<T>);
-    const weak_ptr<T>     operator=(const weak_ptr<T>);
+    const weak_ptr<T>&    operator=(const shared_ptr<T>& ptr) { this->assign( ptr.object, ptr.ctrl ); return *this; };
+    const weak_ptr<T>&    operator=(const weak_ptr<T>& ptr) { this->assign( ptr.object, ptr.ctrl ); return *this; };
     
     bool                  operator==(const weak_ptr<T>& rhs) { return (this->object == rhs.object); }
     bool                  operator==(const shared_ptr<T>& rhs) { return (this->object == rhs.object); }
@@ -172,52 +330,33 @@ class weak_ptr {
     T*            get() { return this->object; };
     bool          expired();
     
-    weak_ptr() : object(NULL), rc(NULL) {};
-    weak_ptr(shared_ptr<T>&);
-    weak_ptr(weak_ptr<T>&);
+    weak_ptr() : object(NULL), ctrl(NULL) {};
+    weak_ptr(const shared_ptr<T>& ptr) : object(NULL), ctrl(NULL) { this->assign( ptr.object, ptr.ctrl ); };
+    weak_ptr(const weak_ptr<T>& ptr) : object(NULL), ctrl(NULL) { this->assign( ptr.object, ptr.ctrl ); };
+    ~weak_ptr() { this->assign( NULL, NULL ); };
 };
 
 template<class T>
-weak_ptr<T>::weak_ptr( shared_ptr<T>& ptr ) {
-    this->object = ptr.object;
-    this->rc     = ptr.rc;
-    this->rc_id  = ptr.rc_id;
-}
-
-template<class T>
-weak_ptr<T>::weak_ptr( weak_ptr<T>& ptr ) {
-    this->object = ptr.object;
-    this->rc     = ptr.rc;
-    this->rc_id  = ptr.rc_id;
-}
-
-template<class T>
-const weak_ptr<T> weak_ptr<T>::operator=( const weak_ptr<T> ptr ) {
-    this->object = ptr.object;
-    this->rc     = ptr.rc;
-    this->rc_id  = ptr.rc_id;
-    return ptr;
-}
-
-template<class T>
-const shared_ptr<T> weak_ptr<T>::operator=( const shared_ptr<T> ptr ) {
-    this->object = ptr.object;
-    this->rc     = ptr.rc;
-    this->rc_id  = ptr.rc_id;
-    return ptr;
+void weak_ptr<T>::assign( T* obj, shared_ctrl* c ) {
+    if( c != NULL ) {
+        c->weak.increment();
+    }
+    shared_ctrl* old = this->ctrl;
+    this->object = obj;
+    this->ctrl   = c;
+    if( old != NULL ) {
+        shared_ctrl_put_weak( old );
+    }
 }
 
 template<class T>
 bool weak_ptr<T>::expired() {
-    if( this->rc_id == 0 ) {
-        return true;
-    }
-    return !shared_ptr_is_alive[ this->rc_id ];
+    return ( (this->ctrl == NULL) || (this->ctrl->strong.get() == 0) );
 }
 
 template<class T>
 shared_ptr<T> weak_ptr<T>::get_shared() {
-    return shared_ptr<T>(this); // the shared_ptr(weak_ptr) constructor checks this->expired() itself
+    return shared_ptr<T>(*this); // the shared_ptr(weak_ptr) constructor checks whether we've expired itself
 }
 
 //
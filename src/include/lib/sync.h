@@ -3,16 +3,46 @@
 #include "includes.h"
 #include "arch/x86/sys.h"
 
-#define SPINLOCK_LOCKED_VALUE               0x0010CCED
-#define SPINLOCK_UNLOCKED_VALUE             0
+// size of the text in a /dev/locks/<name> file
+#define SPINLOCK_STATS_TEXT_SIZE            192
 
+// how many owners deep priority inheritance follows a chain of blocked mutex owners
+#define MUTEX_PI_MAX_CHAIN                  8
+// number of priority boost / restore events kept for mutex_pi_trace_dump()
+#define MUTEX_PI_TRACE_SIZE                 64
+
+// Contention statistics, kept for spinlocks that are given a name.
+// Every named lock's stats are linked together starting at spinlock_stats_list, and show up under /dev/locks.
+typedef struct spinlock_stats {
+    const char*             name;
+    uint64_t                acquisitions = 0;
+    uint64_t                contended = 0;       // acquisitions that had to wait for another holder
+    uint64_t                spin_cycles = 0;     // total TSC cycles spent waiting
+    uint64_t                max_hold_cycles = 0;
+    uint64_t                acquired_at = 0;     // TSC when the current holder got the lock
+    struct spinlock_stats*  next = NULL;
+} spinlock_stats;
+
+extern spinlock_stats* spinlock_stats_list;
+extern int spinlock_stats_format( spinlock_stats* stats, char* out, size_t bufsz );
+
+// FIFO ticket lock: lockers take a ticket and wait for now_serving to reach it.
+// lock() disables interrupts *before* waiting, so the holder is never interrupted while it has the lock.
+// The holding process can lock the same spinlock again; it's released after the matching number of unlock()s.
 typedef class spinlock {
-    uint32_t lock_value;
-    uint32_t locker;
+    volatile uint32_t next_ticket = 0;
+    volatile uint32_t now_serving = 0;
+    uint32_t locker = 0;
+    uint32_t depth = 0;
     interrupt_status_t int_status;
+    spinlock_stats* stats = NULL;
+
+    bool acquire();
+    bool release();
     
     public:
     spinlock();
+    spinlock( const char* name ); // also keeps contention statistics under the given name
     bool get_lock_status();
     uint32_t get_lock_owner();
     void lock_no_cli();
@@ -21,12 +51,68 @@ typedef class spinlock {
     void unlock();
 } spinlock;
 
+struct process;
+class wait_queue;
+
+// A process waiting on a wait_queue. Each process has exactly one (process::wait_entry), since
+// whoever wakes us walks and unlinks it from their own address space, where our stack isn't mapped.
+typedef struct wait_queue_entry {
+    struct process*          proc = NULL;
+    struct wait_queue_entry* next = NULL;
+    class wait_queue*        queue = NULL;  // the queue we're on, if any
+} wait_queue_entry;
+
+// FIFO queue of sleeping processes (see synchronization.cpp).
+// To wait for a condition without losing wakeups:
+//     while( true ) {
+//         wq.prepare_to_wait();
+//         if( condition ) break;
+//         process_switch_immediate();
+//     }
+//     wq.finish_wait();
+// A process can only be on one queue at a time, so don't block on anything else in between.
+// or, if the condition is protected by a spinlock, check it with the lock held and call wq.wait( &lock ).
+typedef class wait_queue {
+    spinlock          lock;
+    wait_queue_entry* head = NULL;
+    wait_queue_entry* tail = NULL;
+
+    void remove( wait_queue_entry* ent );
+
+    public:
+    void prepare_to_wait();
+    void finish_wait();
+    void wait( spinlock* held = NULL );
+    bool wait_timeout( unsigned int timeout_ms, spinlock* held = NULL );
+    bool wake_one();
+    struct process* wake_first();   // like wake_one(), but returns who was woken (NULL if nobody)
+    unsigned int wake_all();
+    bool empty();
+    int top_priority(); // best (lowest) priority of any waiter, or -1 if there are none
+} wait_queue;
+
+// Mutexes do priority inheritance: while a process waits on a mutex, the owner (and whatever
+// the owner is itself blocked on, and so on) runs at the waiter's priority if that's higher.
+// The boost is dropped once the owner no longer holds any mutex with a higher-priority waiter.
+// Unlocking (or the owner exiting) hands the mutex straight to the first waiter, so waiters just sleep
+// until they're given it.
+
 typedef class reentrant_mutex {
     spinlock          control_lock;
+    wait_queue        waiters;
     uint32_t          lock_count = 0;
     unsigned int      uid = ~0;
     uint64_t          mutex_id = ~0;
+    reentrant_mutex*  next_held = NULL; // next mutex held by our owner (see process::held_mutexes)
+
+    void take();
+    void release_ownership( struct process* owner );
+    void hand_off();
+    void propagate_priority();
     
+    friend void mutex_pi_recompute( struct process* proc );
+    friend void mutex_pi_process_exit( struct process* proc );
+
     public:
     int get_owner_uid();
     uint32_t get_lock_count();
@@ -41,6 +127,7 @@ typedef class reentrant_mutex {
 
 typedef class semaphore {
     spinlock control_lock;
+    wait_queue waiters;
     uint32_t count;
     uint32_t max_count;
     uint64_t semaphore_id = ~0;
@@ -57,6 +144,75 @@ typedef class semaphore {
     semaphore(uint32_t,uint32_t);
 } semaphore;
 
+// One-shot "it's done" event: complete() wakes everyone waiting, and anyone who waits afterwards
+// doesn't sleep at all. reinit() arms it again for reuse.
+// complete() never sleeps, so it can be called from interrupt handlers.
+typedef class completion {
+    spinlock      lock;
+    wait_queue    waiters;
+    volatile bool is_done = false;
+
+    public:
+    bool done() { return this->is_done; };
+    void complete();
+    void wait();
+    bool wait_timeout( unsigned int timeout_ms ); // false if it timed out
+    void reinit();
+} completion;
+
+// Sleeping reader-writer lock for read-mostly tables.
+// Writers are preferred: once a writer is waiting, new readers wait behind it, so a process
+// must not take a read lock it already holds (use an unlocked helper for nested lookups instead).
+typedef class rwlock {
+    spinlock   control_lock;
+    wait_queue read_waiters;
+    wait_queue write_waiters;
+    uint32_t   readers = 0;
+    uint32_t   writers_waiting = 0;
+    bool       writing = false;
+
+    public:
+    void read_lock();
+    void read_unlock();
+    void write_lock();
+    void write_unlock();
+    bool try_read_lock();
+    bool try_write_lock();
+} rwlock;
+
+// Sequence lock for small, frequently-read values (like the system timer).
+// Readers never block writers; they just retry if a write happened while they were reading:
+//     uint32_t seq;
+//     do {
+//         seq = lock.read_begin();
+//         copy = value;
+//     } while( lock.read_retry( seq ) );
+// Writers must not be interrupted by readers on the same CPU, so write_begin() disables interrupts.
+typedef class seqlock {
+    volatile uint32_t  sequence = 0;
+    spinlock           write_lock;
+    interrupt_status_t int_status;
+
+    public:
+    uint32_t read_begin();
+    bool read_retry( uint32_t start );
+    void write_begin();
+    void write_end();
+} seqlock;
+
+typedef struct mutex_pi_event {
+    unsigned long long int time;        // system timer ms
+    uint32_t               pid;
+    uint64_t               mutex_id;    // mutex that caused a boost (~0 for restores)
+    int                    old_priority;
+    int                    new_priority;
+    unsigned long long int boosted_for; // for restores: how long the process was boosted
+} mutex_pi_event;
+
+extern void mutex_pi_recompute( struct process* proc );
+extern void mutex_pi_process_exit( struct process* proc );
+extern void mutex_pi_trace_dump();
+
 template <class T>
 class lock_guard {
     T* lock;
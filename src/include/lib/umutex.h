@@ -0,0 +1,96 @@
+// umutex.h -- futex-based mutex and condition variable for user processes
+// Locking and unlocking an uncontended umutex never enters the kernel; only a process that has to wait
+// (or has someone to wake) makes a wait_on_address / wake system call (see core/futex.cpp).
+// Everything here is inline and only relies on the syscall() stub, so it works from kernel processes too.
+#pragma once
+#include "includes.h"
+#include "core/syscall.h"
+#include "arch/x86/multitask.h"
+
+inline uint32_t wait_on_address( volatile uint32_t* addr, uint32_t expected, uint32_t timeout_ms=0 ) {
+    return syscall( SYSCALL_WAIT_ON_ADDRESS, (uint32_t)addr, expected, timeout_ms, 0, 0 );
+}
+
+inline uint32_t wake( volatile uint32_t* addr, uint32_t n ) {
+    return syscall( SYSCALL_WAKE, (uint32_t)addr, n, 0, 0, 0 );
+}
+
+#define UMUTEX_UNLOCKED         0
+#define UMUTEX_LOCKED           1
+#define UMUTEX_CONTENDED        2   // locked, and someone may be sleeping on it
+
+// Not recursive, and there's no owner tracking or priority inheritance (use a kernel mutex for those).
+typedef class umutex {
+    volatile uint32_t state = UMUTEX_UNLOCKED;
+
+    friend class ucondvar;
+
+    public:
+    bool try_lock() { return __sync_bool_compare_and_swap( &this->state, UMUTEX_UNLOCKED, UMUTEX_LOCKED ); };
+    void lock();
+    void unlock();
+} umutex;
+
+inline void umutex::lock() {
+    uint32_t cur = __sync_val_compare_and_swap( &this->state, UMUTEX_UNLOCKED, UMUTEX_LOCKED );
+    if( cur == UMUTEX_UNLOCKED ) {
+        return;
+    }
+    // slow path: mark the lock contended, so whoever holds it knows to wake us.
+    if( cur != UMUTEX_CONTENDED ) {
+        cur = __sync_lock_test_and_set( &this->state, UMUTEX_CONTENDED );
+    }
+    while( cur != UMUTEX_UNLOCKED ) {
+        wait_on_address( &this->state, UMUTEX_CONTENDED );
+        cur = __sync_lock_test_and_set( &this->state, UMUTEX_CONTENDED );
+    }
+}
+
+inline void umutex::unlock() {
+    if( __sync_fetch_and_sub( &this->state, 1 ) != UMUTEX_LOCKED ) {
+        this->state = UMUTEX_UNLOCKED;
+        wake( &this->state, 1 );
+    }
+}
+
+// Condition variable: waiters sleep on a sequence number that every signal / broadcast bumps,
+// so a signal between unlocking the mutex and going to sleep isn't lost.
+typedef class ucondvar {
+    volatile uint32_t seq = 0;
+
+    public:
+    void wait( umutex* m );
+    bool wait_timeout( umutex* m, unsigned int timeout_ms ); // false if we timed out
+    void signal();
+    void broadcast();
+} ucondvar;
+
+inline void ucondvar::wait( umutex* m ) {
+    uint32_t seen = this->seq;
+    m->unlock();
+    wait_on_address( &this->seq, seen );
+    // we can't tell whether there are other sleepers, so assume there are
+    while( __sync_lock_test_and_set( &m->state, UMUTEX_CONTENDED ) != UMUTEX_UNLOCKED ) {
+        wait_on_address( &m->state, UMUTEX_CONTENDED );
+    }
+}
+
+inline bool ucondvar::wait_timeout( umutex* m, unsigned int timeout_ms ) {
+    uint32_t seen = this->seq;
+    m->unlock();
+    uint32_t ret = wait_on_address( &this->seq, seen, timeout_ms );
+    while( __sync_lock_test_and_set( &m->state, UMUTEX_CONTENDED ) != UMUTEX_UNLOCKED ) {
+        wait_on_address( &m->state, UMUTEX_CONTENDED );
+    }
+    return (ret != SYSCALL_ERR_TIMED_OUT);
+}
+
+inline void ucondvar::signal() {
+    __sync_fetch_and_add( &this->seq, 1 );
+    wake( &this->seq, 1 );
+}
+
+inline void ucondvar::broadcast() {
+    __sync_fetch_and_add( &this->seq, 1 );
+    wake( &this->seq, 0xFFFFFFFF );
+}
@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <sys/times.h>
 #include "core/scheduler.h"
+#include "core/syscall.h"
 #include "device/ps2_keyboard.h"
 #include "device/vga.h"
 #include "core/vfs.h"
@@ -85,7 +86,7 @@ extern "C" {
     }
 
     uint32_t fork() {
-        return syscall(1, 0,0,0,0,0);
+        return syscall(SYSCALL_FORK, 0,0,0,0,0);
     }
 
     int fstat(int file, struct stat *st) {
@@ -1112,8 +1112,12 @@ int ksnprintf(char *out, size_t bufsz, const char *fmt, ...) {
 inline void __logger_do_writeout(char* o) {
 #ifdef ENABLE_SERIAL_LOGGING
     if( serial_initialized ) {
-        message m( (void*)o, strlen(o) );
-		send_to_channel( "serial_xmit", m );
+        // the payload takes ownership of what it's given, and our callers still free o (and write it out below)
+        size_t len = strlen(o);
+        char* copy = (char*)kmalloc( len+1 );
+        memcpy( (void*)copy, (void*)o, len+1 );
+        message m( (void*)copy, len );
+		send_to_channel( serial_xmit_channel, m );
     }
 #endif
     __kprintf_lock.lock();
@@ -1227,7 +1231,7 @@ void logger_flush_buffer() {
 }
 
 void logger_initialize() {
-    logger_process = new process( (size_t)&logger_process_func, false, 0, "kernel_logger", NULL, 0);
+    logger_process = kthread_create( (size_t)&logger_process_func, 0, "kernel_logger" );
 }
 
 // Print "panic: mesg" and then hang.
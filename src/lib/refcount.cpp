@@ -1,33 +1,19 @@
 // refcount.cpp
 
 #include "includes.h"
-#include "lib/vector.h"
 #include "lib/refcount.h"
 
-vector<bool> shared_ptr_is_alive(1);
-mutex        shared_ptr_list_lock;
-
-void refcount::increment() {
-    this->lock.lock();
-    this->count++;
-    this->lock.unlock();
-}
-
-uint64_t refcount::decrement() {
-    this->lock.lock();
-    uint64_t ret = 0;
-    if(this->count > 0) {
-        this->count--;
-        ret = this->count;
+// Drop a shared_ptr's reference.
+// The last one destroys the object, then gives up the weak reference the shared_ptrs held together.
+void shared_ctrl_put_strong( shared_ctrl* ctrl ) {
+    if( ctrl->strong.decrement() == 0 ) {
+        ctrl->destroy_object( ctrl );
+        shared_ctrl_put_weak( ctrl );
     }
-    this->lock.unlock();
-    return ret;
 }
 
-uint32_t get_next_shared_ptr_id() {
-    shared_ptr_list_lock.lock();
-    shared_ptr_is_alive.add(true);
-    uint32_t ret = shared_ptr_is_alive.length() - 1;
-    shared_ptr_list_lock.unlock();
-    return ret;
+void shared_ctrl_put_weak( shared_ctrl* ctrl ) {
+    if( ctrl->weak.decrement() == 0 ) {
+        ctrl->free_block( ctrl );
+    }
 }
\ No newline at end of file